@@ -0,0 +1,134 @@
+/*
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "virglrenderer.h"
+
+uint64_t bench_time_ns(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+void bench_begin(struct bench *b, const char *suite, int argc, char **argv)
+{
+   b->suite = suite;
+   b->scale = 1;
+   b->num_results = 0;
+
+   for (int i = 1; i < argc; i++) {
+      if (!strcmp(argv[i], "--scale") && i + 1 < argc) {
+         int scale = atoi(argv[++i]);
+         if (scale > 0)
+            b->scale = scale;
+      } else {
+         fprintf(stderr, "usage: %s [--scale N]\n", argv[0]);
+         exit(EXIT_FAILURE);
+      }
+   }
+
+   printf("{\n  \"suite\": \"%s\",\n  \"repeat\": %d,\n  \"results\": [", suite, BENCH_REPEAT);
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+   uint64_t x = *(const uint64_t *)a;
+   uint64_t y = *(const uint64_t *)b;
+   return x < y ? -1 : x > y;
+}
+
+void bench_run(struct bench *b, const char *name, bench_func func, void *data,
+               uint32_t iterations, uint64_t bytes, uint64_t items)
+{
+   uint64_t samples[BENCH_REPEAT];
+   double median_ns, min_ns;
+
+   iterations *= b->scale;
+
+   /* warm up caches, shader variants, allocations, ... */
+   func(data, iterations);
+
+   for (int i = 0; i < BENCH_REPEAT; i++) {
+      uint64_t start = bench_time_ns();
+      func(data, iterations);
+      samples[i] = bench_time_ns() - start;
+   }
+   qsort(samples, BENCH_REPEAT, sizeof(samples[0]), compare_u64);
+
+   median_ns = (double)samples[BENCH_REPEAT / 2] / iterations;
+   min_ns = (double)samples[0] / iterations;
+
+   printf("%s\n    {\"name\": \"%s\", \"iterations\": %u, "
+          "\"ns_per_iter\": %.1f, \"min_ns_per_iter\": %.1f",
+          b->num_results ? "," : "", name, iterations, median_ns, min_ns);
+   if (bytes)
+      printf(", \"mib_per_sec\": %.1f", bytes * 1e9 / median_ns / (1024.0 * 1024.0));
+   if (items)
+      printf(", \"items_per_sec\": %.0f", items * 1e9 / median_ns);
+   printf("}");
+   fflush(stdout);
+
+   b->num_results++;
+}
+
+void bench_end(struct bench *b)
+{
+   printf("\n  ]\n}\n");
+   (void)b;
+}
+
+static uint32_t last_fence;
+
+static void bench_write_fence(void *cookie, uint32_t fence)
+{
+   (void)cookie;
+   last_fence = fence;
+}
+
+static struct virgl_renderer_callbacks bench_cbs = {
+   .version = 1,
+   .write_fence = bench_write_fence,
+};
+
+static int bench_cookie;
+
+int bench_vrend_init(int flags)
+{
+   int ret;
+
+   last_fence = 0;
+
+   ret = virgl_renderer_init(&bench_cookie,
+                             flags | VIRGL_RENDERER_USE_EGL | VIRGL_RENDERER_USE_SURFACELESS,
+                             &bench_cbs);
+   if (ret) {
+      fprintf(stderr, "failed to initialize virglrenderer: %d\n", ret);
+      return ret;
+   }
+
+   ret = virgl_renderer_context_create(BENCH_CTX_ID, strlen("bench"), "bench");
+   if (ret) {
+      fprintf(stderr, "failed to create context: %d\n", ret);
+      virgl_renderer_cleanup(&bench_cookie);
+   }
+   return ret;
+}
+
+void bench_vrend_fini(void)
+{
+   virgl_renderer_context_destroy(BENCH_CTX_ID);
+   virgl_renderer_cleanup(&bench_cookie);
+}
+
+uint32_t bench_vrend_last_fence(void)
+{
+   return last_fence;
+}
@@ -0,0 +1,57 @@
+/*
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Minimal harness shared by the micro-benchmarks.
+ *
+ * Every case runs a fixed number of iterations, once to warm up and then
+ * BENCH_REPEAT times.  The median and the minimum of the repetitions are
+ * reported so that runs can be diffed without too much noise.  Results are
+ * printed as a single JSON document on stdout, with keys in a fixed order.
+ *
+ * Passing "--scale N" on the command line multiplies all iteration counts.
+ *
+ * The GL benchmarks initialize virglrenderer with surfaceless EGL, so they
+ * can run on llvmpipe with LIBGL_ALWAYS_SOFTWARE=1.
+ */
+
+#define BENCH_REPEAT 5
+
+typedef void (*bench_func)(void *data, uint32_t iterations);
+
+struct bench {
+   const char *suite;
+   uint32_t scale;
+   uint32_t num_results;
+};
+
+void bench_begin(struct bench *b, const char *suite, int argc, char **argv);
+
+/* Runs func and reports it under name.  bytes and items are the amount of
+ * work done per iteration and may be 0 if meaningless.
+ */
+void bench_run(struct bench *b, const char *name, bench_func func, void *data,
+               uint32_t iterations, uint64_t bytes, uint64_t items);
+
+void bench_end(struct bench *b);
+
+uint64_t bench_time_ns(void);
+
+/* virglrenderer with a single vrend context of id BENCH_CTX_ID */
+#define BENCH_CTX_ID 1
+
+int bench_vrend_init(int flags);
+void bench_vrend_fini(void);
+
+/* id of the last fence signalled through write_fence */
+uint32_t bench_vrend_last_fence(void);
+
+#endif /* BENCH_H */
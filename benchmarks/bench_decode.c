@@ -0,0 +1,150 @@
+/*
+ * SPDX-License-Identifier: MIT
+ */
+
+/* Throughput of vrend_decode_ctx_submit_cmd on synthetic command streams,
+ * submitted through virgl_renderer_submit_cmd.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pipe/p_defines.h"
+#include "pipe/p_state.h"
+#include "util/macros.h"
+#include "util/u_memory.h"
+#include "virglrenderer.h"
+#include "virgl_protocol.h"
+#include "testvirgl.h"
+#include "testvirgl_encode.h"
+
+#include "bench.h"
+
+struct decode_case {
+   const char *name;
+   void (*build)(struct virgl_context *ctx, uint32_t *num_cmds);
+   uint32_t *stream;
+   uint32_t num_dwords;
+   uint32_t num_cmds;
+};
+
+static void bench_flush(struct virgl_context *ctx)
+{
+   (void)ctx;
+   fprintf(stderr, "synthetic command stream does not fit into one buffer\n");
+   exit(EXIT_FAILURE);
+}
+
+static void build_state_stream(struct virgl_context *ctx, uint32_t *num_cmds)
+{
+   struct pipe_blend_color color = { { 0.25f, 0.5f, 0.75f, 1.0f } };
+   struct pipe_stencil_ref ref = { { 0x12, 0x34 } };
+   struct pipe_scissor_state scissor = { 0, 0, 640, 480 };
+   struct pipe_viewport_state viewport = {
+      .scale = { 320.0f, 240.0f, 0.5f },
+      .translate = { 320.0f, 240.0f, 0.5f },
+   };
+   float consts[16 * 4];
+
+   for (unsigned i = 0; i < ARRAY_SIZE(consts); i++)
+      consts[i] = (float)i;
+
+   for (int i = 0; i < 64; i++) {
+      virgl_encoder_set_blend_color(ctx, &color);
+      virgl_encoder_set_stencil_ref(ctx, &ref);
+      virgl_encoder_set_scissor_state(ctx, 0, 1, &scissor);
+      virgl_encoder_set_viewport_states(ctx, 0, 1, &viewport);
+      virgl_encoder_write_constant_buffer(ctx, PIPE_SHADER_VERTEX, 0,
+                                          ARRAY_SIZE(consts), consts);
+      virgl_encoder_write_constant_buffer(ctx, PIPE_SHADER_FRAGMENT, 0,
+                                          ARRAY_SIZE(consts), consts);
+      *num_cmds += 6;
+   }
+}
+
+static void build_object_stream(struct virgl_context *ctx, uint32_t *num_cmds)
+{
+   struct pipe_blend_state blend;
+   struct pipe_depth_stencil_alpha_state dsa;
+   struct pipe_rasterizer_state rs;
+
+   memset(&blend, 0, sizeof(blend));
+   blend.rt[0].colormask = PIPE_MASK_RGBA;
+   memset(&dsa, 0, sizeof(dsa));
+   dsa.depth.enabled = 1;
+   dsa.depth.writemask = 1;
+   dsa.depth.func = PIPE_FUNC_LESS;
+   memset(&rs, 0, sizeof(rs));
+   rs.cull_face = PIPE_FACE_BACK;
+   rs.half_pixel_center = 1;
+
+   for (uint32_t i = 0; i < 32; i++) {
+      uint32_t handle = 100 + i * 3;
+
+      virgl_encode_blend_state(ctx, handle, &blend);
+      virgl_encode_dsa_state(ctx, handle + 1, &dsa);
+      virgl_encode_rasterizer_state(ctx, handle + 2, &rs);
+      virgl_encode_bind_object(ctx, handle, VIRGL_OBJECT_BLEND);
+      virgl_encode_bind_object(ctx, handle + 1, VIRGL_OBJECT_DSA);
+      virgl_encode_bind_object(ctx, handle + 2, VIRGL_OBJECT_RASTERIZER);
+      virgl_encode_delete_object(ctx, handle, VIRGL_OBJECT_BLEND);
+      virgl_encode_delete_object(ctx, handle + 1, VIRGL_OBJECT_DSA);
+      virgl_encode_delete_object(ctx, handle + 2, VIRGL_OBJECT_RASTERIZER);
+      *num_cmds += 9;
+   }
+}
+
+static void run_submit(void *data, uint32_t iterations)
+{
+   struct decode_case *c = data;
+
+   for (uint32_t i = 0; i < iterations; i++) {
+      int ret = virgl_renderer_submit_cmd(c->stream, BENCH_CTX_ID, c->num_dwords);
+      if (ret) {
+         fprintf(stderr, "%s: submit failed: %d\n", c->name, ret);
+         exit(EXIT_FAILURE);
+      }
+   }
+}
+
+int main(int argc, char **argv)
+{
+   struct decode_case cases[] = {
+      { .name = "submit_cmd/state", .build = build_state_stream },
+      { .name = "submit_cmd/objects", .build = build_object_stream },
+   };
+   struct virgl_cmd_buf cbuf;
+   struct virgl_context ctx = {
+      .flush = bench_flush,
+      .cbuf = &cbuf,
+      .ctx_id = BENCH_CTX_ID,
+   };
+   struct bench b;
+
+   if (bench_vrend_init(0))
+      return EXIT_FAILURE;
+
+   bench_begin(&b, "vrend_decode", argc, argv);
+
+   for (unsigned i = 0; i < ARRAY_SIZE(cases); i++) {
+      struct decode_case *c = &cases[i];
+
+      c->stream = CALLOC(VIRGL_MAX_CMDBUF_DWORDS, sizeof(uint32_t));
+      if (!c->stream)
+         return EXIT_FAILURE;
+
+      cbuf.buf = c->stream;
+      cbuf.cdw = 0;
+      c->build(&ctx, &c->num_cmds);
+      c->num_dwords = cbuf.cdw;
+
+      bench_run(&b, c->name, run_submit, c, 500,
+                c->num_dwords * sizeof(uint32_t), c->num_cmds);
+      FREE(c->stream);
+   }
+
+   bench_end(&b);
+   bench_vrend_fini();
+   return EXIT_SUCCESS;
+}
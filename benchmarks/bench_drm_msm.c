@@ -0,0 +1,420 @@
+/*
+ * SPDX-License-Identifier: MIT
+ */
+
+/* The msm native context driven through the public API, on top of the stub
+ * device (see src/drm/msm/msm_stub.h), so that it runs without msm
+ * hardware.  Every case replays a stream of one kind of ccmd, and reports
+ * the latency per ccmd and the ccmd throughput; the fence case measures the
+ * round trip of a submit through the fence thread back to
+ * write_context_fence.
+ *
+ * The stub completes submits immediately, unless VIRGL_DRM_STUB is set to
+ * a latency in microseconds.
+ */
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util/macros.h"
+#include "virglrenderer.h"
+#include "virglrenderer_hw.h"
+
+#include "msm_drm.h"
+#include "msm_proto.h"
+
+#include "bench.h"
+
+#define SHMEM_RES_ID 1
+#define SHMEM_SIZE   (64 * 1024)
+#define POOL_RES_ID  16
+#define POOL_SIZE    16
+#define BO_SIZE      (64 * 1024)
+#define CCMDS_PER_ITER 64
+
+/* the first user-allocated iova, see the stub device */
+#define VA_START 0x100000000ull
+
+struct stream {
+   uint8_t *data;
+   size_t size;
+   size_t alloc;
+};
+
+struct ccmd_case {
+   const char *name;
+   void (*build)(struct stream *s);
+   uint32_t iterations;
+   uint64_t bytes;
+};
+
+static struct {
+   atomic_uint_fast64_t last_fence;
+   struct msm_shmem *shmem;
+   uint32_t seqno;
+   uint32_t queue_id;
+   uint32_t fence;
+   uint32_t next_blob_id;
+   uint32_t next_res_id;
+} drm;
+
+static int bench_cookie;
+
+static void stub_write_fence(UNUSED void *cookie, UNUSED uint32_t fence)
+{
+}
+
+static void stub_write_context_fence(UNUSED void *cookie,
+                                     UNUSED uint32_t ctx_id,
+                                     UNUSED uint32_t ring_idx,
+                                     uint64_t fence_id)
+{
+   atomic_store(&drm.last_fence, fence_id);
+}
+
+static struct virgl_renderer_callbacks bench_cbs = {
+   .version = 3,
+   .write_fence = stub_write_fence,
+   .write_context_fence = stub_write_context_fence,
+};
+
+static void *stream_alloc(struct stream *s, size_t size)
+{
+   if (s->size + size > s->alloc) {
+      s->alloc = MAX2(s->alloc * 2, s->size + size);
+      s->data = realloc(s->data, s->alloc);
+      if (!s->data) {
+         fprintf(stderr, "out of memory\n");
+         exit(EXIT_FAILURE);
+      }
+   }
+
+   void *ptr = s->data + s->size;
+   memset(ptr, 0, size);
+   s->size += size;
+   return ptr;
+}
+
+static struct msm_ccmd_req *stream_ccmd(struct stream *s, uint32_t cmd, uint32_t len)
+{
+   struct msm_ccmd_req *hdr = stream_alloc(s, ALIGN_POT(len, 4));
+
+   hdr->cmd = cmd;
+   hdr->len = ALIGN_POT(len, 4);
+   hdr->seqno = ++drm.seqno;
+   hdr->rsp_off = 0;
+
+   return hdr;
+}
+
+static void submit(struct stream *s)
+{
+   int ret = virgl_renderer_submit_cmd(s->data, BENCH_CTX_ID, s->size / 4);
+   if (ret) {
+      fprintf(stderr, "ccmd submission failed: %d\n", ret);
+      exit(EXIT_FAILURE);
+   }
+}
+
+static void *response(void)
+{
+   return (uint8_t *)drm.shmem + drm.shmem->rsp_mem_offset;
+}
+
+static uint32_t submitqueue_new(void)
+{
+   struct stream s = { 0 };
+   const uint32_t len = sizeof(struct msm_ccmd_ioctl_simple_req) +
+                        sizeof(struct drm_msm_submitqueue);
+   struct msm_ccmd_ioctl_simple_req *req =
+      (void *)stream_ccmd(&s, MSM_CCMD_IOCTL_SIMPLE, len);
+   const struct drm_msm_submitqueue args = { .prio = 0 };
+
+   req->cmd = DRM_IOCTL_MSM_SUBMITQUEUE_NEW;
+   memcpy(req->payload, &args, sizeof(args));
+   submit(&s);
+   free(s.data);
+
+   const struct msm_ccmd_ioctl_simple_rsp *rsp = response();
+   const struct drm_msm_submitqueue *out = (const void *)rsp->payload;
+   if (rsp->ret) {
+      fprintf(stderr, "failed to create a submitqueue: %d\n", rsp->ret);
+      exit(EXIT_FAILURE);
+   }
+
+   return out->id;
+}
+
+static void build_gem_new(struct stream *s, uint32_t blob_id)
+{
+   struct msm_ccmd_gem_new_req *req =
+      (void *)stream_ccmd(s, MSM_CCMD_GEM_NEW, sizeof(*req));
+
+   req->iova = VA_START + (uint64_t)blob_id * BO_SIZE;
+   req->size = BO_SIZE;
+   req->flags = MSM_BO_WC;
+   req->blob_id = blob_id;
+}
+
+static uint32_t bo_create(void)
+{
+   const uint32_t blob_id = ++drm.next_blob_id;
+   const uint32_t res_id = ++drm.next_res_id;
+   struct stream s = { 0 };
+
+   build_gem_new(&s, blob_id);
+   submit(&s);
+   free(s.data);
+
+   const struct virgl_renderer_resource_create_blob_args args = {
+      .res_handle = res_id,
+      .ctx_id = BENCH_CTX_ID,
+      .blob_mem = VIRGL_RENDERER_BLOB_MEM_HOST3D,
+      .blob_flags = VIRGL_RENDERER_BLOB_FLAG_USE_MAPPABLE,
+      .blob_id = blob_id,
+      .size = BO_SIZE,
+   };
+   int ret = virgl_renderer_resource_create_blob(&args);
+   if (ret) {
+      fprintf(stderr, "failed to create a bo: %d\n", ret);
+      exit(EXIT_FAILURE);
+   }
+   virgl_renderer_ctx_attach_resource(BENCH_CTX_ID, res_id);
+
+   return res_id;
+}
+
+static void bo_destroy(uint32_t res_id)
+{
+   virgl_renderer_ctx_detach_resource(BENCH_CTX_ID, res_id);
+   virgl_renderer_resource_unref(res_id);
+}
+
+static void build_nop(struct stream *s)
+{
+   for (uint32_t i = 0; i < CCMDS_PER_ITER; i++)
+      stream_ccmd(s, MSM_CCMD_NOP, sizeof(struct msm_ccmd_nop_req));
+}
+
+static void build_set_iova(struct stream *s)
+{
+   for (uint32_t i = 0; i < CCMDS_PER_ITER; i++) {
+      const uint32_t bo = i % POOL_SIZE;
+      struct msm_ccmd_gem_set_iova_req *req =
+         (void *)stream_ccmd(s, MSM_CCMD_GEM_SET_IOVA, sizeof(*req));
+
+      req->res_id = POOL_RES_ID + bo;
+      req->iova = VA_START + (uint64_t)bo * BO_SIZE;
+   }
+}
+
+static void build_cpu_prep(struct stream *s)
+{
+   for (uint32_t i = 0; i < CCMDS_PER_ITER; i++) {
+      struct msm_ccmd_gem_cpu_prep_req *req =
+         (void *)stream_ccmd(s, MSM_CCMD_GEM_CPU_PREP, sizeof(*req));
+
+      req->res_id = POOL_RES_ID + i % POOL_SIZE;
+      req->op = MSM_PREP_READ;
+   }
+}
+
+static void build_upload(struct stream *s)
+{
+   for (uint32_t i = 0; i < CCMDS_PER_ITER; i++) {
+      struct msm_ccmd_gem_upload_req *req =
+         (void *)stream_ccmd(s, MSM_CCMD_GEM_UPLOAD, sizeof(*req) + 4096);
+
+      req->res_id = POOL_RES_ID + i % POOL_SIZE;
+      req->off = 0;
+      req->len = 4096;
+   }
+}
+
+static void build_submits(struct stream *s, uint32_t count)
+{
+   for (uint32_t i = 0; i < count; i++) {
+      const uint32_t len = sizeof(struct msm_ccmd_gem_submit_req) +
+                           POOL_SIZE * sizeof(struct drm_msm_gem_submit_bo) +
+                           sizeof(struct drm_msm_gem_submit_cmd);
+      struct msm_ccmd_gem_submit_req *req =
+         (void *)stream_ccmd(s, MSM_CCMD_GEM_SUBMIT, len);
+      struct drm_msm_gem_submit_bo *bos = (void *)req->payload;
+      struct drm_msm_gem_submit_cmd *cmd = (void *)&bos[POOL_SIZE];
+
+      req->flags = MSM_PIPE_3D0;
+      req->queue_id = drm.queue_id;
+      req->nr_bos = POOL_SIZE;
+      req->nr_cmds = 1;
+      req->fence = ++drm.fence;
+
+      for (uint32_t j = 0; j < POOL_SIZE; j++) {
+         bos[j].flags = MSM_SUBMIT_BO_READ;
+         bos[j].handle = POOL_RES_ID + j;
+      }
+
+      cmd->type = MSM_SUBMIT_CMD_BUF;
+      cmd->submit_idx = 0;
+      cmd->size = 256;
+   }
+}
+
+static void build_submit(struct stream *s)
+{
+   build_submits(s, CCMDS_PER_ITER);
+}
+
+static void build_wait_fence(struct stream *s)
+{
+   for (uint32_t i = 0; i < CCMDS_PER_ITER; i++) {
+      struct msm_ccmd_wait_fence_req *req =
+         (void *)stream_ccmd(s, MSM_CCMD_WAIT_FENCE, sizeof(*req));
+
+      req->queue_id = drm.queue_id;
+      req->fence = drm.fence;
+   }
+}
+
+/* streams are rebuilt before each run, for the seqnos and the fences */
+static void run_stream(void *data, uint32_t iterations)
+{
+   const struct ccmd_case *c = data;
+   struct stream s = { 0 };
+
+   for (uint32_t i = 0; i < iterations; i++) {
+      s.size = 0;
+      c->build(&s);
+      submit(&s);
+   }
+
+   free(s.data);
+}
+
+static void run_gem_new(UNUSED void *data, uint32_t iterations)
+{
+   for (uint32_t i = 0; i < iterations; i++)
+      bo_destroy(bo_create());
+}
+
+static void run_fence_roundtrip(UNUSED void *data, uint32_t iterations)
+{
+   struct stream s = { 0 };
+
+   for (uint32_t i = 0; i < iterations; i++) {
+      s.size = 0;
+      build_submits(&s, 1);
+      submit(&s);
+
+      /* ring_idx 0 is the host CPU, queues of priority 0 are on ring 1 */
+      const uint64_t fence_id = drm.fence;
+      if (virgl_renderer_context_create_fence(BENCH_CTX_ID, 0, 1, fence_id)) {
+         fprintf(stderr, "failed to create a fence\n");
+         exit(EXIT_FAILURE);
+      }
+      while (atomic_load(&drm.last_fence) != fence_id)
+         ;
+   }
+
+   free(s.data);
+}
+
+static void drm_init(void)
+{
+   /* an immediate completion, unless asked otherwise */
+   setenv("VIRGL_DRM_STUB", "0", 0);
+
+   int ret = virgl_renderer_init(&bench_cookie,
+                                 VIRGL_RENDERER_NO_VIRGL | VIRGL_RENDERER_DRM |
+                                 VIRGL_RENDERER_ASYNC_FENCE_CB,
+                                 &bench_cbs);
+   if (ret) {
+      fprintf(stderr, "failed to initialize virglrenderer: %d\n", ret);
+      exit(EXIT_FAILURE);
+   }
+
+   ret = virgl_renderer_context_create_with_flags(BENCH_CTX_ID, VIRGL_RENDERER_CAPSET_DRM,
+                                                  strlen("bench"), "bench");
+   if (ret) {
+      fprintf(stderr, "failed to create a drm context: %d\n", ret);
+      exit(EXIT_FAILURE);
+   }
+
+   const struct virgl_renderer_resource_create_blob_args args = {
+      .res_handle = SHMEM_RES_ID,
+      .ctx_id = BENCH_CTX_ID,
+      .blob_mem = VIRGL_RENDERER_BLOB_MEM_HOST3D,
+      .blob_flags = VIRGL_RENDERER_BLOB_FLAG_USE_MAPPABLE,
+      .blob_id = 0,
+      .size = SHMEM_SIZE,
+   };
+   void *map;
+   uint64_t size;
+
+   if (virgl_renderer_resource_create_blob(&args) ||
+       virgl_renderer_resource_map(SHMEM_RES_ID, &map, &size)) {
+      fprintf(stderr, "failed to set up the shmem buffer\n");
+      exit(EXIT_FAILURE);
+   }
+   virgl_renderer_ctx_attach_resource(BENCH_CTX_ID, SHMEM_RES_ID);
+
+   drm.shmem = map;
+   /* large enough for all responses, so that no shadow copy is made */
+   ((struct msm_ccmd_rsp *)response())->len = 256;
+
+   drm.queue_id = submitqueue_new();
+
+   drm.next_res_id = POOL_RES_ID - 1;
+   for (uint32_t i = 0; i < POOL_SIZE; i++)
+      bo_create();
+}
+
+static void drm_fini(void)
+{
+   for (uint32_t i = 0; i < POOL_SIZE; i++)
+      bo_destroy(POOL_RES_ID + i);
+
+   virgl_renderer_resource_unmap(SHMEM_RES_ID);
+   virgl_renderer_ctx_detach_resource(BENCH_CTX_ID, SHMEM_RES_ID);
+   virgl_renderer_resource_unref(SHMEM_RES_ID);
+
+   virgl_renderer_context_destroy(BENCH_CTX_ID);
+   virgl_renderer_cleanup(&bench_cookie);
+}
+
+int main(int argc, char **argv)
+{
+   static const struct ccmd_case cases[] = {
+      { "ccmd/nop", build_nop, 2000, 0 },
+      { "ccmd/gem_set_iova", build_set_iova, 500, 0 },
+      { "ccmd/gem_cpu_prep", build_cpu_prep, 500, 0 },
+      { "ccmd/gem_upload/4k", build_upload, 200, CCMDS_PER_ITER * 4096 },
+      { "ccmd/gem_submit/16bos", build_submit, 100, 0 },
+      { "ccmd/wait_fence", build_wait_fence, 500, 0 },
+   };
+   struct bench b;
+
+   bench_begin(&b, "drm_msm", argc, argv);
+   drm_init();
+
+   for (unsigned i = 0; i < ARRAY_SIZE(cases); i++) {
+      const struct ccmd_case *c = &cases[i];
+      bench_run(&b, c->name, run_stream, (void *)c, c->iterations, c->bytes,
+                CCMDS_PER_ITER);
+   }
+
+   /* GEM_NEW, the blob creation and the destruction of the bo */
+   bench_run(&b, "ccmd/gem_new+blob", run_gem_new, NULL, 500, 0, 1);
+   bench_run(&b, "fence/roundtrip", run_fence_roundtrip, NULL, 500, 0, 1);
+
+   /* failed submits and allocations are only reported there */
+   const uint32_t async_errors = drm.shmem->async_error;
+   if (async_errors)
+      fprintf(stderr, "%u asynchronous errors\n", async_errors);
+
+   drm_fini();
+   bench_end(&b);
+
+   return async_errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
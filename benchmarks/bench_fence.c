@@ -0,0 +1,65 @@
+/*
+ * SPDX-License-Identifier: MIT
+ */
+
+/* Fence creation and retirement on the vrend timeline, retired by polling
+ * like a VMM without the sync thread would.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "util/macros.h"
+#include "virglrenderer.h"
+
+#include "bench.h"
+
+struct fence_case {
+   const char *name;
+   uint32_t batch;
+};
+
+static uint32_t next_fence_id;
+
+static void run_fences(void *data, uint32_t iterations)
+{
+   const struct fence_case *c = data;
+
+   for (uint32_t i = 0; i < iterations; i++) {
+      uint32_t last = 0;
+
+      for (uint32_t j = 0; j < c->batch; j++) {
+         last = ++next_fence_id;
+         if (virgl_renderer_create_fence(last, BENCH_CTX_ID)) {
+            fprintf(stderr, "%s: failed to create fence\n", c->name);
+            exit(EXIT_FAILURE);
+         }
+      }
+
+      while (bench_vrend_last_fence() != last)
+         virgl_renderer_poll();
+   }
+}
+
+int main(int argc, char **argv)
+{
+   static const struct fence_case cases[] = {
+      { "create_retire/batch1", 1 },
+      { "create_retire/batch16", 16 },
+      { "create_retire/batch64", 64 },
+   };
+   struct bench b;
+
+   if (bench_vrend_init(0))
+      return EXIT_FAILURE;
+
+   bench_begin(&b, "vrend_fence", argc, argv);
+
+   for (unsigned i = 0; i < ARRAY_SIZE(cases); i++)
+      bench_run(&b, cases[i].name, run_fences, (void *)&cases[i], 2000 / cases[i].batch,
+                0, cases[i].batch);
+
+   bench_end(&b);
+   bench_vrend_fini();
+   return EXIT_SUCCESS;
+}
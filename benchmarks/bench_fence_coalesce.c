@@ -0,0 +1,122 @@
+/*
+ * SPDX-License-Identifier: MIT
+ */
+
+/* Fence retirement through virgl_fence_coalescer, delivered to stub
+ * callbacks.  The fences are submitted as mergeable.  Throughput cases
+ * retire fences on a few rings and wait for the last one to be delivered;
+ * latency cases retire a single fence and wait for it.  The number of
+ * deliveries per retired fence is printed to stderr.
+ */
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "util/macros.h"
+#include "virgl_fence_coalesce.h"
+#include "virglrenderer.h"
+
+#include "bench.h"
+
+#define NUM_RINGS 4
+#define FENCES_PER_ITER 64
+
+struct coalesce_case {
+   const char *name;
+   bool coalesce;
+   bool threaded;
+   uint64_t window_us;
+   uint32_t watermark;
+   uint32_t fences;
+   uint32_t iterations;
+};
+
+static struct {
+   atomic_uint_fast64_t last_fence[NUM_RINGS];
+   atomic_uint_fast64_t deliveries;
+   uint64_t next_fence;
+   uint64_t retired;
+} stub;
+
+static void stub_deliver(UNUSED void *data,
+                         UNUSED uint32_t ctx_id,
+                         uint32_t ring_idx,
+                         uint64_t fence_id)
+{
+   atomic_store(&stub.last_fence[ring_idx], fence_id);
+   atomic_fetch_add(&stub.deliveries, 1);
+}
+
+static struct virgl_fence_coalescer coalescer;
+
+static void run_retire(void *data, uint32_t iterations)
+{
+   const struct coalesce_case *c = data;
+
+   for (uint32_t i = 0; i < iterations; i++) {
+      uint64_t fence_id = 0;
+
+      if (c->coalesce && !c->threaded)
+         virgl_fence_coalescer_begin(&coalescer);
+
+      for (uint32_t j = 0; j < c->fences; j++) {
+         fence_id = ++stub.next_fence;
+         if (c->coalesce) {
+            virgl_fence_coalescer_submit(&coalescer, 1, j % NUM_RINGS, fence_id,
+                                         VIRGL_RENDERER_FENCE_FLAG_MERGEABLE);
+            virgl_fence_coalescer_retire(&coalescer, 1, j % NUM_RINGS, fence_id);
+         } else
+            stub_deliver(NULL, 1, j % NUM_RINGS, fence_id);
+      }
+      stub.retired += c->fences;
+
+      if (c->coalesce && !c->threaded)
+         virgl_fence_coalescer_end(&coalescer);
+
+      /* the last fence went to this ring */
+      while (atomic_load(&stub.last_fence[(c->fences - 1) % NUM_RINGS]) != fence_id)
+         ;
+   }
+}
+
+int main(int argc, char **argv)
+{
+   static const struct coalesce_case cases[] = {
+      { "throughput/direct", false, false, 0, 0, FENCES_PER_ITER, 2000 },
+      { "throughput/poll", true, false, 0, 16, FENCES_PER_ITER, 2000 },
+      { "throughput/async/window0", true, true, 0, 16, FENCES_PER_ITER, 2000 },
+      { "throughput/async/window50us", true, true, 50, 16, FENCES_PER_ITER, 2000 },
+      { "latency/direct", false, false, 0, 0, 1, 20000 },
+      { "latency/async/window0", true, true, 0, 16, 1, 20000 },
+      { "latency/async/window50us", true, true, 50, 16, 1, 2000 },
+   };
+   struct bench b;
+
+   bench_begin(&b, "fence_coalesce", argc, argv);
+
+   for (unsigned i = 0; i < ARRAY_SIZE(cases); i++) {
+      const struct coalesce_case *c = &cases[i];
+
+      if (c->coalesce &&
+          virgl_fence_coalescer_init(&coalescer, stub_deliver, NULL, c->window_us * 1000,
+                                     c->watermark, c->threaded)) {
+         fprintf(stderr, "%s: failed to initialize the coalescer\n", c->name);
+         return EXIT_FAILURE;
+      }
+
+      atomic_store(&stub.deliveries, 0);
+      stub.retired = 0;
+
+      bench_run(&b, c->name, run_retire, (void *)c, c->iterations, 0, c->fences);
+
+      if (c->coalesce)
+         virgl_fence_coalescer_fini(&coalescer);
+
+      fprintf(stderr, "%s: %.3f deliveries per fence\n", c->name,
+              (double)atomic_load(&stub.deliveries) / stub.retired);
+   }
+
+   bench_end(&b);
+   return EXIT_SUCCESS;
+}
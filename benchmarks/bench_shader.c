@@ -0,0 +1,179 @@
+/*
+ * SPDX-License-Identifier: MIT
+ */
+
+/* TGSI -> GLSL translation through vrend_convert_shader.  This is pure CPU
+ * work and does not need a GL context.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tgsi/tgsi_text.h"
+#include "util/macros.h"
+#include "vrend_shader.h"
+#include "vrend_strbuf.h"
+
+#include "bench.h"
+
+static const char vs_passthrough[] =
+   "VERT\n"
+   "DCL IN[0]\n"
+   "DCL IN[1]\n"
+   "DCL OUT[0], POSITION\n"
+   "DCL OUT[1], GENERIC[0]\n"
+   "  0: MOV OUT[1], IN[1]\n"
+   "  1: MOV OUT[0], IN[0]\n"
+   "  2: END\n";
+
+static const char vs_transform[] =
+   "VERT\n"
+   "DCL IN[0]\n"
+   "DCL IN[1]\n"
+   "DCL IN[2]\n"
+   "DCL OUT[0], POSITION\n"
+   "DCL OUT[1], GENERIC[0]\n"
+   "DCL OUT[2], GENERIC[1]\n"
+   "DCL CONST[0..11]\n"
+   "DCL TEMP[0..3]\n"
+   "  0: MUL TEMP[0], IN[0].xxxx, CONST[0]\n"
+   "  1: MAD TEMP[0], IN[0].yyyy, CONST[1], TEMP[0]\n"
+   "  2: MAD TEMP[0], IN[0].zzzz, CONST[2], TEMP[0]\n"
+   "  3: MAD OUT[0], IN[0].wwww, CONST[3], TEMP[0]\n"
+   "  4: DP3 TEMP[1].x, IN[1], CONST[4]\n"
+   "  5: DP3 TEMP[1].y, IN[1], CONST[5]\n"
+   "  6: DP3 TEMP[1].z, IN[1], CONST[6]\n"
+   "  7: DP3 TEMP[2].x, TEMP[1], TEMP[1]\n"
+   "  8: RSQ TEMP[2].x, TEMP[2].xxxx\n"
+   "  9: MUL OUT[1], TEMP[1], TEMP[2].xxxx\n"
+   " 10: MOV OUT[2], IN[2]\n"
+   " 11: END\n";
+
+static const char fs_textured[] =
+   "FRAG\n"
+   "DCL IN[0], GENERIC[0], PERSPECTIVE\n"
+   "DCL IN[1], GENERIC[1], PERSPECTIVE\n"
+   "DCL OUT[0], COLOR\n"
+   "DCL SAMP[0]\n"
+   "DCL SAMP[1]\n"
+   "DCL SVIEW[0], 2D, FLOAT\n"
+   "DCL SVIEW[1], 2D, FLOAT\n"
+   "DCL CONST[0..1]\n"
+   "DCL TEMP[0..2]\n"
+   "  0: TEX TEMP[0], IN[1], SAMP[0], 2D\n"
+   "  1: TEX TEMP[1], IN[1], SAMP[1], 2D\n"
+   "  2: DP3_SAT TEMP[2].x, IN[0], CONST[0]\n"
+   "  3: MUL TEMP[0], TEMP[0], TEMP[2].xxxx\n"
+   "  4: LRP TEMP[0], CONST[1].wwww, TEMP[1], TEMP[0]\n"
+   "  5: MOV OUT[0], TEMP[0]\n"
+   "  6: END\n";
+
+static const char fs_control_flow[] =
+   "FRAG\n"
+   "DCL IN[0], GENERIC[0], PERSPECTIVE\n"
+   "DCL OUT[0], COLOR\n"
+   "DCL CONST[0..3]\n"
+   "DCL TEMP[0..3]\n"
+   "IMM[0] FLT32 { 0.0000, 1.0000, 0.5000, 8.0000 }\n"
+   "  0: MOV TEMP[0], IMM[0].xxxx\n"
+   "  1: MOV TEMP[1].x, IMM[0].xxxx\n"
+   "  2: BGNLOOP\n"
+   "  3:   SGE TEMP[2].x, TEMP[1].xxxx, IMM[0].wwww\n"
+   "  4:   IF TEMP[2].xxxx\n"
+   "  5:     BRK\n"
+   "  6:   ENDIF\n"
+   "  7:   MAD TEMP[0], IN[0], CONST[0], TEMP[0]\n"
+   "  8:   SLT TEMP[3].x, TEMP[0].xxxx, IMM[0].zzzz\n"
+   "  9:   IF TEMP[3].xxxx\n"
+   " 10:     ADD TEMP[0], TEMP[0], CONST[1]\n"
+   " 11:   ELSE\n"
+   " 12:     MUL TEMP[0], TEMP[0], CONST[2]\n"
+   " 13:   ENDIF\n"
+   " 14:   ADD TEMP[1].x, TEMP[1].xxxx, IMM[0].yyyy\n"
+   " 15: ENDLOOP\n"
+   " 16: MOV_SAT OUT[0], TEMP[0]\n"
+   " 17: END\n";
+
+struct shader_case {
+   const char *name;
+   const char *text;
+   const struct vrend_shader_cfg *cfg;
+   struct tgsi_token tokens[1024];
+};
+
+static const struct vrend_shader_cfg cfg_gl = {
+   .glsl_version = 330,
+   .max_draw_buffers = 8,
+   .use_core_profile = 1,
+   .use_explicit_locations = 1,
+};
+
+static const struct vrend_shader_cfg cfg_gles = {
+   .glsl_version = 310,
+   .max_draw_buffers = 4,
+   .use_gles = 1,
+   .use_explicit_locations = 1,
+};
+
+static void free_shader_info(struct vrend_shader_info *sinfo)
+{
+   if (sinfo->so_names)
+      for (unsigned i = 0; i < sinfo->so_info.num_outputs; i++)
+         free(sinfo->so_names[i]);
+   free(sinfo->so_names);
+   free(sinfo->sampler_arrays);
+   free(sinfo->image_arrays);
+}
+
+static void run_convert_shader(void *data, uint32_t iterations)
+{
+   struct shader_case *c = data;
+
+   for (uint32_t i = 0; i < iterations; i++) {
+      struct vrend_shader_key key;
+      struct vrend_shader_info sinfo;
+      struct vrend_variable_shader_info var_sinfo;
+      struct vrend_strarray glsl;
+
+      memset(&key, 0, sizeof(key));
+      memset(&sinfo, 0, sizeof(sinfo));
+      memset(&var_sinfo, 0, sizeof(var_sinfo));
+      strarray_alloc(&glsl, SHADER_MAX_STRINGS);
+
+      if (!vrend_convert_shader(NULL, c->cfg, c->tokens, 0, &key, &sinfo,
+                                &var_sinfo, &glsl)) {
+         fprintf(stderr, "%s: translation failed\n", c->name);
+         exit(EXIT_FAILURE);
+      }
+
+      strarray_free(&glsl, true);
+      free_shader_info(&sinfo);
+   }
+}
+
+int main(int argc, char **argv)
+{
+   static struct shader_case cases[] = {
+      { "convert_shader/gl/vs_passthrough", vs_passthrough, &cfg_gl },
+      { "convert_shader/gl/vs_transform", vs_transform, &cfg_gl },
+      { "convert_shader/gl/fs_textured", fs_textured, &cfg_gl },
+      { "convert_shader/gl/fs_control_flow", fs_control_flow, &cfg_gl },
+      { "convert_shader/gles/vs_transform", vs_transform, &cfg_gles },
+      { "convert_shader/gles/fs_textured", fs_textured, &cfg_gles },
+   };
+   struct bench b;
+
+   bench_begin(&b, "vrend_shader", argc, argv);
+
+   for (unsigned i = 0; i < ARRAY_SIZE(cases); i++) {
+      if (!tgsi_text_translate(cases[i].text, cases[i].tokens, ARRAY_SIZE(cases[i].tokens))) {
+         fprintf(stderr, "%s: failed to parse TGSI\n", cases[i].name);
+         return EXIT_FAILURE;
+      }
+      bench_run(&b, cases[i].name, run_convert_shader, &cases[i], 200, 0, 1);
+   }
+
+   bench_end(&b);
+   return EXIT_SUCCESS;
+}
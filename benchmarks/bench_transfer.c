@@ -0,0 +1,158 @@
+/*
+ * SPDX-License-Identifier: MIT
+ */
+
+/* Texture and buffer transfers to and from guest backing memory, both from
+ * a single iovec and from page sized iovecs as a guest would hand them out.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#include "pipe/p_defines.h"
+#include "pipe/p_format.h"
+#include "util/macros.h"
+#include "virglrenderer.h"
+#include "virgl_hw.h"
+
+#include "bench.h"
+
+#define TEX_SIZE 512
+#define TEX_BPP 4
+#define BUF_SIZE (1024 * 1024)
+#define PAGE_SIZE 4096
+
+struct transfer_case {
+   const char *name;
+   uint32_t handle;
+   bool write;
+   struct virgl_box box;
+   uint32_t stride;
+   uint64_t bytes;
+};
+
+struct backing {
+   uint8_t *data;
+   struct iovec *iovs;
+   uint32_t num_iovs;
+};
+
+static int create_backing(struct backing *backing, size_t size, bool paged)
+{
+   backing->data = calloc(1, size);
+   if (!backing->data)
+      return -1;
+
+   backing->num_iovs = paged ? DIV_ROUND_UP(size, PAGE_SIZE) : 1;
+   backing->iovs = calloc(backing->num_iovs, sizeof(*backing->iovs));
+   if (!backing->iovs)
+      return -1;
+
+   for (uint32_t i = 0; i < backing->num_iovs; i++) {
+      size_t offset = paged ? i * PAGE_SIZE : 0;
+      backing->iovs[i].iov_base = backing->data + offset;
+      backing->iovs[i].iov_len = paged ? MIN2(PAGE_SIZE, size - offset) : size;
+   }
+
+   for (size_t i = 0; i < size; i++)
+      backing->data[i] = i * 7;
+
+   return 0;
+}
+
+static int create_resource(uint32_t handle, bool texture, struct backing *backing)
+{
+   struct virgl_renderer_resource_create_args args = {
+      .handle = handle,
+      .target = texture ? PIPE_TEXTURE_2D : PIPE_BUFFER,
+      .format = texture ? PIPE_FORMAT_B8G8R8A8_UNORM : PIPE_FORMAT_R8_UNORM,
+      .bind = texture ? PIPE_BIND_SAMPLER_VIEW | PIPE_BIND_RENDER_TARGET : VIRGL_BIND_VERTEX_BUFFER,
+      .width = texture ? TEX_SIZE : BUF_SIZE,
+      .height = texture ? TEX_SIZE : 1,
+      .depth = 1,
+      .array_size = 1,
+   };
+   int ret;
+
+   ret = virgl_renderer_resource_create(&args, backing->iovs, backing->num_iovs);
+   if (ret)
+      return ret;
+
+   virgl_renderer_ctx_attach_resource(BENCH_CTX_ID, handle);
+   return 0;
+}
+
+static void run_transfer(void *data, uint32_t iterations)
+{
+   struct transfer_case *c = data;
+   uint64_t offset = (uint64_t)c->box.y * c->stride + c->box.x * TEX_BPP;
+
+   for (uint32_t i = 0; i < iterations; i++) {
+      int ret;
+
+      if (c->write)
+         ret = virgl_renderer_transfer_write_iov(c->handle, BENCH_CTX_ID, 0, c->stride, 0,
+                                                 &c->box, offset, NULL, 0);
+      else
+         ret = virgl_renderer_transfer_read_iov(c->handle, BENCH_CTX_ID, 0, c->stride, 0,
+                                                &c->box, offset, NULL, 0);
+      if (ret) {
+         fprintf(stderr, "%s: transfer failed: %d\n", c->name, ret);
+         exit(EXIT_FAILURE);
+      }
+   }
+}
+
+int main(int argc, char **argv)
+{
+   const uint32_t tex_stride = TEX_SIZE * TEX_BPP;
+   const struct virgl_box full = { 0, 0, 0, TEX_SIZE, TEX_SIZE, 1 };
+   const struct virgl_box tile = { 128, 128, 0, 64, 64, 1 };
+   const struct virgl_box buf = { 0, 0, 0, BUF_SIZE, 1, 1 };
+   struct transfer_case cases[] = {
+      { "put/tex2d/full/linear", 1, true, full, tex_stride, TEX_SIZE * TEX_SIZE * TEX_BPP },
+      { "put/tex2d/full/paged", 2, true, full, tex_stride, TEX_SIZE * TEX_SIZE * TEX_BPP },
+      { "put/tex2d/tile64/paged", 2, true, tile, tex_stride, 64 * 64 * TEX_BPP },
+      { "get/tex2d/full/linear", 1, false, full, tex_stride, TEX_SIZE * TEX_SIZE * TEX_BPP },
+      { "get/tex2d/full/paged", 2, false, full, tex_stride, TEX_SIZE * TEX_SIZE * TEX_BPP },
+      { "get/tex2d/tile64/paged", 2, false, tile, tex_stride, 64 * 64 * TEX_BPP },
+      { "put/buffer/1m/paged", 3, true, buf, 0, BUF_SIZE },
+      { "get/buffer/1m/paged", 3, false, buf, 0, BUF_SIZE },
+   };
+   struct backing backings[3];
+   struct bench b;
+
+   if (bench_vrend_init(0))
+      return EXIT_FAILURE;
+
+   if (create_backing(&backings[0], TEX_SIZE * TEX_SIZE * TEX_BPP, false) ||
+       create_backing(&backings[1], TEX_SIZE * TEX_SIZE * TEX_BPP, true) ||
+       create_backing(&backings[2], BUF_SIZE, true) ||
+       create_resource(1, true, &backings[0]) ||
+       create_resource(2, true, &backings[1]) ||
+       create_resource(3, false, &backings[2])) {
+      fprintf(stderr, "failed to create resources\n");
+      return EXIT_FAILURE;
+   }
+
+   bench_begin(&b, "vrend_transfer", argc, argv);
+
+   for (unsigned i = 0; i < ARRAY_SIZE(cases); i++)
+      bench_run(&b, cases[i].name, run_transfer, &cases[i], 50, cases[i].bytes, 0);
+
+   bench_end(&b);
+
+   for (uint32_t handle = 1; handle <= 3; handle++) {
+      virgl_renderer_ctx_detach_resource(BENCH_CTX_ID, handle);
+      virgl_renderer_resource_unref(handle);
+   }
+   for (unsigned i = 0; i < ARRAY_SIZE(backings); i++) {
+      free(backings[i].iovs);
+      free(backings[i].data);
+   }
+
+   bench_vrend_fini();
+   return EXIT_SUCCESS;
+}
@@ -0,0 +1,209 @@
+/*
+ * SPDX-License-Identifier: MIT
+ */
+
+/* Venus command stream decoding through vn_dispatch_command, with no-op
+ * dispatch callbacks.  Only the decoder is measured, no Vulkan driver is
+ * involved.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util/hash_table.h"
+#include "util/xxhash.h"
+#include "venus-protocol/vn_protocol_renderer_dispatches.h"
+#include "vkr_cs.h"
+
+#include "bench.h"
+
+#define CMD_BUFFER_ID 1
+#define PIPELINE_LAYOUT_ID 2
+
+struct stream {
+   uint8_t *data;
+   size_t size;
+   size_t alloc;
+};
+
+struct cs_case {
+   const char *name;
+   void (*build)(struct stream *s, uint32_t *num_cmds);
+   struct stream stream;
+   uint32_t num_cmds;
+};
+
+struct cs_bench {
+   struct vkr_cs_decoder decoder;
+   struct vn_dispatch_context dispatch;
+   bool fatal;
+};
+
+static void stream_write(struct stream *s, const void *data, size_t size)
+{
+   if (s->size + size > s->alloc) {
+      s->alloc = MAX2(s->alloc * 2, s->size + size);
+      s->data = realloc(s->data, s->alloc);
+      if (!s->data) {
+         fprintf(stderr, "out of memory\n");
+         exit(EXIT_FAILURE);
+      }
+   }
+   memcpy(s->data + s->size, data, size);
+   s->size += size;
+}
+
+static void stream_u32(struct stream *s, uint32_t val)
+{
+   stream_write(s, &val, sizeof(val));
+}
+
+static void stream_u64(struct stream *s, uint64_t val)
+{
+   stream_write(s, &val, sizeof(val));
+}
+
+static void stream_header(struct stream *s, VkCommandTypeEXT type)
+{
+   stream_u32(s, type);
+   stream_u32(s, 0);
+}
+
+static void build_draw_stream(struct stream *s, uint32_t *num_cmds)
+{
+   for (uint32_t i = 0; i < 1024; i++) {
+      stream_header(s, VK_COMMAND_TYPE_vkCmdDraw_EXT);
+      stream_u64(s, CMD_BUFFER_ID);
+      stream_u32(s, 3 * (i + 1));
+      stream_u32(s, 1);
+      stream_u32(s, i);
+      stream_u32(s, 0);
+   }
+   *num_cmds += 1024;
+}
+
+static void build_state_stream(struct stream *s, uint32_t *num_cmds)
+{
+   const VkViewport viewport = { 0.0f, 0.0f, 1920.0f, 1080.0f, 0.0f, 1.0f };
+   uint8_t constants[128];
+
+   for (unsigned i = 0; i < sizeof(constants); i++)
+      constants[i] = i;
+
+   for (uint32_t i = 0; i < 256; i++) {
+      stream_header(s, VK_COMMAND_TYPE_vkCmdSetViewport_EXT);
+      stream_u64(s, CMD_BUFFER_ID);
+      stream_u32(s, 0);
+      stream_u32(s, 1);
+      stream_u64(s, 1);
+      stream_write(s, &viewport, sizeof(viewport));
+
+      stream_header(s, VK_COMMAND_TYPE_vkCmdPushConstants_EXT);
+      stream_u64(s, CMD_BUFFER_ID);
+      stream_u64(s, PIPELINE_LAYOUT_ID);
+      stream_u32(s, VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT);
+      stream_u32(s, 0);
+      stream_u32(s, sizeof(constants));
+      stream_u64(s, sizeof(constants));
+      stream_write(s, constants, sizeof(constants));
+
+      stream_header(s, VK_COMMAND_TYPE_vkCmdDraw_EXT);
+      stream_u64(s, CMD_BUFFER_ID);
+      stream_u32(s, 6);
+      stream_u32(s, 1);
+      stream_u32(s, 0);
+      stream_u32(s, 0);
+   }
+   *num_cmds += 256 * 3;
+}
+
+static void dispatch_vkCmdDraw(UNUSED struct vn_dispatch_context *ctx,
+                               UNUSED struct vn_command_vkCmdDraw *args)
+{
+}
+
+static void dispatch_vkCmdSetViewport(UNUSED struct vn_dispatch_context *ctx,
+                                      UNUSED struct vn_command_vkCmdSetViewport *args)
+{
+}
+
+static void dispatch_vkCmdPushConstants(UNUSED struct vn_dispatch_context *ctx,
+                                        UNUSED struct vn_command_vkCmdPushConstants *args)
+{
+}
+
+static uint32_t hash_u64(const void *key)
+{
+   return XXH32(key, sizeof(uint64_t), 0);
+}
+
+static bool key_u64_equal(const void *key1, const void *key2)
+{
+   return *(const uint64_t *)key1 == *(const uint64_t *)key2;
+}
+
+static struct cs_bench cs;
+
+static void run_decode(void *data, uint32_t iterations)
+{
+   struct cs_case *c = data;
+
+   for (uint32_t i = 0; i < iterations; i++) {
+      vkr_cs_decoder_set_stream(&cs.decoder, c->stream.data, c->stream.size);
+      while (vkr_cs_decoder_has_command(&cs.decoder)) {
+         vn_dispatch_command(&cs.dispatch);
+         if (cs.fatal) {
+            fprintf(stderr, "%s: decoding failed\n", c->name);
+            exit(EXIT_FAILURE);
+         }
+      }
+      vkr_cs_decoder_reset(&cs.decoder);
+   }
+}
+
+int main(int argc, char **argv)
+{
+   struct cs_case cases[] = {
+      { .name = "decode/cmd_draw", .build = build_draw_stream },
+      { .name = "decode/cmd_state", .build = build_state_stream },
+   };
+   struct vkr_object cmd_buffer = {
+      .type = VK_OBJECT_TYPE_COMMAND_BUFFER,
+      .id = CMD_BUFFER_ID,
+   };
+   struct vkr_object pipeline_layout = {
+      .type = VK_OBJECT_TYPE_PIPELINE_LAYOUT,
+      .id = PIPELINE_LAYOUT_ID,
+   };
+   struct hash_table *objects;
+   struct bench b;
+
+   objects = _mesa_hash_table_create(NULL, hash_u64, key_u64_equal);
+   if (!objects)
+      return EXIT_FAILURE;
+   _mesa_hash_table_insert(objects, &cmd_buffer.id, &cmd_buffer);
+   _mesa_hash_table_insert(objects, &pipeline_layout.id, &pipeline_layout);
+
+   vkr_cs_decoder_init(&cs.decoder, &cs.fatal, objects);
+   cs.dispatch.decoder = (struct vn_cs_decoder *)&cs.decoder;
+   cs.dispatch.dispatch_vkCmdDraw = dispatch_vkCmdDraw;
+   cs.dispatch.dispatch_vkCmdSetViewport = dispatch_vkCmdSetViewport;
+   cs.dispatch.dispatch_vkCmdPushConstants = dispatch_vkCmdPushConstants;
+
+   bench_begin(&b, "vkr_cs", argc, argv);
+
+   for (unsigned i = 0; i < ARRAY_SIZE(cases); i++) {
+      struct cs_case *c = &cases[i];
+
+      c->build(&c->stream, &c->num_cmds);
+      bench_run(&b, c->name, run_decode, c, 200, c->stream.size, c->num_cmds);
+      free(c->stream.data);
+   }
+
+   bench_end(&b);
+
+   vkr_cs_decoder_fini(&cs.decoder);
+   _mesa_hash_table_destroy(objects, NULL);
+   return EXIT_SUCCESS;
+}
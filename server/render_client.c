@@ -8,6 +8,8 @@
 #include <unistd.h>
 #include <vulkan/vulkan.h>
 
+#include "util/hash_table.h"
+
 #include "render_context.h"
 #include "render_server.h"
 #include "render_worker.h"
@@ -18,7 +20,10 @@
  * worker, which leads to worker termination.  It also sends a
  * RENDER_CLIENT_OP_DESTROY_CONTEXT to us to remove the record.  Because we
  * are responsible for cleaning up the worker, we don't care if the worker has
- * terminated or not.  We always kill, reap, and remove the record.
+ * terminated or not.  We always kill and remove the record.  The worker is
+ * reaped asynchronously, when the jail sigchld fd signals.
+ *
+ * Records are also hashed by ctx_id in context_record_table.
  */
 struct render_context_record {
    uint32_t ctx_id;
@@ -30,12 +35,9 @@ struct render_context_record {
 static struct render_context_record *
 render_client_find_record(struct render_client *client, uint32_t ctx_id)
 {
-   list_for_each_entry (struct render_context_record, rec, &client->context_records,
-                        head) {
-      if (rec->ctx_id == ctx_id)
-         return rec;
-   }
-   return NULL;
+   struct hash_entry *entry =
+      _mesa_hash_table_search(client->context_record_table, &ctx_id);
+   return entry ? entry->data : NULL;
 }
 
 static void
@@ -50,6 +52,7 @@ render_client_detach_all_records(struct render_client *client)
                              head)
       free(rec);
    list_inithead(&client->context_records);
+   _mesa_hash_table_clear(client->context_record_table, NULL);
 }
 
 static void
@@ -60,6 +63,7 @@ render_client_remove_record(struct render_client *client,
 
    render_worker_destroy(srv->worker_jail, rec->worker);
 
+   _mesa_hash_table_remove_key(client->context_record_table, &rec->ctx_id);
    list_del(&rec->head);
    free(rec);
 }
@@ -75,18 +79,18 @@ render_client_clear_records(struct render_client *client)
 static void
 init_context_args(struct render_context_args *ctx_args,
                   uint32_t init_flags,
-                  const struct render_client_op_create_context_request *req,
+                  const struct render_client_context_info *info,
                   int ctx_fd)
 {
    *ctx_args = (struct render_context_args){
       .valid = true,
       .init_flags = init_flags,
-      .ctx_id = req->ctx_id,
+      .ctx_id = info->ctx_id,
       .ctx_fd = ctx_fd,
    };
 
-   static_assert(sizeof(ctx_args->ctx_name) == sizeof(req->ctx_name), "");
-   memcpy(ctx_args->ctx_name, req->ctx_name, sizeof(req->ctx_name) - 1);
+   static_assert(sizeof(ctx_args->ctx_name) == sizeof(info->ctx_name), "");
+   memcpy(ctx_args->ctx_name, info->ctx_name, sizeof(info->ctx_name) - 1);
 }
 
 #ifdef ENABLE_RENDER_SERVER_WORKER_THREAD
@@ -103,11 +107,17 @@ render_client_worker_thread(void *thread_data)
 
 static bool
 render_client_create_context(struct render_client *client,
-                             const struct render_client_op_create_context_request *req,
+                             const struct render_client_context_info *info,
                              int *out_remote_fd)
 {
    struct render_server *srv = client->server;
 
+   if (render_client_find_record(client, info->ctx_id)) {
+      render_log("context %u already exists", info->ctx_id);
+      *out_remote_fd = -1;
+      return false;
+   }
+
    struct render_context_record *rec = calloc(1, sizeof(*rec));
    if (!rec) {
       *out_remote_fd = -1;
@@ -124,7 +134,7 @@ render_client_create_context(struct render_client *client,
    int remote_fd = socket_fds[1];
 
    struct render_context_args ctx_args;
-   init_context_args(&ctx_args, client->init_flags, req, ctx_fd);
+   init_context_args(&ctx_args, client->init_flags, info, ctx_fd);
 
 #ifdef ENABLE_RENDER_SERVER_WORKER_THREAD
    rec->worker = render_worker_create(srv->worker_jail, render_client_worker_thread,
@@ -143,8 +153,9 @@ render_client_create_context(struct render_client *client,
       return false;
    }
 
-   rec->ctx_id = req->ctx_id;
+   rec->ctx_id = info->ctx_id;
    list_addtail(&rec->head, &client->context_records);
+   _mesa_hash_table_insert(client->context_record_table, &rec->ctx_id, rec);
 
    if (!render_worker_is_record(rec->worker)) {
       /* this is the child process */
@@ -174,10 +185,19 @@ static bool
 render_client_dispatch_destroy_context(struct render_client *client,
                                        const union render_client_op_request *req)
 {
-   const uint32_t ctx_id = req->destroy_context.ctx_id;
-   struct render_context_record *rec = render_client_find_record(client, ctx_id);
-   if (rec)
-      render_client_remove_record(client, rec);
+   const struct render_client_op_destroy_context_request *destroy =
+      &req->destroy_context;
+   if (destroy->count > RENDER_CLIENT_MAX_CONTEXT_BATCH) {
+      render_log("invalid context count %u", destroy->count);
+      return false;
+   }
+
+   for (uint32_t i = 0; i < destroy->count; i++) {
+      struct render_context_record *rec =
+         render_client_find_record(client, destroy->ctx_ids[i]);
+      if (rec)
+         render_client_remove_record(client, rec);
+   }
 
    return true;
 }
@@ -187,28 +207,50 @@ render_client_dispatch_create_context(struct render_client *client,
                                       const union render_client_op_request *req)
 {
    struct render_server *srv = client->server;
+   const struct render_client_op_create_context_request *create = &req->create_context;
 
-   int remote_fd;
-   bool ok = render_client_create_context(client, &req->create_context, &remote_fd);
-
-   if (srv->state == RENDER_SERVER_STATE_SUBPROCESS) {
-      assert(remote_fd < 0);
-      return true;
-   }
-
-   const struct render_client_op_create_context_reply reply = {
-      .ok = ok,
+   struct render_client_op_create_context_reply reply = {
+      .ok_mask = 0,
    };
-   if (!ok) {
+   if (!create->count || create->count > RENDER_CLIENT_MAX_CONTEXT_BATCH) {
+      render_log("invalid context count %u", create->count);
       render_socket_send_reply(&client->socket, &reply, sizeof(reply));
       return false;
    }
 
-   ok = render_socket_send_reply_with_fds(&client->socket, &reply, sizeof(reply),
-                                          &remote_fd, 1);
-   close(remote_fd);
+   int remote_fds[RENDER_CLIENT_MAX_CONTEXT_BATCH];
+   int remote_fd_count = 0;
+   for (uint32_t i = 0; i < create->count; i++) {
+      int remote_fd;
+      const bool ok =
+         render_client_create_context(client, &create->contexts[i], &remote_fd);
+
+      if (srv->state == RENDER_SERVER_STATE_SUBPROCESS) {
+         /* this is the child process and the fds are for the other contexts */
+         assert(remote_fd < 0);
+         for (int j = 0; j < remote_fd_count; j++)
+            close(remote_fds[j]);
+         return true;
+      }
+
+      if (ok) {
+         reply.ok_mask |= 1u << i;
+         remote_fds[remote_fd_count++] = remote_fd;
+      }
+   }
+
+   bool ok;
+   if (remote_fd_count) {
+      ok = render_socket_send_reply_with_fds(&client->socket, &reply, sizeof(reply),
+                                             remote_fds, remote_fd_count);
+   } else {
+      ok = render_socket_send_reply(&client->socket, &reply, sizeof(reply));
+   }
+
+   for (int i = 0; i < remote_fd_count; i++)
+      close(remote_fds[i]);
 
-   return ok;
+   return ok && reply.ok_mask == (1u << create->count) - 1;
 }
 
 static bool
@@ -296,6 +338,7 @@ render_client_destroy(struct render_client *client)
       render_client_clear_records(client);
    }
 
+   _mesa_hash_table_destroy(client->context_record_table, NULL);
    render_socket_fini(&client->socket);
    free(client);
 }
@@ -308,6 +351,13 @@ render_client_create(struct render_server *srv, int client_fd)
    if (!client)
       return NULL;
 
+   client->context_record_table =
+      _mesa_hash_table_create(NULL, _mesa_hash_u32, _mesa_key_u32_equal);
+   if (!client->context_record_table) {
+      free(client);
+      return NULL;
+   }
+
    client->server = srv;
    render_socket_init(&client->socket, client_fd);
 
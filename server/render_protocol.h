@@ -68,7 +68,17 @@ struct render_client_op_reset_request {
    struct render_client_op_header header;
 };
 
-/* Create a context, which will be serviced by a worker.
+/* The maximum number of contexts a single create or destroy request can
+ * carry.  It is bounded by the number of fds a create reply can carry.
+ */
+#define RENDER_CLIENT_MAX_CONTEXT_BATCH 8
+
+struct render_client_context_info {
+   uint32_t ctx_id;
+   char ctx_name[32];
+};
+
+/* Create a batch of contexts, each of which will be serviced by a worker.
  *
  * See also the comment before main() for the process model.
  *
@@ -76,22 +86,24 @@ struct render_client_op_reset_request {
  */
 struct render_client_op_create_context_request {
    struct render_client_op_header header;
-   uint32_t ctx_id;
-   char ctx_name[32];
+   uint32_t count;
+   struct render_client_context_info contexts[RENDER_CLIENT_MAX_CONTEXT_BATCH];
 };
 
 struct render_client_op_create_context_reply {
-   bool ok;
-   /* followed by 1 socket fd if ok */
+   /* bit i is set if contexts[i] was created */
+   uint32_t ok_mask;
+   /* followed by 1 socket fd for each bit set in ok_mask, in order */
 };
 
-/* Destroy a context, including the worker.
+/* Destroy a batch of contexts, including the workers.
  *
  * This roughly corresponds to virgl_renderer_context_destroy.
  */
 struct render_client_op_destroy_context_request {
    struct render_client_op_header header;
-   uint32_t ctx_id;
+   uint32_t count;
+   uint32_t ctx_ids[RENDER_CLIENT_MAX_CONTEXT_BATCH];
 };
 
 union render_client_op_request {
@@ -23,19 +23,34 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <signal.h>
-//#include <sys/signalfd.h>
+#ifndef ENABLE_RENDER_SERVER_WORKER_THREAD
+#include <sys/signalfd.h>
+#endif
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <pthread.h>
 #include <unistd.h>
 
+#include "util/hash_table.h"
+
 struct minijail;
 
+/* Workers are reaped when sigchld_fd becomes readable.  For subprocesses, it
+ * is a signalfd for SIGCHLD and workers are looked up by pid in worker_table.
+ * For threads, it is the read end of a pipe to which each thread writes its
+ * render_worker before exiting, so that joining it never blocks.
+ */
 struct render_worker_jail {
    int max_worker_count;
 
    int sigchld_fd;
+#ifdef ENABLE_RENDER_SERVER_WORKER_THREAD
+   int thread_exit_fd;
+#else
+   struct hash_table *worker_table;
+#endif
    struct minijail *minijail;
 
    struct list_head workers;
@@ -45,6 +60,8 @@ struct render_worker_jail {
 struct render_worker {
 #ifdef ENABLE_RENDER_SERVER_WORKER_THREAD
    pthread_t thread;
+   struct render_worker_jail *jail;
+   void *(*thread_func)(void *thread_data);
 #else
    pid_t pid;
 #endif
@@ -197,6 +214,43 @@ create_sigchld_fd(void)
    return fd;
 }
 
+#else /* !ENABLE_RENDER_SERVER_WORKER_THREAD */
+
+static int
+create_thread_exit_fd(int *out_write_fd)
+{
+   int fds[2];
+   if (pipe(fds)) {
+      render_log("failed to create thread exit pipe");
+      return -1;
+   }
+
+   if (fcntl(fds[0], F_SETFD, FD_CLOEXEC) || fcntl(fds[1], F_SETFD, FD_CLOEXEC) ||
+       fcntl(fds[0], F_SETFL, O_NONBLOCK)) {
+      render_log("failed to set up thread exit pipe");
+      close(fds[0]);
+      close(fds[1]);
+      return -1;
+   }
+
+   *out_write_fd = fds[1];
+   return fds[0];
+}
+
+static void *
+render_worker_thread_main(void *data)
+{
+   struct render_worker *worker = data;
+
+   worker->thread_func(worker->thread_data);
+
+   /* a pointer is smaller than PIPE_BUF and the write is atomic */
+   if (write(worker->jail->thread_exit_fd, &worker, sizeof(worker)) != sizeof(worker))
+      render_log("failed to report thread exit");
+
+   return NULL;
+}
+
 #endif /* !ENABLE_RENDER_SERVER_WORKER_THREAD */
 
 static void
@@ -205,12 +259,20 @@ render_worker_jail_add_worker(struct render_worker_jail *jail,
 {
    list_add(&worker->head, &jail->workers);
    jail->worker_count++;
+
+#ifndef ENABLE_RENDER_SERVER_WORKER_THREAD
+   _mesa_hash_table_insert(jail->worker_table, &worker->pid, worker);
+#endif
 }
 
 static void
 render_worker_jail_remove_worker(struct render_worker_jail *jail,
                                  struct render_worker *worker)
 {
+#ifndef ENABLE_RENDER_SERVER_WORKER_THREAD
+   _mesa_hash_table_remove_key(jail->worker_table, &worker->pid);
+#endif
+
    list_del(&worker->head);
    jail->worker_count--;
 
@@ -221,9 +283,24 @@ static struct render_worker *
 render_worker_jail_reap_any_worker(struct render_worker_jail *jail, bool block)
 {
 #ifdef ENABLE_RENDER_SERVER_WORKER_THREAD
-   (void)jail;
-   (void)block;
-   return NULL;
+   if (block) {
+      struct pollfd poll_fd = {
+         .fd = jail->sigchld_fd,
+         .events = POLLIN,
+      };
+      while (poll(&poll_fd, 1, -1) < 0 && errno == EINTR)
+         ;
+   }
+
+   struct render_worker *worker;
+   if (read(jail->sigchld_fd, &worker, sizeof(worker)) != sizeof(worker))
+      return NULL;
+
+   /* the thread has reported its exit and this does not block */
+   pthread_join(worker->thread, NULL);
+   worker->reaped = true;
+
+   return worker;
 #else
    const int options = WEXITED | (block ? 0 : WNOHANG);
    siginfo_t siginfo = { 0 };
@@ -232,15 +309,16 @@ render_worker_jail_reap_any_worker(struct render_worker_jail *jail, bool block)
    if (!pid)
       return NULL;
 
-   list_for_each_entry (struct render_worker, worker, &jail->workers, head) {
-      if (worker->pid == pid) {
-         worker->reaped = true;
-         return worker;
-      }
+   struct hash_entry *entry = _mesa_hash_table_search(jail->worker_table, &pid);
+   if (!entry) {
+      render_log("unknown child process %d", pid);
+      return NULL;
    }
 
-   render_log("unknown child process %d", pid);
-   return NULL;
+   struct render_worker *worker = entry->data;
+   worker->reaped = true;
+
+   return worker;
 #endif
 }
 
@@ -257,7 +335,16 @@ render_worker_jail_create(int max_worker_count,
    jail->sigchld_fd = -1;
    list_inithead(&jail->workers);
 
-#ifndef ENABLE_RENDER_SERVER_WORKER_THREAD
+#ifdef ENABLE_RENDER_SERVER_WORKER_THREAD
+   jail->thread_exit_fd = -1;
+   jail->sigchld_fd = create_thread_exit_fd(&jail->thread_exit_fd);
+   if (jail->sigchld_fd < 0)
+      goto fail;
+#else
+   jail->worker_table = _mesa_hash_table_create(NULL, _mesa_hash_u32, _mesa_key_u32_equal);
+   if (!jail->worker_table)
+      goto fail;
+
    jail->sigchld_fd = create_sigchld_fd();
    if (jail->sigchld_fd < 0)
       goto fail;
@@ -277,6 +364,15 @@ render_worker_jail_create(int max_worker_count,
    return jail;
 
 fail:
+#ifdef ENABLE_RENDER_SERVER_WORKER_THREAD
+   if (jail->thread_exit_fd >= 0)
+      close(jail->thread_exit_fd);
+#else
+   if (jail->worker_table)
+      _mesa_hash_table_destroy(jail->worker_table, NULL);
+#endif
+   if (jail->sigchld_fd >= 0)
+      close(jail->sigchld_fd);
    free(jail);
    return NULL;
 }
@@ -303,6 +399,12 @@ render_worker_jail_destroy(struct render_worker_jail *jail)
    minijail_destroy(jail->minijail);
 #endif
 
+#ifdef ENABLE_RENDER_SERVER_WORKER_THREAD
+   close(jail->thread_exit_fd);
+#else
+   _mesa_hash_table_destroy(jail->worker_table, NULL);
+#endif
+
    if (jail->sigchld_fd >= 0)
       close(jail->sigchld_fd);
 
@@ -318,7 +420,10 @@ render_worker_jail_get_sigchld_fd(const struct render_worker_jail *jail)
 static bool
 render_worker_jail_drain_sigchld_fd(struct render_worker_jail *jail)
 {
-#if 0
+#ifdef ENABLE_RENDER_SERVER_WORKER_THREAD
+   /* the pipe is drained by render_worker_jail_reap_any_worker */
+   (void)jail;
+#else
    if (jail->sigchld_fd < 0)
       return true;
 
@@ -382,6 +487,10 @@ render_worker_create(struct render_worker_jail *jail,
       return NULL;
 
    memcpy(worker->thread_data, thread_data, thread_data_size);
+#ifdef ENABLE_RENDER_SERVER_WORKER_THREAD
+   worker->jail = jail;
+   worker->thread_func = thread_func;
+#endif
 
    bool ok;
 #if defined(ENABLE_RENDER_SERVER_WORKER_PROCESS)
@@ -389,7 +498,7 @@ render_worker_create(struct render_worker_jail *jail,
    ok = worker->pid >= 0;
    (void)thread_func;
 #elif defined(ENABLE_RENDER_SERVER_WORKER_THREAD)
-   ok = pthread_create(&worker->thread, NULL, thread_func, worker->thread_data) == 0;
+   ok = pthread_create(&worker->thread, NULL, render_worker_thread_main, worker) == 0;
 #elif defined(ENABLE_RENDER_SERVER_WORKER_MINIJAIL)
    worker->pid = fork_minijail(jail->minijail);
    ok = worker->pid >= 0;
@@ -411,9 +520,9 @@ render_worker_destroy(struct render_worker_jail *jail, struct render_worker *wor
    assert(render_worker_is_record(worker));
 
 #ifdef ENABLE_RENDER_SERVER_WORKER_THREAD
-   /* we trust the thread to clean up and exit in finite time */
-   pthread_join(worker->thread, NULL);
-   worker->reaped = true;
+   /* we trust the thread to clean up and exit in finite time, and join it
+    * when it reports its exit
+    */
 #else
    /* kill to make sure the worker exits in finite time */
    if (!worker->reaped)
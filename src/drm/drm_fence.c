@@ -3,8 +3,8 @@
  * SPDX-License-Identifier: MIT
  */
 
-#include <poll.h>
 #include <string.h>
+#include <sys/epoll.h>
 
 #include "virgl_context.h"
 #include "virgl_util.h"
@@ -23,19 +23,44 @@ struct drm_fence {
    int fd;
    uint32_t flags;
    uint64_t fence_id;
+   struct drm_timeline *timeline;
+   bool retired;
    struct list_head node;
 };
 
+/**
+ * The process wide fence thread.  Every pending fence fd of every timeline
+ * is registered with the epoll instance, so a fence is noticed as soon as
+ * it signals, independently of the fences queued in front of it.
+ */
+static struct {
+   mtx_t mutex;
+   cnd_t cond;
+   thrd_t thread;
+   int epoll_fd;
+   int wake_fd;
+   unsigned refcount;
+   bool stop;
+   /* bumped every time the thread is done with a batch of events */
+   uint64_t epoch;
+} fence_thread = {
+   .mutex = _MTX_INITIALIZER_NP,
+   .epoll_fd = -1,
+   .wake_fd = -1,
+};
+
 static void
 drm_fence_destroy(struct drm_fence *fence)
 {
+   epoll_ctl(fence_thread.epoll_fd, EPOLL_CTL_DEL, fence->fd, NULL);
    close(fence->fd);
    list_del(&fence->node);
    free(fence);
 }
 
 static struct drm_fence *
-drm_fence_create(int fd, uint32_t flags, uint64_t fence_id)
+drm_fence_create(struct drm_timeline *timeline, int fd, uint32_t flags,
+                 uint64_t fence_id)
 {
    struct drm_fence *fence = calloc(1, sizeof(*fence));
 
@@ -51,47 +76,163 @@ drm_fence_create(int fd, uint32_t flags, uint64_t fence_id)
 
    fence->flags = flags;
    fence->fence_id = fence_id;
+   fence->timeline = timeline;
 
    return fence;
 }
 
+/* Called with the timeline lock held.  Fences on a timeline signal in FIFO
+ * order, so every fence queued before the signaled one is retired with it,
+ * in submission order.  Retired fences are moved to the retired list, as
+ * events for them may still be pending in the current batch.
+ */
+static void
+drm_timeline_retire(struct drm_timeline *timeline, struct drm_fence *signaled,
+                    struct list_head *retired)
+{
+   if (signaled->retired)
+      return;
+
+   list_for_each_entry_safe (struct drm_fence, fence, &timeline->pending_fences, node) {
+      drm_dbg("fence signaled: %p (%" PRIu64 ")", fence, fence->fence_id);
+      timeline->fence_retire(timeline->vctx, timeline->ring_idx, fence->fence_id);
+      fence->retired = true;
+      list_del(&fence->node);
+      list_addtail(&fence->node, retired);
+
+      if (fence == signaled)
+         break;
+   }
+
+   write_eventfd(timeline->eventfd, 1);
+}
+
 static int
-thread_sync(void *arg)
+thread_sync(UNUSED void *arg)
 {
-   struct drm_timeline *timeline = arg;
+   struct epoll_event events[64];
+   struct list_head retired;
 
-   u_thread_setname(timeline->name);
+   u_thread_setname("drm-fence");
+   list_inithead(&retired);
 
-   mtx_lock(&timeline->fence_mutex);
-   while (!timeline->stop_sync_thread) {
-      if (list_is_empty(&timeline->pending_fences)) {
-         if (cnd_wait(&timeline->fence_cond, &timeline->fence_mutex))
-            drm_log("error waiting on fence condition");
-         continue;
-      }
+   while (true) {
+      int n = epoll_wait(fence_thread.epoll_fd, events, ARRAY_SIZE(events), -1);
 
-      struct drm_fence *fence =
-         list_first_entry(&timeline->pending_fences, struct drm_fence, node);
-      int ret;
+      if (n < 0 && errno != EINTR)
+         drm_log("epoll_wait failed: %s", strerror(errno));
 
-      mtx_unlock(&timeline->fence_mutex);
-      ret = poll(&(struct pollfd){fence->fd, POLLIN}, 1, -1); /* wait forever */
-      mtx_lock(&timeline->fence_mutex);
+      mtx_lock(&fence_thread.mutex);
+
+      for (int i = 0; i < n; i++) {
+         struct drm_fence *fence = events[i].data.ptr;
+
+         if (!fence) {
+            flush_eventfd(fence_thread.wake_fd);
+            continue;
+         }
+
+         struct drm_timeline *timeline = fence->timeline;
+
+         mtx_lock(&timeline->fence_mutex);
+         if (!timeline->stopping)
+            drm_timeline_retire(timeline, fence, &retired);
+         mtx_unlock(&timeline->fence_mutex);
+      }
 
-      if (ret == 1) {
-         drm_dbg("fence signaled: %p (%" PRIu64 ")", fence, fence->fence_id);
-         timeline->fence_retire(timeline->vctx, timeline->ring_idx, fence->fence_id);
-         write_eventfd(timeline->eventfd, 1);
+      list_for_each_entry_safe (struct drm_fence, fence, &retired, node)
          drm_fence_destroy(fence);
-      } else if (ret != 0) {
-         drm_log("poll failed: %s", strerror(errno));
+
+      fence_thread.epoch++;
+      cnd_broadcast(&fence_thread.cond);
+
+      if (fence_thread.stop) {
+         mtx_unlock(&fence_thread.mutex);
+         break;
       }
+      mtx_unlock(&fence_thread.mutex);
    }
-   mtx_unlock(&timeline->fence_mutex);
 
    return 0;
 }
 
+/* Called with the fence thread lock held.  Returns once the fence thread
+ * has processed a batch of events that it started waiting for after this
+ * call, so that it no longer holds on to fences removed before it.
+ */
+static void
+fence_thread_sync(void)
+{
+   uint64_t epoch = fence_thread.epoch;
+
+   write_eventfd(fence_thread.wake_fd, 1);
+   while (fence_thread.epoch == epoch)
+      cnd_wait(&fence_thread.cond, &fence_thread.mutex);
+}
+
+static bool
+fence_thread_ref(void)
+{
+   struct epoll_event ev = { .events = EPOLLIN };
+   bool ret = true;
+
+   mtx_lock(&fence_thread.mutex);
+
+   if (fence_thread.refcount++)
+      goto out_unlock;
+
+   fence_thread.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+   fence_thread.wake_fd = create_eventfd(0);
+   if (fence_thread.epoll_fd < 0 || fence_thread.wake_fd < 0 ||
+       epoll_ctl(fence_thread.epoll_fd, EPOLL_CTL_ADD, fence_thread.wake_fd, &ev))
+      goto fail;
+
+   cnd_init(&fence_thread.cond);
+   fence_thread.stop = false;
+   fence_thread.thread = u_thread_create(thread_sync, NULL);
+
+out_unlock:
+   mtx_unlock(&fence_thread.mutex);
+   return ret;
+
+fail:
+   drm_log("failed to set up the fence thread: %s", strerror(errno));
+   if (fence_thread.wake_fd >= 0)
+      close(fence_thread.wake_fd);
+   if (fence_thread.epoll_fd >= 0)
+      close(fence_thread.epoll_fd);
+   fence_thread.wake_fd = -1;
+   fence_thread.epoll_fd = -1;
+   fence_thread.refcount--;
+   ret = false;
+   goto out_unlock;
+}
+
+static void
+fence_thread_unref(void)
+{
+   mtx_lock(&fence_thread.mutex);
+
+   if (--fence_thread.refcount) {
+      mtx_unlock(&fence_thread.mutex);
+      return;
+   }
+
+   fence_thread.stop = true;
+   write_eventfd(fence_thread.wake_fd, 1);
+   mtx_unlock(&fence_thread.mutex);
+
+   thrd_join(fence_thread.thread, NULL);
+
+   mtx_lock(&fence_thread.mutex);
+   close(fence_thread.wake_fd);
+   close(fence_thread.epoll_fd);
+   fence_thread.wake_fd = -1;
+   fence_thread.epoll_fd = -1;
+   cnd_destroy(&fence_thread.cond);
+   mtx_unlock(&fence_thread.mutex);
+}
+
 void
 drm_timeline_init(struct drm_timeline *timeline, struct virgl_context *vctx,
                   const char *name, int eventfd, int ring_idx,
@@ -104,26 +245,35 @@ drm_timeline_init(struct drm_timeline *timeline, struct virgl_context *vctx,
    timeline->fence_retire = fence_retire;
 
    timeline->last_fence_fd = -1;
+   timeline->stopping = false;
 
    list_inithead(&timeline->pending_fences);
 
    mtx_init(&timeline->fence_mutex, mtx_plain);
-   cnd_init(&timeline->fence_cond);
 
-   timeline->sync_thread = u_thread_create(thread_sync, timeline);
+   if (!fence_thread_ref())
+      timeline->stopping = true;
 }
 
 void
 drm_timeline_fini(struct drm_timeline *timeline)
 {
-   /* signal thread_sync to shutdown: */
-   mtx_lock(&timeline->fence_mutex);
-   timeline->stop_sync_thread = true;
-   cnd_signal(&timeline->fence_cond);
-   mtx_unlock(&timeline->fence_mutex);
+   bool started = !timeline->stopping;
+
+   if (started) {
+      mtx_lock(&fence_thread.mutex);
+
+      mtx_lock(&timeline->fence_mutex);
+      timeline->stopping = true;
+      list_for_each_entry (struct drm_fence, fence, &timeline->pending_fences, node)
+         epoll_ctl(fence_thread.epoll_fd, EPOLL_CTL_DEL, fence->fd, NULL);
+      mtx_unlock(&timeline->fence_mutex);
 
-   /* wait for thread_sync to exit: */
-   thrd_join(timeline->sync_thread, NULL);
+      /* events for the fences might already have been collected: */
+      fence_thread_sync();
+
+      mtx_unlock(&fence_thread.mutex);
+   }
 
    if (timeline->last_fence_fd != -1)
       close(timeline->last_fence_fd);
@@ -133,31 +283,43 @@ drm_timeline_fini(struct drm_timeline *timeline)
       drm_fence_destroy(fence);
    }
 
-   cnd_destroy(&timeline->fence_cond);
    mtx_destroy(&timeline->fence_mutex);
+
+   if (started)
+      fence_thread_unref();
 }
 
 int
 drm_timeline_submit_fence(struct drm_timeline *timeline, uint32_t flags,
                           uint64_t fence_id)
 {
-   if (timeline->last_fence_fd == -1)
+   if (timeline->last_fence_fd == -1 || timeline->stopping)
       return -EINVAL;
 
    struct drm_fence *fence =
-      drm_fence_create(timeline->last_fence_fd, flags, fence_id);
+      drm_fence_create(timeline, timeline->last_fence_fd, flags, fence_id);
 
    if (!fence)
       return -ENOMEM;
 
    drm_dbg("fence: %p (%" PRIu64 ")", fence, fence->fence_id);
 
+   struct epoll_event ev = {
+      .events = EPOLLIN | EPOLLONESHOT,
+      .data.ptr = fence,
+   };
+   int ret = 0;
+
    mtx_lock(&timeline->fence_mutex);
    list_addtail(&fence->node, &timeline->pending_fences);
-   cnd_signal(&timeline->fence_cond);
+   if (epoll_ctl(fence_thread.epoll_fd, EPOLL_CTL_ADD, fence->fd, &ev)) {
+      ret = -errno;
+      drm_log("failed to watch fence: %s", strerror(errno));
+      drm_fence_destroy(fence);
+   }
    mtx_unlock(&timeline->fence_mutex);
 
-   return 0;
+   return ret;
 }
 
 /* takes ownership of the fd */
@@ -23,6 +23,10 @@ struct virgl_context;
 /**
  * Represents a single timeline of fence-fd's.  Fences on a timeline are
  * signaled in FIFO order.
+ *
+ * The pending fences of all timelines are waited on by a single fence
+ * thread per process, so the number of threads does not depend on the
+ * number of contexts and rings.
  */
 struct drm_timeline {
    struct virgl_context *vctx;
@@ -35,9 +39,7 @@ struct drm_timeline {
    struct list_head pending_fences;
 
    mtx_t fence_mutex;
-   cnd_t fence_cond;
-   thrd_t sync_thread;
-   bool stop_sync_thread;
+   bool stopping;
 };
 
 void drm_timeline_init(struct drm_timeline *timeline, struct virgl_context *vctx,
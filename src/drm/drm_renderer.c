@@ -9,6 +9,7 @@
 #include <inttypes.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <unistd.h>
 
 #include <xf86drm.h>
@@ -18,6 +19,7 @@
 
 #ifdef ENABLE_DRM_MSM
 #  include "msm/msm_renderer.h"
+#  include "msm/msm_stub.h"
 #endif
 
 static struct virgl_renderer_capset_drm capset;
@@ -25,10 +27,24 @@ static struct virgl_renderer_capset_drm capset;
 static const struct backend {
    uint32_t context_type;
    const char *name;
+   /* Set for in-process stand-ins of kernel drivers, which are only used
+    * when VIRGL_DRM_STUB is set, in place of the real device.  The probe
+    * fills in the device version.
+    */
+   int (*open)(void);
+   void (*close)(int fd);
    int (*probe)(int fd, struct virgl_renderer_capset_drm *capset);
    struct virgl_context *(*create)(int fd);
 } backends[] = {
 #ifdef ENABLE_DRM_MSM
+   {
+      .context_type = VIRTGPU_DRM_CONTEXT_MSM,
+      .name = "msm-stub",
+      .open = msm_stub_open,
+      .close = msm_stub_close,
+      .probe = msm_renderer_probe_stub,
+      .create = msm_renderer_create,
+   },
    {
       .context_type = VIRTGPU_DRM_CONTEXT_MSM,
       .name = "msm",
@@ -38,6 +54,28 @@ static const struct backend {
 #endif
 };
 
+/* the backend that was probed successfully */
+static const struct backend *backend;
+
+static int
+drm_renderer_init_stub(const struct backend *b)
+{
+   int fd = b->open();
+   if (fd < 0)
+      return fd;
+
+   capset.context_type = b->context_type;
+
+   int ret = b->probe(fd, &capset);
+   if (ret)
+      memset(&capset, 0, sizeof(capset));
+   else
+      backend = b;
+
+   b->close(fd);
+   return ret;
+}
+
 int
 drm_renderer_init(int drm_fd)
 {
@@ -45,6 +83,12 @@ drm_renderer_init(int drm_fd)
       const struct backend *b = &backends[i];
       int fd;
 
+      if (b->open) {
+         if (drm_fd != -1 || !getenv("VIRGL_DRM_STUB"))
+            continue;
+         return drm_renderer_init_stub(b);
+      }
+
       if (drm_fd != -1) {
          fd = drm_fd;
       } else {
@@ -78,6 +122,8 @@ drm_renderer_init(int drm_fd)
       int ret = b->probe(fd, &capset);
       if (ret)
          memset(&capset, 0, sizeof(capset));
+      else
+         backend = b;
 
       drmFreeVersion(ver);
       close(fd);
@@ -94,6 +140,7 @@ void
 drm_renderer_fini(void)
 {
    drm_log("");
+   backend = NULL;
 }
 
 void
@@ -117,18 +164,13 @@ drm_renderer_capset(void *_c)
 struct virgl_context *
 drm_renderer_create(UNUSED size_t debug_len, UNUSED const char *debug_name)
 {
-   for (unsigned i = 0; i < ARRAY_SIZE(backends); i++) {
-      const struct backend *b = &backends[i];
-
-      if (b->context_type != capset.context_type)
-         continue;
+   if (!backend)
+      return NULL;
 
-      int fd = drmOpenWithType(b->name, NULL, DRM_NODE_RENDER);
-      if (fd < 0)
-         return NULL;
-
-      return b->create(fd);
-   }
+   int fd = backend->open ? backend->open()
+                          : drmOpenWithType(backend->name, NULL, DRM_NODE_RENDER);
+   if (fd < 0)
+      return NULL;
 
-   return NULL;
+   return backend->create(fd);
 }
@@ -19,6 +19,8 @@
  *    should be explicitly padded to avoid 32b vs 64b struct padding issues
  */
 
+#define MSM_SHMEM_MAX_QUEUES 16
+
 /**
  * Defines the layout of shmem buffer used for host->guest communication.
  */
@@ -60,6 +62,17 @@ struct msm_shmem {
     * Counter that is incremented on global fault (see MSM_PARAM_FAULTS)
     */
    uint32_t global_faults;
+
+   /**
+    * Seqno of the last retired fence of each submitqueue, indexed by
+    * submitqueue id (only for ids below MSM_SHMEM_MAX_QUEUES).  This is
+    * updated when the host retires the ring fence that follows a submit,
+    * so the guest can check for completion of a fence with a memory read,
+    * taking seqno wraparound into account.  A fence that is not reported
+    * here may still be signaled, the guest should fall back to
+    * MSM_CCMD_WAIT_FENCE before blocking on it.
+    */
+   uint32_t retired_fences[MSM_SHMEM_MAX_QUEUES];
 };
 
 #define DEFINE_CAST(parent, child)                                             \
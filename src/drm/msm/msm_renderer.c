@@ -7,6 +7,7 @@
 #include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/mman.h>
 #include <sys/types.h>
@@ -18,7 +19,9 @@
 #include "virglrenderer.h"
 
 #include "util/anon_file.h"
+#include "util/bitscan.h"
 #include "util/hash_table.h"
+#include "util/list.h"
 #include "util/macros.h"
 #include "util/os_file.h"
 #include "util/u_atomic.h"
@@ -29,9 +32,47 @@
 #include "msm_drm.h"
 #include "msm_proto.h"
 #include "msm_renderer.h"
+#include "msm_stub.h"
 
 static unsigned nr_timelines;
 static uint32_t uabi_version;
+static bool use_stub;
+
+#define MSM_BO_CACHE_MAX_BUCKETS 64
+
+struct msm_bo_bucket {
+   uint32_t size;
+   struct list_head list;
+};
+
+/**
+ * The fences of the submitqueues below MSM_SHMEM_MAX_QUEUES that signal
+ * before a given ring fence.
+ */
+struct msm_fence_seqnos {
+   uint32_t ring_idx;
+   uint64_t fence_id;
+
+   uint32_t queue_mask;
+   uint32_t seqnos[MSM_SHMEM_MAX_QUEUES];
+
+   struct list_head node;
+};
+
+/**
+ * Released GEM buffers, kept around to be handed out again by GEM_NEW.
+ * Each bucket holds the buffers of one size, least recently released
+ * first.
+ */
+struct msm_bo_cache {
+   bool enabled;
+   unsigned num_buckets;
+   struct msm_bo_bucket buckets[MSM_BO_CACHE_MAX_BUCKETS];
+   uint64_t size;
+   time_t time;
+   uint32_t hits;
+   uint32_t misses;
+};
 
 /**
  * A single context (from the PoV of the virtio-gpu protocol) maps to
@@ -73,6 +114,22 @@ struct msm_context {
     */
    struct hash_table *sq_to_ring_idx_table;
 
+   struct msm_bo_cache bo_cache;
+
+   /**
+    * Indexed by ring_idx-1, the submitqueue fences to report in
+    * shmem->retired_fences once the next ring fence retires.
+    */
+   struct msm_fence_seqnos *submitted_seqnos;
+
+   /**
+    * Submitted ring fences with their submitqueue fences, in the order
+    * they are retired.  Protected by seqnos_mutex, as fences are retired
+    * from the fence thread.
+    */
+   struct list_head pending_seqnos;
+   mtx_t seqnos_mutex;
+
    int eventfd;
 
    /**
@@ -87,6 +144,68 @@ DEFINE_CAST(virgl_context, msm_context)
 
 #define valid_payload_len(req) ((req)->len <= ((req)->hdr.len - sizeof(*(req))))
 
+/* All accesses to the device go through here, so that the stub device can
+ * stand in for the kernel driver.
+ */
+static int
+msm_ioctl(int fd, unsigned long request, void *arg)
+{
+   if (unlikely(use_stub))
+      return msm_stub_ioctl(fd, request, arg);
+   return drmIoctl(fd, request, arg);
+}
+
+/* like drmCommandWrite() and drmCommandWriteRead() */
+static int
+msm_command(int fd, unsigned long request, void *arg)
+{
+   if (msm_ioctl(fd, request, arg))
+      return -errno;
+   return 0;
+}
+
+static int
+msm_prime_handle_to_fd(int fd, uint32_t handle, int *prime_fd)
+{
+   struct drm_prime_handle args = {
+      .handle = handle,
+      .flags = DRM_CLOEXEC | DRM_RDWR,
+   };
+   int ret;
+
+   ret = msm_ioctl(fd, DRM_IOCTL_PRIME_HANDLE_TO_FD, &args);
+   if (ret)
+      return ret;
+
+   *prime_fd = args.fd;
+   return 0;
+}
+
+static int
+msm_prime_fd_to_handle(int fd, int prime_fd, uint32_t *handle)
+{
+   struct drm_prime_handle args = {
+      .fd = prime_fd,
+   };
+   int ret;
+
+   ret = msm_ioctl(fd, DRM_IOCTL_PRIME_FD_TO_HANDLE, &args);
+   if (ret)
+      return ret;
+
+   *handle = args.handle;
+   return 0;
+}
+
+static void
+msm_close(int fd)
+{
+   if (use_stub)
+      msm_stub_close(fd);
+   else
+      close(fd);
+}
+
 static struct hash_entry *
 table_search(struct hash_table *ht, uint32_t key)
 {
@@ -106,7 +225,7 @@ gem_info(struct msm_context *mctx, uint32_t handle, uint32_t param, uint64_t *va
    };
    int ret;
 
-   ret = drmCommandWriteRead(mctx->fd, DRM_MSM_GEM_INFO, &args, sizeof(args));
+   ret = msm_command(mctx->fd, DRM_IOCTL_MSM_GEM_INFO, &args);
    if (ret)
       return ret;
 
@@ -120,7 +239,7 @@ gem_close(int fd, uint32_t handle)
    struct drm_gem_close close_req = {
       .handle = handle,
    };
-   return drmIoctl(fd, DRM_IOCTL_GEM_CLOSE, &close_req);
+   return msm_ioctl(fd, DRM_IOCTL_GEM_CLOSE, &close_req);
 }
 
 struct msm_object {
@@ -129,10 +248,20 @@ struct msm_object {
    uint32_t handle;
    uint32_t flags;
    uint32_t size;
+   /* page aligned size of the GEM buffer, which is what the bo cache
+    * matches requests against:
+    */
+   uint64_t alloc_size;
    bool exported   : 1;
    bool exportable : 1;
+   /* exported as a dma-buf that may outlive the resource: */
+   bool shared     : 1;
    struct virgl_resource *res;
    uint8_t *map;
+
+   /* while in the bo cache: */
+   struct list_head cache_node;
+   time_t free_time;
 };
 
 static struct msm_object *
@@ -146,10 +275,22 @@ msm_object_create(uint32_t handle, uint32_t flags, uint32_t size)
    obj->handle = handle;
    obj->flags = flags;
    obj->size = size;
+   obj->alloc_size = size;
 
    return obj;
 }
 
+static void
+msm_object_destroy(struct msm_context *mctx, struct msm_object *obj)
+{
+   if (obj->map)
+      munmap(obj->map, obj->alloc_size);
+
+   gem_close(mctx->fd, obj->handle);
+
+   free(obj);
+}
+
 static bool
 valid_blob_id(struct msm_context *mctx, uint32_t blob_id)
 {
@@ -224,6 +365,232 @@ handle_from_res_id(struct msm_context *mctx, uint32_t res_id)
    return obj->handle;
 }
 
+/*
+ * Guests tend to allocate and free short-lived buffers (staging and
+ * streaming buffers, transient render targets) at a high rate, and each
+ * GEM_NEW costs a page allocation, zeroing and a VMA setup in the kernel.
+ * So buffers released by the guest are kept in a cache, bucketed by size,
+ * and handed out again by GEM_NEW for a request of the same page aligned
+ * size and flags, with only the iova to rebind.  The size must match
+ * exactly, as the whole buffer is mapped at the iova, and the guest only
+ * reserved the size it asked for there.  As a cached buffer keeps its CPU
+ * mapping, reuse is also cheap for GEM_UPLOAD.
+ *
+ * Cached buffers are marked purgeable, so the kernel can reclaim them under
+ * memory pressure, and are freed after MSM_BO_CACHE_EXPIRY seconds.  Their
+ * content is not cleared, which is fine as a buffer is only ever reused by
+ * the context that allocated it.  Imported buffers, and buffers shared as a
+ * dma-buf, can still be referenced from outside the context and are never
+ * cached.
+ *
+ * The cache can be disabled with VIRGL_DRM_NO_BO_CACHE.
+ */
+#define MSM_BO_CACHE_EXPIRY   1                   /* in seconds */
+#define MSM_BO_CACHE_MAX_SIZE (128 * 1024 * 1024) /* per context */
+
+static void
+msm_bo_cache_add_bucket(struct msm_bo_cache *cache, uint32_t size)
+{
+   assert(cache->num_buckets < ARRAY_SIZE(cache->buckets));
+
+   struct msm_bo_bucket *bucket = &cache->buckets[cache->num_buckets++];
+
+   bucket->size = size;
+   list_inithead(&bucket->list);
+}
+
+static void
+msm_bo_cache_init(struct msm_bo_cache *cache)
+{
+   cache->enabled = !getenv("VIRGL_DRM_NO_BO_CACHE");
+
+   /* Same layout as the guest side bo cache: 4k steps up to 16k, and then
+    * four buckets per power of two.  The buckets only keep the lists to
+    * search short, buffers are still reused for their exact size:
+    */
+   msm_bo_cache_add_bucket(cache, 4096);
+   msm_bo_cache_add_bucket(cache, 8192);
+   msm_bo_cache_add_bucket(cache, 12288);
+
+   for (uint32_t size = 16384; size <= 64 * 1024 * 1024; size *= 2) {
+      msm_bo_cache_add_bucket(cache, size);
+      msm_bo_cache_add_bucket(cache, size + size * 1 / 4);
+      msm_bo_cache_add_bucket(cache, size + size * 2 / 4);
+      msm_bo_cache_add_bucket(cache, size + size * 3 / 4);
+   }
+}
+
+static struct msm_bo_bucket *
+msm_bo_cache_bucket(struct msm_bo_cache *cache, uint64_t size)
+{
+   for (unsigned i = 0; i < cache->num_buckets; i++) {
+      struct msm_bo_bucket *bucket = &cache->buckets[i];
+
+      if (bucket->size >= size)
+         return bucket;
+   }
+
+   return NULL;
+}
+
+static time_t
+msm_bo_cache_time(void)
+{
+   struct timespec t;
+
+   clock_gettime(CLOCK_MONOTONIC, &t);
+
+   return t.tv_sec;
+}
+
+static int
+gem_madvise(struct msm_context *mctx, uint32_t handle, uint32_t madv, bool *retained)
+{
+   struct drm_msm_gem_madvise args = {
+      .handle = handle,
+      .madv = madv,
+   };
+   int ret;
+
+   ret = msm_command(mctx->fd, DRM_IOCTL_MSM_GEM_MADVISE, &args);
+   if (ret)
+      return ret;
+
+   *retained = args.retained;
+   return 0;
+}
+
+static void
+msm_bo_cache_remove(struct msm_bo_cache *cache, struct msm_object *obj)
+{
+   list_del(&obj->cache_node);
+   cache->size -= obj->alloc_size;
+}
+
+/* Free the buffers that have been sitting in the cache for too long: */
+static void
+msm_bo_cache_cleanup(struct msm_context *mctx, time_t time)
+{
+   struct msm_bo_cache *cache = &mctx->bo_cache;
+
+   if (cache->time == time)
+      return;
+
+   for (unsigned i = 0; i < cache->num_buckets; i++) {
+      struct msm_bo_bucket *bucket = &cache->buckets[i];
+
+      list_for_each_entry_safe (struct msm_object, obj, &bucket->list, cache_node) {
+         /* the list is ordered by free_time: */
+         if (time - obj->free_time <= MSM_BO_CACHE_EXPIRY)
+            break;
+
+         msm_bo_cache_remove(cache, obj);
+         msm_object_destroy(mctx, obj);
+      }
+   }
+
+   cache->time = time;
+}
+
+/**
+ * Find a cached buffer for a GEM_NEW of the given page aligned size and
+ * flags.
+ */
+static struct msm_object *
+msm_bo_cache_get(struct msm_context *mctx, uint64_t size, uint32_t flags)
+{
+   struct msm_bo_cache *cache = &mctx->bo_cache;
+
+   if (!cache->enabled)
+      return NULL;
+
+   struct msm_bo_bucket *bucket = msm_bo_cache_bucket(cache, size);
+   if (!bucket)
+      return NULL;
+
+   msm_bo_cache_cleanup(mctx, msm_bo_cache_time());
+
+   /* The most recently released buffers are the least likely to have been
+    * purged, so start from the tail:
+    */
+   list_for_each_entry_safe_rev (struct msm_object, obj, &bucket->list, cache_node) {
+      if (obj->flags != flags || obj->alloc_size != size)
+         continue;
+
+      msm_bo_cache_remove(cache, obj);
+
+      bool retained;
+      if (gem_madvise(mctx, obj->handle, MSM_MADV_WILLNEED, &retained) || !retained) {
+         msm_object_destroy(mctx, obj);
+         continue;
+      }
+
+      cache->hits++;
+
+      return obj;
+   }
+
+   cache->misses++;
+
+   return NULL;
+}
+
+/**
+ * Try to move a buffer released by the guest to the cache, returns false
+ * if the caller should free it instead.
+ */
+static bool
+msm_bo_cache_put(struct msm_context *mctx, struct msm_object *obj)
+{
+   struct msm_bo_cache *cache = &mctx->bo_cache;
+
+   if (!cache->enabled || !obj->blob_id || obj->shared)
+      return false;
+
+   struct msm_bo_bucket *bucket = msm_bo_cache_bucket(cache, obj->alloc_size);
+   if (!bucket)
+      return false;
+
+   if (cache->size + obj->alloc_size > MSM_BO_CACHE_MAX_SIZE)
+      return false;
+
+   time_t time = msm_bo_cache_time();
+   msm_bo_cache_cleanup(mctx, time);
+
+   /* The guest is free to hand out the iova again, so release it now: */
+   uint64_t iova = 0;
+   if (gem_info(mctx, obj->handle, MSM_INFO_SET_IOVA, &iova))
+      return false;
+
+   bool retained;
+   if (gem_madvise(mctx, obj->handle, MSM_MADV_DONTNEED, &retained))
+      return false;
+
+   obj->free_time = time;
+   list_addtail(&obj->cache_node, &bucket->list);
+   cache->size += obj->alloc_size;
+
+   return true;
+}
+
+static void
+msm_bo_cache_fini(struct msm_context *mctx)
+{
+   struct msm_bo_cache *cache = &mctx->bo_cache;
+
+   for (unsigned i = 0; i < cache->num_buckets; i++) {
+      struct msm_bo_bucket *bucket = &cache->buckets[i];
+
+      list_for_each_entry_safe (struct msm_object, obj, &bucket->list, cache_node) {
+         msm_bo_cache_remove(cache, obj);
+         msm_object_destroy(mctx, obj);
+      }
+   }
+
+   if (cache->hits || cache->misses)
+      drm_log("bo cache: %u hits, %u misses", cache->hits, cache->misses);
+}
+
 static bool
 has_cached_coherent(int fd)
 {
@@ -233,7 +600,7 @@ has_cached_coherent(int fd)
    };
 
    /* Do a test allocation to see if cached-coherent is supported: */
-   if (!drmCommandWriteRead(fd, DRM_MSM_GEM_NEW, &new_req, sizeof(new_req))) {
+   if (!msm_command(fd, DRM_IOCTL_MSM_GEM_NEW, &new_req)) {
       gem_close(fd, new_req.handle);
       return true;
    }
@@ -252,7 +619,7 @@ get_param64(int fd, uint32_t param, uint64_t *value)
 
    *value = 0;
 
-   ret = drmCommandWriteRead(fd, DRM_MSM_GET_PARAM, &req, sizeof(req));
+   ret = msm_command(fd, DRM_IOCTL_MSM_GET_PARAM, &req);
    if (ret)
       return ret;
 
@@ -321,6 +688,23 @@ msm_renderer_probe(int fd, struct virgl_renderer_capset_drm *capset)
    return 0;
 }
 
+/**
+ * Probe the stub device, see msm_stub.h.
+ */
+int
+msm_renderer_probe_stub(int fd, struct virgl_renderer_capset_drm *capset)
+{
+   msm_stub_get_version(capset);
+
+   use_stub = true;
+
+   int ret = msm_renderer_probe(fd, capset);
+   if (ret)
+      use_stub = false;
+
+   return ret;
+}
+
 static void
 msm_renderer_unmap_blob(struct msm_context *mctx)
 {
@@ -352,13 +736,20 @@ msm_renderer_destroy(struct virgl_context *vctx)
 
    close(mctx->eventfd);
 
+   list_for_each_entry_safe (struct msm_fence_seqnos, seqnos, &mctx->pending_seqnos, node)
+      free(seqnos);
+   free(mctx->submitted_seqnos);
+   mtx_destroy(&mctx->seqnos_mutex);
+
    msm_renderer_unmap_blob(mctx);
 
+   msm_bo_cache_fini(mctx);
+
    _mesa_hash_table_destroy(mctx->resource_table, resource_delete_fxn);
    _mesa_hash_table_destroy(mctx->blob_table, resource_delete_fxn);
    _mesa_hash_table_destroy(mctx->sq_to_ring_idx_table, NULL);
 
-   close(mctx->fd);
+   msm_close(mctx->fd);
    free(mctx);
 }
 
@@ -382,7 +773,7 @@ msm_renderer_attach_resource(struct virgl_context *vctx, struct virgl_resource *
          uint32_t handle;
          int ret;
 
-         ret = drmPrimeFDToHandle(mctx->fd, fd, &handle);
+         ret = msm_prime_fd_to_handle(mctx->fd, fd, &handle);
          if (ret) {
             drm_log("Could not import: %s", strerror(errno));
             close(fd);
@@ -432,12 +823,8 @@ msm_renderer_detach_resource(struct virgl_context *vctx, struct virgl_resource *
 
    msm_remove_object(mctx, obj);
 
-   if (obj->map)
-      munmap(obj->map, obj->size);
-
-   gem_close(mctx->fd, obj->handle);
-
-   free(obj);
+   if (!msm_bo_cache_put(mctx, obj))
+      msm_object_destroy(mctx, obj);
 }
 
 static enum virgl_resource_fd_type
@@ -462,12 +849,15 @@ msm_renderer_export_opaque_handle(struct virgl_context *vctx, struct virgl_resou
       return VIRGL_RESOURCE_FD_INVALID;
    }
 
-   ret = drmPrimeHandleToFD(mctx->fd, obj->handle, DRM_CLOEXEC | DRM_RDWR, out_fd);
+   ret = msm_prime_handle_to_fd(mctx->fd, obj->handle, out_fd);
    if (ret) {
       drm_log("failed to get dmabuf fd: %s", strerror(errno));
       return VIRGL_RESOURCE_FD_INVALID;
    }
 
+   /* the VMM can hold on to the fd, or a mapping of it, past the resource: */
+   obj->shared = true;
+
    return VIRGL_RESOURCE_FD_DMABUF;
 }
 
@@ -584,7 +974,7 @@ msm_renderer_get_blob(struct virgl_context *vctx, uint32_t res_id, uint64_t blob
    if (blob_flags & VIRGL_RENDERER_BLOB_FLAG_USE_SHAREABLE) {
       int fd, ret;
 
-      ret = drmPrimeHandleToFD(mctx->fd, obj->handle, DRM_CLOEXEC | DRM_RDWR, &fd);
+      ret = msm_prime_handle_to_fd(mctx->fd, obj->handle, &fd);
       if (ret) {
          drm_log("Export to fd failed");
          return -EINVAL;
@@ -592,6 +982,8 @@ msm_renderer_get_blob(struct virgl_context *vctx, uint32_t res_id, uint64_t blob
 
       blob->type = VIRGL_RESOURCE_FD_DMABUF;
       blob->u.fd = fd;
+
+      obj->shared = true;
    } else {
       blob->type = VIRGL_RESOURCE_OPAQUE_HANDLE;
       blob->u.opaque_handle = obj->handle;
@@ -700,7 +1092,7 @@ msm_ccmd_ioctl_simple(struct msm_context *mctx, const struct msm_ccmd_req *hdr)
    char payload[payload_len];
    memcpy(payload, req->payload, payload_len);
 
-   rsp->ret = drmIoctl(mctx->fd, req->cmd, payload);
+   rsp->ret = msm_ioctl(mctx->fd, req->cmd, payload);
 
    if (req->cmd & IOC_OUT)
       memcpy(rsp->payload, payload, payload_len);
@@ -730,14 +1122,39 @@ msm_ccmd_gem_new(struct msm_context *mctx, const struct msm_ccmd_req *hdr)
    }
 
    /*
-    * First part, allocate the GEM bo:
+    * First part, allocate the GEM bo, unless there is one to recycle:
     */
+   uint64_t alloc_size = ALIGN_POT(req->size, (uint64_t)getpagesize());
+   struct msm_object *obj = msm_bo_cache_get(mctx, alloc_size, req->flags);
+   if (obj) {
+      uint64_t iova = req->iova;
+      ret = gem_info(mctx, obj->handle, MSM_INFO_SET_IOVA, &iova);
+      if (ret) {
+         drm_log("SET_IOVA failed: %d (%s)", ret, strerror(errno));
+         msm_object_destroy(mctx, obj);
+         goto out_error;
+      }
+
+      obj->res_id = 0;
+      obj->size = req->size;
+      obj->exported = false;
+      obj->exportable = false;
+      obj->res = NULL;
+
+      msm_object_set_blob_id(mctx, obj, req->blob_id);
+
+      drm_dbg("obj=%p, blob_id=%u, handle=%u, iova=%" PRIx64 " (cached)", obj,
+              obj->blob_id, obj->handle, iova);
+
+      return 0;
+   }
+
    struct drm_msm_gem_new gem_new = {
-      .size = req->size,
+      .size = alloc_size,
       .flags = req->flags,
    };
 
-   ret = drmCommandWriteRead(mctx->fd, DRM_MSM_GEM_NEW, &gem_new, sizeof(gem_new));
+   ret = msm_command(mctx->fd, DRM_IOCTL_MSM_GEM_NEW, &gem_new);
    if (ret) {
       drm_log("GEM_NEW failed: %d (%s)", ret, strerror(errno));
       goto out_error;
@@ -757,13 +1174,15 @@ msm_ccmd_gem_new(struct msm_context *mctx, const struct msm_ccmd_req *hdr)
     * And then finally create our msm_object for tracking the resource,
     * and add to blob table:
     */
-   struct msm_object *obj = msm_object_create(gem_new.handle, req->flags, req->size);
+   obj = msm_object_create(gem_new.handle, req->flags, req->size);
 
    if (!obj) {
       ret = -ENOMEM;
       goto out_close;
    }
 
+   obj->alloc_size = alloc_size;
+
    msm_object_set_blob_id(mctx, obj, req->blob_id);
 
    drm_dbg("obj=%p, blob_id=%u, handle=%u, iova=%" PRIx64, obj, obj->blob_id,
@@ -833,7 +1252,7 @@ msm_ccmd_gem_cpu_prep(struct msm_context *mctx, const struct msm_ccmd_req *hdr)
    if (uabi_version >= 11)
       args.op |= MSM_PREP_BOOST;
 
-   rsp->ret = drmCommandWrite(mctx->fd, DRM_MSM_GEM_CPU_PREP, &args, sizeof(args));
+   rsp->ret = msm_command(mctx->fd, DRM_IOCTL_MSM_GEM_CPU_PREP, &args);
 
    return 0;
 }
@@ -853,7 +1272,7 @@ msm_ccmd_gem_set_name(struct msm_context *mctx, const struct msm_ccmd_req *hdr)
    if (!valid_payload_len(req))
       return -EINVAL;
 
-   int ret = drmCommandWrite(mctx->fd, DRM_MSM_GEM_INFO, &args, sizeof(args));
+   int ret = msm_command(mctx->fd, DRM_IOCTL_MSM_GEM_INFO, &args);
    if (ret)
       drm_log("ret=%d, len=%u, name=%.*s", ret, req->len, req->len, req->payload);
 
@@ -927,7 +1346,7 @@ msm_ccmd_gem_submit(struct msm_context *mctx, const struct msm_ccmd_req *hdr)
       .queueid = req->queue_id,
    };
 
-   int ret = drmCommandWriteRead(mctx->fd, DRM_MSM_GEM_SUBMIT, &args, sizeof(args));
+   int ret = msm_command(mctx->fd, DRM_IOCTL_MSM_GEM_SUBMIT, &args);
    drm_dbg("fence=%u, ret=%d", args.fence, ret);
 
    if (unlikely(ret)) {
@@ -947,6 +1366,16 @@ msm_ccmd_gem_submit(struct msm_context *mctx, const struct msm_ccmd_req *hdr)
       unsigned prio = (uintptr_t)entry->data;
 
       drm_timeline_set_last_fence_fd(&mctx->timelines[prio], args.fence_fd);
+
+      /* Submits on the same priority level complete in order, so this
+       * fence is known to be signaled once the next fence on the ring is:
+       */
+      if (args.queueid < MSM_SHMEM_MAX_QUEUES) {
+         struct msm_fence_seqnos *submitted = &mctx->submitted_seqnos[prio];
+
+         submitted->queue_mask |= 1u << args.queueid;
+         submitted->seqnos[args.queueid] = args.fence;
+      }
    }
 
 out:
@@ -972,7 +1401,7 @@ map_object(struct msm_context *mctx, struct msm_object *obj)
    }
 
    uint8_t *map =
-      mmap(0, obj->size, PROT_READ | PROT_WRITE, MAP_SHARED, mctx->fd, offset);
+      mmap(0, obj->alloc_size, PROT_READ | PROT_WRITE, MAP_SHARED, mctx->fd, offset);
    if (map == MAP_FAILED) {
       drm_log("mmap failed: %s", strerror(errno));
       return -ENOMEM;
@@ -1027,8 +1456,7 @@ msm_ccmd_submitqueue_query(struct msm_context *mctx, const struct msm_ccmd_req *
       .len = req->len,
    };
 
-   rsp->ret =
-      drmCommandWriteRead(mctx->fd, DRM_MSM_SUBMITQUEUE_QUERY, &args, sizeof(args));
+   rsp->ret = msm_command(mctx->fd, DRM_IOCTL_MSM_SUBMITQUEUE_QUERY, &args);
 
    rsp->out_len = args.len;
 
@@ -1060,7 +1488,7 @@ msm_ccmd_wait_fence(struct msm_context *mctx, const struct msm_ccmd_req *hdr)
          },
    };
 
-   rsp->ret = drmCommandWrite(mctx->fd, DRM_MSM_WAIT_FENCE, &args, sizeof(args));
+   rsp->ret = msm_command(mctx->fd, DRM_IOCTL_MSM_WAIT_FENCE, &args);
 
    return 0;
 }
@@ -1086,7 +1514,7 @@ msm_ccmd_set_debuginfo(struct msm_context *mctx, const struct msm_ccmd_req *hdr)
       .len = req->comm_len,
    };
 
-   drmCommandWriteRead(mctx->fd, DRM_MSM_SET_PARAM, &set_comm, sizeof(set_comm));
+   msm_command(mctx->fd, DRM_IOCTL_MSM_SET_PARAM, &set_comm);
 
    struct drm_msm_param set_cmdline = {
       .pipe = MSM_PIPE_3D0,
@@ -1095,7 +1523,7 @@ msm_ccmd_set_debuginfo(struct msm_context *mctx, const struct msm_ccmd_req *hdr)
       .len = req->cmdline_len,
    };
 
-   drmCommandWriteRead(mctx->fd, DRM_MSM_SET_PARAM, &set_cmdline, sizeof(set_cmdline));
+   msm_command(mctx->fd, DRM_IOCTL_MSM_SET_PARAM, &set_cmdline);
 
    return 0;
 }
@@ -1245,6 +1673,33 @@ msm_renderer_retire_fences(UNUSED struct virgl_context *vctx)
    /* No-op as VIRGL_RENDERER_ASYNC_FENCE_CB is required */
 }
 
+static void
+msm_renderer_retire_seqnos(struct msm_context *mctx, uint32_t ring_idx, uint64_t fence_id)
+{
+   struct msm_shmem *shmem = mctx->shmem;
+
+   mtx_lock(&mctx->seqnos_mutex);
+
+   list_for_each_entry_safe (struct msm_fence_seqnos, seqnos, &mctx->pending_seqnos, node) {
+      if (seqnos->ring_idx != ring_idx)
+         continue;
+
+      /* fences on a ring are retired in order: */
+      if (seqnos->fence_id > fence_id)
+         break;
+
+      if (shmem && msm_shmem_has_field(shmem, retired_fences)) {
+         u_foreach_bit (queue_id, seqnos->queue_mask)
+            p_atomic_set(&shmem->retired_fences[queue_id], seqnos->seqnos[queue_id]);
+      }
+
+      list_del(&seqnos->node);
+      free(seqnos);
+   }
+
+   mtx_unlock(&mctx->seqnos_mutex);
+}
+
 static void
 msm_renderer_fence_retire(struct virgl_context *vctx,
                           uint32_t ring_idx,
@@ -1254,6 +1709,8 @@ msm_renderer_fence_retire(struct virgl_context *vctx,
 
    get_param32(mctx->fd, MSM_PARAM_FAULTS, &mctx->shmem->global_faults);
 
+   msm_renderer_retire_seqnos(mctx, ring_idx, fence_id);
+
    vctx->fence_retire(vctx, ring_idx, fence_id);
 }
 
@@ -1281,6 +1738,24 @@ msm_renderer_submit_fence(struct virgl_context *vctx, uint32_t flags, uint32_t r
       return 0;
    }
 
+   struct msm_fence_seqnos *submitted = &mctx->submitted_seqnos[ring_idx - 1];
+   if (submitted->queue_mask) {
+      struct msm_fence_seqnos *seqnos = malloc(sizeof(*seqnos));
+
+      /* Not fatal, the guest just has to ask the kernel: */
+      if (seqnos) {
+         *seqnos = *submitted;
+         seqnos->ring_idx = ring_idx;
+         seqnos->fence_id = fence_id;
+
+         mtx_lock(&mctx->seqnos_mutex);
+         list_addtail(&seqnos->node, &mctx->pending_seqnos);
+         mtx_unlock(&mctx->seqnos_mutex);
+      }
+
+      submitted->queue_mask = 0;
+   }
+
    return drm_timeline_submit_fence(&mctx->timelines[ring_idx - 1], flags, fence_id);
 }
 
@@ -1297,6 +1772,15 @@ msm_renderer_create(int fd)
 
    mctx->fd = fd;
 
+   mctx->submitted_seqnos = calloc(nr_timelines, sizeof(*mctx->submitted_seqnos));
+   if (!mctx->submitted_seqnos) {
+      free(mctx);
+      return NULL;
+   }
+
+   list_inithead(&mctx->pending_seqnos);
+   mtx_init(&mctx->seqnos_mutex, mtx_plain);
+
    /* Indexed by blob_id, but only lower 32b of blob_id are used: */
    mctx->blob_table = _mesa_hash_table_create_u32_keys(NULL);
    /* Indexed by res_id: */
@@ -1304,6 +1788,8 @@ msm_renderer_create(int fd)
    /* Indexed by submitqueue-id: */
    mctx->sq_to_ring_idx_table = _mesa_hash_table_create_u32_keys(NULL);
 
+   msm_bo_cache_init(&mctx->bo_cache);
+
    mctx->eventfd = create_eventfd(0);
 
    for (unsigned i = 0; i < nr_timelines; i++) {
@@ -1325,3 +1811,20 @@ msm_renderer_create(int fd)
 
    return &mctx->base;
 }
+
+bool
+msm_renderer_get_bo_cache_stats(uint32_t ctx_id, struct msm_bo_cache_stats *stats)
+{
+   struct virgl_context *vctx = virgl_context_lookup(ctx_id);
+
+   if (!vctx || vctx->destroy != msm_renderer_destroy)
+      return false;
+
+   const struct msm_bo_cache *cache = &to_msm_context(vctx)->bo_cache;
+
+   stats->hits = cache->hits;
+   stats->misses = cache->misses;
+   stats->size = cache->size;
+
+   return true;
+}
@@ -9,6 +9,7 @@
 #include "config.h"
 
 #include <inttypes.h>
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <time.h>
@@ -20,6 +21,19 @@
 
 int msm_renderer_probe(int fd, struct virgl_renderer_capset_drm *capset);
 
+int msm_renderer_probe_stub(int fd, struct virgl_renderer_capset_drm *capset);
+
 struct virgl_context *msm_renderer_create(int fd);
 
+struct msm_bo_cache_stats {
+   uint32_t hits;
+   uint32_t misses;
+   uint64_t size;
+};
+
+/* Counters of the bo cache of a drm context, returns false if there is no
+ * such msm context.
+ */
+bool msm_renderer_get_bo_cache_stats(uint32_t ctx_id, struct msm_bo_cache_stats *stats);
+
 #endif /* MSM_RENDERER_H_ */
@@ -0,0 +1,703 @@
+/*
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+
+#include <xf86drm.h>
+
+#include "drm_hw.h"
+
+#include "c11/threads.h"
+#include "util/anon_file.h"
+#include "util/hash_table.h"
+#include "util/list.h"
+#include "util/macros.h"
+#include "util/os_file.h"
+
+#include "drm_util.h"
+
+#include "msm_drm.h"
+#include "msm_stub.h"
+
+/* what the msm native context needs, see msm_renderer_probe() */
+#define STUB_VERSION_MAJOR 1
+#define STUB_VERSION_MINOR 12
+
+#define STUB_PRIORITIES 3
+#define STUB_VA_START   0x100000000ull
+#define STUB_VA_SIZE    0xfff00000ull
+
+/* number of fences per submitqueue whose completion time is kept */
+#define STUB_FENCE_HISTORY 64
+
+struct msm_stub_bo {
+   uint32_t handle;
+   uint32_t flags;
+   uint64_t offset;
+   uint64_t size;
+   uint64_t iova;
+   /* when the last submit referencing the bo completes */
+   uint64_t busy_until;
+};
+
+struct msm_stub_queue {
+   uint32_t id;
+   uint32_t prio;
+   uint32_t last_fence;
+   uint64_t last_deadline;
+
+   /* ring of the last submits, oldest first from history_start */
+   struct {
+      uint32_t fence;
+      uint64_t deadline;
+   } history[STUB_FENCE_HISTORY];
+   unsigned history_start;
+   unsigned history_count;
+
+   struct list_head head;
+};
+
+/**
+ * A single open of the stub device.  The fd is a memfd that all GEM
+ * buffers are allocated from, at increasing offsets that double as their
+ * mmap() offsets.
+ */
+struct msm_stub_device {
+   int fd;
+   uint64_t latency_ns;
+
+   /* ioctls come from the context thread and the fence thread */
+   mtx_t mutex;
+
+   uint64_t heap_size;
+   uint32_t next_handle;
+   struct hash_table *bos;
+
+   uint32_t next_queue_id;
+   struct list_head queues;
+
+   struct list_head head;
+};
+
+static struct {
+   mtx_t mutex;
+   struct list_head devices;
+} stub = {
+   .mutex = _MTX_INITIALIZER_NP,
+};
+
+static uint64_t
+stub_now(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static struct msm_stub_device *
+stub_lookup_device(int fd)
+{
+   struct msm_stub_device *ret = NULL;
+
+   mtx_lock(&stub.mutex);
+   if (stub.devices.next) {
+      list_for_each_entry (struct msm_stub_device, dev, &stub.devices, head) {
+         if (dev->fd == fd) {
+            ret = dev;
+            break;
+         }
+      }
+   }
+   mtx_unlock(&stub.mutex);
+
+   return ret;
+}
+
+static struct msm_stub_bo *
+stub_lookup_bo(struct msm_stub_device *dev, uint32_t handle)
+{
+   if (!handle)
+      return NULL;
+
+   struct hash_entry *entry =
+      _mesa_hash_table_search(dev->bos, (void *)(uintptr_t)handle);
+   return entry ? entry->data : NULL;
+}
+
+static struct msm_stub_queue *
+stub_lookup_queue(struct msm_stub_device *dev, uint32_t id)
+{
+   list_for_each_entry (struct msm_stub_queue, queue, &dev->queues, head) {
+      if (queue->id == id)
+         return queue;
+   }
+   return NULL;
+}
+
+static struct msm_stub_queue *
+stub_queue_create(struct msm_stub_device *dev, uint32_t prio)
+{
+   struct msm_stub_queue *queue = calloc(1, sizeof(*queue));
+   if (!queue)
+      return NULL;
+
+   queue->id = dev->next_queue_id++;
+   queue->prio = prio;
+   list_addtail(&queue->head, &dev->queues);
+
+   return queue;
+}
+
+/* The completion time of a fence is that of the first submit at or after
+ * it.  Fences older than the history are assumed to complete with the
+ * oldest submit that is still in it.
+ */
+static uint64_t
+stub_queue_fence_deadline(const struct msm_stub_queue *queue, uint32_t fence)
+{
+   for (unsigned i = 0; i < queue->history_count; i++) {
+      unsigned idx = (queue->history_start + i) % STUB_FENCE_HISTORY;
+
+      if ((int32_t)(queue->history[idx].fence - fence) >= 0)
+         return queue->history[idx].deadline;
+   }
+
+   return queue->last_deadline;
+}
+
+static void
+stub_queue_add_fence(struct msm_stub_queue *queue, uint32_t fence, uint64_t deadline)
+{
+   unsigned idx;
+
+   if (queue->history_count < STUB_FENCE_HISTORY) {
+      idx = (queue->history_start + queue->history_count++) % STUB_FENCE_HISTORY;
+   } else {
+      idx = queue->history_start;
+      queue->history_start = (queue->history_start + 1) % STUB_FENCE_HISTORY;
+   }
+
+   queue->history[idx].fence = fence;
+   queue->history[idx].deadline = deadline;
+   queue->last_fence = fence;
+   queue->last_deadline = deadline;
+}
+
+static void
+stub_sleep_until(uint64_t deadline)
+{
+   struct timespec ts = {
+      .tv_sec = deadline / NSEC_PER_SEC,
+      .tv_nsec = deadline % NSEC_PER_SEC,
+   };
+
+   while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+      ;
+}
+
+static int
+stub_get_param(UNUSED struct msm_stub_device *dev, struct drm_msm_param *args)
+{
+   if (args->pipe != MSM_PIPE_3D0)
+      return -EINVAL;
+
+   switch (args->param) {
+   case MSM_PARAM_GPU_ID:
+      args->value = 630;
+      break;
+   case MSM_PARAM_GMEM_SIZE:
+      args->value = 1024 * 1024;
+      break;
+   case MSM_PARAM_CHIP_ID:
+      args->value = 0x06030001;
+      break;
+   case MSM_PARAM_MAX_FREQ:
+      args->value = 710000000;
+      break;
+   case MSM_PARAM_TIMESTAMP:
+      /* the always-on counter runs at 19.2MHz */
+      args->value = stub_now() * 192 / 10000;
+      break;
+   case MSM_PARAM_GMEM_BASE:
+      args->value = 0x100000;
+      break;
+   case MSM_PARAM_PRIORITIES:
+      args->value = STUB_PRIORITIES;
+      break;
+   case MSM_PARAM_FAULTS:
+   case MSM_PARAM_SUSPENDS:
+      args->value = 0;
+      break;
+   case MSM_PARAM_VA_START:
+      args->value = STUB_VA_START;
+      break;
+   case MSM_PARAM_VA_SIZE:
+      args->value = STUB_VA_SIZE;
+      break;
+   default:
+      return -EINVAL;
+   }
+
+   return 0;
+}
+
+static int
+stub_set_param(UNUSED struct msm_stub_device *dev, struct drm_msm_param *args)
+{
+   if (args->pipe != MSM_PIPE_3D0)
+      return -EINVAL;
+
+   switch (args->param) {
+   case MSM_PARAM_SYSPROF:
+   case MSM_PARAM_COMM:
+   case MSM_PARAM_CMDLINE:
+      return 0;
+   default:
+      return -EINVAL;
+   }
+}
+
+static int
+stub_gem_new(struct msm_stub_device *dev, struct drm_msm_gem_new *args)
+{
+   if (!args->size)
+      return -EINVAL;
+
+   const uint64_t size = ALIGN_POT(args->size, (uint64_t)getpagesize());
+   struct msm_stub_bo *bo = calloc(1, sizeof(*bo));
+   if (!bo)
+      return -ENOMEM;
+
+   if (ftruncate(dev->fd, dev->heap_size + size)) {
+      free(bo);
+      return -ENOMEM;
+   }
+
+   bo->handle = ++dev->next_handle;
+   bo->flags = args->flags;
+   bo->offset = dev->heap_size;
+   bo->size = size;
+   dev->heap_size += size;
+
+   _mesa_hash_table_insert(dev->bos, (void *)(uintptr_t)bo->handle, bo);
+   args->handle = bo->handle;
+
+   return 0;
+}
+
+static int
+stub_gem_close(struct msm_stub_device *dev, struct drm_gem_close *args)
+{
+   struct msm_stub_bo *bo = stub_lookup_bo(dev, args->handle);
+   if (!bo)
+      return -EINVAL;
+
+   /* offsets are never reused, but the memory is given back */
+   fallocate(dev->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, bo->offset, bo->size);
+
+   _mesa_hash_table_remove_key(dev->bos, (void *)(uintptr_t)bo->handle);
+   free(bo);
+
+   return 0;
+}
+
+static int
+stub_gem_info(struct msm_stub_device *dev, struct drm_msm_gem_info *args)
+{
+   struct msm_stub_bo *bo = stub_lookup_bo(dev, args->handle);
+   if (!bo)
+      return -ENOENT;
+
+   switch (args->info) {
+   case MSM_INFO_GET_OFFSET:
+      args->value = bo->offset;
+      break;
+   case MSM_INFO_GET_IOVA:
+      args->value = bo->iova;
+      break;
+   case MSM_INFO_SET_IOVA:
+      if (args->value && (args->value < STUB_VA_START ||
+                          args->value + bo->size > STUB_VA_START + STUB_VA_SIZE))
+         return -EINVAL;
+      bo->iova = args->value;
+      break;
+   case MSM_INFO_GET_FLAGS:
+      args->value = bo->flags;
+      break;
+   case MSM_INFO_SET_NAME:
+      break;
+   case MSM_INFO_GET_NAME:
+      args->len = 0;
+      break;
+   default:
+      return -EINVAL;
+   }
+
+   return 0;
+}
+
+static int
+stub_gem_cpu_prep(struct msm_stub_device *dev, struct drm_msm_gem_cpu_prep *args)
+{
+   struct msm_stub_bo *bo = stub_lookup_bo(dev, args->handle);
+   if (!bo)
+      return -ENOENT;
+
+   const uint64_t busy_until = bo->busy_until;
+   if (busy_until <= stub_now())
+      return 0;
+
+   if (args->op & MSM_PREP_NOSYNC)
+      return -EBUSY;
+
+   mtx_unlock(&dev->mutex);
+   stub_sleep_until(busy_until);
+   mtx_lock(&dev->mutex);
+
+   return 0;
+}
+
+/* A dup of the device fd stands in for the dma-buf, so that exports can be
+ * tracked and closed like the real thing.  Unlike a dma-buf, it maps the
+ * buffer at its GET_OFFSET offset rather than at 0.
+ */
+static int
+stub_prime_handle_to_fd(struct msm_stub_device *dev, struct drm_prime_handle *args)
+{
+   if (!stub_lookup_bo(dev, args->handle))
+      return -ENOENT;
+
+   int fd = os_dupfd_cloexec(dev->fd);
+   if (fd < 0)
+      return -errno;
+
+   args->fd = fd;
+
+   return 0;
+}
+
+static int
+stub_gem_madvise(struct msm_stub_device *dev, struct drm_msm_gem_madvise *args)
+{
+   struct msm_stub_bo *bo = stub_lookup_bo(dev, args->handle);
+   if (!bo)
+      return -ENOENT;
+
+   if (args->madv != MSM_MADV_WILLNEED && args->madv != MSM_MADV_DONTNEED)
+      return -EINVAL;
+
+   /* there is no shrinker, so the pages are never purged */
+   args->retained = 1;
+
+   return 0;
+}
+
+static int
+stub_gem_submit(struct msm_stub_device *dev, struct drm_msm_gem_submit *args)
+{
+   struct drm_msm_gem_submit_bo *bos = U642VOID(args->bos);
+   struct drm_msm_gem_submit_cmd *cmds = U642VOID(args->cmds);
+
+   struct msm_stub_queue *queue = stub_lookup_queue(dev, args->queueid);
+   if (!queue)
+      return -ENOENT;
+
+   if (MSM_PIPE_ID(args->flags) != MSM_PIPE_3D0 ||
+       MSM_PIPE_FLAGS(args->flags) & ~MSM_SUBMIT_FLAGS)
+      return -EINVAL;
+
+   for (uint32_t i = 0; i < args->nr_bos; i++) {
+      if ((bos[i].flags & ~MSM_SUBMIT_BO_FLAGS) || !stub_lookup_bo(dev, bos[i].handle))
+         return -EINVAL;
+   }
+
+   for (uint32_t i = 0; i < args->nr_cmds; i++) {
+      const struct drm_msm_gem_submit_cmd *cmd = &cmds[i];
+
+      if (cmd->type < MSM_SUBMIT_CMD_BUF || cmd->type > MSM_SUBMIT_CMD_CTX_RESTORE_BUF ||
+          cmd->submit_idx >= args->nr_bos || cmd->size % 4)
+         return -EINVAL;
+
+      const struct msm_stub_bo *bo = stub_lookup_bo(dev, bos[cmd->submit_idx].handle);
+      if ((uint64_t)cmd->submit_offset + cmd->size > bo->size)
+         return -EINVAL;
+   }
+
+   uint32_t fence;
+   if (args->flags & MSM_SUBMIT_FENCE_SN_IN) {
+      fence = args->fence;
+      if (queue->history_count && (int32_t)(fence - queue->last_fence) <= 0)
+         return -EINVAL;
+   } else {
+      fence = queue->last_fence + 1;
+   }
+
+   /* submits on a queue complete in order */
+   const uint64_t deadline = MAX2(stub_now() + dev->latency_ns, queue->last_deadline);
+
+   if (args->flags & MSM_SUBMIT_FENCE_FD_OUT) {
+      int fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+      if (fd < 0)
+         return -errno;
+
+      const struct itimerspec its = {
+         .it_value = {
+            .tv_sec = deadline / NSEC_PER_SEC,
+            .tv_nsec = deadline % NSEC_PER_SEC,
+         },
+      };
+      if (timerfd_settime(fd, TFD_TIMER_ABSTIME, &its, NULL)) {
+         int ret = -errno;
+         close(fd);
+         return ret;
+      }
+
+      args->fence_fd = fd;
+   }
+
+   for (uint32_t i = 0; i < args->nr_bos; i++)
+      stub_lookup_bo(dev, bos[i].handle)->busy_until = deadline;
+
+   stub_queue_add_fence(queue, fence, deadline);
+   args->fence = fence;
+
+   return 0;
+}
+
+static int
+stub_wait_fence(struct msm_stub_device *dev, struct drm_msm_wait_fence *args)
+{
+   const struct msm_stub_queue *queue = stub_lookup_queue(dev, args->queueid);
+   if (!queue)
+      return -ENOENT;
+
+   if (!queue->history_count || (int32_t)(args->fence - queue->last_fence) > 0)
+      return -EINVAL;
+
+   const uint64_t deadline = stub_queue_fence_deadline(queue, args->fence);
+   if (deadline <= stub_now())
+      return 0;
+
+   const uint64_t timeout =
+      (uint64_t)args->timeout.tv_sec * NSEC_PER_SEC + args->timeout.tv_nsec;
+   if (deadline > timeout)
+      return -ETIMEDOUT;
+
+   mtx_unlock(&dev->mutex);
+   stub_sleep_until(deadline);
+   mtx_lock(&dev->mutex);
+
+   return 0;
+}
+
+static int
+stub_submitqueue_new(struct msm_stub_device *dev, struct drm_msm_submitqueue *args)
+{
+   if (args->prio >= STUB_PRIORITIES)
+      return -EINVAL;
+
+   struct msm_stub_queue *queue = stub_queue_create(dev, args->prio);
+   if (!queue)
+      return -ENOMEM;
+
+   args->id = queue->id;
+
+   return 0;
+}
+
+static int
+stub_submitqueue_close(struct msm_stub_device *dev, uint32_t *id)
+{
+   /* the default queue cannot be closed */
+   struct msm_stub_queue *queue = *id ? stub_lookup_queue(dev, *id) : NULL;
+   if (!queue)
+      return -ENOENT;
+
+   list_del(&queue->head);
+   free(queue);
+
+   return 0;
+}
+
+static int
+stub_submitqueue_query(struct msm_stub_device *dev, struct drm_msm_submitqueue_query *args)
+{
+   if (!stub_lookup_queue(dev, args->id))
+      return -ENOENT;
+
+   if (args->param != MSM_SUBMITQUEUE_PARAM_FAULTS)
+      return -EINVAL;
+
+   const uint32_t faults = 0;
+
+   if (args->data) {
+      if (args->len < sizeof(faults))
+         return -EINVAL;
+      memcpy(U642VOID(args->data), &faults, sizeof(faults));
+   }
+   args->len = sizeof(faults);
+
+   return 0;
+}
+
+int
+msm_stub_ioctl(int fd, unsigned long request, void *arg)
+{
+   struct msm_stub_device *dev = stub_lookup_device(fd);
+   int ret;
+
+   if (!dev) {
+      errno = EBADF;
+      return -1;
+   }
+
+   mtx_lock(&dev->mutex);
+
+   /* like the kernel, ignore the direction and size of the request */
+   switch (_IOC_NR(request)) {
+   case DRM_COMMAND_BASE + DRM_MSM_GET_PARAM:
+      ret = stub_get_param(dev, arg);
+      break;
+   case DRM_COMMAND_BASE + DRM_MSM_SET_PARAM:
+      ret = stub_set_param(dev, arg);
+      break;
+   case DRM_COMMAND_BASE + DRM_MSM_GEM_NEW:
+      ret = stub_gem_new(dev, arg);
+      break;
+   case _IOC_NR(DRM_IOCTL_GEM_CLOSE):
+      ret = stub_gem_close(dev, arg);
+      break;
+   case DRM_COMMAND_BASE + DRM_MSM_GEM_INFO:
+      ret = stub_gem_info(dev, arg);
+      break;
+   case DRM_COMMAND_BASE + DRM_MSM_GEM_CPU_PREP:
+      ret = stub_gem_cpu_prep(dev, arg);
+      break;
+   case DRM_COMMAND_BASE + DRM_MSM_GEM_MADVISE:
+      ret = stub_gem_madvise(dev, arg);
+      break;
+   case DRM_COMMAND_BASE + DRM_MSM_GEM_SUBMIT:
+      ret = stub_gem_submit(dev, arg);
+      break;
+   case DRM_COMMAND_BASE + DRM_MSM_WAIT_FENCE:
+      ret = stub_wait_fence(dev, arg);
+      break;
+   case DRM_COMMAND_BASE + DRM_MSM_SUBMITQUEUE_NEW:
+      ret = stub_submitqueue_new(dev, arg);
+      break;
+   case DRM_COMMAND_BASE + DRM_MSM_SUBMITQUEUE_CLOSE:
+      ret = stub_submitqueue_close(dev, arg);
+      break;
+   case DRM_COMMAND_BASE + DRM_MSM_SUBMITQUEUE_QUERY:
+      ret = stub_submitqueue_query(dev, arg);
+      break;
+   case _IOC_NR(DRM_IOCTL_PRIME_HANDLE_TO_FD):
+      ret = stub_prime_handle_to_fd(dev, arg);
+      break;
+   case _IOC_NR(DRM_IOCTL_PRIME_FD_TO_HANDLE):
+      /* there are no dma-bufs to import without a kernel driver */
+      ret = -EOPNOTSUPP;
+      break;
+   default:
+      ret = -ENOTTY;
+      break;
+   }
+
+   mtx_unlock(&dev->mutex);
+
+   if (ret) {
+      errno = -ret;
+      return -1;
+   }
+
+   return 0;
+}
+
+void
+msm_stub_get_version(struct virgl_renderer_capset_drm *capset)
+{
+   capset->version_major = STUB_VERSION_MAJOR;
+   capset->version_minor = STUB_VERSION_MINOR;
+   capset->version_patchlevel = 0;
+}
+
+int
+msm_stub_open(void)
+{
+   struct msm_stub_device *dev = calloc(1, sizeof(*dev));
+   if (!dev)
+      return -ENOMEM;
+
+   const char *latency = getenv("VIRGL_DRM_STUB");
+   if (latency)
+      dev->latency_ns = strtoull(latency, NULL, 10) * 1000;
+
+   dev->fd = os_create_anonymous_file(0, "msm-stub");
+   if (dev->fd < 0) {
+      drm_log("failed to create the stub heap: %s", strerror(errno));
+      free(dev);
+      return -ENOMEM;
+   }
+
+   mtx_init(&dev->mutex, mtx_plain);
+   dev->bos = _mesa_hash_table_create_u32_keys(NULL);
+   list_inithead(&dev->queues);
+
+   /* like the kernel, every open comes with a default queue of id 0 */
+   if (!dev->bos || !stub_queue_create(dev, 0)) {
+      _mesa_hash_table_destroy(dev->bos, NULL);
+      mtx_destroy(&dev->mutex);
+      close(dev->fd);
+      free(dev);
+      return -ENOMEM;
+   }
+
+   mtx_lock(&stub.mutex);
+   if (!stub.devices.next)
+      list_inithead(&stub.devices);
+   list_add(&dev->head, &stub.devices);
+   mtx_unlock(&stub.mutex);
+
+   drm_log("stub device %d, submit latency %" PRIu64 "us", dev->fd,
+           dev->latency_ns / 1000);
+
+   return dev->fd;
+}
+
+static void
+stub_bo_delete(struct hash_entry *entry)
+{
+   free(entry->data);
+}
+
+void
+msm_stub_close(int fd)
+{
+   struct msm_stub_device *dev = stub_lookup_device(fd);
+
+   if (!dev) {
+      close(fd);
+      return;
+   }
+
+   mtx_lock(&stub.mutex);
+   list_del(&dev->head);
+   mtx_unlock(&stub.mutex);
+
+   list_for_each_entry_safe (struct msm_stub_queue, queue, &dev->queues, head)
+      free(queue);
+   _mesa_hash_table_destroy(dev->bos, stub_bo_delete);
+   mtx_destroy(&dev->mutex);
+
+   /* mappings of the buffers keep the memfd alive */
+   close(dev->fd);
+   free(dev);
+}
@@ -0,0 +1,35 @@
+/*
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef MSM_STUB_H_
+#define MSM_STUB_H_
+
+#include <stdint.h>
+
+struct virgl_renderer_capset_drm;
+
+/*
+ * An in-process stand-in for the msm kernel driver, so that the native
+ * context can be run and profiled on hosts without msm hardware.  It is
+ * selected by setting VIRGL_DRM_STUB, whose value is the latency of a
+ * submit in microseconds.
+ *
+ * GEM buffers are allocated from a memfd, which is also the fd of the
+ * device, so that the MSM_INFO_GET_OFFSET + mmap() path works unchanged.
+ * Submits complete on a timerfd, which is returned as the out-fence fd and
+ * polled like a sync_file by the fence thread.  Nothing is ever executed.
+ * Buffers are exported as a dup of the device fd, which only stands in for
+ * the lifetime of a dma-buf, and cannot be imported.
+ */
+
+int msm_stub_open(void);
+
+void msm_stub_close(int fd);
+
+void msm_stub_get_version(struct virgl_renderer_capset_drm *capset);
+
+/* drmIoctl() for the fds returned by msm_stub_open() */
+int msm_stub_ioctl(int fd, unsigned long request, void *arg);
+
+#endif /* MSM_STUB_H_ */
@@ -7,21 +7,38 @@
 
 #include <unistd.h>
 
-#include "server/render_protocol.h"
-
 #include "proxy_server.h"
 
-bool
-proxy_client_destroy_context(struct proxy_client *client, uint32_t ctx_id)
+static bool
+proxy_client_flush_destroys(struct proxy_client *client)
 {
-   const struct render_client_op_destroy_context_request req = {
+   if (!client->pending_destroy_count)
+      return true;
+
+   struct render_client_op_destroy_context_request req = {
       .header.op = RENDER_CLIENT_OP_DESTROY_CONTEXT,
-      .ctx_id = ctx_id,
+      .count = client->pending_destroy_count,
    };
+   memcpy(req.ctx_ids, client->pending_destroy_ctx_ids,
+          sizeof(*req.ctx_ids) * client->pending_destroy_count);
+   client->pending_destroy_count = 0;
 
    return proxy_socket_send_request(&client->socket, &req, sizeof(req));
 }
 
+bool
+proxy_client_destroy_context(struct proxy_client *client, uint32_t ctx_id)
+{
+   /* The worker exits on its own once the context socket is closed.  The
+    * request only removes the record from the server and can be deferred.
+    */
+   client->pending_destroy_ctx_ids[client->pending_destroy_count++] = ctx_id;
+   if (client->pending_destroy_count < RENDER_CLIENT_MAX_CONTEXT_BATCH)
+      return true;
+
+   return proxy_client_flush_destroys(client);
+}
+
 bool
 proxy_client_create_context(struct proxy_client *client,
                             uint32_t ctx_id,
@@ -29,13 +46,18 @@ proxy_client_create_context(struct proxy_client *client,
                             const char *ctx_name,
                             int *out_ctx_fd)
 {
+   /* the server must see the destroys before reusing ctx_id */
+   if (!proxy_client_flush_destroys(client))
+      return false;
+
    struct render_client_op_create_context_request req = {
       .header.op = RENDER_CLIENT_OP_CREATE_CONTEXT,
-      .ctx_id = ctx_id,
+      .count = 1,
+      .contexts[0].ctx_id = ctx_id,
    };
 
-   const size_t len = MIN2(ctx_name_len, sizeof(req.ctx_name) - 1);
-   memcpy(req.ctx_name, ctx_name, len);
+   const size_t len = MIN2(ctx_name_len, sizeof(req.contexts[0].ctx_name) - 1);
+   memcpy(req.contexts[0].ctx_name, ctx_name, len);
 
    if (!proxy_socket_send_request(&client->socket, &req, sizeof(req)))
       return false;
@@ -47,11 +69,11 @@ proxy_client_create_context(struct proxy_client *client,
                                             &ctx_fd, 1, &fd_count))
       return false;
 
-   if (reply.ok != fd_count) {
+   if (reply.ok_mask != (uint32_t)fd_count) {
       if (fd_count)
          close(ctx_fd);
       return false;
-   } else if (!reply.ok) {
+   } else if (!reply.ok_mask) {
       return false;
    }
 
@@ -67,6 +89,9 @@ proxy_client_create_context(struct proxy_client *client,
 bool
 proxy_client_reset(struct proxy_client *client)
 {
+   /* the reset removes all contexts anyway */
+   client->pending_destroy_count = 0;
+
    const struct render_client_op_reset_request req = {
       .header.op = RENDER_CLIENT_OP_RESET,
    };
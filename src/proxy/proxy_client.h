@@ -8,8 +8,14 @@
 
 #include "proxy_common.h"
 
+#include "server/render_protocol.h"
+
 struct proxy_client {
    struct proxy_socket socket;
+
+   /* context destroys are batched and sent before the next request */
+   uint32_t pending_destroy_count;
+   uint32_t pending_destroy_ctx_ids[RENDER_CLIENT_MAX_CONTEXT_BATCH];
 };
 
 struct proxy_client *
@@ -6,6 +6,7 @@
 #include "vkr_buffer.h"
 
 #include "vkr_buffer_gen.h"
+#include "vkr_device_memory.h"
 #include "vkr_physical_device.h"
 
 static void
@@ -78,6 +79,8 @@ vkr_dispatch_vkBindBufferMemory(UNUSED struct vn_dispatch_context *dispatch,
    struct vkr_device *dev = vkr_device_from_handle(args->device);
    struct vn_device_proc_table *vk = &dev->proc_table;
 
+   args->memoryOffset = vkr_device_memory_get_driver_offset(args->memory, args->memoryOffset);
+
    vn_replace_vkBindBufferMemory_args_handle(args);
    args->ret =
       vk->BindBufferMemory(args->device, args->buffer, args->memory, args->memoryOffset);
@@ -90,6 +93,12 @@ vkr_dispatch_vkBindBufferMemory2(UNUSED struct vn_dispatch_context *dispatch,
    struct vkr_device *dev = vkr_device_from_handle(args->device);
    struct vn_device_proc_table *vk = &dev->proc_table;
 
+   for (uint32_t i = 0; i < args->bindInfoCount; i++) {
+      VkBindBufferMemoryInfo *info = (VkBindBufferMemoryInfo *)&args->pBindInfos[i];
+      info->memoryOffset =
+         vkr_device_memory_get_driver_offset(info->memory, info->memoryOffset);
+   }
+
    vn_replace_vkBindBufferMemory2_args_handle(args);
    args->ret = vk->BindBufferMemory2(args->device, args->bindInfoCount, args->pBindInfos);
 }
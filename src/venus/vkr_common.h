@@ -88,6 +88,7 @@ struct vkr_shader_module;
 struct vkr_pipeline_layout;
 struct vkr_pipeline_cache;
 struct vkr_pipeline;
+struct vkr_pipeline_pool;
 struct vkr_command_pool;
 struct vkr_command_buffer;
 
@@ -156,6 +156,7 @@ vkr_context_submit_cmd(struct vkr_context *ctx, const void *buffer, size_t size)
    vkr_cs_decoder_set_stream(&ctx->decoder, buffer, size);
 
    while (vkr_cs_decoder_has_command(&ctx->decoder)) {
+      vkr_cs_decoder_begin_command(&ctx->decoder);
       vn_dispatch_command(&ctx->dispatch);
       if (vkr_context_get_fatal(ctx)) {
          vkr_log("submit_cmd: vn_dispatch_command failed");
@@ -180,6 +181,9 @@ vkr_context_free_resource(struct hash_entry *entry)
       //fprintf(stderr, "%s: CAN'T call vkUnmapMemory\n", __func__);
    }
 
+   if (res->slab)
+      vkr_device_memory_release_blob(res->slab);
+
    free(res);
 }
 
@@ -200,6 +204,9 @@ vkr_context_free_resource_internal(struct vkr_context *ctx, struct hash_entry *e
       */
    }
 
+   if (res->slab)
+      vkr_device_memory_release_blob(res->slab);
+
    free(res);
 }
 
@@ -234,7 +241,8 @@ vkr_context_import_resource_internal(struct vkr_context *ctx,
                                      uint64_t blob_size,
                                      enum virgl_resource_fd_type fd_type,
                                      int fd,
-                                     void *mmap_ptr)
+                                     void *mmap_ptr,
+                                     struct vkr_device_memory_slab *slab)
 {
    assert(!vkr_context_get_resource(ctx, res_id));
 
@@ -246,6 +254,7 @@ vkr_context_import_resource_internal(struct vkr_context *ctx,
    res->blob_id = blob_id;
    res->fd_type = fd_type;
    res->size = blob_size;
+   res->slab = slab;
 
    /* fd and mmap_ptr cannot be valid at the same time, but allowed to be -1 and NULL */
    assert(fd < 0 || !mmap_ptr);
@@ -285,7 +294,8 @@ vkr_context_create_resource_from_shm(struct vkr_context *ctx,
    }
 
    if (!vkr_context_import_resource_internal(ctx, res_id, 0, blob_size,
-                                             VIRGL_RESOURCE_FD_SHM, -1, mmap_ptr)) {
+                                             VIRGL_RESOURCE_FD_SHM, -1, mmap_ptr,
+                                             NULL)) {
       munmap(mmap_ptr, blob_size);
       //close(fd);
       return false;
@@ -336,7 +346,9 @@ vkr_context_create_resource_from_device_memory(struct vkr_context *ctx,
    */
 
    if (!vkr_context_import_resource_internal(ctx, res_id, blob_id, blob_size, blob.type, res_fd,
-                                             NULL)) {
+                                             NULL, mem->slab)) {
+      if (mem->slab)
+         vkr_device_memory_release_blob(mem->slab);
       //if (res_fd >= 0)
       //   close(res_fd);
       //close(blob.u.fd);
@@ -382,7 +394,7 @@ vkr_context_import_resource(struct vkr_context *ctx,
                             int fd,
                             uint64_t size)
 {
-   //return vkr_context_import_resource_internal(ctx, res_id, size, fd_type, fd, NULL);
+   //return vkr_context_import_resource_internal(ctx, res_id, size, fd_type, fd, NULL, NULL);
    //fprintf(stderr, "%s: UNIMPLEMENTED\n", __func__);
    return false;
 }
@@ -614,6 +626,8 @@ vkr_context_destroy(struct vkr_context *ctx)
       vkr_instance_destroy(ctx, ctx->instance);
    }
 
+   vkr_pipeline_pool_destroy(ctx->pipeline_pool);
+
    _mesa_hash_table_destroy(ctx->resource_table, vkr_context_free_resource);
    mtx_destroy(&ctx->resource_mutex);
 
@@ -704,6 +718,9 @@ vkr_context_create(uint32_t ctx_id,
 
    list_inithead(&ctx->rings);
 
+   /* optional, pipelines are created on the ring threads without it */
+   ctx->pipeline_pool = vkr_pipeline_pool_create();
+
    return ctx;
 
 err_ctx_ring_mutex:
@@ -13,6 +13,8 @@
 
 #include "vkr_cs.h"
 
+struct vkr_device_memory_slab;
+
 /*
  * When vkr_context_create_resource or vkr_context_import_resource is called, a
  * vkr_resource is created, and is valid until vkr_context_destroy_resource.
@@ -31,6 +33,9 @@ struct vkr_resource {
    } u;
 
    size_t size;
+
+   /* the slab of a suballocated memory the resource was exported from */
+   struct vkr_device_memory_slab *slab;
 };
 
 enum vkr_context_validate_level {
@@ -91,6 +96,9 @@ struct vkr_context {
 
    struct vkr_queue *sync_queues[64];
 
+   /* NULL unless VKR_PIPELINE_THREADS is set */
+   struct vkr_pipeline_pool *pipeline_pool;
+
    struct vkr_instance *instance;
    char *instance_name;
 
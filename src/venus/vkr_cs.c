@@ -60,15 +60,41 @@ vkr_cs_decoder_init(struct vkr_cs_decoder *dec,
 }
 
 void
-vkr_cs_decoder_fini(struct vkr_cs_decoder *dec)
+vkr_cs_decoder_temp_pool_fini(struct vkr_cs_decoder_temp_pool *pool)
 {
-   struct vkr_cs_decoder_temp_pool *pool = &dec->temp_pool;
    for (uint32_t i = 0; i < pool->buffer_count; i++)
       free(pool->buffers[i]);
    if (pool->buffers)
       free(pool->buffers);
 }
 
+void
+vkr_cs_decoder_fini(struct vkr_cs_decoder *dec)
+{
+   vkr_cs_decoder_temp_pool_fini(&dec->temp_pool);
+}
+
+/**
+ * Transfer the temp pool, and everything decoded into it so far, to the
+ * caller, who must free it with vkr_cs_decoder_temp_pool_fini.  This lets
+ * the decoded args of a command outlive the command.
+ *
+ * This fails when a state is pushed, because the temp pool then also holds
+ * data of the outer command.
+ */
+bool
+vkr_cs_decoder_steal_temp_pool(struct vkr_cs_decoder *dec,
+                               struct vkr_cs_decoder_temp_pool *pool)
+{
+   if (dec->saved_state_count)
+      return false;
+
+   *pool = dec->temp_pool;
+   memset(&dec->temp_pool, 0, sizeof(dec->temp_pool));
+
+   return true;
+}
+
 static void
 vkr_cs_decoder_sanity_check(const struct vkr_cs_decoder *dec)
 {
@@ -68,6 +68,9 @@ struct vkr_cs_decoder {
    struct vkr_cs_decoder_saved_state saved_states[1];
    uint32_t saved_state_count;
 
+   /* flags of the command being dispatched */
+   uint32_t command_flags;
+
    const uint8_t *cur;
    const uint8_t *end;
 };
@@ -173,6 +176,30 @@ vkr_cs_decoder_has_command(const struct vkr_cs_decoder *dec)
    return dec->cur < dec->end;
 }
 
+/* Record the flags of the next command, for dispatch functions that behave
+ * differently when the command expects a reply.  The command header is
+ * validated by vn_dispatch_command.
+ */
+static inline void
+vkr_cs_decoder_begin_command(struct vkr_cs_decoder *dec)
+{
+   uint32_t header[2];
+
+   if (likely((size_t)(dec->end - dec->cur) >= sizeof(header))) {
+      memcpy(header, dec->cur, sizeof(header));
+      dec->command_flags = header[1];
+   } else {
+      dec->command_flags = 0;
+   }
+}
+
+bool
+vkr_cs_decoder_steal_temp_pool(struct vkr_cs_decoder *dec,
+                               struct vkr_cs_decoder_temp_pool *pool);
+
+void
+vkr_cs_decoder_temp_pool_fini(struct vkr_cs_decoder_temp_pool *pool);
+
 bool
 vkr_cs_decoder_push_state(struct vkr_cs_decoder *dec);
 
@@ -215,6 +242,12 @@ vkr_cs_decoder_peek(const struct vkr_cs_decoder *dec,
    vkr_cs_decoder_peek_internal(dec, size, val, val_size);
 }
 
+/* waits for a pipeline that is being created asynchronously, and returns
+ * false if its creation failed
+ */
+bool
+vkr_pipeline_wait(struct vkr_object *obj);
+
 static inline struct vkr_object *
 vkr_cs_decoder_lookup_object(const struct vkr_cs_decoder *dec,
                              vkr_object_id id,
@@ -234,6 +267,9 @@ vkr_cs_decoder_lookup_object(const struct vkr_cs_decoder *dec,
       else
          vkr_log("failed to look up object %" PRIu64, id);
       vkr_cs_decoder_set_fatal(dec);
+   } else if (type == VK_OBJECT_TYPE_PIPELINE && unlikely(!vkr_pipeline_wait(obj))) {
+      vkr_log("pipeline %" PRIu64 " failed to be created", id);
+      vkr_cs_decoder_set_fatal(dec);
    }
 
    return obj;
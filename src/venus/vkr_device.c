@@ -12,6 +12,7 @@
 #include "vkr_descriptor_set.h"
 #include "vkr_device_memory.h"
 #include "vkr_physical_device.h"
+#include "vkr_pipeline.h"
 #include "vkr_queue.h"
 
 static VkResult
@@ -148,6 +149,7 @@ vkr_dispatch_vkCreateDevice(struct vn_dispatch_context *dispatch,
    list_inithead(&dev->free_syncs);
 
    list_inithead(&dev->objects);
+   list_inithead(&dev->memory_slabs);
 
    list_add(&dev->base.track_head, &physical_dev->devices);
 
@@ -172,7 +174,9 @@ vkr_device_object_destroy(struct vkr_context *ctx,
       vk->DestroyFence(device, obj->handle.fence, NULL);
       break;
    case VK_OBJECT_TYPE_DEVICE_MEMORY:
-      vk->FreeMemory(device, obj->handle.device_memory, NULL);
+      /* suballocated memories share the driver memory of their slab */
+      if (!((struct vkr_device_memory *)obj)->slab)
+         vk->FreeMemory(device, obj->handle.device_memory, NULL);
       vkr_device_memory_release((struct vkr_device_memory *)obj);
       break;
    case VK_OBJECT_TYPE_BUFFER:
@@ -252,6 +256,9 @@ vkr_device_destroy(struct vkr_context *ctx, struct vkr_device *dev)
    struct vn_device_proc_table *vk = &dev->proc_table;
    VkDevice device = dev->base.handle.device;
 
+   /* retire pipeline jobs and deferred destroys that may use the device */
+   vkr_pipeline_pool_drain(ctx->pipeline_pool);
+
    if (!LIST_IS_EMPTY(&dev->objects))
       vkr_log("destroying device with valid objects");
 
@@ -265,6 +272,8 @@ vkr_device_destroy(struct vkr_context *ctx, struct vkr_device *dev)
          vkr_device_object_destroy(ctx, dev, obj);
    }
 
+   vkr_device_memory_fini_slabs(dev);
+
    struct vkr_queue *queue, *queue_tmp;
    LIST_FOR_EACH_ENTRY_SAFE (queue, queue_tmp, &dev->queues, base.track_head)
       vkr_queue_destroy(ctx, queue);
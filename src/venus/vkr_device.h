@@ -11,6 +11,7 @@
 #include "venus-protocol/vn_protocol_renderer_util.h"
 
 #include "vkr_context.h"
+#include "vkr_device_memory.h"
 
 struct vkr_device {
    struct vkr_object base;
@@ -25,6 +26,10 @@ struct vkr_device {
    struct list_head free_syncs;
 
    struct list_head objects;
+
+   /* slabs for suballocated host-visible memories */
+   struct list_head memory_slabs;
+   struct vkr_device_memory_suballoc_stats suballoc_stats;
 };
 VKR_DEFINE_OBJECT_CAST(device, VK_OBJECT_TYPE_DEVICE, VkDevice)
 
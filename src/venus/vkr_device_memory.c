@@ -5,11 +5,309 @@
 
 #include "vkr_device_memory.h"
 
+#include "util/u_debug.h"
 #include "venus-protocol/vn_protocol_renderer_transport.h"
 
+#include "vkr_device.h"
 #include "vkr_device_memory_gen.h"
 #include "vkr_physical_device.h"
 
+/* With VKR_SUBALLOC=true, small host-visible allocations are carved out of
+ * larger slabs instead of getting a driver allocation, a mapping and an export
+ * each.  Ranges are aligned to the blob size granularity used by
+ * vkr_context_create_resource so that each one can be exported as a blob of
+ * its own.
+ *
+ * A blob exported from a suballocation points into the slab mapping, which
+ * the VMM may keep mapped after the memory is freed.  Each exported blob
+ * holds a reference on its slab until its resource is destroyed, and a slab
+ * is only unmapped once it has neither suballocations nor exported blobs.
+ * Slabs are shared between the ring threads and the resource callbacks, and
+ * may outlive their device, so they are protected by a global mutex.
+ */
+DEBUG_GET_ONCE_BOOL_OPTION(vkr_suballoc, "VKR_SUBALLOC", false)
+
+#define VKR_SUBALLOC_ALIGNMENT 16384
+#define VKR_SUBALLOC_MAX_SIZE (256 * 1024)
+#define VKR_SLAB_SIZE (4 * 1024 * 1024)
+#define VKR_SLAB_CHUNK_COUNT (VKR_SLAB_SIZE / VKR_SUBALLOC_ALIGNMENT)
+
+struct vkr_device_memory_slab {
+   struct list_head head;
+
+   /* NULL once the device is destroyed while blobs are still exported */
+   struct vkr_device *device;
+   VkDeviceMemory memory;
+   uint32_t memory_type_index;
+   uint8_t *map_ptr;
+
+   /* one bit per VKR_SUBALLOC_ALIGNMENT chunk, set when in use */
+   uint64_t used_mask[VKR_SLAB_CHUNK_COUNT / 64];
+   uint32_t used_count;
+
+   uint32_t export_count;
+};
+
+static once_flag vkr_slab_once_flag = ONCE_FLAG_INIT;
+static mtx_t vkr_slab_mutex;
+
+static void
+vkr_device_memory_slab_mutex_init_once(void)
+{
+   mtx_init(&vkr_slab_mutex, mtx_plain);
+}
+
+static void
+vkr_device_memory_slab_lock(void)
+{
+   call_once(&vkr_slab_once_flag, vkr_device_memory_slab_mutex_init_once);
+   mtx_lock(&vkr_slab_mutex);
+}
+
+static void
+vkr_device_memory_slab_unlock(void)
+{
+   mtx_unlock(&vkr_slab_mutex);
+}
+
+static struct vkr_device_memory_slab *
+vkr_device_memory_slab_create(struct vkr_device *dev, uint32_t mem_type_index)
+{
+   struct vn_device_proc_table *vk = &dev->proc_table;
+   VkDevice device = dev->base.handle.device;
+
+   struct vkr_device_memory_slab *slab = calloc(1, sizeof(*slab));
+   if (!slab)
+      return NULL;
+
+   const VkMemoryAllocateInfo alloc_info = {
+      .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+      .allocationSize = VKR_SLAB_SIZE,
+      .memoryTypeIndex = mem_type_index,
+   };
+   if (vk->AllocateMemory(device, &alloc_info, NULL, &slab->memory) != VK_SUCCESS) {
+      free(slab);
+      return NULL;
+   }
+
+   /* the slab stays mapped for its lifetime, blobs point into the mapping */
+   void *ptr;
+   if (vk->MapMemory(device, slab->memory, 0, VK_WHOLE_SIZE, 0, &ptr) != VK_SUCCESS) {
+      vk->FreeMemory(device, slab->memory, NULL);
+      free(slab);
+      return NULL;
+   }
+
+   slab->device = dev;
+   slab->memory_type_index = mem_type_index;
+   slab->map_ptr = ptr;
+   list_add(&slab->head, &dev->memory_slabs);
+
+   dev->suballoc_stats.slab_count++;
+   dev->suballoc_stats.slab_bytes += VKR_SLAB_SIZE;
+
+   return slab;
+}
+
+/* frees the driver memory of the slab and detaches it from its device */
+static void
+vkr_device_memory_slab_release_memory(struct vkr_device_memory_slab *slab)
+{
+   struct vkr_device *dev = slab->device;
+   struct vn_device_proc_table *vk = &dev->proc_table;
+
+   vk->UnmapMemory(dev->base.handle.device, slab->memory);
+   vk->FreeMemory(dev->base.handle.device, slab->memory, NULL);
+   list_del(&slab->head);
+   slab->device = NULL;
+
+   dev->suballoc_stats.slab_count--;
+   dev->suballoc_stats.slab_bytes -= VKR_SLAB_SIZE;
+}
+
+static void
+vkr_device_memory_slab_destroy(struct vkr_device_memory_slab *slab)
+{
+   assert(!slab->used_count && !slab->export_count);
+
+   if (slab->device)
+      vkr_device_memory_slab_release_memory(slab);
+
+   free(slab);
+}
+
+/* called with the slab mutex held when the slab loses a suballocation or an
+ * exported blob
+ */
+static void
+vkr_device_memory_slab_trim(struct vkr_device_memory_slab *slab)
+{
+   if (slab->used_count || slab->export_count)
+      return;
+
+   struct vkr_device *dev = slab->device;
+   if (!dev) {
+      vkr_device_memory_slab_destroy(slab);
+      return;
+   }
+
+   /* keep a single empty slab per memory type around to absorb alloc/free
+    * cycles
+    */
+   struct vkr_device_memory_slab *iter;
+   LIST_FOR_EACH_ENTRY (iter, &dev->memory_slabs, head) {
+      if (iter != slab && !iter->used_count && !iter->export_count &&
+          iter->memory_type_index == slab->memory_type_index) {
+         vkr_device_memory_slab_destroy(slab);
+         return;
+      }
+   }
+}
+
+static bool
+vkr_device_memory_slab_alloc(struct vkr_device_memory_slab *slab,
+                             uint32_t count,
+                             uint32_t *out_first)
+{
+   if (VKR_SLAB_CHUNK_COUNT - slab->used_count < count)
+      return false;
+
+   /* first fit */
+   uint32_t run = 0;
+   for (uint32_t i = 0; i < VKR_SLAB_CHUNK_COUNT; i++) {
+      if (slab->used_mask[i / 64] & (1ull << (i % 64))) {
+         run = 0;
+         continue;
+      }
+
+      if (++run == count) {
+         const uint32_t first = i + 1 - count;
+         for (uint32_t j = first; j <= i; j++)
+            slab->used_mask[j / 64] |= 1ull << (j % 64);
+         slab->used_count += count;
+
+         *out_first = first;
+         return true;
+      }
+   }
+
+   return false;
+}
+
+static void
+vkr_device_memory_slab_free(struct vkr_device_memory_slab *slab,
+                            uint32_t first,
+                            uint32_t count)
+{
+   for (uint32_t j = first; j < first + count; j++) {
+      assert(slab->used_mask[j / 64] & (1ull << (j % 64)));
+      slab->used_mask[j / 64] &= ~(1ull << (j % 64));
+   }
+   slab->used_count -= count;
+}
+
+static bool
+vkr_device_memory_can_suballocate(const VkMemoryAllocateInfo *alloc_info,
+                                  uint32_t property_flags)
+{
+   if (!debug_get_option_vkr_suballoc())
+      return false;
+
+   /* anything chained (import, export, dedicated, flags) needs a memory of its
+    * own
+    */
+   return (property_flags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) && !alloc_info->pNext &&
+          alloc_info->allocationSize &&
+          alloc_info->allocationSize <= VKR_SUBALLOC_MAX_SIZE;
+}
+
+static bool
+vkr_device_memory_suballocate(struct vkr_context *ctx,
+                              struct vkr_device *dev,
+                              struct vn_command_vkAllocateMemory *args,
+                              uint32_t property_flags)
+{
+   const VkMemoryAllocateInfo *alloc_info = args->pAllocateInfo;
+   const uint32_t count = DIV_ROUND_UP(alloc_info->allocationSize, VKR_SUBALLOC_ALIGNMENT);
+   struct vkr_device_memory_slab *slab;
+   uint32_t first;
+   bool found = false;
+
+   vkr_device_memory_slab_lock();
+
+   LIST_FOR_EACH_ENTRY (slab, &dev->memory_slabs, head) {
+      if (slab->memory_type_index == alloc_info->memoryTypeIndex &&
+          vkr_device_memory_slab_alloc(slab, count, &first)) {
+         found = true;
+         break;
+      }
+   }
+
+   if (!found) {
+      slab = vkr_device_memory_slab_create(dev, alloc_info->memoryTypeIndex);
+      if (!slab) {
+         dev->suballoc_stats.fallback_count++;
+         vkr_device_memory_slab_unlock();
+         return false;
+      }
+
+      ASSERTED bool ok = vkr_device_memory_slab_alloc(slab, count, &first);
+      assert(ok && !first);
+   }
+
+   dev->suballoc_stats.suballoc_count++;
+   dev->suballoc_stats.suballoc_bytes += (uint64_t)count * VKR_SUBALLOC_ALIGNMENT;
+
+   vkr_device_memory_slab_unlock();
+
+   struct vkr_device_memory *mem = vkr_context_alloc_object(
+      ctx, sizeof(*mem), VK_OBJECT_TYPE_DEVICE_MEMORY, args->pMemory);
+   if (!mem) {
+      vkr_device_memory_slab_lock();
+      vkr_device_memory_slab_free(slab, first, count);
+      dev->suballoc_stats.suballoc_count--;
+      dev->suballoc_stats.suballoc_bytes -= (uint64_t)count * VKR_SUBALLOC_ALIGNMENT;
+      vkr_device_memory_slab_trim(slab);
+      vkr_device_memory_slab_unlock();
+
+      args->ret = VK_ERROR_OUT_OF_HOST_MEMORY;
+      return true;
+   }
+
+   mem->base.handle.device_memory = slab->memory;
+   mem->device = dev;
+   mem->property_flags = property_flags;
+   mem->allocation_size = alloc_info->allocationSize;
+   mem->memory_type_index = alloc_info->memoryTypeIndex;
+   mem->slab = slab;
+   mem->slab_offset = (uint64_t)first * VKR_SUBALLOC_ALIGNMENT;
+
+   vkr_device_add_object(ctx, dev, &mem->base);
+
+   args->ret = VK_SUCCESS;
+   return true;
+}
+
+static void
+vkr_device_memory_unsuballocate(struct vkr_device_memory *mem)
+{
+   struct vkr_device *dev = mem->device;
+   struct vkr_device_memory_slab *slab = mem->slab;
+   const uint32_t count = DIV_ROUND_UP(mem->allocation_size, VKR_SUBALLOC_ALIGNMENT);
+
+   vkr_device_memory_slab_lock();
+
+   vkr_device_memory_slab_free(slab, mem->slab_offset / VKR_SUBALLOC_ALIGNMENT, count);
+   mem->slab = NULL;
+
+   dev->suballoc_stats.suballoc_count--;
+   dev->suballoc_stats.suballoc_bytes -= (uint64_t)count * VKR_SUBALLOC_ALIGNMENT;
+
+   vkr_device_memory_slab_trim(slab);
+
+   vkr_device_memory_slab_unlock();
+}
+
 static bool
 vkr_get_fd_info_from_resource_info(struct vkr_context *ctx,
                                    const VkImportMemoryResourceInfoMESA *res_info,
@@ -155,6 +453,12 @@ vkr_dispatch_vkAllocateMemory(struct vn_dispatch_context *dispatch,
       return;
    }
 
+   const uint32_t property_flags =
+      physical_dev->memory_properties.memoryTypes[mem_type_index].propertyFlags;
+   if (vkr_device_memory_can_suballocate(alloc_info, property_flags) &&
+       vkr_device_memory_suballocate(ctx, dev, args, property_flags))
+      return;
+
    /* translate VkImportMemoryResourceInfoMESA into VkImportMemoryFdInfoKHR in place */
    VkImportMemoryFdInfoKHR local_import_info = { .fd = -1 };
    VkImportMemoryResourceInfoMESA *res_info = NULL;
@@ -181,8 +485,6 @@ vkr_dispatch_vkAllocateMemory(struct vn_dispatch_context *dispatch,
     * Skip forcing external if a valid VkImportMemoryResourceInfoMESA is provided, since
     * the mapping will be directly set up from the existing virgl resource.
     */
-   const uint32_t property_flags =
-      physical_dev->memory_properties.memoryTypes[mem_type_index].propertyFlags;
    uint32_t valid_fd_types = 0;
    void *gbm_bo = NULL;
    VkExportMemoryAllocateInfo local_export_info;
@@ -271,6 +573,13 @@ vkr_dispatch_vkFreeMemory(struct vn_dispatch_context *dispatch,
 
    //fprintf(stderr, "%s: mem=%p device_memory=%p\n", __func__, (void*) mem, (void*)mem->base.handle.device_memory);
 
+   if (mem->slab) {
+      /* the slab memory stays allocated and mapped */
+      vkr_device_memory_release(mem);
+      vkr_device_remove_object(dispatch->data, mem->device, &mem->base);
+      return;
+   }
+
    if (mem->exported) {
       //fprintf(stderr, "%s: memory exported, unmapping\n", __func__);
       vkUnmapMemory(mem->device->base.handle.device, mem->base.handle.device_memory);
@@ -373,10 +682,108 @@ vkr_context_init_device_memory_dispatch(struct vkr_context *ctx)
 void
 vkr_device_memory_release(struct vkr_device_memory *mem)
 {
+   if (mem->slab)
+      vkr_device_memory_unsuballocate(mem);
+
    if (mem->gbm_bo)
       vkr_gbm_bo_destroy(mem->gbm_bo);
 }
 
+void
+vkr_device_memory_fini_slabs(struct vkr_device *dev)
+{
+   const struct vkr_device_memory_suballoc_stats *stats = &dev->suballoc_stats;
+   struct vkr_device_memory_slab *slab, *tmp;
+
+   if (!debug_get_option_vkr_suballoc())
+      return;
+
+   vkr_device_memory_slab_lock();
+
+   vkr_log("suballoc: %" PRIu64 " slabs (%" PRIu64 " bytes), %" PRIu64
+           " live suballocations (%" PRIu64 " bytes), %" PRIu64 " fallbacks",
+           stats->slab_count, stats->slab_bytes, stats->suballoc_count,
+           stats->suballoc_bytes, stats->fallback_count);
+
+   /* all memories have been released by now.  The driver memory cannot
+    * outlive the device, but a slab with exported blobs is kept until the last
+    * of them is released.
+    */
+   LIST_FOR_EACH_ENTRY_SAFE (slab, tmp, &dev->memory_slabs, head) {
+      if (slab->export_count) {
+         vkr_log("destroying device with exported suballocations");
+         vkr_device_memory_slab_release_memory(slab);
+      } else {
+         vkr_device_memory_slab_destroy(slab);
+      }
+   }
+
+   vkr_device_memory_slab_unlock();
+}
+
+void
+vkr_device_memory_release_blob(struct vkr_device_memory_slab *slab)
+{
+   vkr_device_memory_slab_lock();
+
+   assert(slab->export_count);
+   slab->export_count--;
+   vkr_device_memory_slab_trim(slab);
+
+   vkr_device_memory_slab_unlock();
+}
+
+void
+vkr_device_memory_get_suballoc_stats(const struct vkr_device *dev,
+                                     struct vkr_device_memory_suballoc_stats *stats)
+{
+   vkr_device_memory_slab_lock();
+   *stats = dev->suballoc_stats;
+   vkr_device_memory_slab_unlock();
+}
+
+static bool
+vkr_device_memory_export_suballocation(struct vkr_device_memory *mem,
+                                       uint64_t blob_size,
+                                       uint32_t blob_flags,
+                                       struct virgl_context_blob *out_blob)
+{
+   /* a suballocation has no fd of its own, only a range of the slab mapping */
+   if (blob_flags & VIRGL_RENDERER_BLOB_FLAG_USE_CROSS_DEVICE) {
+      vkr_log("suballocated mem cannot be shared cross device");
+      return false;
+   }
+
+   if (blob_size > align64(mem->allocation_size, VKR_SUBALLOC_ALIGNMENT)) {
+      vkr_log("mem blob_size %" PRIu64 " exceeds its suballocation", blob_size);
+      return false;
+   }
+
+   const bool coherent = mem->property_flags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+   const bool cached = mem->property_flags & VK_MEMORY_PROPERTY_HOST_CACHED_BIT;
+
+   mem->exported = true;
+
+   /* released by vkr_device_memory_release_blob when the resource is destroyed */
+   vkr_device_memory_slab_lock();
+   mem->slab->export_count++;
+   vkr_device_memory_slab_unlock();
+
+   *out_blob = (struct virgl_context_blob){
+      .type = VIRGL_RESOURCE_OPAQUE_HANDLE,
+      .u.fd = -1,
+      .map_ptr = (uint64_t)(uintptr_t)(mem->slab->map_ptr + mem->slab_offset),
+      .map_info = (coherent && cached) ? VIRGL_RENDERER_MAP_CACHE_CACHED
+                                       : VIRGL_RENDERER_MAP_CACHE_WC,
+      .vulkan_info = {
+         .allocation_size = mem->allocation_size,
+         .memory_type_index = mem->memory_type_index,
+      },
+   };
+
+   return true;
+}
+
 bool
 vkr_device_memory_export_blob(struct vkr_device_memory *mem,
                               uint64_t blob_size,
@@ -391,6 +798,9 @@ vkr_device_memory_export_blob(struct vkr_device_memory *mem,
       return false;
    }
 
+   if (mem->slab)
+      return vkr_device_memory_export_suballocation(mem, blob_size, blob_flags, out_blob);
+
    uint32_t map_info = VIRGL_RENDERER_MAP_CACHE_NONE;
    if (blob_flags & VIRGL_RENDERER_BLOB_FLAG_USE_MAPPABLE) {
       const bool visible = mem->property_flags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT;
@@ -9,6 +9,16 @@
 #include "vkr_common.h"
 
 struct gbm_bo;
+struct vkr_device_memory_slab;
+
+struct vkr_device_memory_suballoc_stats {
+   uint64_t slab_count;
+   uint64_t slab_bytes;
+   uint64_t suballoc_count;
+   uint64_t suballoc_bytes;
+   /* eligible allocations that fell back to a dedicated VkDeviceMemory */
+   uint64_t fallback_count;
+};
 
 struct vkr_device_memory {
    struct vkr_object base;
@@ -24,19 +34,48 @@ struct vkr_device_memory {
    uint32_t memory_type_index;
 
    bool exported;
+
+   /* when suballocated, base.handle.device_memory is the slab memory and the
+    * allocation starts at slab_offset
+    */
+   struct vkr_device_memory_slab *slab;
+   uint64_t slab_offset;
 };
 VKR_DEFINE_OBJECT_CAST(device_memory, VK_OBJECT_TYPE_DEVICE_MEMORY, VkDeviceMemory)
 
+/* Translate an offset into a memory to an offset into the driver memory.  This
+ * must be called before the handles in args are replaced.
+ */
+static inline VkDeviceSize
+vkr_device_memory_get_driver_offset(VkDeviceMemory memory, VkDeviceSize offset)
+{
+   const struct vkr_device_memory *mem = vkr_device_memory_from_handle(memory);
+   return mem && mem->slab ? mem->slab_offset + offset : offset;
+}
+
 void
 vkr_context_init_device_memory_dispatch(struct vkr_context *ctx);
 
 void
 vkr_device_memory_release(struct vkr_device_memory *mem);
 
+void
+vkr_device_memory_fini_slabs(struct vkr_device *dev);
+
+void
+vkr_device_memory_get_suballoc_stats(const struct vkr_device *dev,
+                                     struct vkr_device_memory_suballoc_stats *stats);
+
+/* When mem is suballocated, the exported blob holds a reference on mem->slab
+ * that must be released with vkr_device_memory_release_blob.
+ */
 bool
 vkr_device_memory_export_blob(struct vkr_device_memory *mem,
                               uint64_t blob_size,
                               uint32_t blob_flags,
                               struct virgl_context_blob *out_blob);
 
+void
+vkr_device_memory_release_blob(struct vkr_device_memory_slab *slab);
+
 #endif /* VKR_DEVICE_MEMORY_H */
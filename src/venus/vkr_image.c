@@ -5,6 +5,7 @@
 
 #include "vkr_image.h"
 
+#include "vkr_device_memory.h"
 #include "vkr_image_gen.h"
 #include "vkr_physical_device.h"
 
@@ -100,6 +101,8 @@ vkr_dispatch_vkBindImageMemory(UNUSED struct vn_dispatch_context *dispatch,
    struct vkr_device *dev = vkr_device_from_handle(args->device);
    struct vn_device_proc_table *vk = &dev->proc_table;
 
+   args->memoryOffset = vkr_device_memory_get_driver_offset(args->memory, args->memoryOffset);
+
    vn_replace_vkBindImageMemory_args_handle(args);
    args->ret =
       vk->BindImageMemory(args->device, args->image, args->memory, args->memoryOffset);
@@ -112,6 +115,12 @@ vkr_dispatch_vkBindImageMemory2(UNUSED struct vn_dispatch_context *dispatch,
    struct vkr_device *dev = vkr_device_from_handle(args->device);
    struct vn_device_proc_table *vk = &dev->proc_table;
 
+   for (uint32_t i = 0; i < args->bindInfoCount; i++) {
+      VkBindImageMemoryInfo *info = (VkBindImageMemoryInfo *)&args->pBindInfos[i];
+      info->memoryOffset =
+         vkr_device_memory_get_driver_offset(info->memory, info->memoryOffset);
+   }
+
    vn_replace_vkBindImageMemory2_args_handle(args);
    args->ret = vk->BindImageMemory2(args->device, args->bindInfoCount, args->pBindInfos);
 }
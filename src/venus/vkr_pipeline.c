@@ -5,8 +5,380 @@
 
 #include "vkr_pipeline.h"
 
+#include "util/u_debug.h"
+
 #include "vkr_pipeline_gen.h"
 
+/*
+ * With VKR_PIPELINE_THREADS=n, pipelines are created by n worker threads
+ * rather than on the ring thread, for commands that do not expect a reply.
+ *
+ * The pipeline objects are added to the object table right away and are
+ * marked pending.  Looking up a pending pipeline, which every command that
+ * references it does, waits for its creation.  The decoded args stay valid
+ * because the job takes over the temp pool of the decoder.  Handles in the
+ * args are replaced on the ring thread, so objects referenced by a job can
+ * be removed from the object table while the job runs.  Their driver
+ * handles are only destroyed once all jobs submitted before have retired.
+ */
+
+DEBUG_GET_ONCE_NUM_OPTION(vkr_pipeline_threads, "VKR_PIPELINE_THREADS", 0)
+
+#define VKR_PIPELINE_POOL_MAX_THREADS 16
+
+struct vkr_pipeline_job {
+   struct list_head head;
+   struct list_head queue_head;
+   uint64_t serial;
+
+   struct vkr_device *dev;
+   bool compute;
+   union {
+      struct vn_command_vkCreateGraphicsPipelines graphics;
+      struct vn_command_vkCreateComputePipelines compute;
+   } args;
+
+   struct object_array arr;
+   struct vkr_cs_decoder_temp_pool temp_pool;
+};
+
+/* a driver handle whose destruction waits for the jobs submitted before */
+struct vkr_pipeline_deferred_destroy {
+   struct list_head head;
+   uint64_t serial;
+
+   struct vkr_device *dev;
+   struct vkr_object obj;
+};
+
+struct vkr_pipeline_pool {
+   mtx_t mutex;
+   /* signaled when a job is queued or when the pool stops */
+   cnd_t queue_cond;
+   /* signaled when a job retires */
+   cnd_t retire_cond;
+   bool stop;
+
+   thrd_t threads[VKR_PIPELINE_POOL_MAX_THREADS];
+   uint32_t thread_count;
+
+   uint64_t serial;
+   /* jobs not picked up by a worker yet */
+   struct list_head queue;
+   /* jobs not retired yet, in submission order */
+   struct list_head jobs;
+   struct list_head deferred_destroys;
+};
+
+static void
+vkr_pipeline_deferred_destroy_run(struct vkr_pipeline_deferred_destroy *deferred)
+{
+   struct vn_device_proc_table *vk = &deferred->dev->proc_table;
+   VkDevice device = deferred->dev->base.handle.device;
+
+   switch (deferred->obj.type) {
+   case VK_OBJECT_TYPE_SHADER_MODULE:
+      vk->DestroyShaderModule(device, deferred->obj.handle.shader_module, NULL);
+      break;
+   case VK_OBJECT_TYPE_PIPELINE_LAYOUT:
+      vk->DestroyPipelineLayout(device, deferred->obj.handle.pipeline_layout, NULL);
+      break;
+   case VK_OBJECT_TYPE_PIPELINE_CACHE:
+      vk->DestroyPipelineCache(device, deferred->obj.handle.pipeline_cache, NULL);
+      break;
+   case VK_OBJECT_TYPE_PIPELINE:
+      vk->DestroyPipeline(device, deferred->obj.handle.pipeline, NULL);
+      break;
+   case VK_OBJECT_TYPE_RENDER_PASS:
+      vk->DestroyRenderPass(device, deferred->obj.handle.render_pass, NULL);
+      break;
+   default:
+      assert(false);
+      break;
+   }
+}
+
+/* must be called with the pool mutex held */
+static void
+vkr_pipeline_pool_retire_deferred_destroys_locked(struct vkr_pipeline_pool *pool)
+{
+   const uint64_t oldest_serial =
+      list_is_empty(&pool->jobs)
+         ? UINT64_MAX
+         : list_first_entry(&pool->jobs, struct vkr_pipeline_job, head)->serial;
+
+   struct vkr_pipeline_deferred_destroy *deferred, *tmp;
+   LIST_FOR_EACH_ENTRY_SAFE (deferred, tmp, &pool->deferred_destroys, head) {
+      if (deferred->serial >= oldest_serial)
+         break;
+
+      vkr_pipeline_deferred_destroy_run(deferred);
+      list_del(&deferred->head);
+      free(deferred);
+   }
+}
+
+static void
+vkr_pipeline_job_run(struct vkr_pipeline_job *job)
+{
+   struct vn_device_proc_table *vk = &job->dev->proc_table;
+
+   memset(job->arr.handle_storage, 0, sizeof(VkPipeline) * job->arr.count);
+
+   if (job->compute) {
+      struct vn_command_vkCreateComputePipelines *args = &job->args.compute;
+      vk->CreateComputePipelines(args->device, args->pipelineCache, args->createInfoCount,
+                                 args->pCreateInfos, NULL, job->arr.handle_storage);
+   } else {
+      struct vn_command_vkCreateGraphicsPipelines *args = &job->args.graphics;
+      vk->CreateGraphicsPipelines(args->device, args->pipelineCache, args->createInfoCount,
+                                  args->pCreateInfos, NULL, job->arr.handle_storage);
+   }
+
+   /* failed pipelines keep VK_NULL_HANDLE and fail vkr_pipeline_wait */
+   for (uint32_t i = 0; i < job->arr.count; i++) {
+      struct vkr_pipeline *pipeline = job->arr.objects[i];
+      pipeline->base.handle.pipeline = ((VkPipeline *)job->arr.handle_storage)[i];
+   }
+}
+
+static int
+vkr_pipeline_pool_thread(void *arg)
+{
+   struct vkr_pipeline_pool *pool = arg;
+
+   u_thread_setname("vkr-pipeline");
+
+   mtx_lock(&pool->mutex);
+   while (true) {
+      while (!pool->stop && list_is_empty(&pool->queue))
+         cnd_wait(&pool->queue_cond, &pool->mutex);
+      if (pool->stop)
+         break;
+
+      struct vkr_pipeline_job *job =
+         list_first_entry(&pool->queue, struct vkr_pipeline_job, queue_head);
+      list_del(&job->queue_head);
+      mtx_unlock(&pool->mutex);
+
+      vkr_pipeline_job_run(job);
+
+      mtx_lock(&pool->mutex);
+      for (uint32_t i = 0; i < job->arr.count; i++) {
+         struct vkr_pipeline *pipeline = job->arr.objects[i];
+         atomic_store(&pipeline->pending, false);
+      }
+      list_del(&job->head);
+      vkr_pipeline_pool_retire_deferred_destroys_locked(pool);
+      cnd_broadcast(&pool->retire_cond);
+      mtx_unlock(&pool->mutex);
+
+      object_array_fini(&job->arr);
+      vkr_cs_decoder_temp_pool_fini(&job->temp_pool);
+      free(job);
+
+      mtx_lock(&pool->mutex);
+   }
+   mtx_unlock(&pool->mutex);
+
+   return 0;
+}
+
+struct vkr_pipeline_pool *
+vkr_pipeline_pool_create(void)
+{
+   const uint32_t thread_count =
+      MIN2(debug_get_option_vkr_pipeline_threads(), VKR_PIPELINE_POOL_MAX_THREADS);
+   if (!thread_count)
+      return NULL;
+
+   struct vkr_pipeline_pool *pool = calloc(1, sizeof(*pool));
+   if (!pool)
+      return NULL;
+
+   if (mtx_init(&pool->mutex, mtx_plain) != thrd_success)
+      goto err_mtx_init;
+   if (cnd_init(&pool->queue_cond) != thrd_success)
+      goto err_queue_cnd_init;
+   if (cnd_init(&pool->retire_cond) != thrd_success)
+      goto err_retire_cnd_init;
+
+   list_inithead(&pool->queue);
+   list_inithead(&pool->jobs);
+   list_inithead(&pool->deferred_destroys);
+
+   for (uint32_t i = 0; i < thread_count; i++) {
+      if (thrd_create(&pool->threads[i], vkr_pipeline_pool_thread, pool) != thrd_success)
+         break;
+      pool->thread_count++;
+   }
+
+   if (!pool->thread_count) {
+      vkr_log("failed to create pipeline threads");
+      goto err_thrd_create;
+   }
+
+   return pool;
+
+err_thrd_create:
+   cnd_destroy(&pool->retire_cond);
+err_retire_cnd_init:
+   cnd_destroy(&pool->queue_cond);
+err_queue_cnd_init:
+   mtx_destroy(&pool->mutex);
+err_mtx_init:
+   free(pool);
+   return NULL;
+}
+
+void
+vkr_pipeline_pool_destroy(struct vkr_pipeline_pool *pool)
+{
+   if (!pool)
+      return;
+
+   vkr_pipeline_pool_drain(pool);
+
+   mtx_lock(&pool->mutex);
+   pool->stop = true;
+   cnd_broadcast(&pool->queue_cond);
+   mtx_unlock(&pool->mutex);
+
+   for (uint32_t i = 0; i < pool->thread_count; i++)
+      thrd_join(pool->threads[i], NULL);
+
+   assert(list_is_empty(&pool->deferred_destroys));
+
+   cnd_destroy(&pool->retire_cond);
+   cnd_destroy(&pool->queue_cond);
+   mtx_destroy(&pool->mutex);
+   free(pool);
+}
+
+/* wait for all jobs to retire, and thus for all deferred destroys */
+void
+vkr_pipeline_pool_drain(struct vkr_pipeline_pool *pool)
+{
+   if (!pool)
+      return;
+
+   mtx_lock(&pool->mutex);
+   while (!list_is_empty(&pool->jobs))
+      cnd_wait(&pool->retire_cond, &pool->mutex);
+   mtx_unlock(&pool->mutex);
+}
+
+/* Destroy the driver handle of obj once the jobs submitted so far have
+ * retired.  Returns false when no job is pending, in which case the caller
+ * destroys the handle itself.
+ */
+bool
+vkr_pipeline_pool_defer_destroy(struct vkr_pipeline_pool *pool,
+                                struct vkr_device *dev,
+                                const struct vkr_object *obj)
+{
+   if (!pool)
+      return false;
+
+   mtx_lock(&pool->mutex);
+   if (list_is_empty(&pool->jobs)) {
+      mtx_unlock(&pool->mutex);
+      return false;
+   }
+
+   struct vkr_pipeline_deferred_destroy *deferred = calloc(1, sizeof(*deferred));
+   if (!deferred) {
+      /* fall back to waiting */
+      while (!list_is_empty(&pool->jobs))
+         cnd_wait(&pool->retire_cond, &pool->mutex);
+      mtx_unlock(&pool->mutex);
+      return false;
+   }
+
+   deferred->serial = pool->serial;
+   deferred->dev = dev;
+   deferred->obj = *obj;
+   list_addtail(&deferred->head, &pool->deferred_destroys);
+   mtx_unlock(&pool->mutex);
+
+   return true;
+}
+
+bool
+vkr_pipeline_wait(struct vkr_object *obj)
+{
+   struct vkr_pipeline *pipeline = (struct vkr_pipeline *)obj;
+
+   if (unlikely(atomic_load(&pipeline->pending))) {
+      struct vkr_pipeline_pool *pool = pipeline->pool;
+
+      mtx_lock(&pool->mutex);
+      while (atomic_load(&pipeline->pending))
+         cnd_wait(&pool->retire_cond, &pool->mutex);
+      mtx_unlock(&pool->mutex);
+   }
+
+   return pipeline->base.handle.pipeline != VK_NULL_HANDLE;
+}
+
+/* Returns true when a vkCreate*Pipelines command can be handed to the pool.
+ * The reply needs the results, and a nested command stream shares its temp
+ * pool with vkExecuteCommandStreamsMESA.
+ */
+static bool
+vkr_pipeline_pool_can_submit(struct vkr_context *ctx,
+                             struct vn_dispatch_context *dispatch,
+                             VkPipelineCache cache_handle)
+{
+   const struct vkr_cs_decoder *dec = (const struct vkr_cs_decoder *)dispatch->decoder;
+
+   if (!ctx->pipeline_pool)
+      return false;
+
+   if ((dec->command_flags & VK_COMMAND_GENERATE_REPLY_BIT_EXT) || dec->saved_state_count)
+      return false;
+
+   /* jobs must not use the cache concurrently with each other */
+   struct vkr_pipeline_cache *cache = vkr_pipeline_cache_from_handle(cache_handle);
+   if (cache && cache->externally_synchronized) {
+      vkr_pipeline_pool_drain(ctx->pipeline_pool);
+      return false;
+   }
+
+   return true;
+}
+
+static void
+vkr_pipeline_pool_submit(struct vkr_context *ctx,
+                         struct vn_dispatch_context *dispatch,
+                         struct vkr_device *dev,
+                         struct vkr_pipeline_job *job)
+{
+   struct vkr_pipeline_pool *pool = ctx->pipeline_pool;
+
+   job->dev = dev;
+
+   /* reserve the object ids */
+   for (uint32_t i = 0; i < job->arr.count; i++) {
+      struct vkr_pipeline *pipeline = job->arr.objects[i];
+      atomic_init(&pipeline->pending, true);
+      pipeline->pool = pool;
+      vkr_device_add_object(ctx, dev, &pipeline->base);
+   }
+   job->arr.objects_stolen = true;
+
+   /* this cannot fail, as can_submit checked saved_state_count */
+   vkr_cs_decoder_steal_temp_pool((struct vkr_cs_decoder *)dispatch->decoder,
+                                  &job->temp_pool);
+
+   mtx_lock(&pool->mutex);
+   job->serial = ++pool->serial;
+   list_addtail(&job->head, &pool->jobs);
+   list_addtail(&job->queue_head, &pool->queue);
+   cnd_signal(&pool->queue_cond);
+   mtx_unlock(&pool->mutex);
+}
+
 static void
 vkr_dispatch_vkCreateShaderModule(struct vn_dispatch_context *dispatch,
                                   struct vn_command_vkCreateShaderModule *args)
@@ -48,7 +420,16 @@ static void
 vkr_dispatch_vkDestroyShaderModule(struct vn_dispatch_context *dispatch,
                                    struct vn_command_vkDestroyShaderModule *args)
 {
-   vkr_shader_module_destroy_and_remove(dispatch->data, args);
+   struct vkr_context *ctx = dispatch->data;
+   struct vkr_device *dev = vkr_device_from_handle(args->device);
+   struct vkr_shader_module *mod = vkr_shader_module_from_handle(args->shaderModule);
+
+   if (mod && vkr_pipeline_pool_defer_destroy(ctx->pipeline_pool, dev, &mod->base)) {
+      vkr_device_remove_object(ctx, dev, &mod->base);
+      return;
+   }
+
+   vkr_shader_module_destroy_and_remove(ctx, args);
 }
 
 static void
@@ -62,42 +443,73 @@ static void
 vkr_dispatch_vkDestroyPipelineLayout(struct vn_dispatch_context *dispatch,
                                      struct vn_command_vkDestroyPipelineLayout *args)
 {
-   vkr_pipeline_layout_destroy_and_remove(dispatch->data, args);
+   struct vkr_context *ctx = dispatch->data;
+   struct vkr_device *dev = vkr_device_from_handle(args->device);
+   struct vkr_pipeline_layout *layout = vkr_pipeline_layout_from_handle(args->pipelineLayout);
+
+   if (layout && vkr_pipeline_pool_defer_destroy(ctx->pipeline_pool, dev, &layout->base)) {
+      vkr_device_remove_object(ctx, dev, &layout->base);
+      return;
+   }
+
+   vkr_pipeline_layout_destroy_and_remove(ctx, args);
 }
 
 static void
 vkr_dispatch_vkCreatePipelineCache(struct vn_dispatch_context *dispatch,
                                    struct vn_command_vkCreatePipelineCache *args)
 {
-   vkr_pipeline_cache_create_and_add(dispatch->data, args);
+   const VkPipelineCacheCreateFlags flags = args->pCreateInfo->flags;
+
+   struct vkr_pipeline_cache *cache = vkr_pipeline_cache_create_and_add(dispatch->data, args);
+   if (cache) {
+      cache->externally_synchronized =
+         flags & VK_PIPELINE_CACHE_CREATE_EXTERNALLY_SYNCHRONIZED_BIT;
+   }
 }
 
 static void
 vkr_dispatch_vkDestroyPipelineCache(struct vn_dispatch_context *dispatch,
                                     struct vn_command_vkDestroyPipelineCache *args)
 {
-   vkr_pipeline_cache_destroy_and_remove(dispatch->data, args);
+   struct vkr_context *ctx = dispatch->data;
+   struct vkr_device *dev = vkr_device_from_handle(args->device);
+   struct vkr_pipeline_cache *cache = vkr_pipeline_cache_from_handle(args->pipelineCache);
+
+   if (cache && vkr_pipeline_pool_defer_destroy(ctx->pipeline_pool, dev, &cache->base)) {
+      vkr_device_remove_object(ctx, dev, &cache->base);
+      return;
+   }
+
+   vkr_pipeline_cache_destroy_and_remove(ctx, args);
 }
 
 static void
-vkr_dispatch_vkGetPipelineCacheData(UNUSED struct vn_dispatch_context *dispatch,
+vkr_dispatch_vkGetPipelineCacheData(struct vn_dispatch_context *dispatch,
                                     struct vn_command_vkGetPipelineCacheData *args)
 {
+   struct vkr_context *ctx = dispatch->data;
    struct vkr_device *dev = vkr_device_from_handle(args->device);
    struct vn_device_proc_table *vk = &dev->proc_table;
 
+   /* the data must include the pipelines created so far */
+   vkr_pipeline_pool_drain(ctx->pipeline_pool);
+
    vn_replace_vkGetPipelineCacheData_args_handle(args);
    args->ret = vk->GetPipelineCacheData(args->device, args->pipelineCache,
                                         args->pDataSize, args->pData);
 }
 
 static void
-vkr_dispatch_vkMergePipelineCaches(UNUSED struct vn_dispatch_context *dispatch,
+vkr_dispatch_vkMergePipelineCaches(struct vn_dispatch_context *dispatch,
                                    struct vn_command_vkMergePipelineCaches *args)
 {
+   struct vkr_context *ctx = dispatch->data;
    struct vkr_device *dev = vkr_device_from_handle(args->device);
    struct vn_device_proc_table *vk = &dev->proc_table;
 
+   vkr_pipeline_pool_drain(ctx->pipeline_pool);
+
    vn_replace_vkMergePipelineCaches_args_handle(args);
    args->ret = vk->MergePipelineCaches(args->device, args->dstCache, args->srcCacheCount,
                                        args->pSrcCaches);
@@ -111,6 +523,25 @@ vkr_dispatch_vkCreateGraphicsPipelines(struct vn_dispatch_context *dispatch,
    struct vkr_device *dev = vkr_device_from_handle(args->device);
    struct object_array arr;
 
+   if (vkr_pipeline_pool_can_submit(ctx, dispatch, args->pipelineCache)) {
+      struct vkr_pipeline_job *job = calloc(1, sizeof(*job));
+      if (!job) {
+         args->ret = VK_ERROR_OUT_OF_HOST_MEMORY;
+         return;
+      }
+
+      if (vkr_graphics_pipeline_init_array(ctx, args, &job->arr) != VK_SUCCESS) {
+         free(job);
+         return;
+      }
+
+      vn_replace_vkCreateGraphicsPipelines_args_handle(args);
+      job->args.graphics = *args;
+      vkr_pipeline_pool_submit(ctx, dispatch, dev, job);
+      args->ret = VK_SUCCESS;
+      return;
+   }
+
    if (vkr_graphics_pipeline_create_array(ctx, args, &arr) < VK_SUCCESS)
       return;
 
@@ -125,6 +556,26 @@ vkr_dispatch_vkCreateComputePipelines(struct vn_dispatch_context *dispatch,
    struct vkr_device *dev = vkr_device_from_handle(args->device);
    struct object_array arr;
 
+   if (vkr_pipeline_pool_can_submit(ctx, dispatch, args->pipelineCache)) {
+      struct vkr_pipeline_job *job = calloc(1, sizeof(*job));
+      if (!job) {
+         args->ret = VK_ERROR_OUT_OF_HOST_MEMORY;
+         return;
+      }
+
+      if (vkr_compute_pipeline_init_array(ctx, args, &job->arr) != VK_SUCCESS) {
+         free(job);
+         return;
+      }
+
+      vn_replace_vkCreateComputePipelines_args_handle(args);
+      job->compute = true;
+      job->args.compute = *args;
+      vkr_pipeline_pool_submit(ctx, dispatch, dev, job);
+      args->ret = VK_SUCCESS;
+      return;
+   }
+
    if (vkr_compute_pipeline_create_array(ctx, args, &arr) < VK_SUCCESS)
       return;
 
@@ -135,7 +586,17 @@ static void
 vkr_dispatch_vkDestroyPipeline(struct vn_dispatch_context *dispatch,
                                struct vn_command_vkDestroyPipeline *args)
 {
-   vkr_pipeline_destroy_and_remove(dispatch->data, args);
+   struct vkr_context *ctx = dispatch->data;
+   struct vkr_device *dev = vkr_device_from_handle(args->device);
+   struct vkr_pipeline *pipeline = vkr_pipeline_from_handle(args->pipeline);
+
+   /* the pipeline may be a library or the base of a pending pipeline */
+   if (pipeline && vkr_pipeline_pool_defer_destroy(ctx->pipeline_pool, dev, &pipeline->base)) {
+      vkr_device_remove_object(ctx, dev, &pipeline->base);
+      return;
+   }
+
+   vkr_pipeline_destroy_and_remove(ctx, args);
 }
 
 void
@@ -20,14 +20,35 @@ VKR_DEFINE_OBJECT_CAST(pipeline_layout, VK_OBJECT_TYPE_PIPELINE_LAYOUT, VkPipeli
 
 struct vkr_pipeline_cache {
    struct vkr_object base;
+
+   /* VK_PIPELINE_CACHE_CREATE_EXTERNALLY_SYNCHRONIZED_BIT was set */
+   bool externally_synchronized;
 };
 VKR_DEFINE_OBJECT_CAST(pipeline_cache, VK_OBJECT_TYPE_PIPELINE_CACHE, VkPipelineCache)
 
 struct vkr_pipeline {
    struct vkr_object base;
+
+   /* set while the pipeline is created by a worker of the pipeline pool */
+   atomic_bool pending;
+   struct vkr_pipeline_pool *pool;
 };
 VKR_DEFINE_OBJECT_CAST(pipeline, VK_OBJECT_TYPE_PIPELINE, VkPipeline)
 
+struct vkr_pipeline_pool *
+vkr_pipeline_pool_create(void);
+
+void
+vkr_pipeline_pool_destroy(struct vkr_pipeline_pool *pool);
+
+void
+vkr_pipeline_pool_drain(struct vkr_pipeline_pool *pool);
+
+bool
+vkr_pipeline_pool_defer_destroy(struct vkr_pipeline_pool *pool,
+                                struct vkr_device *dev,
+                                const struct vkr_object *obj);
+
 void
 vkr_context_init_shader_module_dispatch(struct vkr_context *ctx);
 
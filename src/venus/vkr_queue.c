@@ -8,6 +8,7 @@
 #include "venus-protocol/vn_protocol_renderer_queue.h"
 
 #include "vkr_context.h"
+#include "vkr_device_memory.h"
 #include "vkr_physical_device.h"
 #include "vkr_queue_gen.h"
 
@@ -381,6 +382,15 @@ vkr_dispatch_vkQueueSubmit(UNUSED struct vn_dispatch_context *dispatch,
    mtx_unlock(&queue->vk_mutex);
 }
 
+static void
+vkr_sparse_memory_binds_translate_offsets(const VkSparseMemoryBind *binds, uint32_t count)
+{
+   for (uint32_t i = 0; i < count; i++) {
+      VkSparseMemoryBind *bind = (VkSparseMemoryBind *)&binds[i];
+      bind->memoryOffset = vkr_device_memory_get_driver_offset(bind->memory, bind->memoryOffset);
+   }
+}
+
 static void
 vkr_dispatch_vkQueueBindSparse(UNUSED struct vn_dispatch_context *dispatch,
                                struct vn_command_vkQueueBindSparse *args)
@@ -388,6 +398,29 @@ vkr_dispatch_vkQueueBindSparse(UNUSED struct vn_dispatch_context *dispatch,
    struct vkr_queue *queue = vkr_queue_from_handle(args->queue);
    struct vn_device_proc_table *vk = &queue->device->proc_table;
 
+   /* suballocated memories are bound at their offset into the slab */
+   for (uint32_t i = 0; i < args->bindInfoCount; i++) {
+      const VkBindSparseInfo *info = &args->pBindInfo[i];
+
+      for (uint32_t j = 0; j < info->bufferBindCount; j++) {
+         vkr_sparse_memory_binds_translate_offsets(info->pBufferBinds[j].pBinds,
+                                                   info->pBufferBinds[j].bindCount);
+      }
+      for (uint32_t j = 0; j < info->imageOpaqueBindCount; j++) {
+         vkr_sparse_memory_binds_translate_offsets(info->pImageOpaqueBinds[j].pBinds,
+                                                   info->pImageOpaqueBinds[j].bindCount);
+      }
+      for (uint32_t j = 0; j < info->imageBindCount; j++) {
+         const VkSparseImageMemoryBindInfo *image_bind = &info->pImageBinds[j];
+
+         for (uint32_t k = 0; k < image_bind->bindCount; k++) {
+            VkSparseImageMemoryBind *bind = (VkSparseImageMemoryBind *)&image_bind->pBinds[k];
+            bind->memoryOffset =
+               vkr_device_memory_get_driver_offset(bind->memory, bind->memoryOffset);
+         }
+      }
+   }
+
    vn_replace_vkQueueBindSparse_args_handle(args);
 
    mtx_lock(&queue->vk_mutex);
@@ -5,6 +5,7 @@
 
 #include "vkr_render_pass.h"
 
+#include "vkr_pipeline.h"
 #include "vkr_render_pass_gen.h"
 
 static void
@@ -44,7 +45,16 @@ static void
 vkr_dispatch_vkDestroyRenderPass(struct vn_dispatch_context *dispatch,
                                  struct vn_command_vkDestroyRenderPass *args)
 {
-   vkr_render_pass_destroy_and_remove(dispatch->data, args);
+   struct vkr_context *ctx = dispatch->data;
+   struct vkr_device *dev = vkr_device_from_handle(args->device);
+   struct vkr_render_pass *pass = vkr_render_pass_from_handle(args->renderPass);
+
+   if (pass && vkr_pipeline_pool_defer_destroy(ctx->pipeline_pool, dev, &pass->base)) {
+      vkr_device_remove_object(ctx, dev, &pass->base);
+      return;
+   }
+
+   vkr_render_pass_destroy_and_remove(ctx, args);
 }
 
 static void
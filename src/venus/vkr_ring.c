@@ -217,6 +217,7 @@ vkr_ring_submit_cmd(struct vkr_ring *ring,
    vkr_cs_decoder_set_stream(dec, buffer, size);
 
    while (vkr_cs_decoder_has_command(dec)) {
+      vkr_cs_decoder_begin_command(dec);
       vn_dispatch_command(&ring->dispatch);
       if (vkr_cs_decoder_get_fatal(dec)) {
          vkr_log("ring_submit_cmd: vn_dispatch_command failed");
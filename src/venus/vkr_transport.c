@@ -88,6 +88,7 @@ vkr_dispatch_vkExecuteCommandStreamsMESA(
 
       vkr_cs_decoder_set_stream(dec, res->u.data + stream->offset, stream->size);
       while (vkr_cs_decoder_has_command(dec)) {
+         vkr_cs_decoder_begin_command(dec);
          vn_dispatch_command(dispatch);
          if (vkr_context_get_fatal(ctx))
             break;
@@ -110,6 +110,28 @@ struct virgl_context {
                      const void *buffer,
                      size_t size);
 
+   /*
+    * Optional.  Like submit_cmd, but for a command stream scattered over
+    * iovecs.  When missing, the stream is copied to a contiguous buffer
+    * and passed to submit_cmd.
+    */
+   int (*submit_cmd_iov)(struct virgl_context *ctx,
+                         const struct iovec *iov,
+                         unsigned int num_iovs);
+
+   /*
+    * Optional.  snapshot serializes the state of the context into a buffer
+    * allocated with malloc, and restore brings the context back to the
+    * state of such a buffer.
+    */
+   int (*snapshot)(struct virgl_context *ctx,
+                   uint32_t flags,
+                   void **data,
+                   size_t *size);
+   int (*restore)(struct virgl_context *ctx,
+                  const void *data,
+                  size_t size);
+
    /*
     * Return an fd that is readable whenever there is any signaled fence in
     * any queue, or -1 if not supported.
@@ -0,0 +1,388 @@
+/*
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "virgl_fence_coalesce.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "virgl_util.h"
+
+struct virgl_fence_coalesce_ring {
+   struct list_head head;
+   uint32_t ctx_id;
+   uint32_t ring_idx;
+   struct list_head fences;
+};
+
+struct virgl_fence_coalesce_fence {
+   struct list_head head;
+   uint64_t fence_id;
+   bool mergeable;
+};
+
+static struct virgl_fence_coalesce_ring *
+virgl_fence_coalescer_find_ring_locked(struct virgl_fence_coalescer *coalescer,
+                                       uint32_t ctx_id,
+                                       uint32_t ring_idx)
+{
+   list_for_each_entry (struct virgl_fence_coalesce_ring, ring, &coalescer->rings, head) {
+      if (ring->ctx_id == ctx_id && ring->ring_idx == ring_idx)
+         return ring;
+   }
+   return NULL;
+}
+
+static void
+virgl_fence_coalescer_free_ring(struct virgl_fence_coalesce_ring *ring)
+{
+   list_for_each_entry_safe (struct virgl_fence_coalesce_fence, fence, &ring->fences, head)
+      free(fence);
+   list_del(&ring->head);
+   free(ring);
+}
+
+/* Forgets the fence and the earlier ones of the ring, which the context
+ * skipped because they were mergeable.  Returns whether the fence itself is
+ * mergeable, an unknown fence is not.
+ */
+static bool
+virgl_fence_coalescer_pop_fence_locked(struct virgl_fence_coalescer *coalescer,
+                                       uint32_t ctx_id,
+                                       uint32_t ring_idx,
+                                       uint64_t fence_id)
+{
+   struct virgl_fence_coalesce_ring *ring =
+      virgl_fence_coalescer_find_ring_locked(coalescer, ctx_id, ring_idx);
+   if (!ring)
+      return false;
+
+   struct virgl_fence_coalesce_fence *found = NULL;
+   list_for_each_entry (struct virgl_fence_coalesce_fence, fence, &ring->fences, head) {
+      if (fence->fence_id == fence_id) {
+         found = fence;
+         break;
+      }
+   }
+   if (!found)
+      return false;
+
+   const bool mergeable = found->mergeable;
+   list_for_each_entry_safe (struct virgl_fence_coalesce_fence, fence, &ring->fences, head) {
+      const bool last = fence == found;
+      list_del(&fence->head);
+      free(fence);
+      if (last)
+         break;
+   }
+
+   return mergeable;
+}
+
+static void
+virgl_fence_coalescer_remove_entry_locked(struct virgl_fence_coalescer *coalescer,
+                                          uint32_t ctx_id,
+                                          uint32_t ring_idx)
+{
+   for (uint32_t i = 0; i < coalescer->pending_count; i++) {
+      struct virgl_fence_coalesce_entry *entry = &coalescer->pending[i];
+      if (entry->ctx_id == ctx_id && entry->ring_idx == ring_idx) {
+         *entry = coalescer->pending[--coalescer->pending_count];
+         return;
+      }
+   }
+}
+
+static struct virgl_fence_coalesce_entry *
+virgl_fence_coalescer_get_entry_locked(struct virgl_fence_coalescer *coalescer,
+                                       uint32_t ctx_id,
+                                       uint32_t ring_idx)
+{
+   for (uint32_t i = 0; i < coalescer->pending_count; i++) {
+      struct virgl_fence_coalesce_entry *entry = &coalescer->pending[i];
+      if (entry->ctx_id == ctx_id && entry->ring_idx == ring_idx)
+         return entry;
+   }
+
+   if (coalescer->pending_count == VIRGL_FENCE_COALESCE_MAX_RINGS)
+      return NULL;
+
+   if (!coalescer->pending_count) {
+      coalescer->first_pending_ns = virgl_time_ns();
+      if (coalescer->threaded)
+         cnd_signal(&coalescer->cond);
+   }
+
+   struct virgl_fence_coalesce_entry *entry =
+      &coalescer->pending[coalescer->pending_count++];
+   entry->ctx_id = ctx_id;
+   entry->ring_idx = ring_idx;
+
+   return entry;
+}
+
+/* must be called with deliver_mutex held */
+static void
+virgl_fence_coalescer_deliver_pending(struct virgl_fence_coalescer *coalescer)
+{
+   struct virgl_fence_coalesce_entry entries[VIRGL_FENCE_COALESCE_MAX_RINGS];
+   uint32_t count;
+
+   mtx_lock(&coalescer->mutex);
+   count = coalescer->pending_count;
+   memcpy(entries, coalescer->pending, sizeof(*entries) * count);
+   coalescer->pending_count = 0;
+   coalescer->retired_count = 0;
+   mtx_unlock(&coalescer->mutex);
+
+   for (uint32_t i = 0; i < count; i++) {
+      coalescer->deliver(coalescer->data, entries[i].ctx_id, entries[i].ring_idx,
+                         entries[i].fence_id);
+   }
+}
+
+void
+virgl_fence_coalescer_flush(struct virgl_fence_coalescer *coalescer)
+{
+   mtx_lock(&coalescer->deliver_mutex);
+   virgl_fence_coalescer_deliver_pending(coalescer);
+   mtx_unlock(&coalescer->deliver_mutex);
+}
+
+void
+virgl_fence_coalescer_submit(struct virgl_fence_coalescer *coalescer,
+                             uint32_t ctx_id,
+                             uint32_t ring_idx,
+                             uint64_t fence_id,
+                             uint32_t flags)
+{
+   /* a fence that is not recorded is delivered as if it was not mergeable */
+   struct virgl_fence_coalesce_fence *fence = malloc(sizeof(*fence));
+   if (!fence)
+      return;
+
+   fence->fence_id = fence_id;
+   fence->mergeable = flags & VIRGL_RENDERER_FENCE_FLAG_MERGEABLE;
+
+   mtx_lock(&coalescer->mutex);
+
+   struct virgl_fence_coalesce_ring *ring =
+      virgl_fence_coalescer_find_ring_locked(coalescer, ctx_id, ring_idx);
+   if (!ring) {
+      ring = malloc(sizeof(*ring));
+      if (!ring) {
+         mtx_unlock(&coalescer->mutex);
+         free(fence);
+         return;
+      }
+      ring->ctx_id = ctx_id;
+      ring->ring_idx = ring_idx;
+      list_inithead(&ring->fences);
+      list_add(&ring->head, &coalescer->rings);
+   }
+   list_addtail(&fence->head, &ring->fences);
+
+   mtx_unlock(&coalescer->mutex);
+}
+
+void
+virgl_fence_coalescer_cancel(struct virgl_fence_coalescer *coalescer,
+                             uint32_t ctx_id,
+                             uint32_t ring_idx)
+{
+   mtx_lock(&coalescer->mutex);
+
+   struct virgl_fence_coalesce_ring *ring =
+      virgl_fence_coalescer_find_ring_locked(coalescer, ctx_id, ring_idx);
+   if (ring && !list_is_empty(&ring->fences)) {
+      struct virgl_fence_coalesce_fence *fence =
+         list_last_entry(&ring->fences, struct virgl_fence_coalesce_fence, head);
+      list_del(&fence->head);
+      free(fence);
+   }
+
+   mtx_unlock(&coalescer->mutex);
+}
+
+void
+virgl_fence_coalescer_remove_context(struct virgl_fence_coalescer *coalescer,
+                                     uint32_t ctx_id)
+{
+   mtx_lock(&coalescer->deliver_mutex);
+   virgl_fence_coalescer_deliver_pending(coalescer);
+
+   mtx_lock(&coalescer->mutex);
+   list_for_each_entry_safe (struct virgl_fence_coalesce_ring, ring, &coalescer->rings, head) {
+      if (ring->ctx_id == ctx_id)
+         virgl_fence_coalescer_free_ring(ring);
+   }
+   mtx_unlock(&coalescer->mutex);
+
+   mtx_unlock(&coalescer->deliver_mutex);
+}
+
+void
+virgl_fence_coalescer_retire(struct virgl_fence_coalescer *coalescer,
+                             uint32_t ctx_id,
+                             uint32_t ring_idx,
+                             uint64_t fence_id)
+{
+   struct virgl_fence_coalesce_entry *entry;
+   bool flush;
+
+   mtx_lock(&coalescer->deliver_mutex);
+   mtx_lock(&coalescer->mutex);
+
+   const bool mergeable =
+      virgl_fence_coalescer_pop_fence_locked(coalescer, ctx_id, ring_idx, fence_id);
+
+   if (!mergeable || (!coalescer->threaded && !coalescer->batch_depth)) {
+      /* a pending retirement of the ring is implied by this one */
+      virgl_fence_coalescer_remove_entry_locked(coalescer, ctx_id, ring_idx);
+      mtx_unlock(&coalescer->mutex);
+
+      coalescer->deliver(coalescer->data, ctx_id, ring_idx, fence_id);
+      mtx_unlock(&coalescer->deliver_mutex);
+      return;
+   }
+
+   while (!(entry = virgl_fence_coalescer_get_entry_locked(coalescer, ctx_id, ring_idx))) {
+      mtx_unlock(&coalescer->mutex);
+      virgl_fence_coalescer_deliver_pending(coalescer);
+      mtx_lock(&coalescer->mutex);
+   }
+
+   entry->fence_id = fence_id;
+   flush = ++coalescer->retired_count >= coalescer->watermark;
+
+   mtx_unlock(&coalescer->mutex);
+
+   if (flush)
+      virgl_fence_coalescer_deliver_pending(coalescer);
+
+   mtx_unlock(&coalescer->deliver_mutex);
+}
+
+void
+virgl_fence_coalescer_begin(struct virgl_fence_coalescer *coalescer)
+{
+   mtx_lock(&coalescer->mutex);
+   coalescer->batch_depth++;
+   mtx_unlock(&coalescer->mutex);
+}
+
+void
+virgl_fence_coalescer_end(struct virgl_fence_coalescer *coalescer)
+{
+   bool flush;
+
+   mtx_lock(&coalescer->mutex);
+   flush = !--coalescer->batch_depth && !coalescer->threaded;
+   mtx_unlock(&coalescer->mutex);
+
+   if (flush)
+      virgl_fence_coalescer_flush(coalescer);
+}
+
+static int
+virgl_fence_coalescer_thread(void *arg)
+{
+   struct virgl_fence_coalescer *coalescer = arg;
+
+   mtx_lock(&coalescer->mutex);
+   while (!coalescer->stop) {
+      if (!coalescer->pending_count) {
+         cnd_wait(&coalescer->cond, &coalescer->mutex);
+         continue;
+      }
+
+      const uint64_t deadline = coalescer->first_pending_ns + coalescer->window_ns;
+      const uint64_t now = virgl_time_ns();
+      if (now < deadline) {
+         struct timespec ts;
+         timespec_get(&ts, TIME_UTC);
+
+         const uint64_t ns = (uint64_t)ts.tv_nsec + (deadline - now);
+         ts.tv_sec += ns / 1000000000;
+         ts.tv_nsec = ns % 1000000000;
+         cnd_timedwait(&coalescer->cond, &coalescer->mutex, &ts);
+         continue;
+      }
+
+      mtx_unlock(&coalescer->mutex);
+      virgl_fence_coalescer_flush(coalescer);
+      mtx_lock(&coalescer->mutex);
+   }
+   mtx_unlock(&coalescer->mutex);
+
+   return 0;
+}
+
+int
+virgl_fence_coalescer_init(struct virgl_fence_coalescer *coalescer,
+                           virgl_fence_deliver_func deliver,
+                           void *data,
+                           uint64_t window_ns,
+                           uint32_t watermark,
+                           bool threaded)
+{
+   memset(coalescer, 0, sizeof(*coalescer));
+   coalescer->deliver = deliver;
+   coalescer->data = data;
+   coalescer->window_ns = window_ns;
+   coalescer->watermark = MAX2(watermark, 1);
+   coalescer->threaded = threaded;
+   list_inithead(&coalescer->rings);
+
+   if (mtx_init(&coalescer->deliver_mutex, mtx_plain) != thrd_success)
+      return -ENOMEM;
+
+   if (mtx_init(&coalescer->mutex, mtx_plain) != thrd_success) {
+      mtx_destroy(&coalescer->deliver_mutex);
+      return -ENOMEM;
+   }
+
+   if (!threaded)
+      return 0;
+
+   if (cnd_init(&coalescer->cond) != thrd_success) {
+      mtx_destroy(&coalescer->mutex);
+      mtx_destroy(&coalescer->deliver_mutex);
+      return -ENOMEM;
+   }
+
+   if (thrd_create(&coalescer->thread, virgl_fence_coalescer_thread, coalescer) !=
+       thrd_success) {
+      cnd_destroy(&coalescer->cond);
+      mtx_destroy(&coalescer->mutex);
+      mtx_destroy(&coalescer->deliver_mutex);
+      return -ENOMEM;
+   }
+
+   return 0;
+}
+
+void
+virgl_fence_coalescer_fini(struct virgl_fence_coalescer *coalescer)
+{
+   if (coalescer->threaded) {
+      mtx_lock(&coalescer->mutex);
+      coalescer->stop = true;
+      cnd_signal(&coalescer->cond);
+      mtx_unlock(&coalescer->mutex);
+
+      thrd_join(coalescer->thread, NULL);
+      cnd_destroy(&coalescer->cond);
+   }
+
+   virgl_fence_coalescer_flush(coalescer);
+
+   list_for_each_entry_safe (struct virgl_fence_coalesce_ring, ring, &coalescer->rings, head)
+      virgl_fence_coalescer_free_ring(ring);
+
+   mtx_destroy(&coalescer->mutex);
+   mtx_destroy(&coalescer->deliver_mutex);
+}
@@ -0,0 +1,113 @@
+/*
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef VIRGL_FENCE_COALESCE_H
+#define VIRGL_FENCE_COALESCE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "c11/threads.h"
+#include "util/list.h"
+
+/*
+ * Coalesces retirements of per-context fences before they reach the VMM.
+ *
+ * write_context_fence may be skipped for a fence submitted with
+ * VIRGL_RENDERER_FENCE_FLAG_MERGEABLE, as long as a later fence of the same
+ * ring is delivered.  Submitted fences are recorded with their flags, and
+ * only the retirement of a mergeable fence is held back, where a later
+ * retirement of the ring replaces it.  Other fences are delivered as soon as
+ * they retire.  Fence ids are only compared for equality.
+ *
+ * Without a thread, retirements are only held between
+ * virgl_fence_coalescer_begin and virgl_fence_coalescer_end, which bracket
+ * a poll.  Outside of that they are delivered immediately.
+ *
+ * With a thread (for VIRGL_RENDERER_ASYNC_FENCE_CB, where fences retire on
+ * other threads), retirements are held for up to window_ns after the first
+ * pending one and then delivered by the coalescer thread.
+ *
+ * In both modes, pending retirements are delivered as soon as watermark
+ * fences have retired.  Deliveries are serialized, and a ring never sees
+ * an older fence after a newer one.
+ */
+
+#define VIRGL_FENCE_COALESCE_MAX_RINGS 64
+
+typedef void (*virgl_fence_deliver_func)(void *data,
+                                         uint32_t ctx_id,
+                                         uint32_t ring_idx,
+                                         uint64_t fence_id);
+
+struct virgl_fence_coalesce_entry {
+   uint32_t ctx_id;
+   uint32_t ring_idx;
+   uint64_t fence_id;
+};
+
+struct virgl_fence_coalescer {
+   virgl_fence_deliver_func deliver;
+   void *data;
+
+   uint64_t window_ns;
+   uint32_t watermark;
+
+   /* serializes deliveries, taken before mutex */
+   mtx_t deliver_mutex;
+   mtx_t mutex;
+
+   bool threaded;
+   bool stop;
+   cnd_t cond;
+   thrd_t thread;
+
+   /* submitted fences of each ring, in submission order */
+   struct list_head rings;
+
+   uint32_t batch_depth;
+   uint32_t retired_count;
+   uint64_t first_pending_ns;
+   uint32_t pending_count;
+   struct virgl_fence_coalesce_entry pending[VIRGL_FENCE_COALESCE_MAX_RINGS];
+};
+
+int virgl_fence_coalescer_init(struct virgl_fence_coalescer *coalescer,
+                               virgl_fence_deliver_func deliver,
+                               void *data,
+                               uint64_t window_ns,
+                               uint32_t watermark,
+                               bool threaded);
+
+/* delivers what is still pending */
+void virgl_fence_coalescer_fini(struct virgl_fence_coalescer *coalescer);
+
+/* records a fence that is submitted with the given flags */
+void virgl_fence_coalescer_submit(struct virgl_fence_coalescer *coalescer,
+                                  uint32_t ctx_id,
+                                  uint32_t ring_idx,
+                                  uint64_t fence_id,
+                                  uint32_t flags);
+
+/* forgets the last recorded fence of the ring, which failed to submit */
+void virgl_fence_coalescer_cancel(struct virgl_fence_coalescer *coalescer,
+                                  uint32_t ctx_id,
+                                  uint32_t ring_idx);
+
+void virgl_fence_coalescer_retire(struct virgl_fence_coalescer *coalescer,
+                                  uint32_t ctx_id,
+                                  uint32_t ring_idx,
+                                  uint64_t fence_id);
+
+void virgl_fence_coalescer_flush(struct virgl_fence_coalescer *coalescer);
+
+/* delivers what is pending and forgets the fences of the context */
+void virgl_fence_coalescer_remove_context(struct virgl_fence_coalescer *coalescer,
+                                          uint32_t ctx_id);
+
+void virgl_fence_coalescer_begin(struct virgl_fence_coalescer *coalescer);
+
+void virgl_fence_coalescer_end(struct virgl_fence_coalescer *coalescer);
+
+#endif /* VIRGL_FENCE_COALESCE_H */
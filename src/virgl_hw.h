@@ -473,6 +473,7 @@ enum virgl_formats {
 #define VIRGL_CAP_V2_PIPELINE_STATISTICS_QUERY (1 << 13)
 #define VIRGL_CAP_V2_DRAW_PARAMETERS      (1 << 14)
 #define VIRGL_CAP_V2_GROUP_VOTE           (1 << 15)
+#define VIRGL_CAP_V2_LINK_SHADER_HINT     (1 << 16)
 
 /* virgl bind flags - these are compatible with mesa 10.5 gallium.
  * but are fixed, no other should be passed to virgl either.
@@ -128,6 +128,7 @@ enum virgl_context_cmd {
    VIRGL_CCMD_DECODE_BITSTREAM,
    VIRGL_CCMD_ENCODE_BITSTREAM,
    VIRGL_CCMD_END_FRAME,
+   VIRGL_CCMD_LINK_SHADER_HINT,
 
    VIRGL_MAX_COMMANDS
 };
@@ -754,4 +755,17 @@ enum vrend_tweak_type {
 #define VIRGL_END_FRAME_CDC_HANDLE          1
 #define VIRGL_END_FRAME_TGT_HANDLE          2
 
+/* VIRGL_CCMD_LINK_SHADER_HINT
+ * one or more shader combinations the guest is about to draw with, as
+ * vertex, fragment, geometry, tess ctrl and tess eval handles.  The host
+ * links them when it is idle, or not at all.
+ */
+#define VIRGL_LINK_SHADER_HINT_ENTRY_SIZE   5
+#define VIRGL_LINK_SHADER_HINT_MAX_ENTRIES  64
+#define VIRGL_LINK_SHADER_HINT_VERTEX_HANDLE(x) (1 + (x) * VIRGL_LINK_SHADER_HINT_ENTRY_SIZE)
+#define VIRGL_LINK_SHADER_HINT_FRAGMENT_HANDLE(x) (2 + (x) * VIRGL_LINK_SHADER_HINT_ENTRY_SIZE)
+#define VIRGL_LINK_SHADER_HINT_GEOMETRY_HANDLE(x) (3 + (x) * VIRGL_LINK_SHADER_HINT_ENTRY_SIZE)
+#define VIRGL_LINK_SHADER_HINT_TESS_CTRL_HANDLE(x) (4 + (x) * VIRGL_LINK_SHADER_HINT_ENTRY_SIZE)
+#define VIRGL_LINK_SHADER_HINT_TESS_EVAL_HANDLE(x) (5 + (x) * VIRGL_LINK_SHADER_HINT_ENTRY_SIZE)
+
 #endif
@@ -32,6 +32,7 @@
 #ifdef HAVE_EVENTFD_H
 #include <sys/eventfd.h>
 #endif
+#include <time.h>
 #include <unistd.h>
 
 #include "util/os_misc.h"
@@ -120,6 +121,14 @@ void flush_eventfd(int fd)
     } while ((len == -1 && errno == EINTR) || len == sizeof(value));
 }
 
+uint64_t virgl_time_ns(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
 const struct log_levels_lut {
    char *name;
    enum virgl_log_level_flags log_level;
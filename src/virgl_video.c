@@ -48,10 +48,14 @@
  *     It constructs the encoding-related VABuffers according to the picture
  *     description information, and then calls vaRenderPicture() for encoding.
  *   - virgl_video_end_frame()
- *     It calls vaEndPicture() to end encoding and decoding. After decoding,
- *     it transmits the raw picture data from VASurface to the guest side,
- *     and after encoding, it transmits the result and the coded data in
- *     VACodedBuffer to the guest side.
+ *     It calls vaEndPicture() to end encoding and decoding, and queues the
+ *     frame for completion. A worker thread waits for the frames in order
+ *     with vaSyncSurface(). After decoding, the completion transmits the raw
+ *     picture data from VASurface to the guest side, and after encoding, it
+ *     transmits the result and the coded data in VACodedBuffer to the guest
+ *     side. Completions run on the caller's thread, from
+ *     virgl_video_retire_frames() and virgl_video_wait_frame(), and also
+ *     before a buffer or a codec is used again.
  *
  * @author Feng Jiang <jiangfeng@kylinos.cn>
  */
@@ -76,6 +80,7 @@
 #include "virgl_video_hw.h"
 #include "virgl_util.h"
 #include "virgl_video.h"
+#include "virgl_video_queue.h"
 
 /*
  * The max size of codec buffer is approximately:
@@ -94,6 +99,7 @@ struct virgl_video_buffer {
     bool interlanced;
     VASurfaceID va_sfc;
     struct virgl_video_dma_buf *dmabuf;
+    uint64_t frame;                             /* Last frame targeting it */
     void *opaque;                               /* User opaque data */
 };
 
@@ -111,9 +117,17 @@ struct virgl_video_codec {
    struct virgl_video_buffer *buffer;
    struct virgl_video_buffer *ref_pic_list[32]; /* Enc: reference pictures */
    VABufferID  va_coded_buf;                    /* Enc: VACodedBuffer */
+   uint64_t frame;                              /* Last frame ended */
    void *opaque;                                /* User opaque data */
 };
 
+/* A frame that has ended and waits for its completion */
+struct virgl_video_frame {
+   struct virgl_video_queue_entry base;
+   struct virgl_video_codec *codec;
+   struct virgl_video_buffer *target;
+};
+
 struct virgl_video_supported_entry {
     VAProfile profile;
     VAEntrypoint entrypoints[16];
@@ -123,6 +137,9 @@ static VADisplay va_dpy;
 
 static struct virgl_video_callbacks *callbacks = NULL;
 
+static struct virgl_video_queue frame_queue;
+static bool frame_queue_enabled;
+
 static enum pipe_video_profile pipe_profile_from_va(VAProfile profile)
 {
    switch (profile) {
@@ -500,6 +517,55 @@ static void decode_completed(struct virgl_video_codec *codec,
         callbacks->decode_completed(codec, buffer->dmabuf);
 }
 
+static void frame_completed(struct virgl_video_codec *codec,
+                            struct virgl_video_buffer *buffer)
+{
+    if (codec->entrypoint != PIPE_VIDEO_ENTRYPOINT_ENCODE) {
+        decode_completed(codec, buffer);
+    } else {
+        encode_completed(codec, buffer);
+    }
+}
+
+/* Called on the frame queue thread */
+static int frame_queue_sync(void *data, struct virgl_video_queue_entry *entry)
+{
+    struct virgl_video_frame *frame = (struct virgl_video_frame *)entry;
+    VAStatus va_stat;
+
+    (void)data;
+
+    va_stat = vaSyncSurface(va_dpy, frame->target->va_sfc);
+    if (VA_STATUS_SUCCESS != va_stat) {
+        virgl_error("sync surface failed, err = 0x%x\n", va_stat);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void frame_queue_complete(void *data,
+                                 struct virgl_video_queue_entry *entry)
+{
+    struct virgl_video_frame *frame = (struct virgl_video_frame *)entry;
+
+    (void)data;
+
+    if (!entry->status)
+        frame_completed(frame->codec, frame->target);
+
+    free(frame);
+}
+
+/* Called on the frame queue thread */
+static void frame_queue_notify(void *data)
+{
+    (void)data;
+
+    if (callbacks && callbacks->frame_synced)
+        callbacks->frame_synced();
+}
+
 static VASurfaceID get_enc_ref_pic(struct virgl_video_codec *codec,
                                    uint32_t frame_num)
 {
@@ -567,11 +633,23 @@ int virgl_video_init(int drm_fd,
 
     callbacks = cbs;
 
+    frame_queue_enabled = !virgl_video_queue_init(&frame_queue,
+                                                  frame_queue_sync,
+                                                  frame_queue_complete,
+                                                  frame_queue_notify, NULL);
+    if (!frame_queue_enabled)
+        virgl_warn("failed to create the frame queue, frames will end synchronously\n");
+
     return 0;
 }
 
 void virgl_video_destroy(void)
 {
+    if (frame_queue_enabled) {
+        virgl_video_queue_fini(&frame_queue);
+        frame_queue_enabled = false;
+    }
+
     if (va_dpy) {
         vaTerminate(va_dpy);
         va_dpy = NULL;
@@ -798,6 +876,8 @@ void virgl_video_destroy_codec(struct virgl_video_codec *codec)
     if (!va_dpy || !codec)
         return;
 
+    virgl_video_wait_frame(codec->frame);
+
     if (codec->va_ctx)
         vaDestroyContext(va_dpy, codec->va_ctx);
 
@@ -861,6 +941,8 @@ void virgl_video_destroy_buffer(struct virgl_video_buffer *buffer)
     if (!va_dpy || !buffer)
         return;
 
+    virgl_video_wait_frame(buffer->frame);
+
     if (buffer->dmabuf)
         destroy_video_dma_buf(buffer->dmabuf);
 
@@ -891,6 +973,29 @@ void *virgl_video_buffer_opaque_data(struct virgl_video_buffer *buffer)
     return buffer ? buffer->opaque : NULL;
 }
 
+uint64_t virgl_video_buffer_frame(const struct virgl_video_buffer *buffer)
+{
+    return buffer ? buffer->frame : 0;
+}
+
+void virgl_video_retire_frames(void)
+{
+    if (frame_queue_enabled)
+        virgl_video_queue_retire(&frame_queue);
+}
+
+void virgl_video_wait_frame(uint64_t frame)
+{
+    if (frame_queue_enabled)
+        virgl_video_queue_wait(&frame_queue, frame);
+}
+
+bool virgl_video_frame_completed(uint64_t frame)
+{
+    return !frame_queue_enabled ||
+           virgl_video_queue_is_completed(&frame_queue, frame);
+}
+
 int virgl_video_begin_frame(struct virgl_video_codec *codec,
                             struct virgl_video_buffer *target)
 {
@@ -899,6 +1004,13 @@ int virgl_video_begin_frame(struct virgl_video_codec *codec,
     if (!va_dpy || !codec || !target)
         return -1;
 
+    /*
+     * The previous frame of the codec may still have to read its coded
+     * buffer, and the target may still have to be read back.
+     */
+    virgl_video_wait_frame(codec->frame);
+    virgl_video_wait_frame(target->frame);
+
     if (codec->entrypoint == PIPE_VIDEO_ENTRYPOINT_ENCODE)
         encode_upload_picture(codec, target);
 
@@ -3170,6 +3282,7 @@ int virgl_video_end_frame(struct virgl_video_codec *codec,
                           struct virgl_video_buffer *target)
 {
     VAStatus va_stat;
+    struct virgl_video_frame *frame;
 
     if (!va_dpy || !codec || !target)
         return -1;
@@ -3180,17 +3293,22 @@ int virgl_video_end_frame(struct virgl_video_codec *codec,
         return -1;
     }
 
+    frame = frame_queue_enabled ? calloc(1, sizeof(*frame)) : NULL;
+    if (frame) {
+        frame->codec = codec;
+        frame->target = target;
+        codec->frame = virgl_video_queue_submit(&frame_queue, &frame->base);
+        target->frame = codec->frame;
+        return 0;
+    }
+
     va_stat = vaSyncSurface(va_dpy, target->va_sfc);
     if (VA_STATUS_SUCCESS != va_stat) {
         virgl_error("sync surface failed, err = 0x%x\n", va_stat);
         return -1;
     }
 
-    if (codec->entrypoint != PIPE_VIDEO_ENTRYPOINT_ENCODE) {
-        decode_completed(codec, target);
-    } else {
-        encode_completed(codec, target);
-    }
+    frame_completed(codec, target);
 
     return 0;
 }
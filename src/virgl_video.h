@@ -92,7 +92,7 @@ struct virgl_video_dma_buf {
         uint32_t drm_format;
         int fd;
         uint32_t size;
-        int modifier;
+        uint64_t modifier;
         uint32_t offset;
         uint32_t pitch;
     } planes[4];
@@ -122,6 +122,10 @@ struct virgl_video_callbacks {
                              unsigned num_coded_bufs,
                              const void * const *coded_bufs,
                              const unsigned *coded_sizes);
+
+    /* Optional, called on another thread when an ended frame is ready to be
+     * completed by virgl_video_retire_frames() */
+    void (*frame_synced)(void);
 };
 
 int virgl_video_init(int drm_fd,
@@ -144,6 +148,16 @@ void virgl_video_destroy_buffer(struct virgl_video_buffer *buffer);
 uint32_t virgl_video_buffer_id(const struct virgl_video_buffer *buffer);
 void *virgl_video_buffer_opaque_data(struct virgl_video_buffer *buffer);
 
+/*
+ * virgl_video_end_frame() returns before the frame is decoded or encoded.
+ * Frames are numbered from 1 in the order they end, and the callbacks of a
+ * frame run when it is retired or waited for, on the calling thread.
+ */
+uint64_t virgl_video_buffer_frame(const struct virgl_video_buffer *buffer);
+void virgl_video_retire_frames(void);
+void virgl_video_wait_frame(uint64_t frame);
+bool virgl_video_frame_completed(uint64_t frame);
+
 int virgl_video_begin_frame(struct virgl_video_codec *codec,
                             struct virgl_video_buffer *target);
 int virgl_video_decode_bitstream(struct virgl_video_codec *codec,
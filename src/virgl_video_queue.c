@@ -0,0 +1,150 @@
+/*
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "virgl_video_queue.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include "util/u_thread.h"
+
+static int
+virgl_video_queue_thread(void *arg)
+{
+   struct virgl_video_queue *queue = arg;
+
+   u_thread_setname("virgl-video");
+
+   mtx_lock(&queue->mutex);
+   while (true) {
+      while (!queue->stop && list_is_empty(&queue->pending))
+         cnd_wait(&queue->cond, &queue->mutex);
+      if (list_is_empty(&queue->pending))
+         break;
+
+      struct virgl_video_queue_entry *entry =
+         list_first_entry(&queue->pending, struct virgl_video_queue_entry, head);
+      mtx_unlock(&queue->mutex);
+
+      const int status = queue->sync(queue->data, entry);
+
+      mtx_lock(&queue->mutex);
+      entry->status = status;
+      list_del(&entry->head);
+      list_addtail(&entry->head, &queue->synced);
+      queue->synced_seq = entry->seq;
+      cnd_broadcast(&queue->cond);
+      mtx_unlock(&queue->mutex);
+
+      if (queue->notify)
+         queue->notify(queue->data);
+
+      mtx_lock(&queue->mutex);
+   }
+   mtx_unlock(&queue->mutex);
+
+   return 0;
+}
+
+int
+virgl_video_queue_init(struct virgl_video_queue *queue,
+                       virgl_video_queue_sync_func sync,
+                       virgl_video_queue_complete_func complete,
+                       virgl_video_queue_notify_func notify,
+                       void *data)
+{
+   memset(queue, 0, sizeof(*queue));
+   queue->sync = sync;
+   queue->complete = complete;
+   queue->notify = notify;
+   queue->data = data;
+   list_inithead(&queue->pending);
+   list_inithead(&queue->synced);
+
+   if (mtx_init(&queue->mutex, mtx_plain) != thrd_success)
+      return -ENOMEM;
+
+   if (cnd_init(&queue->cond) != thrd_success) {
+      mtx_destroy(&queue->mutex);
+      return -ENOMEM;
+   }
+
+   if (thrd_create(&queue->thread, virgl_video_queue_thread, queue) != thrd_success) {
+      cnd_destroy(&queue->cond);
+      mtx_destroy(&queue->mutex);
+      return -ENOMEM;
+   }
+
+   return 0;
+}
+
+void
+virgl_video_queue_fini(struct virgl_video_queue *queue)
+{
+   /* the worker drains the pending entries before it stops */
+   mtx_lock(&queue->mutex);
+   queue->stop = true;
+   cnd_broadcast(&queue->cond);
+   mtx_unlock(&queue->mutex);
+
+   thrd_join(queue->thread, NULL);
+
+   virgl_video_queue_retire(queue);
+
+   cnd_destroy(&queue->cond);
+   mtx_destroy(&queue->mutex);
+}
+
+uint64_t
+virgl_video_queue_submit(struct virgl_video_queue *queue,
+                         struct virgl_video_queue_entry *entry)
+{
+   mtx_lock(&queue->mutex);
+   entry->seq = ++queue->submitted_seq;
+   entry->status = 0;
+   list_addtail(&entry->head, &queue->pending);
+   cnd_broadcast(&queue->cond);
+   mtx_unlock(&queue->mutex);
+
+   return entry->seq;
+}
+
+void
+virgl_video_queue_retire(struct virgl_video_queue *queue)
+{
+   struct list_head synced;
+
+   mtx_lock(&queue->mutex);
+   if (list_is_empty(&queue->synced)) {
+      mtx_unlock(&queue->mutex);
+      return;
+   }
+   list_replace(&queue->synced, &synced);
+   list_inithead(&queue->synced);
+   mtx_unlock(&queue->mutex);
+
+   list_for_each_entry_safe (struct virgl_video_queue_entry, entry, &synced, head) {
+      /* before complete, which may free the entry, and so that waiting for
+       * the entry from complete returns immediately
+       */
+      queue->completed_seq = entry->seq;
+
+      list_del(&entry->head);
+      queue->complete(queue->data, entry);
+   }
+}
+
+void
+virgl_video_queue_wait(struct virgl_video_queue *queue, uint64_t seq)
+{
+   if (virgl_video_queue_is_completed(queue, seq))
+      return;
+
+   mtx_lock(&queue->mutex);
+   while (queue->synced_seq < seq)
+      cnd_wait(&queue->cond, &queue->mutex);
+   mtx_unlock(&queue->mutex);
+
+   virgl_video_queue_retire(queue);
+}
@@ -0,0 +1,88 @@
+/*
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef VIRGL_VIDEO_QUEUE_H
+#define VIRGL_VIDEO_QUEUE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "c11/threads.h"
+#include "util/list.h"
+
+/*
+ * Completes video frames in submission order without blocking the thread
+ * that submits them.
+ *
+ * A worker thread calls sync on each submitted entry, in order, and may
+ * block for as long as the hardware needs.  complete is then called on the
+ * thread that owns the queue, from virgl_video_queue_retire or
+ * virgl_video_queue_wait, and also runs in submission order.  notify is
+ * called by the worker after an entry has been synced, so that the owner
+ * knows that retiring would make progress.
+ *
+ * Sequence numbers start at 1 and act as fences: once an entry has
+ * completed, every entry submitted before it has completed as well.
+ */
+
+struct virgl_video_queue_entry {
+   struct list_head head;
+   uint64_t seq;
+   /* returned by sync */
+   int status;
+};
+
+typedef int (*virgl_video_queue_sync_func)(void *data,
+                                           struct virgl_video_queue_entry *entry);
+typedef void (*virgl_video_queue_complete_func)(void *data,
+                                                struct virgl_video_queue_entry *entry);
+typedef void (*virgl_video_queue_notify_func)(void *data);
+
+struct virgl_video_queue {
+   virgl_video_queue_sync_func sync;
+   virgl_video_queue_complete_func complete;
+   virgl_video_queue_notify_func notify;
+   void *data;
+
+   mtx_t mutex;
+   cnd_t cond;
+   thrd_t thread;
+   bool stop;
+
+   /* protected by mutex */
+   uint64_t submitted_seq;
+   uint64_t synced_seq;
+   struct list_head pending;
+   struct list_head synced;
+
+   /* only accessed by the owner */
+   uint64_t completed_seq;
+};
+
+int virgl_video_queue_init(struct virgl_video_queue *queue,
+                           virgl_video_queue_sync_func sync,
+                           virgl_video_queue_complete_func complete,
+                           virgl_video_queue_notify_func notify,
+                           void *data);
+
+/* completes what is still pending */
+void virgl_video_queue_fini(struct virgl_video_queue *queue);
+
+/* returns the sequence number of the entry */
+uint64_t virgl_video_queue_submit(struct virgl_video_queue *queue,
+                                  struct virgl_video_queue_entry *entry);
+
+/* completes the entries that have been synced, without blocking */
+void virgl_video_queue_retire(struct virgl_video_queue *queue);
+
+/* completes the entries up to and including seq */
+void virgl_video_queue_wait(struct virgl_video_queue *queue, uint64_t seq);
+
+static inline bool
+virgl_video_queue_is_completed(const struct virgl_video_queue *queue, uint64_t seq)
+{
+   return seq <= queue->completed_seq;
+}
+
+#endif /* VIRGL_VIDEO_QUEUE_H */
@@ -50,6 +50,7 @@
 #include "virglrenderer_hw.h"
 
 #include "virgl_context.h"
+#include "virgl_fence_coalesce.h"
 #include "virgl_resource.h"
 #include "virgl_util.h"
 
@@ -68,6 +69,9 @@ struct global_state {
    bool proxy_initialized;
    bool external_winsys_initialized;
    bool drm_initialized;
+   bool fence_coalesce_initialized;
+
+   struct virgl_fence_coalescer fence_coalescer;
 };
 
 static struct global_state state;
@@ -194,6 +198,12 @@ static void per_context_fence_retire(struct virgl_context *ctx,
                                      uint32_t ring_idx,
                                      uint64_t fence_id)
 {
+   if (state.fence_coalesce_initialized) {
+      virgl_fence_coalescer_retire(&state.fence_coalescer, ctx->ctx_id, ring_idx,
+                                   fence_id);
+      return;
+   }
+
    state.cbs->write_context_fence(state.cookie,
                                   ctx->ctx_id,
                                   ring_idx,
@@ -274,6 +284,10 @@ int virgl_renderer_context_create(uint32_t handle, uint32_t nlen, const char *na
 void virgl_renderer_context_destroy(uint32_t handle)
 {
    TRACE_FUNC();
+   /* deliver what the context retired before it goes away */
+   if (state.fence_coalesce_initialized)
+      virgl_fence_coalescer_remove_context(&state.fence_coalescer, handle);
+
    virgl_context_remove(handle);
 }
 
@@ -292,6 +306,39 @@ int virgl_renderer_submit_cmd(void *buffer,
    return ctx->submit_cmd(ctx, buffer, ndw * sizeof(uint32_t));
 }
 
+int virgl_renderer_submit_cmd_iov(const struct iovec *iov,
+                                  unsigned int num_iovs,
+                                  int ctx_id)
+{
+   TRACE_FUNC();
+   struct virgl_context *ctx = virgl_context_lookup(ctx_id);
+   if (!ctx)
+      return EINVAL;
+
+   if (!iov && num_iovs)
+      return EINVAL;
+
+   if (ctx->submit_cmd_iov)
+      return ctx->submit_cmd_iov(ctx, iov, num_iovs);
+
+   size_t size = vrend_get_iovec_size(iov, num_iovs);
+   if (size / sizeof(uint32_t) > UINT32_MAX / sizeof(uint32_t))
+      return EINVAL;
+   size -= size % sizeof(uint32_t);
+
+   /* always copy, the guest can still write to its pages and the decoders
+    * read some of the dwords more than once */
+   void *buffer = malloc(size);
+   if (!buffer)
+      return ENOMEM;
+
+   vrend_read_from_iovec(iov, num_iovs, 0, buffer, size);
+   int ret = ctx->submit_cmd(ctx, buffer, size);
+   free(buffer);
+
+   return ret;
+}
+
 int virgl_renderer_transfer_write_iov(uint32_t handle,
                                       uint32_t ctx_id,
                                       int level,
@@ -420,7 +467,15 @@ int virgl_renderer_context_create_fence(uint32_t ctx_id,
       return -EINVAL;
 
    assert(state.cbs->version >= 3 && state.cbs->write_context_fence);
-   return ctx->submit_fence(ctx, flags, ring_idx, fence_id);
+   /* recorded first, the fence can retire on another thread right away */
+   if (state.fence_coalesce_initialized)
+      virgl_fence_coalescer_submit(&state.fence_coalescer, ctx_id, ring_idx, fence_id, flags);
+
+   int ret = ctx->submit_fence(ctx, flags, ring_idx, fence_id);
+   if (ret && state.fence_coalesce_initialized)
+      virgl_fence_coalescer_cancel(&state.fence_coalescer, ctx_id, ring_idx);
+
+   return ret;
 }
 
 void virgl_renderer_context_poll(uint32_t ctx_id)
@@ -429,7 +484,13 @@ void virgl_renderer_context_poll(uint32_t ctx_id)
    if (!ctx)
       return;
 
+   if (state.fence_coalesce_initialized)
+      virgl_fence_coalescer_begin(&state.fence_coalescer);
+
    ctx->retire_fences(ctx);
+
+   if (state.fence_coalesce_initialized)
+      virgl_fence_coalescer_end(&state.fence_coalescer);
 }
 
 int virgl_renderer_context_get_poll_fd(uint32_t ctx_id)
@@ -441,6 +502,31 @@ int virgl_renderer_context_get_poll_fd(uint32_t ctx_id)
    return ctx->get_fencing_fd(ctx);
 }
 
+int virgl_renderer_context_snapshot(uint32_t ctx_id, uint32_t flags,
+                                    void **data, size_t *size)
+{
+   TRACE_FUNC();
+   struct virgl_context *ctx = virgl_context_lookup(ctx_id);
+   if (!ctx)
+      return -EINVAL;
+   if (!ctx->snapshot)
+      return -ENOTSUP;
+
+   return ctx->snapshot(ctx, flags, data, size);
+}
+
+int virgl_renderer_context_restore(uint32_t ctx_id, const void *data, size_t size)
+{
+   TRACE_FUNC();
+   struct virgl_context *ctx = virgl_context_lookup(ctx_id);
+   if (!ctx)
+      return -EINVAL;
+   if (!ctx->restore)
+      return -ENOTSUP;
+
+   return ctx->restore(ctx, data, size);
+}
+
 void virgl_renderer_force_ctx_0(void)
 {
    if (state.vrend_initialized)
@@ -588,9 +674,40 @@ static void ctx0_fence_retire(uint64_t fence_id, UNUSED void *retire_data)
    // ctx0 fence_id is created from uint32_t but stored internally as uint64_t,
    // so casting back to uint32_t doesn't result in data loss.
    assert((fence_id >> 32) == 0);
+
    state.cbs->write_fence(state.cookie, (uint32_t)fence_id);
 }
 
+static void deliver_coalesced_fence(UNUSED void *data,
+                                    uint32_t ctx_id,
+                                    uint32_t ring_idx,
+                                    uint64_t fence_id)
+{
+   state.cbs->write_context_fence(state.cookie, ctx_id, ring_idx, fence_id);
+}
+
+/* how long async fence callbacks hold mergeable retirements, and how many
+ * retirements force a delivery */
+#define FENCE_COALESCE_WINDOW_NS 50000
+#define FENCE_COALESCE_WATERMARK 16
+
+static int fence_coalesce_init(int flags)
+{
+   if (!(flags & VIRGL_RENDERER_COALESCE_FENCES))
+      return 0;
+
+   int ret = virgl_fence_coalescer_init(&state.fence_coalescer,
+                                        deliver_coalesced_fence, NULL,
+                                        FENCE_COALESCE_WINDOW_NS,
+                                        FENCE_COALESCE_WATERMARK,
+                                        flags & VIRGL_RENDERER_ASYNC_FENCE_CB);
+   if (ret)
+      return ret;
+
+   state.fence_coalesce_initialized = true;
+   return 0;
+}
+
 static virgl_renderer_gl_context create_gl_context(int scanout_idx, struct virgl_gl_ctx_param *param)
 {
    struct virgl_renderer_gl_ctx_param vparam;
@@ -738,17 +855,28 @@ virgl_context_foreach_retire_fences(struct virgl_context *ctx,
 void virgl_renderer_poll(void)
 {
    TRACE_FUNC();
+   if (state.fence_coalesce_initialized)
+      virgl_fence_coalescer_begin(&state.fence_coalescer);
+
    if (state.vrend_initialized)
       vrend_renderer_poll();
 
    struct virgl_context_foreach_args args;
    args.callback = virgl_context_foreach_retire_fences;
    virgl_context_foreach(&args);
+
+   if (state.fence_coalesce_initialized)
+      virgl_fence_coalescer_end(&state.fence_coalescer);
 }
 
 void virgl_renderer_cleanup(UNUSED void *cookie)
 {
    TRACE_FUNC();
+   if (state.fence_coalesce_initialized) {
+      virgl_fence_coalescer_fini(&state.fence_coalescer);
+      state.fence_coalesce_initialized = false;
+   }
+
    if (state.vrend_initialized)
       vrend_renderer_prepare_reset();
 
@@ -804,6 +932,12 @@ int virgl_renderer_init(void *cookie, int flags, struct virgl_renderer_callbacks
       state.client_initialized = true;
    }
 
+   if (!state.fence_coalesce_initialized) {
+      ret = fence_coalesce_init(flags);
+      if (ret)
+         goto fail;
+   }
+
    if (!state.resource_initialized) {
       const struct virgl_resource_pipe_callbacks *pipe_cbs =
          (flags & VIRGL_RENDERER_NO_VIRGL) ? NULL :
@@ -886,6 +1020,8 @@ int virgl_renderer_init(void *cookie, int flags, struct virgl_renderer_callbacks
          renderer_flags |= VREND_D3D11_SHARE_TEXTURE;
       if (flags & VIRGL_RENDERER_COMPAT_PROFILE)
          renderer_flags |= VREND_USE_COMPAT_CONTEXT;
+      if (flags & VIRGL_RENDERER_CONTEXT_SNAPSHOTS)
+         renderer_flags |= VREND_USE_SNAPSHOTS;
 
       ret = vrend_renderer_init(&vrend_cbs, renderer_flags);
       if (ret)
@@ -27,6 +27,7 @@
 #ifndef VIRGLRENDERER_H
 #define VIRGLRENDERER_H
 
+#include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdarg.h>
@@ -164,6 +165,20 @@ struct virgl_renderer_callbacks {
 #define VIRGL_RENDERER_D3D11_SHARE_TEXTURE (1 << 12)
 #define VIRGL_RENDERER_COMPAT_PROFILE (1 << 13)
 
+/*
+ * Keep track of the state of virgl contexts, so that they can be
+ * snapshotted with virgl_renderer_context_snapshot.
+ */
+#define VIRGL_RENDERER_CONTEXT_SNAPSHOTS (1 << 14)
+
+/*
+ * Hold back the retirement of per-context fences submitted with
+ * VIRGL_RENDERER_FENCE_FLAG_MERGEABLE, so that write_context_fence is only
+ * called for the latest retired fence of a ring.  Retirements are held for
+ * the duration of a poll, or briefly with VIRGL_RENDERER_ASYNC_FENCE_CB.
+ */
+#define VIRGL_RENDERER_COALESCE_FENCES (1 << 15)
+
 VIRGL_EXPORT int virgl_renderer_init(void *cookie, int flags, struct virgl_renderer_callbacks *cb);
 VIRGL_EXPORT void virgl_renderer_poll(void); /* force fences */
 
@@ -280,6 +295,16 @@ VIRGL_EXPORT int virgl_renderer_submit_cmd(void *buffer,
                                            int ctx_id,
                                            int ndw);
 
+/*
+ * Submits a command stream that is scattered over iovecs, typically the
+ * guest pages of a virtqueue buffer, so that the VMM does not have to copy
+ * it to a contiguous buffer first.  Only commands that straddle two iovecs
+ * are copied, and the guest may keep writing to the iovecs meanwhile.
+ */
+VIRGL_EXPORT int virgl_renderer_submit_cmd_iov(const struct iovec *iov,
+                                               unsigned int num_iovs,
+                                               int ctx_id);
+
 VIRGL_EXPORT int virgl_renderer_transfer_read_iov(uint32_t handle, uint32_t ctx_id,
                                                   uint32_t level, uint32_t stride,
                                                   uint32_t layer_stride,
@@ -445,6 +470,24 @@ virgl_renderer_export_fence(uint32_t client_fence_id, int *fd);
 VIRGL_EXPORT void virgl_renderer_context_poll(uint32_t ctx_id); /* force fences */
 VIRGL_EXPORT int virgl_renderer_context_get_poll_fd(uint32_t ctx_id);
 
+/*
+ * Context snapshots, for live migration.  The snapshot is returned in a
+ * buffer that the caller frees with free().  It only covers the state of
+ * the context: the resources attached to it must be recreated and attached
+ * again before restoring, and the contents of resources backed by guest
+ * memory are not included.
+ *
+ * An incremental snapshot only includes the contents of the resources that
+ * were written since the previous snapshot of the context, and is restored
+ * after the snapshots that precede it.
+ */
+#define VIRGL_RENDERER_SNAPSHOT_INCREMENTAL (1 << 0)
+
+VIRGL_EXPORT int virgl_renderer_context_snapshot(uint32_t ctx_id, uint32_t flags,
+                                                 void **data, size_t *size);
+VIRGL_EXPORT int virgl_renderer_context_restore(uint32_t ctx_id,
+                                                const void *data, size_t size);
+
 #endif /* VIRGL_RENDERER_UNSTABLE_APIS */
 
 #endif
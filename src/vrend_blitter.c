@@ -49,6 +49,10 @@
 #define BLIT_MANUAL_SRGB_DECODE (1 << 3)
 #define BLIT_MANUAL_SRGB_ENCODE (1 << 4)
 
+#define BLIT_COMPUTE_GROUP_SIZE 8
+/* cached in place of a compute program that failed to build */
+#define BLIT_COMPUTE_PROG_FAILED (~0u)
+
 struct vec4 {
    GLfloat x,y,z,w;
 };
@@ -62,6 +66,8 @@ struct vrend_blitter_ctx {
    virgl_gl_context gl_context;
    bool initialised;
    bool use_gles;
+   bool use_compute;
+   unsigned compute_blits;
 
    GLuint vaoid;
 
@@ -92,6 +98,7 @@ struct blit_swizzle_and_type {
 
 #pragma pack(push,1)
 struct PACKED blit_prog_key {
+   bool is_compute: 1;
    bool is_color: 1;
    bool is_msaa: 1;
    bool manual_srgb_decode: 1;
@@ -101,6 +108,7 @@ struct PACKED blit_prog_key {
    struct {
       bool has_swizzle: 1;
       enum virgl_formats src_format: 9;
+      enum virgl_formats dst_format: 9;
       enum pipe_swizzle swizzle1: 3;
       enum pipe_swizzle swizzle2: 3;
       enum pipe_swizzle swizzle3: 3;
@@ -118,7 +126,7 @@ prog_key_to_uint64( struct blit_prog_key prog_key )
    union {
       struct blit_prog_key prog_key;
       uint64_t u;
-   } pu;
+   } pu = { .u = 0 };
    pu.prog_key = prog_key;
    return pu.u;
 }
@@ -465,6 +473,7 @@ static void vrend_renderer_init_blit_ctx(struct vrend_blitter_ctx *blit_ctx)
    vrend_blit_ctx.blit_programs = _mesa_hash_table_u64_create(NULL);
 
    blit_ctx->use_gles = epoxy_is_desktop_gl() == 0;
+   blit_ctx->use_compute = blit_ctx->use_gles && !getenv("VIRGL_NO_COMPUTE_BLIT");
    ctx_params.shared = true;
    ctx_params.compat_ctx = false;
    for (uint32_t i = 0; i < ARRAY_SIZE(gl_versions); i++) {
@@ -697,19 +706,15 @@ static void calc_dst_deltas_from_src(const struct pipe_blit_info *info,
    dst1_delta->y = src1_delta->y * scale_y;
 }
 
-static void blitter_set_points(struct vrend_blitter_ctx *blit_ctx,
-                               const struct pipe_blit_info *info,
+static void blitter_get_points(const struct pipe_blit_info *info,
                                struct vrend_resource *src_res,
-                               struct vrend_resource *dst_res,
                                struct blit_point *src0,
-                               struct blit_point *src1)
+                               struct blit_point *src1,
+                               struct blit_point *dst0,
+                               struct blit_point *dst1)
 {
-   struct blit_point dst0, dst1;
    struct blit_point src0_delta, src1_delta, dst0_delta, dst1_delta;
 
-   blit_ctx->dst_width = u_minify(dst_res->base.width0, info->dst.level);
-   blit_ctx->dst_height = u_minify(dst_res->base.height0, info->dst.level);
-
    /* Calculate src and dst points taking deltas into account */
    calc_src_deltas_for_bounds(src_res, info, &src0_delta, &src1_delta);
    calc_dst_deltas_from_src(info, &src0_delta, &src1_delta, &dst0_delta, &dst1_delta);
@@ -719,14 +724,29 @@ static void blitter_set_points(struct vrend_blitter_ctx *blit_ctx,
    src1->x = info->src.box.x + info->src.box.width + src1_delta.x;
    src1->y = info->src.box.y + info->src.box.height + src1_delta.y;
 
-   dst0.x = info->dst.box.x + dst0_delta.x;
-   dst0.y = info->dst.box.y + dst0_delta.y;
-   dst1.x = info->dst.box.x + info->dst.box.width + dst1_delta.x;
-   dst1.y = info->dst.box.y + info->dst.box.height + dst1_delta.y;
+   dst0->x = info->dst.box.x + dst0_delta.x;
+   dst0->y = info->dst.box.y + dst0_delta.y;
+   dst1->x = info->dst.box.x + info->dst.box.width + dst1_delta.x;
+   dst1->y = info->dst.box.y + info->dst.box.height + dst1_delta.y;
 
    VREND_DEBUG(dbg_blit, NULL, "Blitter src:[%3d, %3d] - [%3d, %3d] to dst:[%3d, %3d] - [%3d, %3d]\n",
                src0->x, src0->y, src1->x, src1->y,
-               dst0.x, dst0.y, dst1.x, dst1.y);
+               dst0->x, dst0->y, dst1->x, dst1->y);
+}
+
+static void blitter_set_points(struct vrend_blitter_ctx *blit_ctx,
+                               const struct pipe_blit_info *info,
+                               struct vrend_resource *src_res,
+                               struct vrend_resource *dst_res,
+                               struct blit_point *src0,
+                               struct blit_point *src1)
+{
+   struct blit_point dst0, dst1;
+
+   blit_ctx->dst_width = u_minify(dst_res->base.width0, info->dst.level);
+   blit_ctx->dst_height = u_minify(dst_res->base.height0, info->dst.level);
+
+   blitter_get_points(info, src_res, src0, src1, &dst0, &dst1);
 
    blitter_set_rectangle(blit_ctx, dst0.x, dst0.y, dst1.x, dst1.y);
 }
@@ -906,13 +926,214 @@ void vrend_renderer_blit_gl(ASSERTED struct vrend_context *ctx,
    glBindTexture(src_res->target, 0);
 }
 
+static const char *blit_image_format(enum virgl_formats format)
+{
+   switch (vrend_get_format_table_entry(format)->internalformat) {
+   case GL_RGBA8: return "rgba8";
+   case GL_RGBA8_SNORM: return "rgba8_snorm";
+   case GL_RGBA16F: return "rgba16f";
+   case GL_RGBA32F: return "rgba32f";
+   case GL_R32F: return "r32f";
+   default: return NULL;
+   }
+}
+
+static GLuint blit_get_compute_tex_col(struct vrend_blitter_ctx *blit_ctx,
+                                       enum pipe_texture_target pipe_tex_target,
+                                       enum virgl_formats dst_format,
+                                       const enum pipe_swizzle swizzle[static 4])
+{
+   struct blit_prog_key key = {
+      .is_compute = true,
+      .is_color = true,
+      .pipe_tex_target = pipe_tex_target,
+   };
+
+   key.texcol.dst_format = dst_format;
+   key.texcol.has_swizzle = true;
+   key.texcol.swizzle1 = swizzle[0];
+   key.texcol.swizzle2 = swizzle[1];
+   key.texcol.swizzle3 = swizzle[2];
+   key.texcol.swizzle4 = swizzle[3];
+
+   void *shader = _mesa_hash_table_u64_search(blit_ctx->blit_programs, prog_key_to_uint64(key));
+   if (shader) {
+      GLuint prog_id = (GLuint)((size_t)(shader) & 0xffffffff);
+      return prog_id == BLIT_COMPUTE_PROG_FAILED ? 0 : prog_id;
+   }
+
+   char shader_buf[4096];
+   char dest_swizzle_snippet[DEST_SWIZZLE_SNIPPET_SIZE];
+   enum tgsi_texture_type tgsi_tex = util_pipe_tex_to_tgsi_tex(pipe_tex_target, 0);
+   bool is_array = pipe_tex_target == PIPE_TEXTURE_2D_ARRAY;
+
+   create_dest_swizzle_snippet(swizzle, dest_swizzle_snippet);
+
+   snprintf(shader_buf, sizeof(shader_buf), CS_TEXFETCH_COL_GLES,
+            BLIT_COMPUTE_GROUP_SIZE, BLIT_COMPUTE_GROUP_SIZE,
+            vrend_shader_samplertypeconv(true, tgsi_tex),
+            blit_image_format(dst_format), is_array ? "2DArray" : "2D",
+            is_array ? "vec3(tc, float(layers.x + int(gl_GlobalInvocationID.z)))" : "tc",
+            is_array ? "ivec3(pos, layers.y + int(gl_GlobalInvocationID.z))" : "pos",
+            dest_swizzle_snippet);
+
+   VREND_DEBUG(dbg_blit, NULL, "-- Blit CS color shader -----------------\n"
+               "%s\n---------------------------------------\n", shader_buf);
+
+   /* the blit falls back to the GL path, don't try again on every blit */
+   GLuint prog_id = BLIT_COMPUTE_PROG_FAILED;
+   GLuint cs_id = blit_shader_build_and_check(GL_COMPUTE_SHADER, shader_buf);
+   if (cs_id) {
+      GLuint id = glCreateProgram();
+      glAttachShader(id, cs_id);
+      if (blit_shader_link_and_check(id))
+         prog_id = id;
+      glDeleteShader(cs_id);
+   }
+
+   _mesa_hash_table_u64_insert(blit_ctx->blit_programs, prog_key_to_uint64(key), (void *)(uintptr_t)prog_id);
+
+   return prog_id == BLIT_COMPUTE_PROG_FAILED ? 0 : prog_id;
+}
+
+static bool blit_can_use_compute(struct vrend_resource *src_res,
+                                 struct vrend_resource *dst_res,
+                                 const struct vrend_blit_info *info)
+{
+   if (!info->has_compute_blit)
+      return false;
+
+   /* color only, without any of the states the GL blitter would have to
+    * apply */
+   if (info->b.mask != PIPE_MASK_RGBA || info->b.scissor_enable ||
+       info->b.alpha_blend || info->b.render_condition_enable ||
+       info->needs_manual_srgb_decode || info->needs_manual_srgb_encode)
+      return false;
+
+   if (src_res->base.target != dst_res->base.target ||
+       (src_res->base.target != PIPE_TEXTURE_2D &&
+        src_res->base.target != PIPE_TEXTURE_2D_ARRAY) ||
+       src_res->base.nr_samples > 0 || dst_res->base.nr_samples > 0)
+      return false;
+
+   /* layers are blitted one to one */
+   if (info->b.src.box.depth != info->b.dst.box.depth ||
+       info->b.src.box.depth <= 0)
+      return false;
+
+   if (util_format_is_pure_integer(info->b.src.format) ||
+       util_format_is_pure_integer(info->b.dst.format) ||
+       util_format_is_srgb(info->b.dst.format) ||
+       !blit_image_format(info->b.dst.format))
+      return false;
+
+   /* the views were not created if the resources don't support them */
+   if ((info->src_view == src_res->id && info->b.src.format != src_res->base.format) ||
+       (info->dst_view == dst_res->id && info->b.dst.format != dst_res->base.format))
+      return false;
+
+   /* GLES can only bind immutable textures as images, views always are */
+   if (info->dst_view == dst_res->id &&
+       !has_bit(dst_res->storage_bits, VREND_STORAGE_GL_IMMUTABLE))
+      return false;
+
+   return true;
+}
+
+/* Blit with a compute shader that writes the destination as an image, all
+ * the layers in one dispatch and without binding a framebuffer.  Mipmap
+ * generation being a chain of such blits, the barrier at the end is all
+ * that is needed between two levels.  The texels are fetched and swizzled
+ * exactly as in vrend_renderer_blit_gl.
+ */
+bool vrend_renderer_blit_compute(ASSERTED struct vrend_context *ctx,
+                                 struct vrend_resource *src_res,
+                                 struct vrend_resource *dst_res,
+                                 const struct vrend_blit_info *info)
+{
+   struct vrend_blitter_ctx *blit_ctx = &vrend_blit_ctx;
+   struct blit_point src0, src1, dst0, dst1;
+   float coord[4];
+
+   if (!blit_can_use_compute(src_res, dst_res, info))
+      return false;
+
+   vrend_renderer_init_blit_ctx(blit_ctx);
+   if (!blit_ctx->use_compute)
+      return false;
+
+   GLuint prog_id = blit_get_compute_tex_col(blit_ctx, src_res->base.target,
+                                             info->b.dst.format, info->swizzle);
+   if (!prog_id)
+      return false;
+
+   VREND_DEBUG(dbg_blit, ctx, "BLIT: use compute shader\n");
+
+   blitter_get_points(&info->b, src_res, &src0, &src1, &dst0, &dst1);
+   get_texcoords(blit_ctx, src_res, info->b.src.level,
+                 src0.x, src0.y, src1.x, src1.y, coord);
+
+   /* only the texels of the level are written */
+   int dst_width = u_minify(dst_res->base.width0, info->b.dst.level);
+   int dst_height = u_minify(dst_res->base.height0, info->b.dst.level);
+   int clip_x0 = CLAMP(MIN2(dst0.x, dst1.x), 0, dst_width);
+   int clip_y0 = CLAMP(MIN2(dst0.y, dst1.y), 0, dst_height);
+   int clip_x1 = CLAMP(MAX2(dst0.x, dst1.x), 0, dst_width);
+   int clip_y1 = CLAMP(MAX2(dst0.y, dst1.y), 0, dst_height);
+
+   glUseProgram(prog_id);
+
+   glBindTexture(src_res->target, info->src_view);
+   vrend_set_tex_param(src_res, &info->b,
+                       info->has_texture_srgb_decode);
+
+   glBindImageTexture(0, info->dst_view, info->b.dst.level,
+                      dst_res->base.target == PIPE_TEXTURE_2D_ARRAY, 0,
+                      GL_WRITE_ONLY,
+                      vrend_get_format_table_entry(info->b.dst.format)->internalformat);
+
+   glUniform1i(glGetUniformLocation(prog_id, "samp"), 0);
+   glUniform1i(glGetUniformLocation(prog_id, "img"), 0);
+   glUniform4f(glGetUniformLocation(prog_id, "src_rect"),
+               coord[0], coord[1], coord[2], coord[3]);
+   glUniform4i(glGetUniformLocation(prog_id, "dst_rect"),
+               dst0.x, dst0.y, dst1.x, dst1.y);
+   glUniform4i(glGetUniformLocation(prog_id, "dst_clip"),
+               clip_x0, clip_y0, clip_x1, clip_y1);
+   glUniform2i(glGetUniformLocation(prog_id, "layers"),
+               info->b.src.box.z, info->b.dst.box.z);
+
+   if (clip_x1 > clip_x0 && clip_y1 > clip_y0 && dst0.x != dst1.x && dst0.y != dst1.y)
+      glDispatchCompute(DIV_ROUND_UP(clip_x1 - clip_x0, BLIT_COMPUTE_GROUP_SIZE),
+                        DIV_ROUND_UP(clip_y1 - clip_y0, BLIT_COMPUTE_GROUP_SIZE),
+                        info->b.dst.box.depth);
+
+   glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT | GL_SHADER_IMAGE_ACCESS_BARRIER_BIT |
+                   GL_TEXTURE_UPDATE_BARRIER_BIT | GL_FRAMEBUFFER_BARRIER_BIT |
+                   GL_PIXEL_BUFFER_BARRIER_BIT);
+
+   glBindImageTexture(0, 0, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA8);
+   glUseProgram(0);
+   glBindTexture(src_res->target, 0);
+
+   blit_ctx->compute_blits++;
+   return true;
+}
+
+unsigned vrend_blitter_compute_blit_count(void)
+{
+   return vrend_blit_ctx.compute_blits;
+}
+
 void vrend_blitter_fini(void)
 {
    vrend_blit_ctx.initialised = false;
    vrend_clicbs->destroy_gl_context(vrend_blit_ctx.gl_context);
    if (vrend_blit_ctx.blit_programs) {
       hash_table_foreach(vrend_blit_ctx.blit_programs->table, entry) {
-         glDeleteProgram((GLuint)pointer_to_uintptr(entry->data));
+         GLuint prog_id = (GLuint)pointer_to_uintptr(entry->data);
+         if (prog_id != BLIT_COMPUTE_PROG_FAILED)
+            glDeleteProgram(prog_id);
       }
 
       _mesa_hash_table_u64_destroy(vrend_blit_ctx.blit_programs);
@@ -174,6 +174,33 @@
    "}\n"
 
 
+#define CS_HEADER_GLES                          \
+   "#version 310 es\n"                          \
+   "// Blitter\n"                               \
+   "precision highp float;\n"                   \
+
+#define CS_TEXFETCH_COL_BODY                                             \
+   "#define cvec4 vec4\n"                                                \
+   "layout(local_size_x = %d, local_size_y = %d) in;\n"                  \
+   "uniform mediump sampler%s samp;\n"                                   \
+   "layout(%s) writeonly uniform mediump image%s img;\n"                 \
+   "uniform vec4 src_rect;\n"                                            \
+   "uniform ivec4 dst_rect;\n"                                           \
+   "uniform ivec4 dst_clip;\n"                                           \
+   "uniform ivec2 layers;\n"                                             \
+   "void main() {\n"                                                     \
+   "   ivec2 pos = dst_clip.xy + ivec2(gl_GlobalInvocationID.xy);\n"     \
+   "   if (any(greaterThanEqual(pos, dst_clip.zw)))\n"                   \
+   "      return;\n"                                                     \
+   "   vec2 t = (vec2(pos) + 0.5 - vec2(dst_rect.xy)) /\n"               \
+   "            vec2(dst_rect.zw - dst_rect.xy);\n"                      \
+   "   vec2 tc = mix(src_rect.xy, src_rect.zw, t);\n"                    \
+   "   cvec4 texel = cvec4(textureLod(samp, %s, 0.0));\n"                \
+   "   imageStore(img, %s, cvec4(%s));\n"                                \
+   "}\n"
+
+#define CS_TEXFETCH_COL_GLES CS_HEADER_GLES CS_TEXFETCH_COL_BODY
+
 struct vrend_context;
 struct vrend_resource;
 struct vrend_blit_info;
@@ -186,6 +213,12 @@ void vrend_renderer_blit_gl(ASSERTED struct vrend_context *ctx,
                             struct vrend_resource *src_res,
                             struct vrend_resource *dst_res,
                             const struct vrend_blit_info *info);
+bool vrend_renderer_blit_compute(ASSERTED struct vrend_context *ctx,
+                                 struct vrend_resource *src_res,
+                                 struct vrend_resource *dst_res,
+                                 const struct vrend_blit_info *info);
+/* number of blits done with a compute shader since the last fini */
+unsigned vrend_blitter_compute_blit_count(void);
 void vrend_blitter_fini(void);
 
 #endif
@@ -0,0 +1,241 @@
+/*
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "pipe/p_config.h"
+#include "util/u_cpu_detect.h"
+#include "util/macros.h"
+
+#include "vrend_convert.h"
+#include "virgl_util.h"
+
+#if (defined(PIPE_ARCH_X86) || defined(PIPE_ARCH_X86_64)) && defined(PIPE_CC_GCC)
+#define VREND_CONVERT_X86 1
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON)
+#define VREND_CONVERT_NEON 1
+#include <arm_neon.h>
+#endif
+
+/*
+ * Reference kernels.  These define the results, the vector variants below
+ * only handle the bulk of the data and finish the tail with them.
+ */
+
+static void swap_rb_c(void *data, size_t count)
+{
+   uint8_t *p = data;
+   for (size_t i = 0; i < count; i++, p += 4) {
+      uint8_t r = p[0];
+      p[0] = p[2];
+      p[2] = r;
+   }
+}
+
+static void z24_scale_c(void *data, size_t count, float scale)
+{
+   uint32_t *ival = data;
+   const float myscale = 1.0f / 0xffffff;
+   for (size_t i = 0; i < count; i++) {
+      uint32_t value = ival[i];
+      float d = ((float)(value >> 8) * myscale) * scale;
+      d = CLAMP(d, 0.0f, 1.0f);
+      ival[i] = (uint32_t)(int)(d / myscale) << 8;
+   }
+}
+
+static const struct vrend_convert_funcs convert_c = {
+   .name = "c",
+   .swap_rb = swap_rb_c,
+   .z24_scale = z24_scale_c,
+};
+
+#ifdef VREND_CONVERT_X86
+
+#define SSE2 __attribute__((target("sse2")))
+#define AVX2 __attribute__((target("avx2")))
+
+SSE2 static void swap_rb_sse2(void *data, size_t count)
+{
+   const __m128i ag_mask = _mm_set1_epi32(0xff00ff00);
+   const __m128i rb_mask = _mm_set1_epi32(0x00ff00ff);
+   uint8_t *p = data;
+   size_t i = 0;
+
+   for (; i + 4 <= count; i += 4, p += 16) {
+      __m128i v = _mm_loadu_si128((const __m128i *)p);
+      __m128i ag = _mm_and_si128(v, ag_mask);
+      __m128i rb = _mm_and_si128(v, rb_mask);
+      rb = _mm_or_si128(_mm_slli_epi32(rb, 16), _mm_srli_epi32(rb, 16));
+      _mm_storeu_si128((__m128i *)p, _mm_or_si128(ag, rb));
+   }
+   swap_rb_c(p, count - i);
+}
+
+SSE2 static void z24_scale_sse2(void *data, size_t count, float scale)
+{
+   const __m128 myscale = _mm_set1_ps(1.0f / 0xffffff);
+   const __m128 vscale = _mm_set1_ps(scale);
+   const __m128 zero = _mm_setzero_ps();
+   const __m128 one = _mm_set1_ps(1.0f);
+   uint32_t *p = data;
+   size_t i = 0;
+
+   for (; i + 4 <= count; i += 4) {
+      __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+      __m128 d = _mm_cvtepi32_ps(_mm_srli_epi32(v, 8));
+      d = _mm_mul_ps(_mm_mul_ps(d, myscale), vscale);
+      d = _mm_min_ps(_mm_max_ps(d, zero), one);
+      v = _mm_slli_epi32(_mm_cvttps_epi32(_mm_div_ps(d, myscale)), 8);
+      _mm_storeu_si128((__m128i *)(p + i), v);
+   }
+   z24_scale_c(p + i, count - i, scale);
+}
+
+static const struct vrend_convert_funcs convert_sse2 = {
+   .name = "sse2",
+   .swap_rb = swap_rb_sse2,
+   .z24_scale = z24_scale_sse2,
+};
+
+AVX2 static void swap_rb_avx2(void *data, size_t count)
+{
+   const __m256i shuf = _mm256_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7,
+                                         10, 9, 8, 11, 14, 13, 12, 15,
+                                         2, 1, 0, 3, 6, 5, 4, 7,
+                                         10, 9, 8, 11, 14, 13, 12, 15);
+   uint8_t *p = data;
+   size_t i = 0;
+
+   for (; i + 8 <= count; i += 8, p += 32) {
+      __m256i v = _mm256_loadu_si256((const __m256i *)p);
+      _mm256_storeu_si256((__m256i *)p, _mm256_shuffle_epi8(v, shuf));
+   }
+   swap_rb_sse2(p, count - i);
+}
+
+AVX2 static void z24_scale_avx2(void *data, size_t count, float scale)
+{
+   const __m256 myscale = _mm256_set1_ps(1.0f / 0xffffff);
+   const __m256 vscale = _mm256_set1_ps(scale);
+   const __m256 zero = _mm256_setzero_ps();
+   const __m256 one = _mm256_set1_ps(1.0f);
+   uint32_t *p = data;
+   size_t i = 0;
+
+   for (; i + 8 <= count; i += 8) {
+      __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+      __m256 d = _mm256_cvtepi32_ps(_mm256_srli_epi32(v, 8));
+      d = _mm256_mul_ps(_mm256_mul_ps(d, myscale), vscale);
+      d = _mm256_min_ps(_mm256_max_ps(d, zero), one);
+      v = _mm256_slli_epi32(_mm256_cvttps_epi32(_mm256_div_ps(d, myscale)), 8);
+      _mm256_storeu_si256((__m256i *)(p + i), v);
+   }
+   z24_scale_sse2(p + i, count - i, scale);
+}
+
+static const struct vrend_convert_funcs convert_avx2 = {
+   .name = "avx2",
+   .swap_rb = swap_rb_avx2,
+   .z24_scale = z24_scale_avx2,
+};
+
+#endif /* VREND_CONVERT_X86 */
+
+#ifdef VREND_CONVERT_NEON
+
+static void swap_rb_neon(void *data, size_t count)
+{
+   uint8_t *p = data;
+   size_t i = 0;
+
+   for (; i + 16 <= count; i += 16, p += 64) {
+      uint8x16x4_t v = vld4q_u8(p);
+      uint8x16_t r = v.val[0];
+      v.val[0] = v.val[2];
+      v.val[2] = r;
+      vst4q_u8(p, v);
+   }
+   swap_rb_c(p, count - i);
+}
+
+#ifdef __aarch64__
+/* vdivq_f32 and vmaxnmq_f32 are only available on AArch64 */
+
+static void z24_scale_neon(void *data, size_t count, float scale)
+{
+   const float32x4_t myscale = vdupq_n_f32(1.0f / 0xffffff);
+   const float32x4_t vscale = vdupq_n_f32(scale);
+   const float32x4_t zero = vdupq_n_f32(0.0f);
+   const float32x4_t one = vdupq_n_f32(1.0f);
+   uint32_t *p = data;
+   size_t i = 0;
+
+   for (; i + 4 <= count; i += 4) {
+      float32x4_t d = vcvtq_f32_u32(vshrq_n_u32(vld1q_u32(p + i), 8));
+      d = vmulq_f32(vmulq_f32(d, myscale), vscale);
+      d = vminnmq_f32(vmaxnmq_f32(d, zero), one);
+      uint32x4_t v = vreinterpretq_u32_s32(vcvtq_s32_f32(vdivq_f32(d, myscale)));
+      vst1q_u32(p + i, vshlq_n_u32(v, 8));
+   }
+   z24_scale_c(p + i, count - i, scale);
+}
+
+#else
+#define z24_scale_neon z24_scale_c
+#endif
+
+static const struct vrend_convert_funcs convert_neon = {
+   .name = "neon",
+   .swap_rb = swap_rb_neon,
+   .z24_scale = z24_scale_neon,
+};
+
+#endif /* VREND_CONVERT_NEON */
+
+const struct vrend_convert_funcs *vrend_convert = &convert_c;
+
+const struct vrend_convert_funcs *vrend_convert_get_funcs(enum vrend_convert_isa isa)
+{
+   const struct util_cpu_caps_t *caps;
+
+   util_cpu_detect();
+   caps = util_get_cpu_caps();
+
+   switch (isa) {
+   case VREND_CONVERT_ISA_C:
+      return &convert_c;
+#ifdef VREND_CONVERT_X86
+   case VREND_CONVERT_ISA_SSE2:
+      return caps->has_sse2 ? &convert_sse2 : NULL;
+   case VREND_CONVERT_ISA_AVX2:
+      return caps->has_sse2 && caps->has_avx2 ? &convert_avx2 : NULL;
+#endif
+#ifdef VREND_CONVERT_NEON
+   case VREND_CONVERT_ISA_NEON:
+      return caps->has_neon ? &convert_neon : NULL;
+#endif
+   default:
+      (void)caps;
+      return NULL;
+   }
+}
+
+void vrend_convert_init(void)
+{
+   for (int isa = VREND_CONVERT_ISA_COUNT - 1; isa >= 0; isa--) {
+      const struct vrend_convert_funcs *funcs = vrend_convert_get_funcs(isa);
+      if (funcs) {
+         vrend_convert = funcs;
+         break;
+      }
+   }
+
+   virgl_debug("using %s pixel conversion kernels\n", vrend_convert->name);
+}
@@ -0,0 +1,55 @@
+/*
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef VREND_CONVERT_H
+#define VREND_CONVERT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* CPU pixel conversions used when the host GL cannot convert formats for
+ * us, e.g. BGRA data on GLES or Z24 data on core profiles.  Every kernel
+ * takes a pixel count and accepts unaligned pointers.  The variants are
+ * expected to produce bit-identical results.
+ */
+
+enum vrend_convert_isa {
+   VREND_CONVERT_ISA_C,
+   VREND_CONVERT_ISA_SSE2,
+   VREND_CONVERT_ISA_AVX2,
+   VREND_CONVERT_ISA_NEON,
+   VREND_CONVERT_ISA_COUNT,
+};
+
+struct vrend_convert_funcs {
+   const char *name;
+
+   /* 32bpp RGBA <-> BGRA, in place */
+   void (*swap_rb)(void *data, size_t count);
+   /* rescales the depth bits of Z24X8 values in place, see the transfer
+    * paths for why the guest and host disagree on the scale */
+   void (*z24_scale)(void *data, size_t count, float scale);
+};
+
+/* Selects the fastest kernels the host CPU supports. */
+void vrend_convert_init(void);
+
+/* Returns the kernels for isa, or NULL if they are not built in or the host
+ * CPU does not support them.  Missing kernels fall back to narrower ones.
+ */
+const struct vrend_convert_funcs *vrend_convert_get_funcs(enum vrend_convert_isa isa);
+
+extern const struct vrend_convert_funcs *vrend_convert;
+
+static inline void vrend_convert_swap_rb(void *data, size_t count)
+{
+   vrend_convert->swap_rb(data, count);
+}
+
+static inline void vrend_convert_z24_scale(void *data, size_t count, float scale)
+{
+   vrend_convert->z24_scale(data, count, scale);
+}
+
+#endif /* VREND_CONVERT_H */
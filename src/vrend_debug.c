@@ -95,6 +95,7 @@ static const char *command_names[VIRGL_MAX_COMMANDS] = {
    "DECODE_BITSTREAM",
    "ENCODE_BITSTREAM",
    "END_FRAME",
+   "LINK_SHADER_HINT",
 };
 
 static const char *object_type_names[VIRGL_MAX_OBJECTS] = {
@@ -160,6 +161,7 @@ static const struct debug_named_value vrend_debug_options[] = {
    {"query", dbg_query, "Log queries"},
    {"gles", dbg_gles, "GLES host specific debug"},
    {"bgra", dbg_bgra, "Debug specific to BGRA emulation on GLES hosts"},
+   {"stats", dbg_stats, "Log renderer cache and pool statistics"},
    {"all", dbg_all, "Enable all debugging output"},
    {"guestallow", dbg_allow_guest_override, "Allow the guest to override the debug flags"},
    {"khr", dbg_khr, "Enable debug via KHR_debug extension"},
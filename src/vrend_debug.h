@@ -48,7 +48,8 @@ enum virgl_debug_flags {
    dbg_query =  1 << 11,
    dbg_gles =  1 << 12,
    dbg_bgra = 1 << 13,
-   dbg_all = (1 << 14) - 1,
+   dbg_stats = 1 << 14,
+   dbg_all = (1 << 15) - 1,
    dbg_allow_guest_override = 1 << 16,
    dbg_feature_use = 1 << 17,
    dbg_khr = 1 << 18,
@@ -72,6 +73,29 @@ unsigned vrend_debug(const struct vrend_context *ctx, enum virgl_debug_flags fla
 
 void vrend_debug_add_flag(enum virgl_debug_flags flag);
 
+struct vrend_link_hint_stats {
+   uint64_t queued;
+   uint64_t dropped;
+   uint64_t linked;
+   uint64_t used;
+};
+
+/* Link hint counters of the current sub-context of a virgl context, returns
+ * false if there is no such context. */
+bool vrend_debug_get_link_hint_stats(uint32_t ctx_id,
+                                     struct vrend_link_hint_stats *stats);
+
+struct vrend_lazy_storage_stats {
+   bool enabled;
+   uint64_t deferred;
+   uint64_t materialized;
+   uint64_t never_materialized;
+   uint64_t never_materialized_size;
+};
+
+/* Counters of the textures whose GL storage is allocated on first use. */
+void vrend_debug_get_lazy_storage_stats(struct vrend_lazy_storage_stats *stats);
+
 #ifdef NDEBUG
 #define VREND_DEBUG_ENABLED (false)
 #else
@@ -22,6 +22,7 @@
  *
  **************************************************************************/
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <errno.h>
@@ -36,10 +37,12 @@
 #include "virgl_resource.h"
 #include "vrend_renderer.h"
 #include "vrend_object.h"
+#include "vrend_snapshot.h"
 #include "tgsi/tgsi_text.h"
 #include "vrend_debug.h"
 #include "vrend_tweaks.h"
 #include "virgl_util.h"
+#include "virglrenderer.h"
 
 #ifdef ENABLE_VIDEO
 #include "vrend_video.h"
@@ -48,9 +51,32 @@
 /* decode side */
 #define DECODE_MAX_TOKENS 8000
 
+#define VREND_COPY_BATCH_MAX 64
+
+/* A run of VIRGL_CCMD_RESOURCE_COPY_REGION commands between the same pair
+ * of resource levels that has not been executed yet. */
+struct vrend_copy_batch {
+   uint32_t dst_handle, dst_level;
+   uint32_t src_handle, src_level;
+   uint32_t num_regions;
+   struct vrend_copy_region regions[VREND_COPY_BATCH_MAX];
+};
+
 struct vrend_decode_ctx {
    struct virgl_context base;
    struct vrend_context *grctx;
+
+   bool batch_copies;
+   struct vrend_copy_batch copy_batch;
+
+   /* NULL unless the renderer was initialized with
+    * VIRGL_RENDERER_CONTEXT_SNAPSHOTS */
+   struct vrend_snapshot_journal *journal;
+
+   /* commands of an iovec submit are copied here before they are decoded,
+    * the guest can still write to its pages */
+   uint32_t *cmd_scratch;
+   size_t cmd_scratch_size;
 };
 
 static inline uint32_t get_buf_entry(const uint32_t *buf, uint32_t offset)
@@ -970,34 +996,150 @@ static int vrend_decode_set_min_samples(struct vrend_context *ctx, const uint32_
    return 0;
 }
 
+static void vrend_decode_copy_region_args(const uint32_t *buf,
+                                          uint32_t *dst_handle, uint32_t *dst_level,
+                                          uint32_t *src_handle, uint32_t *src_level,
+                                          struct vrend_copy_region *region)
+{
+   *dst_handle = get_buf_entry(buf, VIRGL_CMD_RCR_DST_RES_HANDLE);
+   *dst_level = get_buf_entry(buf, VIRGL_CMD_RCR_DST_LEVEL);
+   region->dstx = get_buf_entry(buf, VIRGL_CMD_RCR_DST_X);
+   region->dsty = get_buf_entry(buf, VIRGL_CMD_RCR_DST_Y);
+   region->dstz = get_buf_entry(buf, VIRGL_CMD_RCR_DST_Z);
+   *src_handle = get_buf_entry(buf, VIRGL_CMD_RCR_SRC_RES_HANDLE);
+   *src_level = get_buf_entry(buf, VIRGL_CMD_RCR_SRC_LEVEL);
+   region->src_box.x = get_buf_entry(buf, VIRGL_CMD_RCR_SRC_X);
+   region->src_box.y = get_buf_entry(buf, VIRGL_CMD_RCR_SRC_Y);
+   region->src_box.z = get_buf_entry(buf, VIRGL_CMD_RCR_SRC_Z);
+   region->src_box.width = get_buf_entry(buf, VIRGL_CMD_RCR_SRC_W);
+   region->src_box.height = get_buf_entry(buf, VIRGL_CMD_RCR_SRC_H);
+   region->src_box.depth = get_buf_entry(buf, VIRGL_CMD_RCR_SRC_D);
+}
+
 static int vrend_decode_resource_copy_region(struct vrend_context *ctx, const uint32_t *buf, uint32_t length)
 {
-   struct pipe_box box;
+   struct vrend_copy_region region;
+   uint32_t dst_handle, src_handle;
+   uint32_t dst_level, src_level;
+
+   if (length != VIRGL_CMD_RESOURCE_COPY_REGION_SIZE)
+      return EINVAL;
+
+   vrend_decode_copy_region_args(buf, &dst_handle, &dst_level,
+                                 &src_handle, &src_level, &region);
+
+   vrend_renderer_resource_copy_regions(ctx, dst_handle, dst_level,
+                                        src_handle, src_level, &region, 1);
+   return 0;
+}
+
+/* Grow the last region of the batch by the new one if both are adjacent
+ * rows or columns in the source and in the destination. */
+static bool vrend_copy_region_merge(struct vrend_copy_region *last,
+                                    const struct vrend_copy_region *region)
+{
+   struct pipe_box *a = &last->src_box;
+   const struct pipe_box *b = &region->src_box;
+
+   if (a->z != b->z || a->depth != b->depth || last->dstz != region->dstz)
+      return false;
+
+   /* empty or inverted boxes are left for the copy to reject */
+   if (a->width <= 0 || a->height <= 0 || b->width <= 0 || b->height <= 0)
+      return false;
+
+   /* the values come from the guest, add them without overflowing and only
+    * merge into a box that still fits */
+   if (a->y == b->y && a->height == b->height && last->dsty == region->dsty &&
+       (int64_t)a->x + a->width == b->x &&
+       (int64_t)last->dstx + a->width == region->dstx &&
+       (int64_t)a->width + b->width <= INT32_MAX) {
+      a->width += b->width;
+      return true;
+   }
+
+   if (a->x == b->x && a->width == b->width && last->dstx == region->dstx &&
+       (int64_t)a->y + a->height == b->y &&
+       (int64_t)last->dsty + a->height == region->dsty &&
+       (int64_t)a->height + b->height <= INT32_MAX) {
+      a->height += b->height;
+      return true;
+   }
+
+   return false;
+}
+
+static void vrend_decode_flush_copies(struct vrend_decode_ctx *dctx)
+{
+   struct vrend_copy_batch *batch = &dctx->copy_batch;
+
+   if (!batch->num_regions)
+      return;
+
+   VREND_DEBUG(dbg_copy_resource, dctx->grctx, "COPY_REGION: flush batch of %u regions\n",
+               batch->num_regions);
+
+   vrend_renderer_resource_copy_regions(dctx->grctx, batch->dst_handle, batch->dst_level,
+                                        batch->src_handle, batch->src_level,
+                                        batch->regions, batch->num_regions);
+   batch->num_regions = 0;
+}
+
+/* Executes the queued copies, returns non-zero if they left a GL error, in
+ * which case the stream must stop as it would have without batching. */
+static int vrend_decode_flush_copies_checked(struct vrend_decode_ctx *dctx)
+{
+   if (!dctx->copy_batch.num_regions)
+      return 0;
+
+   vrend_decode_flush_copies(dctx);
+   if (!vrend_check_no_error(dctx->grctx)) {
+      virgl_error("context %d failed to dispatch %s: %d\n", dctx->base.ctx_id,
+                  vrend_get_comand_name(VIRGL_CCMD_RESOURCE_COPY_REGION), EINVAL);
+      return EINVAL;
+   }
+   return 0;
+}
+
+static int vrend_decode_queue_copy_region(struct vrend_decode_ctx *dctx,
+                                          const uint32_t *buf, uint32_t length)
+{
+   struct vrend_copy_batch *batch = &dctx->copy_batch;
+   struct vrend_copy_region region;
    uint32_t dst_handle, src_handle;
-   uint32_t dst_level, dstx, dsty, dstz;
-   uint32_t src_level;
+   uint32_t dst_level, src_level;
+   int ret;
 
    if (length != VIRGL_CMD_RESOURCE_COPY_REGION_SIZE)
       return EINVAL;
 
-   dst_handle = get_buf_entry(buf, VIRGL_CMD_RCR_DST_RES_HANDLE);
-   dst_level = get_buf_entry(buf, VIRGL_CMD_RCR_DST_LEVEL);
-   dstx = get_buf_entry(buf, VIRGL_CMD_RCR_DST_X);
-   dsty = get_buf_entry(buf, VIRGL_CMD_RCR_DST_Y);
-   dstz = get_buf_entry(buf, VIRGL_CMD_RCR_DST_Z);
-   src_handle = get_buf_entry(buf, VIRGL_CMD_RCR_SRC_RES_HANDLE);
-   src_level = get_buf_entry(buf, VIRGL_CMD_RCR_SRC_LEVEL);
-   box.x = get_buf_entry(buf, VIRGL_CMD_RCR_SRC_X);
-   box.y = get_buf_entry(buf, VIRGL_CMD_RCR_SRC_Y);
-   box.z = get_buf_entry(buf, VIRGL_CMD_RCR_SRC_Z);
-   box.width = get_buf_entry(buf, VIRGL_CMD_RCR_SRC_W);
-   box.height = get_buf_entry(buf, VIRGL_CMD_RCR_SRC_H);
-   box.depth = get_buf_entry(buf, VIRGL_CMD_RCR_SRC_D);
-
-   vrend_renderer_resource_copy_region(ctx, dst_handle,
-                                       dst_level, dstx, dsty, dstz,
-                                       src_handle, src_level,
-                                       &box);
+   vrend_decode_copy_region_args(buf, &dst_handle, &dst_level,
+                                 &src_handle, &src_level, &region);
+
+   if (batch->num_regions &&
+       (batch->dst_handle != dst_handle || batch->dst_level != dst_level ||
+        batch->src_handle != src_handle || batch->src_level != src_level)) {
+      ret = vrend_decode_flush_copies_checked(dctx);
+      if (ret)
+         return ret;
+   }
+
+   /* a merged copy within one resource could read what the run wrote */
+   if (batch->num_regions && src_handle != dst_handle &&
+       vrend_copy_region_merge(&batch->regions[batch->num_regions - 1], &region))
+      return 0;
+
+   if (batch->num_regions == VREND_COPY_BATCH_MAX) {
+      ret = vrend_decode_flush_copies_checked(dctx);
+      if (ret)
+         return ret;
+   }
+
+   batch->dst_handle = dst_handle;
+   batch->dst_level = dst_level;
+   batch->src_handle = src_handle;
+   batch->src_level = src_level;
+   batch->regions[batch->num_regions++] = region;
    return 0;
 }
 
@@ -1176,6 +1318,29 @@ static int vrend_decode_link_shader(struct vrend_context *ctx, const uint32_t *b
    return 0;
 }
 
+static int vrend_decode_link_shader_hint(struct vrend_context *ctx, const uint32_t *buf, uint32_t length)
+{
+   if (length == 0 || length % VIRGL_LINK_SHADER_HINT_ENTRY_SIZE)
+      return EINVAL;
+
+   uint32_t num_entries = length / VIRGL_LINK_SHADER_HINT_ENTRY_SIZE;
+   if (num_entries > VIRGL_LINK_SHADER_HINT_MAX_ENTRIES)
+      return EINVAL;
+
+   for (uint32_t i = 0; i < num_entries; i++) {
+      uint32_t handles[PIPE_SHADER_TYPES];
+      handles[PIPE_SHADER_VERTEX] = get_buf_entry(buf, VIRGL_LINK_SHADER_HINT_VERTEX_HANDLE(i));
+      handles[PIPE_SHADER_FRAGMENT] = get_buf_entry(buf, VIRGL_LINK_SHADER_HINT_FRAGMENT_HANDLE(i));
+      handles[PIPE_SHADER_GEOMETRY] = get_buf_entry(buf, VIRGL_LINK_SHADER_HINT_GEOMETRY_HANDLE(i));
+      handles[PIPE_SHADER_TESS_CTRL] = get_buf_entry(buf, VIRGL_LINK_SHADER_HINT_TESS_CTRL_HANDLE(i));
+      handles[PIPE_SHADER_TESS_EVAL] = get_buf_entry(buf, VIRGL_LINK_SHADER_HINT_TESS_EVAL_HANDLE(i));
+      handles[PIPE_SHADER_COMPUTE] = 0;
+
+      vrend_link_program_hint(ctx, handles);
+   }
+   return 0;
+}
+
 static int vrend_decode_bind_shader(struct vrend_context *ctx, const uint32_t *buf, uint32_t length)
 {
    uint32_t handle, type;
@@ -1529,8 +1694,22 @@ struct virgl_context *vrend_renderer_context_create(uint32_t handle,
 
    vrend_decode_ctx_init_base(dctx, handle);
 
+   dctx->batch_copies = !getenv("VIRGL_NO_COPY_BATCHING");
+   dctx->copy_batch.num_regions = 0;
+
+   dctx->journal = NULL;
+   if (vrend_renderer_use_snapshots()) {
+      dctx->journal = vrend_snapshot_journal_create();
+      if (!dctx->journal) {
+         free(dctx);
+         return NULL;
+      }
+   }
+
    dctx->grctx = vrend_create_context(handle, nlen, debug_name);
    if (!dctx->grctx) {
+      if (dctx->journal)
+         vrend_snapshot_journal_destroy(dctx->journal);
       free(dctx);
       return NULL;
    }
@@ -1548,6 +1727,9 @@ static void vrend_decode_ctx_destroy(struct virgl_context *ctx)
    struct vrend_decode_ctx *dctx = (struct vrend_decode_ctx *)ctx;
 
    vrend_destroy_context(dctx->grctx);
+   if (dctx->journal)
+      vrend_snapshot_journal_destroy(dctx->journal);
+   free(dctx->cmd_scratch);
    free(dctx);
 }
 
@@ -1877,6 +2059,7 @@ static const vrend_decode_callback decode_table[VIRGL_MAX_COMMANDS] = {
    [VIRGL_CCMD_GET_MEMORY_INFO] = vrend_decode_get_memory_info,
    [VIRGL_CCMD_SEND_STRING_MARKER] = vrend_decode_send_string_marker,
    [VIRGL_CCMD_LINK_SHADER] = vrend_decode_link_shader,
+   [VIRGL_CCMD_LINK_SHADER_HINT] = vrend_decode_link_shader_hint,
 #ifdef ENABLE_VIDEO
    [VIRGL_CCMD_CREATE_VIDEO_CODEC] = vrend_decode_create_video_codec,
    [VIRGL_CCMD_DESTROY_VIDEO_CODEC] = vrend_decode_destroy_video_codec,
@@ -1900,6 +2083,63 @@ static const vrend_decode_callback decode_table[VIRGL_MAX_COMMANDS] = {
 #endif
 };
 
+/* Dispatches the command cmd at buf, of len dwords after the header,
+ * returns non-zero if the context should stop processing the stream.  The
+ * caller has checked cmd against VIRGL_MAX_COMMANDS. */
+static int vrend_decode_ctx_dispatch(struct vrend_decode_ctx *gdctx,
+                                     const uint32_t *buf,
+                                     uint32_t cmd,
+                                     uint32_t len,
+                                     uint32_t cur_offset)
+{
+   int ret;
+
+   VREND_DEBUG(dbg_cmd, gdctx->grctx, "%-4d %-20s len:%d\n",
+               cur_offset, vrend_get_comand_name(cmd), len);
+
+   TRACE_SCOPE_SLOW(vrend_get_comand_name(cmd));
+
+   /* Copies are queued so that runs between the same resources can be
+    * merged, any other command executes the queued ones first. */
+   if (cmd == VIRGL_CCMD_RESOURCE_COPY_REGION && gdctx->batch_copies) {
+      ret = vrend_decode_queue_copy_region(gdctx, buf, len);
+   } else {
+      ret = vrend_decode_flush_copies_checked(gdctx);
+      if (ret)
+         return ret;
+      ret = decode_table[cmd](gdctx->grctx, buf, len);
+   }
+   if (!vrend_check_no_error(gdctx->grctx) && !ret)
+      ret = EINVAL;
+   if (ret) {
+      virgl_error("context %d failed to dispatch %s: %d\n",
+            gdctx->base.ctx_id, vrend_get_comand_name(cmd), ret);
+      if (ret == EINVAL)
+         vrend_report_buffer_error(gdctx->grctx, *buf);
+      /* the copies queued before the failing command were valid and would
+       * have been executed without batching */
+      vrend_decode_flush_copies(gdctx);
+      return ret;
+   }
+
+   if (gdctx->journal)
+      vrend_snapshot_journal_record(gdctx->journal, buf, len);
+
+   return 0;
+}
+
+static int vrend_decode_ctx_end_submit(struct vrend_decode_ctx *gdctx)
+{
+   int ret = vrend_decode_flush_copies_checked(gdctx);
+   if (ret)
+      return ret;
+
+   /* the commands of the submit are queued, link what the guest said it
+    * is going to draw with next while the GPU is busy with them */
+   vrend_renderer_process_link_hints(gdctx->grctx);
+   return 0;
+}
+
 static int vrend_decode_ctx_submit_cmd(struct virgl_context *ctx,
                                        const void *buffer,
                                        size_t size)
@@ -1928,30 +2168,201 @@ static int vrend_decode_ctx_submit_cmd(struct virgl_context *ctx,
 
       buf_offset += len + 1;
 
-      ret = 0;
       /* check if the guest is doing something bad */
       if (buf_offset > buf_total) {
          vrend_report_buffer_error(gdctx->grctx, 0);
          break;
       }
 
-      VREND_DEBUG(dbg_cmd, gdctx->grctx, "%-4d %-20s len:%d\n",
-                  cur_offset, vrend_get_comand_name(cmd), len);
+      ret = vrend_decode_ctx_dispatch(gdctx, buf, cmd, len, cur_offset);
+      if (ret)
+         return ret;
+   }
 
-      TRACE_SCOPE_SLOW(vrend_get_comand_name(cmd));
+   return vrend_decode_ctx_end_submit(gdctx);
+}
 
-      ret = decode_table[cmd](gdctx->grctx, buf, len);
-      if (!vrend_check_no_error(gdctx->grctx) && !ret)
-         ret = EINVAL;
-      if (ret) {
-         virgl_error("context %d failed to dispatch %s: %d\n",
-               gdctx->base.ctx_id, vrend_get_comand_name(cmd), ret);
-         if (ret == EINVAL)
-            vrend_report_buffer_error(gdctx->grctx, *buf);
-         return ret;
+struct vrend_decode_iov_cursor {
+   const struct iovec *iov;
+   unsigned int num_iovs;
+   unsigned int index;
+   /* offset in iov[index] */
+   size_t offset;
+};
+
+/* Moves the cursor past the iovecs that it has consumed entirely. */
+static void vrend_decode_iov_normalize(struct vrend_decode_iov_cursor *cursor)
+{
+   while (cursor->offset == cursor->iov[cursor->index].iov_len) {
+      cursor->index++;
+      cursor->offset = 0;
+   }
+}
+
+/* Copies the next size bytes of the stream to dst without consuming them.
+ * The caller makes sure that there are enough bytes left. */
+static void vrend_decode_iov_copy(struct vrend_decode_iov_cursor *cursor,
+                                  void *dst, size_t size)
+{
+   vrend_decode_iov_normalize(cursor);
+   vrend_read_from_iovec(&cursor->iov[cursor->index], cursor->num_iovs - cursor->index,
+                         cursor->offset, dst, size);
+}
+
+/* Returns the next size bytes of the stream without consuming them.  They
+ * are decoded in place when they lie within one iovec, only a command that
+ * straddles an iovec boundary, or that is not dword aligned, is reassembled
+ * in the scratch buffer. */
+static const uint32_t *vrend_decode_iov_get(struct vrend_decode_ctx *gdctx,
+                                            struct vrend_decode_iov_cursor *cursor,
+                                            size_t size)
+{
+   vrend_decode_iov_normalize(cursor);
+
+   const struct iovec *iov = &cursor->iov[cursor->index];
+   const char *ptr = (const char *)iov->iov_base + cursor->offset;
+   if (iov->iov_len - cursor->offset >= size && !((uintptr_t)ptr % sizeof(uint32_t)))
+      return (const uint32_t *)ptr;
+
+   if (size > gdctx->cmd_scratch_size) {
+      uint32_t *scratch = realloc(gdctx->cmd_scratch, size);
+      if (!scratch)
+         return NULL;
+      gdctx->cmd_scratch = scratch;
+      gdctx->cmd_scratch_size = size;
+   }
+
+   vrend_decode_iov_copy(cursor, gdctx->cmd_scratch, size);
+   return gdctx->cmd_scratch;
+}
+
+static void vrend_decode_iov_skip(struct vrend_decode_iov_cursor *cursor,
+                                  size_t size)
+{
+   while (size) {
+      const size_t avail = cursor->iov[cursor->index].iov_len - cursor->offset;
+
+      if (size < avail) {
+         cursor->offset += size;
+         return;
       }
+
+      size -= avail;
+      cursor->index++;
+      cursor->offset = 0;
    }
-   return 0;
+}
+
+/* Same as vrend_decode_ctx_submit_cmd, but decodes the commands from the
+ * guest pages, so that the VMM does not have to copy the stream into a
+ * contiguous buffer first.  The guest may keep writing to them meanwhile.
+ * The command id and length are only taken from a copy of the header, so
+ * that can't make the dispatch go out of bounds, and the payload is guest
+ * input that the decoders check like any other. */
+static int vrend_decode_ctx_submit_cmd_iov(struct virgl_context *ctx,
+                                           const struct iovec *iov,
+                                           unsigned int num_iovs)
+{
+   TRACE_FUNC();
+   struct vrend_decode_ctx *gdctx = (struct vrend_decode_ctx *)ctx;
+   int ret;
+
+   if (!vrend_hw_switch_context(gdctx->grctx, true))
+      return EINVAL;
+
+   const size_t size = vrend_get_iovec_size(iov, num_iovs);
+   if (size / sizeof(uint32_t) > UINT32_MAX)
+      return EINVAL;
+
+   struct vrend_decode_iov_cursor cursor = {
+      .iov = iov,
+      .num_iovs = num_iovs,
+   };
+   const uint32_t buf_total = (uint32_t)(size / sizeof(uint32_t));
+   uint32_t buf_offset = 0;
+
+   while (buf_offset < buf_total) {
+      const uint32_t cur_offset = buf_offset;
+      uint32_t header;
+      vrend_decode_iov_copy(&cursor, &header, sizeof(header));
+
+      uint32_t len = header >> 16;
+      uint32_t cmd = header & 0xff;
+
+      if (cmd >= VIRGL_MAX_COMMANDS)
+         return EINVAL;
+
+      buf_offset += len + 1;
+
+      /* check if the guest is doing something bad */
+      if (buf_offset > buf_total) {
+         vrend_report_buffer_error(gdctx->grctx, 0);
+         break;
+      }
+
+      const size_t cmd_size = (len + 1) * sizeof(uint32_t);
+      const uint32_t *buf = vrend_decode_iov_get(gdctx, &cursor, cmd_size);
+      if (!buf)
+         return ENOMEM;
+
+      ret = vrend_decode_ctx_dispatch(gdctx, buf, cmd, len, cur_offset);
+      if (ret)
+         return ret;
+
+      vrend_decode_iov_skip(&cursor, cmd_size);
+   }
+
+   return vrend_decode_ctx_end_submit(gdctx);
+}
+
+static int vrend_decode_ctx_snapshot(struct virgl_context *ctx,
+                                     uint32_t flags,
+                                     void **data,
+                                     size_t *size)
+{
+   TRACE_FUNC();
+   struct vrend_decode_ctx *dctx = (struct vrend_decode_ctx *)ctx;
+
+   if (!dctx->journal)
+      return -ENOTSUP;
+
+   return vrend_snapshot_save(dctx->journal, dctx->grctx,
+                              flags & VIRGL_RENDERER_SNAPSHOT_INCREMENTAL,
+                              data, size);
+}
+
+static int vrend_decode_ctx_restore(struct virgl_context *ctx,
+                                    const void *data,
+                                    size_t size)
+{
+   TRACE_FUNC();
+   struct vrend_decode_ctx *dctx = (struct vrend_decode_ctx *)ctx;
+   uint32_t *cmds;
+   uint32_t num_dwords;
+   int ret;
+
+   if (!dctx->journal)
+      return -ENOTSUP;
+
+   ret = vrend_snapshot_get_commands(data, size, &cmds, &num_dwords);
+   if (ret)
+      return ret;
+
+   if (!vrend_hw_switch_context(dctx->grctx, true)) {
+      free(cmds);
+      return -EINVAL;
+   }
+
+   /* the journal is rebuilt as the commands are replayed */
+   vrend_renderer_reset_sub_ctxs(dctx->grctx);
+   vrend_snapshot_journal_reset(dctx->journal);
+
+   ret = vrend_decode_ctx_submit_cmd(ctx, cmds, num_dwords * sizeof(uint32_t));
+   free(cmds);
+   if (ret)
+      return -ret;
+
+   return vrend_snapshot_restore_resources(dctx->journal, dctx->grctx, data, size);
 }
 
 static int vrend_decode_ctx_get_fencing_fd(UNUSED struct virgl_context *ctx)
@@ -1992,8 +2403,24 @@ static void vrend_decode_ctx_init_base(struct vrend_decode_ctx *dctx,
    ctx->transfer_3d = vrend_decode_ctx_transfer_3d;
    ctx->get_blob = vrend_decode_ctx_get_blob;
    ctx->submit_cmd = vrend_decode_ctx_submit_cmd;
+   ctx->submit_cmd_iov = vrend_decode_ctx_submit_cmd_iov;
+   ctx->snapshot = vrend_decode_ctx_snapshot;
+   ctx->restore = vrend_decode_ctx_restore;
 
    ctx->get_fencing_fd = vrend_decode_ctx_get_fencing_fd;
    ctx->retire_fences = vrend_decode_ctx_retire_fences;
    ctx->submit_fence = vrend_decode_ctx_submit_fence;
 }
+
+bool vrend_debug_get_link_hint_stats(uint32_t ctx_id,
+                                     struct vrend_link_hint_stats *stats)
+{
+   struct virgl_context *ctx = virgl_context_lookup(ctx_id);
+
+   if (!ctx || ctx->destroy != vrend_decode_ctx_destroy)
+      return false;
+
+   struct vrend_decode_ctx *dctx = (struct vrend_decode_ctx *)ctx;
+   vrend_renderer_get_link_hint_stats(dctx->grctx, stats);
+   return true;
+}
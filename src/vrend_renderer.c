@@ -28,6 +28,7 @@
 #include <unistd.h>
 #include <stdatomic.h>
 #include <stdio.h>
+#include <inttypes.h>
 #include <errno.h>
 #include "pipe/p_shader_tokens.h"
 
@@ -38,6 +39,7 @@
 #include "util/u_memory.h"
 #include "util/u_dual_blend.h"
 #include "util/hash_table.h"
+#include "util/u_hash_table.h"
 #include "util/ralloc.h"
 
 #include "util/u_thread.h"
@@ -51,6 +53,8 @@
 #include "vrend_blitter.h"
 #include "vrend_debug.h"
 #include "vrend_winsys.h"
+#include "vrend_convert.h"
+#include "vrend_upload.h"
 #include "vrend_blitter.h"
 
 #include "virgl_util.h"
@@ -92,6 +96,20 @@ static const uint32_t fake_occlusion_query_samples_passed_default = 1024;
 
 const struct vrend_if_cbs *vrend_clicbs;
 
+/* The fences of a context retire in order, so a use of a resource by the
+ * context is done once the next fence the context creates has retired.
+ * Uses are stamped with the epoch of that fence.  Resources hold a
+ * reference to the timeline of their last use, as they can outlive the
+ * context.
+ */
+struct vrend_fence_timeline {
+   uint32_t refcount;
+   /* epoch of the next fence of the context */
+   uint64_t epoch;
+   uint64_t used_epoch;
+   uint64_t retired_epoch;
+};
+
 struct vrend_fence {
    /* When the sync thread is waiting on the fence and the main thread
     * destroys the context, ctx is set to NULL.  Otherwise, ctx is always
@@ -100,6 +118,9 @@ struct vrend_fence {
    struct vrend_context *ctx;
    uint32_t flags;
    uint64_t fence_id;
+   uint64_t residency_epoch;
+   /* video frame that must complete before the fence retires */
+   uint64_t video_frame;
 
    union {
       GLsync glsyncobj;
@@ -392,8 +413,78 @@ struct global_renderer_state {
    bool use_egl_fence : 1;
 #endif
    bool d3d_share_texture : 1;
+   /* contexts journal their state for snapshots */
+   bool use_snapshots : 1;
+   /* shader constants are read from a uniform block in a ring buffer */
+   bool use_const_ubo : 1;
+   uint32_t const_ubo_alignment;
+
+   /* GL contexts of destroyed sub-contexts, kept for reuse */
+   struct list_head gl_context_pool;
+   uint32_t gl_context_pool_count;
+   uint32_t gl_context_pool_max;
+
+   /* VREND_TWEAK, parsed once */
+   struct vrend_context_tweaks env_tweaks;
+
+   struct {
+      uint64_t created;
+      uint64_t created_ns;
+      uint64_t reused;
+      uint64_t reused_ns;
+   } sub_ctx_stats;
+
+   /* Textures in least recently used order.  A texture counts as idle once
+    * the fence covering its last use has retired, see vrend_fence_timeline.
+    */
+   struct {
+      uint64_t budget;
+      uint64_t resident_size;
+      struct list_head lru;
+   } residency;
+
+   /* Destroyed resources whose GL objects are only deleted once the GPU is
+    * done with them, so that the driver does not have to synchronize with
+    * the GPU when a guest frees a resource that is still in use.  Uses of
+    * resources are stamped while the queue is enabled, and the queue holds
+    * at most limit bytes.
+    */
+   struct {
+      uint64_t limit;
+      uint64_t size;
+      struct list_head list;
+   } destroy_queue;
+
+   /* textures whose GL storage is allocated on first use */
+   struct vrend_lazy_storage_stats lazy_storage;
+
+   /* bumped on every resource write, see vrend_resource_mark_written */
+   uint64_t resource_write_seq;
+};
+
+/* A GL context parked by vrend_destroy_sub_context together with the
+ * objects that every sub-context creates.  The GL state that vrend only
+ * emits on change travels with its shadow copy, so the next sub-context
+ * starts out with shadow state matching the GL context. */
+struct vrend_pooled_gl_context {
+   struct list_head head;
+
+   virgl_gl_context gl_context;
+   GLuint vaoid;
+   GLuint fb_id;
+   GLuint blit_fb_ids[2];
+
+   struct pipe_rasterizer_state hw_rs_state;
+   struct pipe_blend_state hw_blend_state;
+   bool depth_test_enabled;
+   bool alpha_test_enabled;
+   bool stencil_test_enabled;
+   bool framebuffer_srgb_enabled;
 };
 
+#define VREND_GL_CONTEXT_POOL_DEFAULT_SIZE 4
+#define VREND_FB_CACHE_SIZE 16
+
 struct sysval_uniform_block {
    GLfloat clipp[VIRGL_NUM_CLIP_PLANES][4];
    GLuint stipple_pattern[VREND_POLYGON_STIPPLE_SIZE][4];
@@ -405,6 +496,14 @@ struct sysval_uniform_block {
 
 static struct global_renderer_state vrend_state;
 
+/* Called whenever the GPU or a transfer may write to a resource, so that
+ * incremental snapshots know which resources changed. */
+static inline void vrend_resource_mark_written(struct vrend_resource *res)
+{
+   if (res)
+      res->write_seq = ++vrend_state.resource_write_seq;
+}
+
 static inline bool has_feature(enum features_id feature_id)
 {
    int slot = feature_id / 64;
@@ -452,6 +551,7 @@ struct vrend_linked_shader_program {
    GLuint *shadow_samp_add_locs[PIPE_SHADER_TYPES];
 
    GLint const_location[PIPE_SHADER_TYPES];
+   GLint const_ubo_bind[PIPE_SHADER_TYPES];
 
    GLuint *attrib_locs;
    uint32_t shadow_samp_mask[PIPE_SHADER_TYPES];
@@ -473,6 +573,9 @@ struct vrend_linked_shader_program {
    uint32_t gles_use_query_texturelevel_mask;
 
    bool reads_drawid;
+
+   /* linked from a guest hint and not drawn with yet */
+   bool hinted;
 };
 
 struct vrend_shader {
@@ -525,6 +628,21 @@ struct vrend_surface {
    struct vrend_resource *texture;
 };
 
+/* A framebuffer object with a fixed set of attachments.  The entry holds a
+ * reference on each attached surface, so the surface pointers are a stable
+ * key for as long as the entry lives.
+ */
+struct vrend_fb_cache_entry {
+   struct list_head head;
+   GLuint id;
+   GLenum status;
+   /* one of the surfaces was destroyed while the entry was bound */
+   bool stale;
+   int nr_cbufs;
+   struct vrend_surface *zsurf;
+   struct vrend_surface *surf[PIPE_MAX_COLOR_BUFS];
+};
+
 struct vrend_sampler_state {
    struct pipe_sampler_state base;
    struct vrend_sub_context *sub_ctx;
@@ -611,6 +729,24 @@ struct vrend_constants {
    unsigned int *consts;
    uint32_t num_consts;
    uint32_t num_allocated_consts;
+   /* one past the last vec4 changed since the last upload */
+   uint32_t dirty_end;
+};
+
+/* Constant uploads for shaders that read their constants from a uniform
+ * block are written into a persistently mapped ring.  The ring is split into
+ * segments, each fenced when the writer leaves it and waited for before it
+ * is written again. */
+#define VREND_CONST_RING_SIZE (1024 * 1024)
+#define VREND_CONST_RING_SEGMENTS 4
+#define VREND_CONST_RING_SEGMENT_SIZE (VREND_CONST_RING_SIZE / VREND_CONST_RING_SEGMENTS)
+
+struct vrend_const_ring {
+   GLuint id;
+   uint8_t *map;
+   uint32_t offset;
+   uint32_t segment;
+   GLsync fences[VREND_CONST_RING_SEGMENTS];
 };
 
 struct vrend_shader_view {
@@ -626,16 +762,32 @@ struct vrend_viewport {
    GLclampd near_val, far_val;
 };
 
+struct vrend_streamout_key {
+   uint32_t num_targets;
+   uint32_t handles[16];
+};
+
 /* create a streamout object to support pause/resume */
 struct vrend_streamout_object {
+   struct vrend_streamout_key key;
    GLuint id;
-   uint32_t num_targets;
-   uint32_t handles[16];
    struct list_head head;
    int xfb_state;
    struct vrend_so_target *so_targets[16];
 };
 
+#define VREND_STREAMOUT_CACHE_SIZE 32
+
+struct vrend_link_hint {
+   struct list_head head;
+   uint32_t handles[PIPE_SHADER_TYPES];
+};
+
+/* pending hints beyond this are dropped, and a submit links at most a few
+ * of them so that it doesn't delay the next one too much */
+#define VREND_LINK_HINT_MAX_PENDING 256
+#define VREND_LINK_HINTS_PER_SUBMIT 8
+
 #define XFB_STATE_OFF 0
 #define XFB_STATE_STARTED_NEED_BEGIN 1
 #define XFB_STATE_STARTED 2
@@ -691,6 +843,7 @@ struct vrend_sub_context {
 
    struct vrend_constants consts[PIPE_SHADER_TYPES];
    bool const_dirty[PIPE_SHADER_TYPES];
+   struct vrend_const_ring const_ring;
    struct vrend_sampler_state *sampler_state[PIPE_SHADER_TYPES][PIPE_MAX_SAMPLERS];
 
    struct pipe_constant_buffer cbs[PIPE_SHADER_TYPES][PIPE_MAX_CONSTANT_BUFFERS];
@@ -703,7 +856,13 @@ struct vrend_sub_context {
    int32_t texture_levels[PIPE_SHADER_TYPES][PIPE_MAX_SAMPLERS];
    int32_t n_samplers[PIPE_SHADER_TYPES];
 
+   /* fb_id has no attachments and is owned by the sub-context, any other
+    * attachment set is bound from fb_cache (most recently used first) */
    uint32_t fb_id;
+   GLuint cur_fb_id;
+   struct vrend_fb_cache_entry *cur_fb;
+   struct list_head fb_cache;
+   uint32_t fb_cache_count;
    int nr_cbufs;
    struct vrend_surface *zsurf;
    struct vrend_surface *surf[PIPE_MAX_COLOR_BUFS];
@@ -748,8 +907,23 @@ struct vrend_sub_context {
    struct pipe_rasterizer_state hw_rs_state;
    struct pipe_blend_state hw_blend_state;
 
+   /* streamout objects by target handles, most recently bound first */
+   struct hash_table *streamout_cache;
    struct list_head streamout_list;
+   uint32_t streamout_count;
    struct vrend_streamout_object *current_so;
+   struct {
+      uint64_t hits;
+      uint64_t misses;
+      uint64_t evictions;
+   } streamout_stats;
+
+   /* shader combinations the guest is about to use, linked at the end of
+    * the submit */
+   struct list_head link_hints;
+   uint32_t link_hint_count;
+   bool linking_hint;
+   struct vrend_link_hint_stats link_hint_stats;
 
    struct pipe_blend_color blend_color;
 
@@ -797,6 +971,8 @@ struct vrend_context {
    struct vrend_sub_context *sub;
    struct vrend_sub_context *sub0;
 
+   struct vrend_fence_timeline *timeline;
+
    int ctx_id;
    /* has this ctx gotten an error? */
    bool in_error;
@@ -863,6 +1039,8 @@ void vrend_update_stencil_state(struct vrend_sub_context *sub_ctx);
 static struct vrend_format_table tex_conv_table[VIRGL_FORMAT_MAX_EXTENDED] =  {0};
 
 static uint32_t vrend_renderer_get_video_memory(void);
+static uint32_t vrend_get_texture_depth(struct vrend_resource *res, uint32_t level);
+static void vrend_destroy_queue_reclaim(bool idle);
 
 static inline bool vrend_format_can_sample(enum virgl_formats format)
 {
@@ -1631,7 +1809,9 @@ static int bind_sampler_locs(struct vrend_linked_shader_program *sprog,
 static void bind_const_locs(struct vrend_linked_shader_program *sprog,
                             enum pipe_shader_type shader_type)
 {
-  if (sprog->ss[shader_type]->sel->sinfo.num_consts) {
+  const struct vrend_shader_info *sinfo = &sprog->ss[shader_type]->sel->sinfo;
+
+  if (sinfo->num_consts && !sinfo->consts_in_ubo) {
      char name[32];
      snprintf(name, 32, "%sconst0", pipe_shader_to_prefix(shader_type));
      sprog->const_location[shader_type] = vrend_get_uniform_location(sprog, name,
@@ -1687,6 +1867,19 @@ static int bind_ubo_locs(struct vrend_linked_shader_program *sprog,
       }
    }
 
+   sprog->const_ubo_bind[shader_type] = -1;
+   if (sinfo->consts_in_ubo) {
+      char name[32];
+      snprintf(name, 32, "%sVirglConsts", pipe_shader_to_prefix(shader_type));
+
+      /* the block may have been optimized out */
+      GLuint loc = vrend_get_uniform_block_index(sprog, name, shader_type);
+      if (loc != GL_INVALID_INDEX) {
+         vrend_uniform_block_binding(sprog, shader_type, loc, next_ubo_id);
+         sprog->const_ubo_bind[shader_type] = next_ubo_id++;
+      }
+   }
+
    sprog->ubo_used_mask[shader_type] = sinfo->ubo_used_mask;
 
    return next_ubo_id;
@@ -2104,9 +2297,16 @@ static struct vrend_linked_shader_program *add_shader_program(struct vrend_sub_c
    sprog->virgl_block_bind = -1;
    sprog->ubo_sysval_buffer_id = -1;
    sprog->sysvalue_data_cookie = UINT32_MAX;
+   for (int i = 0; i < PIPE_SHADER_TYPES; i++)
+      sprog->const_ubo_bind[i] = -1;
 
    vrend_use_program(sub_ctx, sprog);
 
+   if (sub_ctx->linking_hint) {
+      sprog->hinted = true;
+      sub_ctx->link_hint_stats.linked++;
+   }
+
    for (enum pipe_shader_type shader_type = PIPE_SHADER_VERTEX;
         shader_type <= last_shader;
         shader_type++) {
@@ -2234,17 +2434,60 @@ static void vrend_free_programs(struct vrend_sub_context *sub)
    }
 }
 
-static void vrend_destroy_streamout_object(struct vrend_streamout_object *obj)
+static uint32_t vrend_streamout_key_hash(const void *key)
+{
+   const struct vrend_streamout_key *so_key = key;
+
+   return _mesa_hash_data(so_key, sizeof(so_key->num_targets) +
+                          so_key->num_targets * sizeof(so_key->handles[0]));
+}
+
+static bool vrend_streamout_key_equal(const void *key1, const void *key2)
+{
+   const struct vrend_streamout_key *a = key1, *b = key2;
+
+   return a->num_targets == b->num_targets &&
+          !memcmp(a->handles, b->handles, a->num_targets * sizeof(a->handles[0]));
+}
+
+/* Drop the object from the cache and release its targets, the GL object is
+ * left to the caller. */
+static void vrend_streamout_object_release(struct vrend_sub_context *sub_ctx,
+                                           struct vrend_streamout_object *obj)
 {
    unsigned i;
+
+   _mesa_hash_table_remove_key(sub_ctx->streamout_cache, &obj->key);
    list_del(&obj->head);
-   for (i = 0; i < obj->num_targets; i++)
+   sub_ctx->streamout_count--;
+   for (i = 0; i < obj->key.num_targets; i++)
       vrend_so_target_reference(&obj->so_targets[i], NULL);
+}
+
+static void vrend_destroy_streamout_object(struct vrend_sub_context *sub_ctx,
+                                           struct vrend_streamout_object *obj)
+{
+   vrend_streamout_object_release(sub_ctx, obj);
    if (has_feature(feat_transform_feedback2))
       glDeleteTransformFeedbacks(1, &obj->id);
    FREE(obj);
 }
 
+/* A paused object still has transform feedback active, end it before the
+ * object goes away. */
+static void vrend_streamout_object_end(struct vrend_sub_context *sub_ctx,
+                                       struct vrend_streamout_object *obj)
+{
+   if (obj->xfb_state != XFB_STATE_PAUSED)
+      return;
+
+   if (has_feature(feat_transform_feedback2))
+      glBindTransformFeedback(GL_TRANSFORM_FEEDBACK, obj->id);
+   glEndTransformFeedback();
+   if (sub_ctx->current_so && has_feature(feat_transform_feedback2))
+      glBindTransformFeedback(GL_TRANSFORM_FEEDBACK, sub_ctx->current_so->id);
+}
+
 void vrend_sync_make_current(virgl_gl_context gl_cxt) {
    GLsync sync = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
    vrend_clicbs->make_current(gl_cxt);
@@ -2393,7 +2636,7 @@ static void vrend_destroy_so_target_object(void *obj_ptr)
 
    LIST_FOR_EACH_ENTRY_SAFE(obj, tmp, &sub_ctx->streamout_list, head) {
       found = false;
-      for (i = 0; i < obj->num_targets; i++) {
+      for (i = 0; i < obj->key.num_targets; i++) {
          if (obj->so_targets[i] == target) {
             found = true;
             break;
@@ -2402,14 +2645,8 @@ static void vrend_destroy_so_target_object(void *obj_ptr)
       if (found) {
          if (obj == sub_ctx->current_so)
             sub_ctx->current_so = NULL;
-         if (obj->xfb_state == XFB_STATE_PAUSED) {
-               if (has_feature(feat_transform_feedback2))
-                  glBindTransformFeedback(GL_TRANSFORM_FEEDBACK, obj->id);
-               glEndTransformFeedback();
-            if (sub_ctx->current_so && has_feature(feat_transform_feedback2))
-               glBindTransformFeedback(GL_TRANSFORM_FEEDBACK, sub_ctx->current_so->id);
-         }
-         vrend_destroy_streamout_object(obj);
+         vrend_streamout_object_end(sub_ctx, obj);
+         vrend_destroy_streamout_object(sub_ctx, obj);
       }
    }
 
@@ -3002,7 +3239,7 @@ static void vrend_hw_set_color_surface(struct vrend_sub_context *sub_ctx, int in
    }
 }
 
-static void vrend_hw_emit_framebuffer_state(struct vrend_sub_context *sub_ctx)
+static void vrend_hw_emit_draw_buffers(struct vrend_sub_context *sub_ctx)
 {
    static const GLenum buffers[8] = {
       GL_COLOR_ATTACHMENT0,
@@ -3015,8 +3252,14 @@ static void vrend_hw_emit_framebuffer_state(struct vrend_sub_context *sub_ctx)
       GL_COLOR_ATTACHMENT7,
    };
 
-   if (sub_ctx->nr_cbufs == 0) {
+   if (sub_ctx->nr_cbufs == 0)
       glReadBuffer(GL_NONE);
+   glDrawBuffers(sub_ctx->nr_cbufs, buffers);
+}
+
+static void vrend_hw_emit_framebuffer_state(struct vrend_sub_context *sub_ctx)
+{
+   if (sub_ctx->nr_cbufs == 0) {
       if (has_feature(feat_srgb_write_control)) {
          glDisable(GL_FRAMEBUFFER_SRGB_EXT);
          sub_ctx->framebuffer_srgb_enabled = false;
@@ -3070,8 +3313,148 @@ static void vrend_hw_emit_framebuffer_state(struct vrend_sub_context *sub_ctx)
          sub_ctx->needs_manual_srgb_encode_bitmask |= 1 << i;
       }
    }
+}
 
-   glDrawBuffers(sub_ctx->nr_cbufs, buffers);
+static void vrend_fb_cache_entry_destroy(struct vrend_sub_context *sub_ctx,
+                                         struct vrend_fb_cache_entry *entry)
+{
+   glDeleteFramebuffers(1, &entry->id);
+   vrend_surface_reference(&entry->zsurf, NULL);
+   for (int i = 0; i < entry->nr_cbufs; i++)
+      vrend_surface_reference(&entry->surf[i], NULL);
+
+   list_del(&entry->head);
+   sub_ctx->fb_cache_count--;
+   FREE(entry);
+}
+
+static void vrend_fb_cache_fini(struct vrend_sub_context *sub_ctx)
+{
+   struct vrend_fb_cache_entry *entry, *tmp;
+
+   glBindFramebuffer(GL_FRAMEBUFFER, sub_ctx->fb_id);
+   sub_ctx->cur_fb_id = sub_ctx->fb_id;
+   sub_ctx->cur_fb = NULL;
+
+   LIST_FOR_EACH_ENTRY_SAFE(entry, tmp, &sub_ctx->fb_cache, head)
+      vrend_fb_cache_entry_destroy(sub_ctx, entry);
+}
+
+/* Called when the guest destroys a surface object.  Entries using the
+ * surface can never be looked up again, drop them now rather than keeping
+ * the attached textures alive until they age out of the cache. */
+static void vrend_fb_cache_purge_surface(struct vrend_sub_context *sub_ctx,
+                                         struct vrend_surface *surf)
+{
+   struct vrend_fb_cache_entry *entry, *tmp;
+
+   LIST_FOR_EACH_ENTRY_SAFE(entry, tmp, &sub_ctx->fb_cache, head) {
+      bool used = entry->zsurf == surf;
+
+      for (int i = 0; i < entry->nr_cbufs && !used; i++)
+         used = entry->surf[i] == surf;
+      if (!used)
+         continue;
+
+      if (entry == sub_ctx->cur_fb)
+         entry->stale = true;
+      else
+         vrend_fb_cache_entry_destroy(sub_ctx, entry);
+   }
+}
+
+static struct vrend_fb_cache_entry *
+vrend_fb_cache_lookup(struct vrend_sub_context *sub_ctx)
+{
+   struct vrend_fb_cache_entry *entry;
+
+   LIST_FOR_EACH_ENTRY(entry, &sub_ctx->fb_cache, head) {
+      if (entry->stale ||
+          entry->nr_cbufs != sub_ctx->nr_cbufs ||
+          entry->zsurf != sub_ctx->zsurf ||
+          memcmp(entry->surf, sub_ctx->surf, sub_ctx->nr_cbufs * sizeof(entry->surf[0])))
+         continue;
+
+      list_del(&entry->head);
+      list_add(&entry->head, &sub_ctx->fb_cache);
+      return entry;
+   }
+
+   return NULL;
+}
+
+static struct vrend_fb_cache_entry *
+vrend_fb_cache_create(struct vrend_context *ctx)
+{
+   struct vrend_sub_context *sub_ctx = ctx->sub;
+   struct vrend_fb_cache_entry *entry;
+
+   if (sub_ctx->fb_cache_count >= VREND_FB_CACHE_SIZE) {
+      entry = list_last_entry(&sub_ctx->fb_cache, struct vrend_fb_cache_entry, head);
+      if (entry != sub_ctx->cur_fb)
+         vrend_fb_cache_entry_destroy(sub_ctx, entry);
+   }
+
+   entry = CALLOC_STRUCT(vrend_fb_cache_entry);
+   if (!entry)
+      return NULL;
+
+   glGenFramebuffers(1, &entry->id);
+   glBindFramebuffer(GL_FRAMEBUFFER, entry->id);
+
+   entry->nr_cbufs = sub_ctx->nr_cbufs;
+   vrend_surface_reference(&entry->zsurf, sub_ctx->zsurf);
+   for (int i = 0; i < sub_ctx->nr_cbufs; i++)
+      vrend_surface_reference(&entry->surf[i], sub_ctx->surf[i]);
+
+   if (sub_ctx->zsurf)
+      vrend_hw_set_zsurf_texture(ctx);
+   for (int i = 0; i < sub_ctx->nr_cbufs; i++) {
+      if (sub_ctx->surf[i])
+         vrend_hw_set_color_surface(sub_ctx, i);
+   }
+   vrend_hw_emit_draw_buffers(sub_ctx);
+
+   entry->status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+   if (entry->status != GL_FRAMEBUFFER_COMPLETE)
+      virgl_error("Failed to complete framebuffer 0x%x %s\n", entry->status, ctx->debug_name);
+
+   list_add(&entry->head, &sub_ctx->fb_cache);
+   sub_ctx->fb_cache_count++;
+   return entry;
+}
+
+/* Bind the framebuffer object for the attachments in sub_ctx->surf and
+ * sub_ctx->zsurf, creating it on first use. */
+static void vrend_hw_bind_framebuffer(struct vrend_context *ctx)
+{
+   struct vrend_sub_context *sub_ctx = ctx->sub;
+   struct vrend_fb_cache_entry *old_fb = sub_ctx->cur_fb;
+   struct vrend_fb_cache_entry *entry = NULL;
+
+   if (sub_ctx->nr_cbufs == 0 && !sub_ctx->zsurf) {
+      glBindFramebuffer(GL_FRAMEBUFFER, sub_ctx->fb_id);
+      vrend_hw_emit_draw_buffers(sub_ctx);
+      sub_ctx->cur_fb_id = sub_ctx->fb_id;
+   } else {
+      entry = vrend_fb_cache_lookup(sub_ctx);
+      if (entry)
+         glBindFramebuffer(GL_FRAMEBUFFER, entry->id);
+      else
+         entry = vrend_fb_cache_create(ctx);
+
+      if (!entry) {
+         vrend_report_context_error(ctx, VIRGL_ERROR_CTX_ILLEGAL_SURFACE, 0);
+         glBindFramebuffer(GL_FRAMEBUFFER, sub_ctx->fb_id);
+         sub_ctx->cur_fb_id = sub_ctx->fb_id;
+      } else {
+         sub_ctx->cur_fb_id = entry->id;
+      }
+   }
+
+   sub_ctx->cur_fb = entry;
+   if (old_fb && old_fb != entry && old_fb->stale)
+      vrend_fb_cache_entry_destroy(sub_ctx, old_fb);
 }
 
 void vrend_set_framebuffer_state(struct vrend_context *ctx,
@@ -3079,16 +3462,17 @@ void vrend_set_framebuffer_state(struct vrend_context *ctx,
                                  uint32_t zsurf_handle)
 {
    struct vrend_surface *surf, *zsurf;
+   struct vrend_surface *surfs[PIPE_MAX_COLOR_BUFS];
+   enum pipe_format old_formats[PIPE_MAX_COLOR_BUFS] = { 0 };
    int i;
    int old_num;
-   GLenum status;
+   uint8_t old_swizzle, old_srgb_encode;
+   bool changed;
    GLint new_height = -1;
    bool new_fbo_origin_upper_left = false;
 
    struct vrend_sub_context *sub_ctx = ctx->sub;
 
-   glBindFramebuffer(GL_FRAMEBUFFER, sub_ctx->fb_id);
-
    if (zsurf_handle) {
       zsurf = vrend_object_lookup(sub_ctx->object_hash, zsurf_handle, VIRGL_OBJECT_SURFACE);
       if (!zsurf) {
@@ -3098,36 +3482,33 @@ void vrend_set_framebuffer_state(struct vrend_context *ctx,
    } else
       zsurf = NULL;
 
-   if (sub_ctx->zsurf != zsurf) {
-      vrend_surface_reference(&sub_ctx->zsurf, zsurf);
-      vrend_hw_set_zsurf_texture(ctx);
-   }
-
-   old_num = sub_ctx->nr_cbufs;
-   sub_ctx->nr_cbufs = nr_cbufs;
-
    for (i = 0; i < (int)nr_cbufs; i++) {
       if (surf_handle[i] != 0) {
-         surf = vrend_object_lookup(sub_ctx->object_hash, surf_handle[i], VIRGL_OBJECT_SURFACE);
-         if (!surf) {
+         surfs[i] = vrend_object_lookup(sub_ctx->object_hash, surf_handle[i], VIRGL_OBJECT_SURFACE);
+         if (!surfs[i]) {
             vrend_report_context_error(ctx, VIRGL_ERROR_CTX_ILLEGAL_SURFACE, surf_handle[i]);
             return;
          }
       } else
-         surf = NULL;
-
-      if (sub_ctx->surf[i] != surf) {
-         vrend_surface_reference(&sub_ctx->surf[i], surf);
-         vrend_hw_set_color_surface(sub_ctx, i);
-      }
+         surfs[i] = NULL;
    }
 
-   if (old_num > sub_ctx->nr_cbufs) {
-      for (i = sub_ctx->nr_cbufs; i < old_num; i++) {
-         vrend_surface_reference(&sub_ctx->surf[i], NULL);
-         vrend_hw_set_color_surface(sub_ctx, i);
-      }
+   old_num = sub_ctx->nr_cbufs;
+   for (i = 0; i < old_num; i++) {
+      if (sub_ctx->surf[i])
+         old_formats[i] = sub_ctx->surf[i]->format;
    }
+   old_swizzle = sub_ctx->swizzle_output_rgb_to_bgr;
+   old_srgb_encode = sub_ctx->needs_manual_srgb_encode_bitmask;
+
+   vrend_surface_reference(&sub_ctx->zsurf, zsurf);
+   sub_ctx->nr_cbufs = nr_cbufs;
+   for (i = 0; i < (int)nr_cbufs; i++)
+      vrend_surface_reference(&sub_ctx->surf[i], surfs[i]);
+   for (i = nr_cbufs; i < old_num; i++)
+      vrend_surface_reference(&sub_ctx->surf[i], NULL);
+
+   vrend_hw_bind_framebuffer(ctx);
 
    /* find a buffer to set fb_height from */
    if (sub_ctx->nr_cbufs == 0 && !sub_ctx->zsurf) {
@@ -3153,25 +3534,32 @@ void vrend_set_framebuffer_state(struct vrend_context *ctx,
       new_fbo_origin_upper_left = surf->texture->y_0_top ? true : false;
    }
 
+   changed = old_num != sub_ctx->nr_cbufs;
    if (new_height != -1) {
       if (sub_ctx->fb_height != (uint32_t)new_height ||
           sub_ctx->fbo_origin_upper_left != new_fbo_origin_upper_left) {
          sub_ctx->fb_height = new_height;
          sub_ctx->fbo_origin_upper_left = new_fbo_origin_upper_left;
          sub_ctx->viewport_state_dirty = (1 << 0);
+         changed = true;
       }
    }
 
    vrend_hw_emit_framebuffer_state(sub_ctx);
 
-   if (sub_ctx->nr_cbufs > 0 || sub_ctx->zsurf) {
-      status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
-      if (status != GL_FRAMEBUFFER_COMPLETE)
-         virgl_error("Failed to complete framebuffer 0x%x %s\n", status, ctx->debug_name);
+   /* The shader key and the emulated blend state only depend on the color
+    * buffer formats, so switching between equally shaped render targets does
+    * not need to revalidate them. */
+   for (i = 0; i < sub_ctx->nr_cbufs && !changed; i++) {
+      enum pipe_format format = sub_ctx->surf[i] ? sub_ctx->surf[i]->format : 0;
+      changed = format != old_formats[i];
+   }
+   if (changed ||
+       old_swizzle != sub_ctx->swizzle_output_rgb_to_bgr ||
+       old_srgb_encode != sub_ctx->needs_manual_srgb_encode_bitmask) {
+      sub_ctx->shader_dirty = true;
+      sub_ctx->blend_state_dirty = true;
    }
-
-   sub_ctx->shader_dirty = true;
-   sub_ctx->blend_state_dirty = true;
 }
 
 void vrend_set_framebuffer_state_no_attach(UNUSED struct vrend_context *ctx,
@@ -3407,10 +3795,11 @@ void vrend_set_constants(struct vrend_context *ctx,
                          uint32_t num_constant,
                          const float *data)
 {
+   const unsigned int *src = (const unsigned int *)data;
    struct vrend_constants *consts;
+   uint32_t first = 0, end = num_constant;
 
    consts = &ctx->sub->consts[shader];
-   ctx->sub->const_dirty[shader] = true;
 
    /* avoid reallocations by only growing the buffer */
    if (consts->num_allocated_consts < num_constant) {
@@ -3418,14 +3807,36 @@ void vrend_set_constants(struct vrend_context *ctx,
       consts->consts = malloc(num_constant * sizeof(float));
       if (!consts->consts) {
          consts->num_allocated_consts = 0;
+         consts->num_consts = 0;
          return;
       }
 
       consts->num_allocated_consts = num_constant;
+      consts->num_consts = 0;
+   }
+
+   /* Guests tend to resend the whole constant file when only a few vectors
+    * changed, only the range that actually differs needs to be uploaded. */
+   if (num_constant <= consts->num_consts) {
+      while (first < end && consts->consts[first] == src[first])
+         first++;
+      while (end > first && consts->consts[end - 1] == src[end - 1])
+         end--;
+   } else {
+      while (first < consts->num_consts && consts->consts[first] == src[first])
+         first++;
    }
 
-   memcpy(consts->consts, data, num_constant * sizeof(unsigned int));
    consts->num_consts = num_constant;
+   if (first == end)
+      return;
+
+   memcpy(consts->consts + first, src + first, (end - first) * sizeof(unsigned int));
+
+   end = DIV_ROUND_UP(end, 4);
+   if (!ctx->sub->const_dirty[shader] || consts->dirty_end < end)
+      consts->dirty_end = end;
+   ctx->sub->const_dirty[shader] = true;
 }
 
 void vrend_set_uniform_buffer(struct vrend_context *ctx,
@@ -4560,6 +4971,45 @@ vrend_color_encode_as_srgb(float color) {
       : 1.055f * powf(color, (1.f / 2.4f)) - 0.055f;
 }
 
+/* Everything a draw or dispatch might write to, whether or not the current
+ * shaders actually do. */
+static void vrend_mark_bound_resources_written(struct vrend_sub_context *sub_ctx)
+{
+   for (int i = 0; i < sub_ctx->nr_cbufs; i++) {
+      if (sub_ctx->surf[i])
+         vrend_resource_mark_written(sub_ctx->surf[i]->texture);
+   }
+   if (sub_ctx->zsurf)
+      vrend_resource_mark_written(sub_ctx->zsurf->texture);
+
+   if (sub_ctx->current_so) {
+      for (uint32_t i = 0; i < sub_ctx->current_so->key.num_targets; i++) {
+         if (sub_ctx->current_so->so_targets[i])
+            vrend_resource_mark_written(sub_ctx->current_so->so_targets[i]->buffer);
+      }
+   }
+
+   for (int shader_type = 0; shader_type < PIPE_SHADER_TYPES; shader_type++) {
+      uint32_t mask = sub_ctx->ssbo_used_mask[shader_type];
+      while (mask) {
+         const int i = u_bit_scan(&mask);
+         vrend_resource_mark_written(sub_ctx->ssbo[shader_type][i].res);
+      }
+
+      mask = sub_ctx->images_used_mask[shader_type];
+      while (mask) {
+         const int i = u_bit_scan(&mask);
+         vrend_resource_mark_written(sub_ctx->image_views[shader_type][i].texture);
+      }
+   }
+
+   uint32_t mask = sub_ctx->abo_used_mask;
+   while (mask) {
+      const int i = u_bit_scan(&mask);
+      vrend_resource_mark_written(sub_ctx->abo[i].res);
+   }
+}
+
 void vrend_clear(struct vrend_context *ctx,
                  unsigned buffers,
                  const union pipe_color_union *color,
@@ -4574,6 +5024,8 @@ void vrend_clear(struct vrend_context *ctx,
    if (ctx->ctx_switch_pending)
       vrend_finish_context_switch(ctx);
 
+   vrend_mark_bound_resources_written(sub_ctx);
+
    vrend_update_frontface_state(sub_ctx);
    if (sub_ctx->stencil_state_dirty)
       vrend_update_stencil_state(sub_ctx);
@@ -4739,6 +5191,8 @@ int vrend_clear_texture(struct vrend_context* ctx,
       return EINVAL;
    }
 
+   vrend_resource_mark_written(res);
+
    enum virgl_formats fmt = res->base.format;
    format = tex_conv_table[fmt].glformat;
    type = tex_conv_table[fmt].gltype;
@@ -5125,13 +5579,15 @@ static int vrend_draw_bind_ubo_shader(struct vrend_sub_context *sub_ctx,
    uint32_t mask, dirty, update;
    struct pipe_constant_buffer *cb;
    struct vrend_resource *res;
+   /* the constant block, if any, is bound after the guest blocks */
+   int num_const_ubos = sub_ctx->prog->const_ubo_bind[shader_type] != -1;
 
    mask = sub_ctx->prog->ubo_used_mask[shader_type];
    dirty = sub_ctx->const_bufs_dirty[shader_type];
    update = dirty & sub_ctx->const_bufs_used_mask[shader_type];
 
    if (!update)
-      return next_ubo_id + util_bitcount(mask);
+      return next_ubo_id + util_bitcount(mask) + num_const_ubos;
 
    while (mask) {
       /* The const_bufs_used_mask stores the gallium uniform buffer indices */
@@ -5150,19 +5606,136 @@ static int vrend_draw_bind_ubo_shader(struct vrend_sub_context *sub_ctx,
    }
    sub_ctx->const_bufs_dirty[shader_type] = dirty;
 
-   return next_ubo_id;
+   return next_ubo_id + num_const_ubos;
+}
+
+static void vrend_const_ring_wait(struct vrend_const_ring *ring, uint32_t segment)
+{
+   GLenum ret;
+
+   if (!ring->fences[segment])
+      return;
+
+   do {
+      ret = glClientWaitSync(ring->fences[segment], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+   } while (ret == GL_TIMEOUT_EXPIRED);
+
+   glDeleteSync(ring->fences[segment]);
+   ring->fences[segment] = NULL;
+}
+
+static void vrend_const_ring_init(struct vrend_const_ring *ring)
+{
+   const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+
+   glGenBuffers(1, &ring->id);
+   glBindBuffer(GL_UNIFORM_BUFFER, ring->id);
+   glBufferStorage(GL_UNIFORM_BUFFER, VREND_CONST_RING_SIZE, NULL,
+                   flags | GL_DYNAMIC_STORAGE_BIT);
+   ring->map = glMapBufferRange(GL_UNIFORM_BUFFER, 0, VREND_CONST_RING_SIZE, flags);
+   glBindBuffer(GL_UNIFORM_BUFFER, 0);
+
+   /* without a mapping the ring is filled with glBufferSubData */
+   if (!ring->map)
+      virgl_warn("Failed to map constant ring buffer\n");
+
+   ring->offset = 0;
+   ring->segment = 0;
+}
+
+static void vrend_const_ring_fini(struct vrend_const_ring *ring)
+{
+   if (!ring->id)
+      return;
+
+   for (uint32_t i = 0; i < VREND_CONST_RING_SEGMENTS; i++) {
+      if (ring->fences[i])
+         glDeleteSync(ring->fences[i]);
+      ring->fences[i] = NULL;
+   }
+
+   glDeleteBuffers(1, &ring->id);
+   ring->id = 0;
+   ring->map = NULL;
+}
+
+/* Reserves size bytes of the ring and writes the first data_size of them,
+ * the rest keeps whatever was there before. */
+static uint32_t vrend_const_ring_write(struct vrend_const_ring *ring,
+                                       const void *data, uint32_t data_size,
+                                       uint32_t size)
+{
+   uint32_t offset = align(ring->offset, vrend_state.const_ubo_alignment);
+   uint32_t last;
+
+   if (offset + size > VREND_CONST_RING_SIZE)
+      offset = 0;
+
+   /* an upload never spans more than two segments */
+   last = (offset + size - 1) / VREND_CONST_RING_SEGMENT_SIZE;
+   if (last != ring->segment) {
+      uint32_t first = offset / VREND_CONST_RING_SEGMENT_SIZE;
+
+      ring->fences[ring->segment] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+      if (first != ring->segment)
+         vrend_const_ring_wait(ring, first);
+      if (last != first)
+         vrend_const_ring_wait(ring, last);
+      ring->segment = last;
+   }
+
+   if (ring->map) {
+      memcpy(ring->map + offset, data, data_size);
+   } else if (data_size) {
+      glBindBuffer(GL_UNIFORM_BUFFER, ring->id);
+      glBufferSubData(GL_UNIFORM_BUFFER, offset, data_size, data);
+      glBindBuffer(GL_UNIFORM_BUFFER, 0);
+   }
+
+   ring->offset = offset + size;
+   return offset;
+}
+
+static void vrend_draw_bind_const_ubo(struct vrend_sub_context *sub_ctx,
+                                      int shader_type)
+{
+   struct vrend_constants *consts = &sub_ctx->consts[shader_type];
+   uint32_t size = sub_ctx->shaders[shader_type]->sinfo.num_consts * 4 * sizeof(unsigned int);
+   uint32_t offset;
+
+   if (!sub_ctx->const_ring.id)
+      vrend_const_ring_init(&sub_ctx->const_ring);
+
+   /* The block is read in full, constants the guest didn't set are stale. */
+   offset = vrend_const_ring_write(&sub_ctx->const_ring, consts->consts,
+                                   MIN2(consts->num_consts * sizeof(unsigned int), size),
+                                   size);
+
+   glBindBufferRange(GL_UNIFORM_BUFFER, sub_ctx->prog->const_ubo_bind[shader_type],
+                     sub_ctx->const_ring.id, offset, size);
 }
 
 static void vrend_draw_bind_const_shader(struct vrend_sub_context *sub_ctx,
                                          int shader_type, bool new_program)
 {
-   if (sub_ctx->consts[shader_type].consts &&
-       sub_ctx->shaders[shader_type] &&
-       (sub_ctx->prog->const_location[shader_type] != -1) &&
-       (sub_ctx->const_dirty[shader_type] || new_program)) {
-      glUniform4uiv(sub_ctx->prog->const_location[shader_type],
-            sub_ctx->shaders[shader_type]->sinfo.num_consts,
-            sub_ctx->consts[shader_type].consts);
+   struct vrend_constants *consts = &sub_ctx->consts[shader_type];
+   uint32_t num_consts;
+
+   if (!consts->consts || !sub_ctx->shaders[shader_type] ||
+       !(sub_ctx->const_dirty[shader_type] || new_program))
+      return;
+
+   if (sub_ctx->prog->const_ubo_bind[shader_type] != -1) {
+      vrend_draw_bind_const_ubo(sub_ctx, shader_type);
+      sub_ctx->const_dirty[shader_type] = false;
+   } else if (sub_ctx->prog->const_location[shader_type] != -1) {
+      /* After a program change the whole file is uploaded, otherwise only
+       * the leading part up to the last changed vector. */
+      num_consts = sub_ctx->shaders[shader_type]->sinfo.num_consts;
+      if (!new_program)
+         num_consts = MIN2(num_consts, consts->dirty_end);
+      glUniform4uiv(sub_ctx->prog->const_location[shader_type], num_consts,
+                    consts->consts);
       sub_ctx->const_dirty[shader_type] = false;
    }
 }
@@ -5546,6 +6119,10 @@ vrend_select_program(struct vrend_sub_context *sub_ctx, ubyte vertices_per_patch
 
    if (!same_prog) {
       prog = lookup_shader_program(sub_ctx, vs_id, fs_id, gs_id, tcs_id, tes_id, dual_src);
+      if (prog && prog->hinted && !sub_ctx->linking_hint) {
+         prog->hinted = false;
+         sub_ctx->link_hint_stats.used++;
+      }
       if (!prog) {
          prog = add_shader_program(sub_ctx,
                                    sub_ctx->shaders[PIPE_SHADER_VERTEX]->current,
@@ -5669,24 +6246,106 @@ void vrend_link_program_hook(struct vrend_context *ctx, uint32_t *handles)
    ctx->sub->prog = prev_prog;
 }
 
-int vrend_draw_vbo(struct vrend_context *ctx,
-                   const struct pipe_draw_info *info,
-                   uint32_t cso, uint32_t indirect_handle,
-                   uint32_t indirect_draw_count_handle)
+void vrend_link_program_hint(struct vrend_context *ctx, const uint32_t *handles)
 {
-   bool new_program = false;
-   struct vrend_resource *indirect_res = NULL;
-   struct vrend_resource *indirect_params_res = NULL;
    struct vrend_sub_context *sub_ctx = ctx->sub;
 
-   if (ctx->in_error)
-      return 0;
+   if (sub_ctx->link_hint_count >= VREND_LINK_HINT_MAX_PENDING) {
+      sub_ctx->link_hint_stats.dropped++;
+      return;
+   }
 
-   if (info->instance_count && !has_feature(feat_draw_instance))
-      return EINVAL;
+   struct vrend_link_hint *hint = CALLOC_STRUCT(vrend_link_hint);
+   if (!hint) {
+      sub_ctx->link_hint_stats.dropped++;
+      return;
+   }
 
-   if (info->start_instance && !has_feature(feat_base_instance))
-      return EINVAL;
+   memcpy(hint->handles, handles, sizeof(hint->handles));
+   list_addtail(&hint->head, &sub_ctx->link_hints);
+   sub_ctx->link_hint_count++;
+   sub_ctx->link_hint_stats.queued++;
+}
+
+static bool vrend_link_hint_is_valid(struct vrend_sub_context *sub_ctx,
+                                     const struct vrend_link_hint *hint)
+{
+   /* the shaders may have been deleted since, and vrend_link_program_hook
+    * would then link with whatever is bound instead */
+   for (enum pipe_shader_type type = 0; type < PIPE_SHADER_TYPES; type++) {
+      if (!hint->handles[type])
+         continue;
+
+      struct vrend_shader_selector *sel = vrend_object_lookup(sub_ctx->object_hash,
+                                                              hint->handles[type],
+                                                              VIRGL_OBJECT_SHADER);
+      if (!sel || sel->type != type)
+         return false;
+   }
+   return true;
+}
+
+void vrend_renderer_get_link_hint_stats(struct vrend_context *ctx,
+                                        struct vrend_link_hint_stats *stats)
+{
+   *stats = ctx->sub->link_hint_stats;
+}
+
+void vrend_debug_get_lazy_storage_stats(struct vrend_lazy_storage_stats *stats)
+{
+   *stats = vrend_state.lazy_storage;
+}
+
+void vrend_renderer_process_link_hints(struct vrend_context *ctx)
+{
+   struct vrend_sub_context *sub_ctx = ctx->sub;
+
+   if (!sub_ctx || list_is_empty(&sub_ctx->link_hints))
+      return;
+
+   if (ctx->in_error)
+      return;
+
+   TRACE_FUNC();
+
+   /* get the draws of the submit going before linking */
+   glFlush();
+
+   for (int i = 0; i < VREND_LINK_HINTS_PER_SUBMIT && !list_is_empty(&sub_ctx->link_hints); i++) {
+      struct vrend_link_hint *hint = list_first_entry(&sub_ctx->link_hints,
+                                                      struct vrend_link_hint, head);
+      list_del(&hint->head);
+      sub_ctx->link_hint_count--;
+
+      if (vrend_link_hint_is_valid(sub_ctx, hint)) {
+         sub_ctx->linking_hint = true;
+         vrend_link_program_hook(ctx, hint->handles);
+         sub_ctx->linking_hint = false;
+      } else {
+         sub_ctx->link_hint_stats.dropped++;
+      }
+      free(hint);
+   }
+}
+
+int vrend_draw_vbo(struct vrend_context *ctx,
+                   const struct pipe_draw_info *info,
+                   uint32_t cso, uint32_t indirect_handle,
+                   uint32_t indirect_draw_count_handle)
+{
+   bool new_program = false;
+   struct vrend_resource *indirect_res = NULL;
+   struct vrend_resource *indirect_params_res = NULL;
+   struct vrend_sub_context *sub_ctx = ctx->sub;
+
+   if (ctx->in_error)
+      return 0;
+
+   if (info->instance_count && !has_feature(feat_draw_instance))
+      return EINVAL;
+
+   if (info->start_instance && !has_feature(feat_base_instance))
+      return EINVAL;
 
    if (info->indirect.draw_count > 1 && !has_feature(feat_multi_draw_indirect))
       return EINVAL;
@@ -5716,6 +6375,8 @@ int vrend_draw_vbo(struct vrend_context *ctx,
    if (ctx->ctx_switch_pending)
       vrend_finish_context_switch(ctx);
 
+   vrend_mark_bound_resources_written(sub_ctx);
+
    vrend_update_frontface_state(sub_ctx);
    if (ctx->sub->stencil_state_dirty)
       vrend_update_stencil_state(sub_ctx);
@@ -6021,6 +6682,7 @@ void vrend_launch_grid(struct vrend_context *ctx,
    }
 
    vrend_use_program(sub_ctx, sub_ctx->prog);
+   vrend_mark_bound_resources_written(sub_ctx);
 
    vrend_set_active_pipeline_stage(sub_ctx->prog, PIPE_SHADER_COMPUTE);
    vrend_draw_bind_ubo_shader(sub_ctx, PIPE_SHADER_COMPUTE, 0);
@@ -7338,6 +8000,291 @@ static bool use_integer(void) {
    return false;
 }
 
+static bool vrend_gl_context_pool_has_room(const struct vrend_sub_context *sub)
+{
+   /* the GL context of sub-context 0 of ctx0 is the root of the share
+    * group and is never pooled */
+   if (sub->parent->ctx_id == 0 && sub->sub_ctx_id == 0)
+      return false;
+
+   return !vrend_state.finishing &&
+          vrend_state.gl_context_pool_count < vrend_state.gl_context_pool_max;
+}
+
+static void vrend_framebuffer_detach_all(GLuint fb_id)
+{
+   glBindFramebuffer(GL_FRAMEBUFFER, fb_id);
+   for (uint32_t i = 0; i < vrend_state.max_draw_buffers; i++)
+      glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0 + i,
+                             GL_TEXTURE_2D, 0, 0);
+   glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, 0, 0);
+   glFramebufferTexture2D(GL_FRAMEBUFFER, GL_STENCIL_ATTACHMENT, GL_TEXTURE_2D, 0, 0);
+}
+
+static void vrend_unbind_indexed_buffers(GLenum target, GLenum max_bindings)
+{
+   GLint count = 0;
+
+   glGetIntegerv(max_bindings, &count);
+   for (GLint i = 0; i < count; i++)
+      glBindBufferBase(target, i, 0);
+   glBindBuffer(target, 0);
+}
+
+/* Resets the bindings and the state that a new sub-context expects to be
+ * at the GL defaults, nothing that belonged to the old sub-context may stay
+ * referenced. */
+static void vrend_gl_context_reset(struct vrend_sub_context *sub)
+{
+   GLenum targets[16];
+   unsigned num_targets = 0;
+   GLint count = 0;
+
+   glUseProgram(0);
+   if (has_feature(feat_separate_shader_objects))
+      glBindProgramPipeline(0);
+
+   if (sub->cond_render_q_id) {
+      if (has_feature(feat_gl_conditional_render))
+         glEndConditionalRender();
+      else if (has_feature(feat_nv_conditional_render))
+         glEndConditionalRenderNV();
+   }
+
+   /* textures and samplers of all units */
+   targets[num_targets++] = GL_TEXTURE_2D;
+   targets[num_targets++] = GL_TEXTURE_3D;
+   targets[num_targets++] = GL_TEXTURE_CUBE_MAP;
+   targets[num_targets++] = GL_TEXTURE_2D_ARRAY;
+   if (!vrend_state.use_gles) {
+      targets[num_targets++] = GL_TEXTURE_1D;
+      targets[num_targets++] = GL_TEXTURE_1D_ARRAY;
+      targets[num_targets++] = GL_TEXTURE_RECTANGLE;
+   }
+   if (has_feature(feat_texture_multisample)) {
+      targets[num_targets++] = GL_TEXTURE_2D_MULTISAMPLE;
+      if (!vrend_state.use_gles)
+         targets[num_targets++] = GL_TEXTURE_2D_MULTISAMPLE_ARRAY;
+   }
+   if (has_feature(feat_cube_map_array))
+      targets[num_targets++] = GL_TEXTURE_CUBE_MAP_ARRAY;
+   if (has_feature(feat_arb_or_gles_ext_texture_buffer))
+      targets[num_targets++] = GL_TEXTURE_BUFFER;
+
+   glGetIntegerv(GL_MAX_COMBINED_TEXTURE_IMAGE_UNITS, &count);
+   for (GLint unit = 0; unit < count; unit++) {
+      glActiveTexture(GL_TEXTURE0 + unit);
+      for (unsigned i = 0; i < num_targets; i++)
+         glBindTexture(targets[i], 0);
+      if (has_feature(feat_samplers))
+         glBindSampler(unit, 0);
+   }
+   glActiveTexture(GL_TEXTURE0);
+
+   if (has_feature(feat_images)) {
+      glGetIntegerv(GL_MAX_IMAGE_UNITS, &count);
+      for (GLint unit = 0; unit < count; unit++)
+         glBindImageTexture(unit, 0, 0, GL_FALSE, 0, GL_READ_ONLY, GL_RGBA8);
+   }
+
+   /* buffers, the indexed bindings also reset the generic ones */
+   if (has_feature(feat_ubo))
+      vrend_unbind_indexed_buffers(GL_UNIFORM_BUFFER, GL_MAX_UNIFORM_BUFFER_BINDINGS);
+   if (has_feature(feat_ssbo))
+      vrend_unbind_indexed_buffers(GL_SHADER_STORAGE_BUFFER,
+                                   GL_MAX_SHADER_STORAGE_BUFFER_BINDINGS);
+   if (has_feature(feat_atomic_counters))
+      vrend_unbind_indexed_buffers(GL_ATOMIC_COUNTER_BUFFER,
+                                   GL_MAX_ATOMIC_COUNTER_BUFFER_BINDINGS);
+   if (has_feature(feat_transform_feedback))
+      vrend_unbind_indexed_buffers(GL_TRANSFORM_FEEDBACK_BUFFER,
+                                   GL_MAX_TRANSFORM_FEEDBACK_SEPARATE_ATTRIBS);
+
+   glBindBuffer(GL_ARRAY_BUFFER, 0);
+   glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+   glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+   glBindBuffer(GL_COPY_READ_BUFFER, 0);
+   glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+   if (has_feature(feat_arb_or_gles_ext_texture_buffer))
+      glBindBuffer(GL_TEXTURE_BUFFER, 0);
+   if (has_feature(feat_indirect_draw))
+      glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+   if (has_feature(feat_compute_shader))
+      glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, 0);
+   if (has_feature(feat_qbo))
+      glBindBuffer(GL_QUERY_BUFFER, 0);
+
+   /* the vertex array object stays with the context, it must not keep the
+    * element and vertex buffers referenced nor leave attributes enabled */
+   glBindVertexArray(sub->vaoid);
+   glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+   if (has_feature(feat_gles31_vertex_attrib_binding)) {
+      glGetIntegerv(GL_MAX_VERTEX_ATTRIB_BINDINGS, &count);
+      for (GLint i = 0; i < count; i++)
+         glBindVertexBuffer(i, 0, 0, 0);
+   } else {
+      glGetIntegerv(GL_MAX_VERTEX_ATTRIBS, &count);
+      for (GLint i = 0; i < count; i++) {
+         glDisableVertexAttribArray(i);
+         glVertexAttribPointer(i, 4, GL_FLOAT, GL_FALSE, 0, NULL);
+         glVertexAttribDivisorARB(i, 0);
+      }
+   }
+
+   vrend_framebuffer_detach_all(sub->blit_fb_ids[0]);
+   vrend_framebuffer_detach_all(sub->blit_fb_ids[1]);
+   vrend_framebuffer_detach_all(sub->fb_id);
+   glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+   /* fixed function state that is not tracked in the pooled context, the
+    * initial viewport and scissor of a context without a surface are empty */
+   if (has_feature(feat_viewport_array)) {
+      glGetIntegerv(GL_MAX_VIEWPORTS, &count);
+      for (GLint i = 0; i < count; i++) {
+         glViewportIndexedf(i, 0, 0, 0, 0);
+         glScissorIndexed(i, 0, 0, 0, 0);
+      }
+   } else {
+      glViewport(0, 0, 0, 0);
+      glScissor(0, 0, 0, 0);
+   }
+   if (vrend_state.use_gles)
+      glDepthRangefOES(0.0f, 1.0f);
+   else
+      glDepthRange(0.0, 1.0);
+
+   glStencilFuncSeparate(GL_FRONT_AND_BACK, GL_ALWAYS, 0, ~0u);
+   glStencilOpSeparate(GL_FRONT_AND_BACK, GL_KEEP, GL_KEEP, GL_KEEP);
+   glStencilMaskSeparate(GL_FRONT_AND_BACK, ~0u);
+
+   /* enables that are tracked go back to the GL defaults together with
+    * their shadow state, which is handed over with the context */
+   glDisable(GL_SCISSOR_TEST);
+   sub->hw_rs_state.scissor = 0;
+   glDisable(GL_RASTERIZER_DISCARD);
+   sub->hw_rs_state.rasterizer_discard = 0;
+
+   if (vrend_state.use_gles)
+      glDisable(GL_PRIMITIVE_RESTART_FIXED_INDEX);
+   else if (has_feature(feat_nv_prim_restart))
+      glDisableClientState(GL_PRIMITIVE_RESTART_NV);
+   else if (has_feature(feat_gl_prim_restart))
+      glDisable(GL_PRIMITIVE_RESTART);
+}
+
+/* Must be called with the GL context of the sub-context current, after all
+ * the objects of the sub-context have been released. */
+static void vrend_gl_context_pool_put(struct vrend_sub_context *sub)
+{
+   struct vrend_pooled_gl_context *pooled = CALLOC_STRUCT(vrend_pooled_gl_context);
+
+   if (!pooled) {
+      glDeleteFramebuffers(1, &sub->fb_id);
+      glDeleteFramebuffers(2, sub->blit_fb_ids);
+      glDeleteVertexArrays(1, &sub->vaoid);
+      vrend_clicbs->destroy_gl_context(sub->gl_context);
+      return;
+   }
+
+   vrend_gl_context_reset(sub);
+
+   pooled->gl_context = sub->gl_context;
+   pooled->vaoid = sub->vaoid;
+   pooled->fb_id = sub->fb_id;
+   pooled->blit_fb_ids[0] = sub->blit_fb_ids[0];
+   pooled->blit_fb_ids[1] = sub->blit_fb_ids[1];
+
+   pooled->hw_rs_state = sub->hw_rs_state;
+   pooled->hw_blend_state = sub->hw_blend_state;
+   pooled->depth_test_enabled = sub->depth_test_enabled;
+   pooled->alpha_test_enabled = sub->alpha_test_enabled;
+   pooled->stencil_test_enabled = sub->stencil_test_enabled;
+   pooled->framebuffer_srgb_enabled = sub->framebuffer_srgb_enabled;
+
+   list_add(&pooled->head, &vrend_state.gl_context_pool);
+   vrend_state.gl_context_pool_count++;
+}
+
+static bool vrend_gl_context_pool_get(struct vrend_sub_context *sub)
+{
+   struct vrend_pooled_gl_context *pooled;
+
+   if (list_is_empty(&vrend_state.gl_context_pool))
+      return false;
+
+   pooled = list_first_entry(&vrend_state.gl_context_pool,
+                             struct vrend_pooled_gl_context, head);
+   list_del(&pooled->head);
+   vrend_state.gl_context_pool_count--;
+
+   sub->gl_context = pooled->gl_context;
+   sub->vaoid = pooled->vaoid;
+   sub->fb_id = pooled->fb_id;
+   sub->blit_fb_ids[0] = pooled->blit_fb_ids[0];
+   sub->blit_fb_ids[1] = pooled->blit_fb_ids[1];
+
+   sub->hw_rs_state = pooled->hw_rs_state;
+   sub->hw_blend_state = pooled->hw_blend_state;
+   sub->depth_test_enabled = pooled->depth_test_enabled;
+   sub->alpha_test_enabled = pooled->alpha_test_enabled;
+   sub->stencil_test_enabled = pooled->stencil_test_enabled;
+   sub->framebuffer_srgb_enabled = pooled->framebuffer_srgb_enabled;
+
+   FREE(pooled);
+   return true;
+}
+
+static void vrend_gl_context_pool_fini(void)
+{
+   struct vrend_pooled_gl_context *pooled, *tmp;
+
+   LIST_FOR_EACH_ENTRY_SAFE(pooled, tmp, &vrend_state.gl_context_pool, head) {
+      vrend_clicbs->make_current(pooled->gl_context);
+      glDeleteFramebuffers(1, &pooled->fb_id);
+      glDeleteFramebuffers(2, pooled->blit_fb_ids);
+      glDeleteVertexArrays(1, &pooled->vaoid);
+      vrend_clicbs->destroy_gl_context(pooled->gl_context);
+
+      list_del(&pooled->head);
+      FREE(pooled);
+   }
+   vrend_state.gl_context_pool_count = 0;
+}
+
+static uint32_t gl_context_pool_size(void)
+{
+   const char *size = getenv("VIRGL_GL_CONTEXT_POOL_SIZE");
+
+   if (size)
+      return strtoul(size, NULL, 0);
+
+   return VREND_GL_CONTEXT_POOL_DEFAULT_SIZE;
+}
+
+#define VREND_DESTROY_QUEUE_DEFAULT_MB 64
+
+/* in MiB, 0 deletes the GL objects of destroyed resources right away */
+static uint64_t destroy_queue_limit(void)
+{
+   const char *limit = getenv("VIRGL_DESTROY_QUEUE_MB");
+
+   if (limit)
+      return (uint64_t)strtoul(limit, NULL, 0) * 1024 * 1024;
+
+   return VREND_DESTROY_QUEUE_DEFAULT_MB * 1024 * 1024;
+}
+
+/* in MiB, 0 keeps every texture resident */
+static uint64_t residency_budget(void)
+{
+   const char *budget = getenv("VIRGL_RESIDENCY_BUDGET_MB");
+
+   if (budget)
+      return (uint64_t)strtoul(budget, NULL, 0) * 1024 * 1024;
+
+   return 0;
+}
+
 int vrend_renderer_init(const struct vrend_if_cbs *cbs, uint32_t flags)
 {
    bool gles;
@@ -7356,6 +8303,11 @@ int vrend_renderer_init(const struct vrend_if_cbs *cbs, uint32_t flags)
       vrend_init_debug_flags();
    }
 
+   vrend_convert_init();
+
+   if (!vrend_upload_init())
+      virgl_warn("failed to start the texture upload threads\n");
+
    ctx_params.shared = false;
    if (flags & VREND_USE_COMPAT_CONTEXT) {
       ctx_params.compat_ctx = true;
@@ -7415,6 +8367,16 @@ int vrend_renderer_init(const struct vrend_if_cbs *cbs, uint32_t flags)
    if (vrend_state.max_draw_buffers > 8)
       vrend_state.max_draw_buffers = 8;
 
+   vrend_state.use_const_ubo = has_feature(feat_ubo) &&
+                               has_feature(feat_arb_buffer_storage) &&
+                               (gles || gl_ver >= 31) &&
+                               !getenv("VIRGL_NO_CONST_UBO");
+   if (vrend_state.use_const_ubo) {
+      GLint alignment;
+      glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+      vrend_state.const_ubo_alignment = MAX2(alignment, 16);
+   }
+
    if (!has_feature(feat_arb_robustness) &&
        !has_feature(feat_gles_khr_robustness)) {
       virgl_warn("Running without ARB/KHR robustness in place may crash\n");
@@ -7456,6 +8418,23 @@ int vrend_renderer_init(const struct vrend_if_cbs *cbs, uint32_t flags)
    }
 
    vrend_clicbs->destroy_gl_context(gl_context);
+   list_inithead(&vrend_state.gl_context_pool);
+   vrend_state.gl_context_pool_count = 0;
+   vrend_state.gl_context_pool_max = gl_context_pool_size();
+   memset(&vrend_state.env_tweaks, 0, sizeof(vrend_state.env_tweaks));
+   vrend_set_tweak_from_env(&vrend_state.env_tweaks);
+
+   list_inithead(&vrend_state.residency.lru);
+   vrend_state.residency.resident_size = 0;
+   vrend_state.residency.budget = residency_budget();
+
+   list_inithead(&vrend_state.destroy_queue.list);
+   vrend_state.destroy_queue.size = 0;
+   vrend_state.destroy_queue.limit = destroy_queue_limit();
+
+   memset(&vrend_state.lazy_storage, 0, sizeof(vrend_state.lazy_storage));
+   vrend_state.lazy_storage.enabled = !getenv("VIRGL_NO_LAZY_STORAGE");
+
    list_inithead(&vrend_state.fence_list);
    list_inithead(&vrend_state.fence_wait_list);
    list_inithead(&vrend_state.waiting_query_list);
@@ -7472,6 +8451,23 @@ int vrend_renderer_init(const struct vrend_if_cbs *cbs, uint32_t flags)
    }
    if (flags & VREND_USE_EXTERNAL_BLOB)
       vrend_state.use_external_blob = true;
+   if (flags & VREND_USE_SNAPSHOTS)
+      vrend_state.use_snapshots = true;
+
+   /* spilling reads textures back with glGetTexImage, and relies on
+    * vrend_renderer_check_fences to see fences retire
+    */
+   if (vrend_state.residency.budget &&
+       (vrend_state.use_gles || vrend_state.use_async_fence_cb)) {
+      virgl_warn("texture residency budget is not supported in this configuration\n");
+      vrend_state.residency.budget = 0;
+   }
+
+   /* async fence callbacks retire fences without vrend_renderer_check_fences,
+    * which is where the destroy queue is reclaimed
+    */
+   if (vrend_state.use_async_fence_cb)
+      vrend_state.destroy_queue.limit = 0;
 
 #ifdef HAVE_EPOXY_EGL_H
    vrend_state.use_egl_fence = virgl_egl_supports_fences(egl);
@@ -7507,14 +8503,23 @@ vrend_renderer_fini(void)
    }
 
    vrend_free_fences();
+   vrend_destroy_queue_reclaim(true);
+   vrend_upload_fini();
    vrend_blitter_fini();
 
 #ifdef ENABLE_VIDEO
    vrend_video_fini();
 #endif
 
+   vrend_gl_context_pool_fini();
    vrend_destroy_context(vrend_state.ctx0);
 
+   VREND_DEBUG(dbg_stats, NULL, "lazy texture storage: %" PRIu64 " deferred, %" PRIu64
+               " materialized, %" PRIu64 " never materialized (%" PRIu64 " bytes)\n",
+               vrend_state.lazy_storage.deferred, vrend_state.lazy_storage.materialized,
+               vrend_state.lazy_storage.never_materialized,
+               vrend_state.lazy_storage.never_materialized_size);
+
    vrend_state.current_ctx = NULL;
    vrend_state.current_hw_ctx = NULL;
 
@@ -7524,6 +8529,7 @@ vrend_renderer_fini(void)
 static void vrend_destroy_sub_context(struct vrend_sub_context *sub)
 {
    struct vrend_streamout_object *obj, *tmp;
+   bool pool_gl_context = vrend_gl_context_pool_has_room(sub);
 
    vrend_clicbs->make_current(sub->gl_context);
 
@@ -7566,11 +8572,15 @@ static void vrend_destroy_sub_context(struct vrend_sub_context *sub)
       }
    }
 
-   if (sub->fb_id)
-      glDeleteFramebuffers(1, &sub->fb_id);
+   vrend_fb_cache_fini(sub);
 
-   if (sub->blit_fb_ids[0])
-      glDeleteFramebuffers(2, sub->blit_fb_ids);
+   if (!pool_gl_context) {
+      if (sub->fb_id)
+         glDeleteFramebuffers(1, &sub->fb_id);
+
+      if (sub->blit_fb_ids[0])
+         glDeleteFramebuffers(2, sub->blit_fb_ids);
+   }
 
    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 
@@ -7581,16 +8591,35 @@ static void vrend_destroy_sub_context(struct vrend_sub_context *sub)
          glDisableVertexAttribArray(i);
       }
    }
-   glDeleteVertexArrays(1, &sub->vaoid);
+   if (!pool_gl_context)
+      glDeleteVertexArrays(1, &sub->vaoid);
    glBindVertexArray(0);
 
    if (sub->current_so)
       glBindTransformFeedback(GL_TRANSFORM_FEEDBACK, 0);
 
    LIST_FOR_EACH_ENTRY_SAFE(obj, tmp, &sub->streamout_list, head) {
-      vrend_destroy_streamout_object(obj);
+      vrend_destroy_streamout_object(sub, obj);
+   }
+   _mesa_hash_table_destroy(sub->streamout_cache, NULL);
+
+   vrend_const_ring_fini(&sub->const_ring);
+
+   struct vrend_link_hint *hint, *hint_tmp;
+   LIST_FOR_EACH_ENTRY_SAFE(hint, hint_tmp, &sub->link_hints, head) {
+      list_del(&hint->head);
+      free(hint);
    }
 
+   VREND_DEBUG(dbg_stats, sub->parent, "sub-context %d: streamout objects: %" PRIu64 " hits, "
+               "%" PRIu64 " misses, %" PRIu64 " evictions\n", sub->sub_ctx_id,
+               sub->streamout_stats.hits, sub->streamout_stats.misses,
+               sub->streamout_stats.evictions);
+   VREND_DEBUG(dbg_stats, sub->parent, "sub-context %d: link hints: %" PRIu64 " queued, "
+               "%" PRIu64 " dropped, %" PRIu64 " linked, %" PRIu64 " used\n", sub->sub_ctx_id,
+               sub->link_hint_stats.queued, sub->link_hint_stats.dropped,
+               sub->link_hint_stats.linked, sub->link_hint_stats.used);
+
    vrend_shader_state_reference(&sub->shaders[PIPE_SHADER_VERTEX], NULL);
    vrend_shader_state_reference(&sub->shaders[PIPE_SHADER_FRAGMENT], NULL);
    vrend_shader_state_reference(&sub->shaders[PIPE_SHADER_GEOMETRY], NULL);
@@ -7631,7 +8660,10 @@ static void vrend_destroy_sub_context(struct vrend_sub_context *sub)
    vrend_resource_reference((struct vrend_resource **)&sub->ib.buffer, NULL);
 
    vrend_object_fini_ctx_table(sub->object_hash);
-   vrend_clicbs->destroy_gl_context(sub->gl_context);
+   if (pool_gl_context)
+      vrend_gl_context_pool_put(sub);
+   else
+      vrend_clicbs->destroy_gl_context(sub->gl_context);
 
    list_del(&sub->head);
    FREE(sub);
@@ -7645,6 +8677,53 @@ static void destroy_active_markers_entry(struct hash_entry *entry)
 }
 #endif
 
+static struct vrend_fence_timeline *vrend_fence_timeline_create(void)
+{
+   struct vrend_fence_timeline *timeline = CALLOC_STRUCT(vrend_fence_timeline);
+
+   if (timeline) {
+      timeline->refcount = 1;
+      timeline->epoch = 1;
+   }
+   return timeline;
+}
+
+static void vrend_fence_timeline_reference(struct vrend_fence_timeline **ptr,
+                                           struct vrend_fence_timeline *timeline)
+{
+   struct vrend_fence_timeline *old = *ptr;
+
+   if (old == timeline)
+      return;
+
+   if (timeline)
+      timeline->refcount++;
+   if (old && !--old->refcount)
+      free(old);
+   *ptr = timeline;
+}
+
+/* Records a use of res by the current context. */
+static void vrend_resource_stamp_use(struct vrend_resource *res)
+{
+   struct vrend_context *ctx = vrend_state.current_ctx ? vrend_state.current_ctx :
+                                                         vrend_state.ctx0;
+   if (!ctx)
+      return;
+
+   struct vrend_fence_timeline *timeline = ctx->timeline;
+
+   vrend_fence_timeline_reference(&res->last_use_timeline, timeline);
+   res->last_use = timeline->epoch;
+   timeline->used_epoch = timeline->epoch;
+}
+
+static inline bool vrend_resource_use_retired(const struct vrend_resource *res)
+{
+   return !res->last_use_timeline ||
+          res->last_use <= res->last_use_timeline->retired_epoch;
+}
+
 void vrend_destroy_context(struct vrend_context *ctx)
 {
    bool switch_0 = (ctx == vrend_state.current_ctx);
@@ -7657,6 +8736,13 @@ void vrend_destroy_context(struct vrend_context *ctx)
    }
 
    vrend_clicbs->make_current(ctx->sub->gl_context);
+
+   /* the fences that would retire the last uses of resources by the context
+    * are going away, wait for the uses instead */
+   if (ctx->timeline->used_epoch > ctx->timeline->retired_epoch)
+      glFinish();
+   ctx->timeline->retired_epoch = UINT64_MAX;
+
    /* reset references on framebuffers */
    vrend_set_framebuffer_state(ctx, 0, NULL, 0);
 
@@ -7695,6 +8781,7 @@ void vrend_destroy_context(struct vrend_context *ctx)
    _mesa_hash_table_destroy(ctx->active_markers, destroy_active_markers_entry);
 #endif
 
+   vrend_fence_timeline_reference(&ctx->timeline, NULL);
    FREE(ctx);
 
    if (!switch_0 && cur)
@@ -7708,6 +8795,12 @@ struct vrend_context *vrend_create_context(int id, uint32_t nlen, const char *de
    if (!grctx)
       return NULL;
 
+   grctx->timeline = vrend_fence_timeline_create();
+   if (!grctx->timeline) {
+      FREE(grctx);
+      return NULL;
+   }
+
    if (nlen && debug_name) {
       strncpy(grctx->debug_name, debug_name,
               nlen < sizeof(grctx->debug_name) - 1 ?
@@ -7746,6 +8839,7 @@ struct vrend_context *vrend_create_context(int id, uint32_t nlen, const char *de
    grctx->shader_cfg.has_texture_shadow_lod = has_feature(feat_texture_shadow_lod);
    grctx->shader_cfg.has_vs_layer = has_feature(feat_vs_layer_viewport);
    grctx->shader_cfg.has_vs_viewport_index = has_feature(feat_vs_viewport_index);
+   grctx->shader_cfg.use_const_ubo = vrend_state.use_const_ubo;
 
    vrend_renderer_create_sub_ctx(grctx, 0);
    vrend_renderer_set_sub_ctx(grctx, 0);
@@ -8354,32 +9448,12 @@ static void vrend_resource_gbm_init(struct vrend_resource *gr, uint32_t format)
 #endif
 }
 
-static int vrend_resource_alloc_texture(struct vrend_resource *gr,
-                                        enum virgl_formats format,
-                                        void *image_oes)
+static void vrend_resource_init_gl_target(struct vrend_resource *gr,
+                                          enum virgl_formats format)
 {
-   uint level;
-   GLenum internalformat, glformat, gltype;
-   struct vrend_texture *gt = (struct vrend_texture *)gr;
    struct pipe_resource *pr = &gr->base;
 
-   const bool format_can_texture_storage = has_feature(feat_texture_storage) &&
-        (tex_conv_table[format].flags & VIRGL_TEXTURE_CAN_TEXTURE_STORAGE);
-
-   if (format_can_texture_storage)
-      gr->storage_bits |= VREND_STORAGE_GL_IMMUTABLE;
-
-   if (!image_oes) {
-      vrend_resource_d3d_init(gr, format);
-      vrend_resource_gbm_init(gr, format);
-      if (gr->gbm_bo && !has_bit(gr->storage_bits, VREND_STORAGE_EGL_IMAGE))
-         return 0;
-
-      image_oes = gr->egl_image;
-   }
-
    gr->target = tgsitargettogltarget(pr->target, pr->nr_samples);
-   gr->storage_bits |= VREND_STORAGE_GL_TEXTURE;
 
    /* ugly workaround for texture rectangle incompatibility */
    if (gr->target == GL_TEXTURE_RECTANGLE_NV &&
@@ -8400,6 +9474,20 @@ static int vrend_resource_alloc_texture(struct vrend_resource *gr,
    if (vrend_state.use_gles && gr->target == GL_TEXTURE_1D_ARRAY) {
       gr->target = GL_TEXTURE_2D_ARRAY;
    }
+}
+
+/* allocates the GL texture, the target must have been set up already */
+static int vrend_resource_alloc_gl_texture(struct vrend_resource *gr,
+                                           enum virgl_formats format,
+                                           void *image_oes)
+{
+   uint level;
+   GLenum internalformat, glformat, gltype;
+   struct vrend_texture *gt = (struct vrend_texture *)gr;
+   struct pipe_resource *pr = &gr->base;
+
+   const bool format_can_texture_storage = has_feature(feat_texture_storage) &&
+        (tex_conv_table[format].flags & VIRGL_TEXTURE_CAN_TEXTURE_STORAGE);
 
    glGenTextures(1, &gr->id);
    glBindTexture(gr->target, gr->id);
@@ -8546,6 +9634,272 @@ static int vrend_resource_alloc_texture(struct vrend_resource *gr,
    return 0;
 }
 
+static int vrend_resource_alloc_texture(struct vrend_resource *gr,
+                                        enum virgl_formats format,
+                                        void *image_oes,
+                                        bool defer_storage)
+{
+   if (has_feature(feat_texture_storage) &&
+       (tex_conv_table[format].flags & VIRGL_TEXTURE_CAN_TEXTURE_STORAGE))
+      gr->storage_bits |= VREND_STORAGE_GL_IMMUTABLE;
+
+   if (!image_oes) {
+      vrend_resource_d3d_init(gr, format);
+      vrend_resource_gbm_init(gr, format);
+      if (gr->gbm_bo && !has_bit(gr->storage_bits, VREND_STORAGE_EGL_IMAGE))
+         return 0;
+
+      image_oes = gr->egl_image;
+   }
+
+   vrend_resource_init_gl_target(gr, format);
+   gr->storage_bits |= VREND_STORAGE_GL_TEXTURE;
+
+   /* unknown formats still fail at creation */
+   if (defer_storage && !image_oes && tex_conv_table[format].internalformat) {
+      gr->storage_deferred = true;
+      vrend_state.lazy_storage.deferred++;
+      return 0;
+   }
+
+   return vrend_resource_alloc_gl_texture(gr, format, image_oes);
+}
+
+static uint64_t vrend_residency_level_size(struct vrend_resource *res, uint32_t level)
+{
+   return (uint64_t)util_format_get_nblocks(res->base.format,
+                                            u_minify(res->base.width0, level),
+                                            u_minify(res->base.height0, level)) *
+          util_format_get_blocksize(res->base.format) *
+          vrend_get_texture_depth(res, level);
+}
+
+static uint64_t vrend_residency_texture_size(struct vrend_resource *res)
+{
+   uint64_t size = 0;
+
+   for (uint32_t level = 0; level <= res->base.last_level; level++)
+      size += vrend_residency_level_size(res, level);
+
+   return size;
+}
+
+static void vrend_residency_track(struct vrend_resource *res)
+{
+   if (!vrend_state.residency.budget ||
+       !has_bit(res->storage_bits, VREND_STORAGE_GL_TEXTURE))
+      return;
+
+   vrend_resource_stamp_use(res);
+   list_addtail(&res->residency_head, &vrend_state.residency.lru);
+   vrend_state.residency.resident_size += vrend_residency_texture_size(res);
+}
+
+static void vrend_residency_untrack(struct vrend_resource *res)
+{
+   if (!list_is_linked(&res->residency_head))
+      return;
+
+   list_del(&res->residency_head);
+   if (res->spill_data)
+      free(res->spill_data);
+   else
+      vrend_state.residency.resident_size -= vrend_residency_texture_size(res);
+}
+
+/* Only textures that nothing but the resource table references can be
+ * spilled: sampler views, surfaces and the VMM (through
+ * vrend_renderer_resource_get_info) may hold on to the GL name.
+ */
+static bool vrend_residency_can_spill(struct vrend_resource *res)
+{
+   const enum virgl_formats format = res->base.format;
+
+   if (res->spill_data || res->residency_pinned || res->is_imported)
+      return false;
+
+   if (p_atomic_read(&res->base.reference.count) != 1)
+      return false;
+
+   if (res->storage_bits & (VREND_STORAGE_EGL_IMAGE | VREND_STORAGE_GBM_BUFFER |
+                            VREND_STORAGE_GL_MEMOBJ | VREND_STORAGE_D3D_TEXTURE))
+      return false;
+
+   return res->base.nr_samples <= 1 &&
+          !util_format_is_compressed(format) &&
+          (tex_conv_table[format].flags & VIRGL_TEXTURE_CAN_READBACK);
+}
+
+static void vrend_residency_spill(struct vrend_resource *res)
+{
+   const GLenum glformat = tex_conv_table[res->base.format].glformat;
+   const GLenum gltype = tex_conv_table[res->base.format].gltype;
+   const uint64_t size = vrend_residency_texture_size(res);
+   char *data, *ptr;
+
+   data = malloc(size);
+   if (!data)
+      return;
+
+   glPixelStorei(GL_PACK_ALIGNMENT, 1);
+   glBindTexture(res->target, res->id);
+
+   ptr = data;
+   for (uint32_t level = 0; level <= res->base.last_level; level++) {
+      const uint64_t level_size = vrend_residency_level_size(res, level);
+
+      if (res->target == GL_TEXTURE_CUBE_MAP) {
+         for (uint32_t face = 0; face < 6; face++)
+            glGetTexImage(GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, level, glformat, gltype,
+                          ptr + face * (level_size / 6));
+      } else {
+         glGetTexImage(res->target, level, glformat, gltype, ptr);
+      }
+      ptr += level_size;
+   }
+
+   glBindTexture(res->target, 0);
+   glPixelStorei(GL_PACK_ALIGNMENT, 4);
+
+   glDeleteTextures(1, &res->id);
+   res->id = 0;
+   res->spill_data = data;
+   vrend_state.residency.resident_size -= size;
+
+   virgl_debug("spilled texture (%" PRIu64 " bytes), %" PRIu64 " bytes resident\n",
+               size, vrend_state.residency.resident_size);
+}
+
+static void vrend_residency_restore(struct vrend_resource *res)
+{
+   const GLenum glformat = tex_conv_table[res->base.format].glformat;
+   const GLenum gltype = tex_conv_table[res->base.format].gltype;
+   const char *ptr = res->spill_data;
+
+   if (vrend_resource_alloc_gl_texture(res, res->base.format, NULL)) {
+      virgl_error("failed to restore a spilled texture\n");
+      return;
+   }
+
+   glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+   glBindTexture(res->target, res->id);
+
+   for (uint32_t level = 0; level <= res->base.last_level; level++) {
+      const uint64_t level_size = vrend_residency_level_size(res, level);
+      const uint32_t width = u_minify(res->base.width0, level);
+      const uint32_t height = u_minify(res->base.height0, level);
+      const uint32_t depth = vrend_get_texture_depth(res, level);
+
+      switch (res->target) {
+      case GL_TEXTURE_1D:
+         glTexSubImage1D(res->target, level, 0, width, glformat, gltype, ptr);
+         break;
+      case GL_TEXTURE_1D_ARRAY:
+         glTexSubImage2D(res->target, level, 0, 0, width, depth, glformat, gltype, ptr);
+         break;
+      case GL_TEXTURE_CUBE_MAP:
+         for (uint32_t face = 0; face < 6; face++)
+            glTexSubImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, level, 0, 0, width, height,
+                            glformat, gltype, ptr + face * (level_size / 6));
+         break;
+      case GL_TEXTURE_3D:
+      case GL_TEXTURE_2D_ARRAY:
+      case GL_TEXTURE_CUBE_MAP_ARRAY:
+         glTexSubImage3D(res->target, level, 0, 0, 0, width, height, depth,
+                         glformat, gltype, ptr);
+         break;
+      default:
+         glTexSubImage2D(res->target, level, 0, 0, width, height, glformat, gltype, ptr);
+         break;
+      }
+      ptr += level_size;
+   }
+
+   glBindTexture(res->target, 0);
+   glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+   free(res->spill_data);
+   res->spill_data = NULL;
+   vrend_state.residency.resident_size += vrend_residency_texture_size(res);
+}
+
+/* Called whenever a texture is about to be used: restores it if it was
+ * spilled and moves it to the tail of the LRU list. */
+static inline void vrend_residency_touch(struct vrend_resource *res)
+{
+   if (likely(!list_is_linked(&res->residency_head)))
+      return;
+
+   if (res->spill_data)
+      vrend_residency_restore(res);
+
+   vrend_resource_stamp_use(res);
+   list_del(&res->residency_head);
+   list_addtail(&res->residency_head, &vrend_state.residency.lru);
+}
+
+/* On failure the storage stays deferred and the next use tries again. */
+static bool vrend_resource_materialize(struct vrend_resource *res)
+{
+   if (vrend_resource_alloc_gl_texture(res, res->base.format, NULL)) {
+      virgl_error("failed to allocate deferred texture storage\n");
+      glDeleteTextures(1, &res->id);
+      res->id = 0;
+      return false;
+   }
+
+   res->storage_deferred = false;
+   vrend_state.lazy_storage.materialized++;
+   vrend_residency_track(res);
+   return true;
+}
+
+/* Called whenever a resource is about to be used: allocates deferred
+ * texture storage, then restores and refreshes the texture as above.
+ * Returns false if the texture has no storage. */
+static inline bool vrend_resource_touch(struct vrend_resource *res)
+{
+#ifdef ENABLE_VIDEO
+   if (unlikely(res->video_frame)) {
+      vrend_video_wait_frame(res->video_frame);
+      res->video_frame = 0;
+   }
+#endif
+
+   if (unlikely(res->storage_deferred) && !vrend_resource_materialize(res))
+      return false;
+
+   if (vrend_state.destroy_queue.limit)
+      vrend_resource_stamp_use(res);
+
+   vrend_residency_touch(res);
+   return true;
+}
+
+/* Spill idle textures, least recently used first, until the resident size
+ * is back under the budget. */
+static void vrend_residency_evict(void)
+{
+   struct vrend_resource *res, *tmp;
+
+   if (vrend_state.residency.resident_size <= vrend_state.residency.budget)
+      return;
+
+   vrend_renderer_force_ctx_0();
+
+   LIST_FOR_EACH_ENTRY_SAFE(res, tmp, &vrend_state.residency.lru, residency_head) {
+      if (vrend_state.residency.resident_size <= vrend_state.residency.budget)
+         break;
+
+      /* uses by different contexts retire in any order */
+      if (!vrend_resource_use_retired(res))
+         continue;
+
+      if (vrend_residency_can_spill(res))
+         vrend_residency_spill(res);
+   }
+}
+
 static struct vrend_resource *
 vrend_resource_create(const struct vrend_renderer_resource_create_args *args)
 {
@@ -8589,7 +9943,8 @@ vrend_renderer_resource_create(const struct vrend_renderer_resource_create_args
       ret = vrend_resource_alloc_buffer(gr, args->flags);
    } else {
       const enum virgl_formats format = gr->base.format;
-      ret = vrend_resource_alloc_texture(gr, format, image_oes);
+      ret = vrend_resource_alloc_texture(gr, format, image_oes,
+                                         vrend_state.lazy_storage.enabled);
    }
 
    if (ret) {
@@ -8597,10 +9952,13 @@ vrend_renderer_resource_create(const struct vrend_renderer_resource_create_args
       return NULL;
    }
 
+   if (!gr->storage_deferred)
+      vrend_residency_track(gr);
+
    return &gr->base;
 }
 
-void vrend_renderer_resource_destroy(struct vrend_resource *res)
+static void vrend_resource_free(struct vrend_resource *res)
 {
    if (has_bit(res->storage_bits, VREND_STORAGE_GL_TEXTURE)) {
       glDeleteTextures(1, &res->id);
@@ -8638,9 +9996,168 @@ void vrend_renderer_resource_destroy(struct vrend_resource *res)
    if (res->d3d_tex2d)
       res->d3d_tex2d->lpVtbl->Release(res->d3d_tex2d);
 #endif
+   vrend_fence_timeline_reference(&res->last_use_timeline, NULL);
    free(res);
 }
 
+static uint64_t vrend_destroy_queue_size(struct vrend_resource *res)
+{
+   if (has_bit(res->storage_bits, VREND_STORAGE_GL_BUFFER))
+      return res->base.width0;
+
+   return vrend_residency_texture_size(res);
+}
+
+static void vrend_destroy_queue_remove(struct vrend_resource *res)
+{
+   list_del(&res->destroy_head);
+   vrend_state.destroy_queue.size -= vrend_destroy_queue_size(res);
+   vrend_resource_free(res);
+}
+
+/* Deletes the GL objects of the queued resources whose last use is covered
+ * by a retired fence, or of all of them when no fence is pending.
+ */
+static void vrend_destroy_queue_reclaim(bool idle)
+{
+   struct vrend_resource *res, *tmp;
+
+   LIST_FOR_EACH_ENTRY_SAFE(res, tmp, &vrend_state.destroy_queue.list, destroy_head) {
+      /* uses by different contexts retire in any order */
+      if (!idle && !vrend_resource_use_retired(res))
+         continue;
+
+      vrend_destroy_queue_remove(res);
+   }
+}
+
+/* Only resources that own plain GL textures or buffers are queued, the
+ * storage of imported resources belongs to someone else.
+ */
+static bool vrend_destroy_queue_add(struct vrend_resource *res)
+{
+   const uint64_t limit = vrend_state.destroy_queue.limit;
+
+   if (!limit || !res->id || res->is_imported ||
+       !(res->storage_bits & (VREND_STORAGE_GL_TEXTURE | VREND_STORAGE_GL_BUFFER)))
+      return false;
+
+   const uint64_t size = vrend_destroy_queue_size(res);
+   if (size > limit)
+      return false;
+
+   /* resources that were never looked up since creation are covered by the
+    * next fence of the current context, as anything else */
+   if (!res->last_use_timeline)
+      vrend_resource_stamp_use(res);
+
+   list_addtail(&res->destroy_head, &vrend_state.destroy_queue.list);
+   vrend_state.destroy_queue.size += size;
+
+   /* over the limit, delete the oldest objects even if that stalls */
+   while (vrend_state.destroy_queue.size > limit) {
+      struct vrend_resource *oldest =
+         LIST_ENTRY(struct vrend_resource, vrend_state.destroy_queue.list.next, destroy_head);
+      vrend_destroy_queue_remove(oldest);
+   }
+
+   return true;
+}
+
+void vrend_renderer_resource_destroy(struct vrend_resource *res)
+{
+   if (res->storage_deferred) {
+      vrend_state.lazy_storage.never_materialized++;
+      vrend_state.lazy_storage.never_materialized_size += vrend_residency_texture_size(res);
+   }
+
+   vrend_residency_untrack(res);
+
+   if (!vrend_destroy_queue_add(res))
+      vrend_resource_free(res);
+}
+
+/* The formats of the planes that vrend_renderer_resource_import_egl_image
+ * accepts.  VREND_STORAGE_EGL_IMAGE changes how 24bpp and BGRA resources
+ * are viewed and read back, which must not change under the guest. */
+static bool vrend_format_is_video_plane(enum virgl_formats format)
+{
+   switch (format) {
+   case VIRGL_FORMAT_R8_UNORM:
+   case VIRGL_FORMAT_R8G8_UNORM:
+   case VIRGL_FORMAT_R16_UNORM:
+   case VIRGL_FORMAT_R16G16_UNORM:
+      return true;
+   default:
+      return false;
+   }
+}
+
+/* Re-point the GL texture of a single-level 2D video plane resource at an
+ * external EGLImage so that the image contents can be sampled without a copy.
+ *
+ * Mutable textures are re-specified in place, so that sampler views and
+ * surfaces that share the texture name stay valid.  Immutable textures can't
+ * be re-specified, so their name is only replaced while nothing but the
+ * resource table holds a reference to the resource. */
+int vrend_renderer_resource_import_egl_image(struct vrend_resource *res,
+                                             void *image)
+{
+   GLuint id;
+
+   if (!has_bit(res->storage_bits, VREND_STORAGE_GL_TEXTURE) ||
+       res->target != GL_TEXTURE_2D || res->base.last_level > 0 ||
+       res->base.nr_samples > 1 || !image)
+      return EINVAL;
+
+   if (!vrend_format_is_video_plane(res->base.format))
+      return EINVAL;
+
+   if (!has_feature(feat_egl_image) && !has_feature(feat_egl_image_storage))
+      return EINVAL;
+
+   if (!vrend_resource_touch(res))
+      return ENOMEM;
+
+   if (!has_bit(res->storage_bits, VREND_STORAGE_GL_IMMUTABLE)) {
+      if (!has_feature(feat_egl_image))
+         return EINVAL;
+
+      glBindTexture(res->target, res->id);
+      glEGLImageTargetTexture2DOES(res->target, (GLeglImageOES) image);
+      glBindTexture(res->target, 0);
+      if (glGetError() != GL_NO_ERROR)
+         return EINVAL;
+
+      res->storage_bits |= VREND_STORAGE_EGL_IMAGE;
+      return 0;
+   }
+
+   if (p_atomic_read(&res->base.reference.count) > 1)
+      return EBUSY;
+
+   glGenTextures(1, &id);
+   glBindTexture(res->target, id);
+   if (has_feature(feat_egl_image_storage))
+      glEGLImageTargetTexStorageEXT(res->target, (GLeglImageOES) image, NULL);
+   else
+      glEGLImageTargetTexture2DOES(res->target, (GLeglImageOES) image);
+   glBindTexture(res->target, 0);
+
+   if (glGetError() != GL_NO_ERROR) {
+      glDeleteTextures(1, &id);
+      return EINVAL;
+   }
+
+   glDeleteTextures(1, &res->id);
+   res->id = id;
+   if (!has_feature(feat_egl_image_storage))
+      res->storage_bits &= ~VREND_STORAGE_GL_IMMUTABLE;
+   res->storage_bits |= VREND_STORAGE_EGL_IMAGE;
+
+   return 0;
+}
+
 struct virgl_sub_upload_data {
    GLenum target;
    struct pipe_box *box;
@@ -8648,21 +10165,8 @@ struct virgl_sub_upload_data {
 
 static void iov_buffer_upload(void *cookie, uint32_t doff, void *src, int len)
 {
-   struct virgl_sub_upload_data *d = cookie;
-   glBufferSubData(d->target, d->box->x + doff, len, src);
-}
-
-static void vrend_scale_depth(void *ptr, int size, float scale_val)
-{
-   GLuint *ival = ptr;
-   const GLfloat myscale = 1.0f / 0xffffff;
-   int i;
-   for (i = 0; i < size / 4; i++) {
-      GLuint value = ival[i];
-      GLfloat d = ((float)(value >> 8) * myscale) * scale_val;
-      d = CLAMP(d, 0.0F, 1.0F);
-      ival[i] = (int)(d / myscale) << 8;
-   }
+   struct virgl_sub_upload_data *d = cookie;
+   glBufferSubData(d->target, d->box->x + doff, len, src);
 }
 
 static void read_transfer_data(const struct iovec *iov,
@@ -8894,15 +10398,142 @@ static bool check_iov_bounds(struct vrend_resource *res,
    return true;
 }
 
-static void vrend_swizzle_data_bgra(uint64_t size, void *data) {
-   const size_t bpp = 4;
-   const size_t num_pixels = size / bpp;
-   for (size_t i = 0; i < num_pixels; ++i) {
-      unsigned char *pixel = ((unsigned char*)data) + i * bpp;
-      unsigned char first  = *pixel;
-      *pixel = *(pixel + 2);
-      *(pixel + 2) = first;
+#define VREND_UPLOAD_MAX_BANDS 64
+
+/* Uploads the texels of box, whose y is in GL coordinates, from data. */
+static void vrend_transfer_write_tex_image(struct vrend_context *ctx,
+                                           struct vrend_resource *res,
+                                           uint32_t level,
+                                           const struct pipe_box *box,
+                                           GLenum glformat, GLenum gltype,
+                                           bool compressed, uint32_t comp_size,
+                                           const void *data)
+{
+   if (res->target == GL_TEXTURE_CUBE_MAP) {
+      GLenum ctarget = GL_TEXTURE_CUBE_MAP_POSITIVE_X + box->z;
+      if (compressed) {
+         glCompressedTexSubImage2D(ctarget, level, box->x, box->y,
+                                   box->width, box->height,
+                                   glformat, comp_size, data);
+      } else {
+         glTexSubImage2D(ctarget, level, box->x, box->y, box->width, box->height,
+                         glformat, gltype, data);
+      }
+   } else if (res->target == GL_TEXTURE_3D || res->target == GL_TEXTURE_2D_ARRAY || res->target == GL_TEXTURE_CUBE_MAP_ARRAY) {
+      if (compressed) {
+         glCompressedTexSubImage3D(res->target, level, box->x, box->y, box->z,
+                                   box->width, box->height, box->depth,
+                                   glformat, comp_size, data);
+      } else {
+         glTexSubImage3D(res->target, level, box->x, box->y, box->z,
+                         box->width, box->height, box->depth,
+                         glformat, gltype, data);
+      }
+   } else if (res->target == GL_TEXTURE_1D) {
+      if (vrend_state.use_gles) {
+         /* Covers both compressed and none compressed. */
+         report_gles_missing_func(ctx, "gl[Compressed]TexSubImage1D");
+      } else if (compressed) {
+         glCompressedTexSubImage1D(res->target, level, box->x,
+                                   box->width,
+                                   glformat, comp_size, data);
+      } else {
+         glTexSubImage1D(res->target, level, box->x, box->width,
+                         glformat, gltype, data);
+      }
+   } else {
+      if (compressed) {
+         glCompressedTexSubImage2D(res->target, level, box->x, res->target == GL_TEXTURE_1D_ARRAY ? box->z : box->y,
+                                   box->width, box->height,
+                                   glformat, comp_size, data);
+      } else {
+         glTexSubImage2D(res->target, level, box->x, res->target == GL_TEXTURE_1D_ARRAY ? box->z : box->y,
+                         box->width,
+                         res->target == GL_TEXTURE_1D_ARRAY ? box->depth : box->height,
+                         glformat, gltype, data);
+      }
+   }
+}
+
+/* Splits the staging data of a texture upload in bands, of rows for a single
+ * image and of whole slices otherwise, and queues them on the upload threads.
+ * Returns the number of bands, or 0 when the data is better read and
+ * converted on this thread.
+ */
+static unsigned int vrend_transfer_write_submit_bands(struct vrend_resource *res,
+                                                      const struct iovec *iov, int num_iovs,
+                                                      char *data, uint32_t send_size,
+                                                      const struct vrend_transfer_info *info,
+                                                      uint32_t stride, uint32_t layer_stride,
+                                                      bool invert,
+                                                      struct vrend_upload_job *jobs)
+{
+   const uint32_t row_size = info->box->width * util_format_get_blocksize(res->base.format);
+   const uint32_t rows = info->box->height;
+   const uint32_t total_rows = rows * info->box->depth;
+   uint32_t band_rows;
+   unsigned int num_bands;
+
+   if (!vrend_upload_enabled() || send_size < 2 * VREND_UPLOAD_BAND_SIZE ||
+       util_format_is_compressed(res->base.format))
+      return 0;
+
+   switch (res->target) {
+   case GL_TEXTURE_2D:
+   case GL_TEXTURE_RECTANGLE_NV:
+   case GL_TEXTURE_CUBE_MAP:
+   case GL_TEXTURE_3D:
+   case GL_TEXTURE_2D_ARRAY:
+   case GL_TEXTURE_CUBE_MAP_ARRAY:
+      break;
+   default:
+      return 0;
+   }
+
+   /* glDrawPixels takes the whole image */
+   if (!vrend_state.use_core_profile && res->y_0_top)
+      return 0;
+
+   if (info->box->depth == 1)
+      band_rows = MAX2(VREND_UPLOAD_BAND_SIZE / row_size, 1);
+   else
+      band_rows = MAX2(VREND_UPLOAD_BAND_SIZE / (row_size * rows), 1) * rows;
+
+   num_bands = DIV_ROUND_UP(total_rows, band_rows);
+   if (num_bands > VREND_UPLOAD_MAX_BANDS) {
+      band_rows *= DIV_ROUND_UP(num_bands, VREND_UPLOAD_MAX_BANDS);
+      num_bands = DIV_ROUND_UP(total_rows, band_rows);
+   }
+
+   /* read_transfer_data ignores the strides in that case */
+   if ((send_size == vrend_get_iovec_size(iov, num_iovs) || rows == 1) &&
+       !invert && info->box->depth == 1) {
+      stride = row_size;
+      layer_stride = rows * row_size;
+   }
+
+   for (unsigned int i = 0; i < num_bands; i++) {
+      jobs[i] = (struct vrend_upload_job) {
+         .iov = iov,
+         .num_iovs = num_iovs,
+         .offset = info->offset,
+         .stride = stride,
+         .layer_stride = layer_stride,
+         .row_size = row_size,
+         .rows_per_slice = rows,
+         .invert = invert,
+         .swap_rb = vrend_state.use_gles && vrend_format_is_bgra(res->base.format),
+         .z24_scale = vrend_state.use_core_profile &&
+                      res->base.format == VIRGL_FORMAT_Z24X8_UNORM ? 256.0f : 0.0f,
+         .staging = data,
+         .first_row = i * band_rows,
+         .num_rows = MIN2(band_rows, total_rows - i * band_rows),
+      };
    }
+
+   vrend_upload_submit(jobs, num_bands);
+
+   return num_bands;
 }
 
 static int vrend_renderer_transfer_write_iov(struct vrend_context *ctx,
@@ -8957,6 +10588,8 @@ static int vrend_renderer_transfer_write_iov(struct vrend_context *ctx,
       GLuint send_size = 0;
       uint32_t stride = info->stride;
       uint32_t layer_stride = info->layer_stride;
+      struct vrend_upload_job jobs[VREND_UPLOAD_MAX_BANDS];
+      unsigned int num_bands = 0;
 
       vrend_use_program(ctx->sub, 0);
 
@@ -8997,8 +10630,12 @@ static int vrend_renderer_transfer_write_iov(struct vrend_context *ctx,
          data = malloc(send_size);
          if (!data)
             return ENOMEM;
-         read_transfer_data(iov, num_iovs, data, res->base.format, info->offset,
-                            stride, layer_stride, info->box, invert);
+         num_bands = vrend_transfer_write_submit_bands(res, iov, num_iovs, data, send_size,
+                                                       info, stride, layer_stride, invert,
+                                                       jobs);
+         if (!num_bands)
+            read_transfer_data(iov, num_iovs, data, res->base.format, info->offset,
+                               stride, layer_stride, info->box, invert);
       } else {
          if (send_size > iov[0].iov_len - info->offset)
             return EINVAL;
@@ -9055,7 +10692,7 @@ static int vrend_renderer_transfer_write_iov(struct vrend_context *ctx,
                       data);
          glDeleteFramebuffers(1, &fb_id);
       } else {
-         uint32_t comp_size;
+         uint32_t comp_size = 0;
          glBindTexture(res->target, res->id);
 
          if (compressed) {
@@ -9076,7 +10713,8 @@ static int vrend_renderer_transfer_write_iov(struct vrend_context *ctx,
           * internal format. So we fallback to performing a CPU swizzle before uploading. */
          if (vrend_state.use_gles && vrend_format_is_bgra(res->base.format)) {
             VREND_DEBUG(dbg_bgra, ctx, "manually swizzling bgra->rgba on upload since gles+bgra\n");
-            vrend_swizzle_data_bgra(send_size, data);
+            if (!num_bands)
+               vrend_convert_swap_rb(data, send_size / 4);
          }
 
          /* mipmaps are usually passed in one iov, and we need to keep the offset
@@ -9098,52 +10736,36 @@ static int vrend_renderer_transfer_write_iov(struct vrend_context *ctx,
             depth_scale = 256.0;
             if (!vrend_state.use_core_profile)
                glPixelTransferf(GL_DEPTH_SCALE, depth_scale);
-            else
-               vrend_scale_depth(data, send_size, depth_scale);
+            else if (!num_bands)
+               vrend_convert_z24_scale(data, send_size / 4, depth_scale);
          }
-         if (res->target == GL_TEXTURE_CUBE_MAP) {
-            GLenum ctarget = GL_TEXTURE_CUBE_MAP_POSITIVE_X + info->box->z;
-            if (compressed) {
-               glCompressedTexSubImage2D(ctarget, info->level, x, y,
-                                         info->box->width, info->box->height,
-                                         glformat, comp_size, data);
-            } else {
-               glTexSubImage2D(ctarget, info->level, x, y, info->box->width, info->box->height,
-                               glformat, gltype, data);
-            }
-         } else if (res->target == GL_TEXTURE_3D || res->target == GL_TEXTURE_2D_ARRAY || res->target == GL_TEXTURE_CUBE_MAP_ARRAY) {
-            if (compressed) {
-               glCompressedTexSubImage3D(res->target, info->level, x, y, info->box->z,
-                                         info->box->width, info->box->height, info->box->depth,
-                                         glformat, comp_size, data);
-            } else {
-               glTexSubImage3D(res->target, info->level, x, y, info->box->z,
-                               info->box->width, info->box->height, info->box->depth,
-                               glformat, gltype, data);
-            }
-         } else if (res->target == GL_TEXTURE_1D) {
-            if (vrend_state.use_gles) {
-               /* Covers both compressed and none compressed. */
-               report_gles_missing_func(ctx, "gl[Compressed]TexSubImage1D");
-            } else if (compressed) {
-               glCompressedTexSubImage1D(res->target, info->level, info->box->x,
-                                         info->box->width,
-                                         glformat, comp_size, data);
-            } else {
-               glTexSubImage1D(res->target, info->level, info->box->x, info->box->width,
-                               glformat, gltype, data);
+         if (num_bands) {
+            /* upload each band as soon as the upload threads have prepared it */
+            for (unsigned int i = 0; i < num_bands; i++) {
+               struct pipe_box band = *info->box;
+
+               vrend_upload_wait(&jobs[i]);
+
+               if (info->box->depth == 1) {
+                  band.y = y + jobs[i].first_row;
+                  band.height = jobs[i].num_rows;
+               } else {
+                  band.y = y;
+                  band.z += jobs[i].first_row / info->box->height;
+                  band.depth = jobs[i].num_rows / info->box->height;
+               }
+
+               vrend_transfer_write_tex_image(ctx, res, info->level, &band, glformat, gltype,
+                                              false, 0,
+                                              (char *)data + (uint64_t)jobs[i].first_row *
+                                                             jobs[i].row_size);
             }
          } else {
-            if (compressed) {
-               glCompressedTexSubImage2D(res->target, info->level, x, res->target == GL_TEXTURE_1D_ARRAY ? info->box->z : y,
-                                         info->box->width, info->box->height,
-                                         glformat, comp_size, data);
-            } else {
-               glTexSubImage2D(res->target, info->level, x, res->target == GL_TEXTURE_1D_ARRAY ? info->box->z : y,
-                               info->box->width,
-                               res->target == GL_TEXTURE_1D_ARRAY ? info->box->depth : info->box->height,
-                               glformat, gltype, data);
-            }
+            struct pipe_box box = *info->box;
+
+            box.y = y;
+            vrend_transfer_write_tex_image(ctx, res, info->level, &box, glformat, gltype,
+                                           compressed, comp_size, data);
          }
          if (res->base.format == VIRGL_FORMAT_Z24X8_UNORM) {
             if (!vrend_state.use_core_profile)
@@ -9416,14 +11038,14 @@ static int vrend_transfer_send_readpixels(struct vrend_context *ctx,
     * byte-ordering is used instead to match external access patterns. */
    if (vrend_state.use_gles && vrend_format_is_bgra(res->base.format)) {
       VREND_DEBUG(dbg_bgra, ctx, "manually swizzling rgba->bgra on readback since gles+bgra\n");
-      vrend_swizzle_data_bgra(send_size, data);
+      vrend_convert_swap_rb(data, send_size / 4);
    }
 
    if (res->base.format == VIRGL_FORMAT_Z24X8_UNORM) {
       if (!vrend_state.use_core_profile)
          glPixelTransferf(GL_DEPTH_SCALE, 1.0);
       else
-         vrend_scale_depth(data, send_size, depth_scale);
+         vrend_convert_z24_scale(data, send_size / 4, depth_scale);
    }
    if (has_feature(feat_mesa_invert) && actually_invert)
       glPixelStorei(GL_PACK_INVERT_MESA, 0);
@@ -9554,6 +11176,9 @@ static int vrend_renderer_transfer_internal(struct vrend_context *ctx,
       num_iovs = res->num_iovs;
    }
 
+   if (transfer_mode == VIRGL_TRANSFER_TO_HOST)
+      vrend_resource_mark_written(res);
+
 #if defined(HAVE_EPOXY_EGL_H) && defined(ENABLE_MINIGBM_ALLOCATION)
    if (res->gbm_bo && (transfer_mode == VIRGL_TRANSFER_TO_HOST ||
                        !has_bit(res->storage_bits, VREND_STORAGE_EGL_IMAGE))) {
@@ -9618,6 +11243,9 @@ int vrend_renderer_transfer_pipe(struct pipe_resource *pres,
    if (!check_transfer_iovec(res, info))
       return EINVAL;
 
+   if (!vrend_resource_touch(res))
+      return ENOMEM;
+
    return vrend_renderer_transfer_internal(vrend_state.ctx0, res, info,
                                            transfer_mode);
 }
@@ -9644,6 +11272,8 @@ int vrend_transfer_inline_write(struct vrend_context *ctx,
       return EINVAL;
    }
 
+   vrend_resource_mark_written(res);
+
 #if defined(HAVE_EPOXY_EGL_H) && defined(ENABLE_MINIGBM_ALLOCATION)
    if (res->gbm_bo) {
       assert(!info->synchronized);
@@ -9694,6 +11324,8 @@ int vrend_renderer_copy_transfer3d(struct vrend_context *ctx,
       return EINVAL;
    }
 
+   vrend_resource_mark_written(dst_res);
+
 #if defined(HAVE_EPOXY_EGL_H) && defined(ENABLE_MINIGBM_ALLOCATION)
    if (dst_res->gbm_bo) {
       bool use_gbm = true;
@@ -9909,7 +11541,7 @@ static void vrend_hw_emit_streamout_targets(UNUSED struct vrend_context *ctx, st
 {
    uint i;
 
-   for (i = 0; i < so_obj->num_targets; i++) {
+   for (i = 0; i < so_obj->key.num_targets; i++) {
       if (!so_obj->so_targets[i])
          glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, i, 0);
       else if (so_obj->so_targets[i]->buffer_offset || so_obj->so_targets[i]->buffer_size < so_obj->so_targets[i]->buffer->base.width0)
@@ -9919,60 +11551,114 @@ static void vrend_hw_emit_streamout_targets(UNUSED struct vrend_context *ctx, st
    }
 }
 
+/* Take the least recently bound idle object out of a full cache so that its
+ * GL transform feedback object can be reused.  Active and paused objects can
+ * still be resumed by the guest and are never evicted, when all of them are
+ * busy the caller allocates a new object and the cache grows past its size. */
+static struct vrend_streamout_object *
+vrend_streamout_cache_evict(struct vrend_sub_context *sub_ctx)
+{
+   struct vrend_streamout_object *obj, *tmp;
+
+   if (sub_ctx->streamout_count < VREND_STREAMOUT_CACHE_SIZE)
+      return NULL;
+
+   LIST_FOR_EACH_ENTRY_SAFE_REV(obj, tmp, &sub_ctx->streamout_list, head) {
+      if (obj == sub_ctx->current_so ||
+          obj->xfb_state == XFB_STATE_STARTED ||
+          obj->xfb_state == XFB_STATE_PAUSED)
+         continue;
+
+      vrend_streamout_object_release(sub_ctx, obj);
+      sub_ctx->streamout_stats.evictions++;
+      return obj;
+   }
+
+   return NULL;
+}
+
 void vrend_set_streamout_targets(struct vrend_context *ctx,
                                  UNUSED uint32_t append_bitmask,
                                  uint32_t num_targets,
                                  uint32_t *handles)
 {
-   struct vrend_so_target *target;
+   struct vrend_sub_context *sub_ctx = ctx->sub;
+   struct vrend_so_target *targets[16] = { 0 };
+   uint32_t old_num_targets = 0;
    uint i;
 
    if (!has_feature(feat_transform_feedback))
       return;
 
    if (num_targets) {
-      bool found = false;
       struct vrend_streamout_object *obj;
-      LIST_FOR_EACH_ENTRY(obj, &ctx->sub->streamout_list, head) {
-         if (obj->num_targets == num_targets) {
-            if (!memcmp(handles, obj->handles, num_targets * 4)) {
-               found = true;
-               break;
-            }
-         }
-      }
-      if (found) {
-         ctx->sub->current_so = obj;
-         glBindTransformFeedback(GL_TRANSFORM_FEEDBACK, obj->id);
+      struct vrend_streamout_key key;
+      struct hash_entry *entry;
+
+      key.num_targets = num_targets;
+      memcpy(key.handles, handles, num_targets * sizeof(key.handles[0]));
+
+      entry = _mesa_hash_table_search(sub_ctx->streamout_cache, &key);
+      if (entry) {
+         obj = entry->data;
+         list_del(&obj->head);
+         list_add(&obj->head, &sub_ctx->streamout_list);
+         sub_ctx->streamout_stats.hits++;
+
+         sub_ctx->current_so = obj;
+         if (has_feature(feat_transform_feedback2))
+            glBindTransformFeedback(GL_TRANSFORM_FEEDBACK, obj->id);
+         else
+            vrend_hw_emit_streamout_targets(ctx, obj);
          return;
       }
+      sub_ctx->streamout_stats.misses++;
 
-      obj = CALLOC_STRUCT(vrend_streamout_object);
-      if (has_feature(feat_transform_feedback2)) {
-         glGenTransformFeedbacks(1, &obj->id);
-         glBindTransformFeedback(GL_TRANSFORM_FEEDBACK, obj->id);
-      }
-      obj->num_targets = num_targets;
       for (i = 0; i < num_targets; i++) {
-         obj->handles[i] = handles[i];
          if (handles[i] == 0)
             continue;
-         target = vrend_object_lookup(ctx->sub->object_hash, handles[i], VIRGL_OBJECT_STREAMOUT_TARGET);
-         if (!target) {
+         targets[i] = vrend_object_lookup(sub_ctx->object_hash, handles[i], VIRGL_OBJECT_STREAMOUT_TARGET);
+         if (!targets[i]) {
             vrend_report_context_error(ctx, VIRGL_ERROR_CTX_ILLEGAL_HANDLE, handles[i]);
-            free(obj);
             return;
          }
-         vrend_so_target_reference(&obj->so_targets[i], target);
       }
+
+      obj = vrend_streamout_cache_evict(sub_ctx);
+      if (obj) {
+         GLuint id = obj->id;
+
+         old_num_targets = obj->key.num_targets;
+         memset(obj, 0, sizeof(*obj));
+         obj->id = id;
+      } else {
+         obj = CALLOC_STRUCT(vrend_streamout_object);
+         if (!obj)
+            return;
+         if (has_feature(feat_transform_feedback2))
+            glGenTransformFeedbacks(1, &obj->id);
+      }
+
+      if (has_feature(feat_transform_feedback2))
+         glBindTransformFeedback(GL_TRANSFORM_FEEDBACK, obj->id);
+
+      obj->key = key;
+      for (i = 0; i < num_targets; i++)
+         vrend_so_target_reference(&obj->so_targets[i], targets[i]);
       vrend_hw_emit_streamout_targets(ctx, obj);
-      list_addtail(&obj->head, &ctx->sub->streamout_list);
-      ctx->sub->current_so = obj;
+      /* a recycled object may still have buffers bound past the new ones */
+      for (i = num_targets; i < old_num_targets; i++)
+         glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, i, 0);
+
+      _mesa_hash_table_insert(sub_ctx->streamout_cache, &obj->key, obj);
+      list_add(&obj->head, &sub_ctx->streamout_list);
+      sub_ctx->streamout_count++;
+      sub_ctx->current_so = obj;
       obj->xfb_state = XFB_STATE_STARTED_NEED_BEGIN;
    } else {
       if (has_feature(feat_transform_feedback2))
          glBindTransformFeedback(GL_TRANSFORM_FEEDBACK, 0);
-      ctx->sub->current_so = NULL;
+      sub_ctx->current_so = NULL;
    }
 }
 
@@ -10062,7 +11748,7 @@ static void vrend_resource_copy_fallback(struct vrend_resource *src_res,
          as 32-bit scaled integers, so we need to scale them here */
       if (dst_res->base.format == VIRGL_FORMAT_Z24X8_UNORM) {
          float depth_scale = 256.0;
-         vrend_scale_depth(tptr, total_size, depth_scale);
+         vrend_convert_z24_scale(tptr, total_size / 4, depth_scale);
       }
 
       /* if this is a BGR* resource on GLES, the data needs to be manually swizzled to RGB* before
@@ -10072,7 +11758,7 @@ static void vrend_resource_copy_fallback(struct vrend_resource *src_res,
        * all times.
        */
       if (vrend_state.use_gles && vrend_format_is_bgra(dst_res->base.format))
-         vrend_swizzle_data_bgra(total_size, tptr);
+         vrend_convert_swap_rb(tptr, total_size / 4);
    } else {
       uint32_t read_chunk_size;
       switch (elsize) {
@@ -10195,10 +11881,59 @@ void vrend_renderer_resource_copy_region(struct vrend_context *ctx,
                                          uint32_t src_handle, uint32_t src_level,
                                          const struct pipe_box *src_box)
 {
-   struct vrend_resource *src_res, *dst_res;
-   GLbitfield glmask = 0;
+   const struct vrend_copy_region region = {
+      .dstx = dstx,
+      .dsty = dsty,
+      .dstz = dstz,
+      .src_box = *src_box,
+   };
+
+   vrend_renderer_resource_copy_regions(ctx, dst_handle, dst_level,
+                                        src_handle, src_level, &region, 1);
+}
+
+static void vrend_blit_copy_region(struct vrend_resource *src_res,
+                                   struct vrend_resource *dst_res,
+                                   const struct vrend_copy_region *region)
+{
+   const struct pipe_box *src_box = &region->src_box;
    GLint sy1, sy2, dy1, dy2;
+
+   if (!src_res->y_0_top) {
+      sy1 = src_box->y;
+      sy2 = src_box->y + src_box->height;
+   } else {
+      sy1 = src_res->base.height0 - src_box->y - src_box->height;
+      sy2 = src_res->base.height0 - src_box->y;
+   }
+
+   if (!dst_res->y_0_top) {
+      dy1 = region->dsty;
+      dy2 = region->dsty + src_box->height;
+   } else {
+      dy1 = dst_res->base.height0 - region->dsty - src_box->height;
+      dy2 = dst_res->base.height0 - region->dsty;
+   }
+
+   glBlitFramebuffer(src_box->x, sy1,
+                     src_box->x + src_box->width,
+                     sy2,
+                     region->dstx, dy1,
+                     region->dstx + src_box->width,
+                     dy2,
+                     GL_COLOR_BUFFER_BIT, GL_NEAREST);
+}
+
+void vrend_renderer_resource_copy_regions(struct vrend_context *ctx,
+                                          uint32_t dst_handle, uint32_t dst_level,
+                                          uint32_t src_handle, uint32_t src_level,
+                                          const struct vrend_copy_region *regions,
+                                          uint32_t num_regions)
+{
+   struct vrend_resource *src_res, *dst_res;
+   uint32_t src_layer, dst_layer;
    unsigned int comp_flags;
+   uint32_t i;
 
    if (ctx->in_error)
       return;
@@ -10215,21 +11950,29 @@ void vrend_renderer_resource_copy_region(struct vrend_context *ctx,
       return;
    }
 
-   VREND_DEBUG(dbg_copy_resource, ctx, "COPY_REGION: From %s ms:%d [%d, %d, %d]+[%d, %d, %d] lvl:%d "
-                                   "To %s ms:%d [%d, %d, %d]\n",
-                                   util_format_name(src_res->base.format), src_res->base.nr_samples,
-                                   src_box->x, src_box->y, src_box->z,
-                                   src_box->width, src_box->height, src_box->depth,
-                                   src_level,
-                                   util_format_name(dst_res->base.format), dst_res->base.nr_samples,
-                                   dstx, dsty, dstz);
+   for (i = 0; i < num_regions; i++) {
+      const struct pipe_box *src_box = &regions[i].src_box;
+
+      VREND_DEBUG(dbg_copy_resource, ctx, "COPY_REGION: From %s ms:%d [%d, %d, %d]+[%d, %d, %d] lvl:%d "
+                                      "To %s ms:%d [%d, %d, %d]\n",
+                                      util_format_name(src_res->base.format), src_res->base.nr_samples,
+                                      src_box->x, src_box->y, src_box->z,
+                                      src_box->width, src_box->height, src_box->depth,
+                                      src_level,
+                                      util_format_name(dst_res->base.format), dst_res->base.nr_samples,
+                                      regions[i].dstx, regions[i].dsty, regions[i].dstz);
+   }
+
+   vrend_resource_mark_written(dst_res);
 
    if (src_res->base.target == PIPE_BUFFER && dst_res->base.target == PIPE_BUFFER) {
       /* do a buffer copy */
-      VREND_DEBUG(dbg_copy_resource, ctx, "COPY_REGION: buffer copy %d+%d\n",
-                  src_box->x, src_box->width);
-      vrend_resource_buffer_copy(ctx, src_res, dst_res, dstx,
-                                 src_box->x, src_box->width);
+      for (i = 0; i < num_regions; i++) {
+         VREND_DEBUG(dbg_copy_resource, ctx, "COPY_REGION: buffer copy %d+%d\n",
+                     regions[i].src_box.x, regions[i].src_box.width);
+         vrend_resource_buffer_copy(ctx, src_res, dst_res, regions[i].dstx,
+                                    regions[i].src_box.x, regions[i].src_box.width);
+      }
       return;
    }
 
@@ -10243,16 +11986,19 @@ void vrend_renderer_resource_copy_region(struct vrend_context *ctx,
        format_is_copy_compatible(src_res->base.format,dst_res->base.format, comp_flags) &&
        src_res->base.nr_samples == dst_res->base.nr_samples) {
       VREND_DEBUG(dbg_copy_resource, ctx, "COPY_REGION: use glCopyImageSubData\n");
-      vrend_copy_sub_image(src_res, dst_res, src_level, src_box,
-                           dst_level, dstx, dsty, dstz);
+      for (i = 0; i < num_regions; i++)
+         vrend_copy_sub_image(src_res, dst_res, src_level, &regions[i].src_box,
+                              dst_level, regions[i].dstx, regions[i].dsty, regions[i].dstz);
       return;
    }
 
    if (!vrend_format_can_render(src_res->base.format) ||
        !vrend_format_can_render(dst_res->base.format)) {
       VREND_DEBUG(dbg_copy_resource, ctx, "COPY_REGION: use resource_copy_fallback\n");
-      vrend_resource_copy_fallback(src_res, dst_res, dst_level, dstx,
-                                   dsty, dstz, src_level, src_box);
+      for (i = 0; i < num_regions; i++)
+         vrend_resource_copy_fallback(src_res, dst_res, dst_level, regions[i].dstx,
+                                      regions[i].dsty, regions[i].dstz, src_level,
+                                      &regions[i].src_box);
       return;
    }
 
@@ -10262,42 +12008,42 @@ void vrend_renderer_resource_copy_region(struct vrend_context *ctx,
    /* clean out fb ids */
    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT,
                           GL_TEXTURE_2D, 0, 0);
-   vrend_fb_bind_texture(src_res, 0, src_level, src_box->z);
+   src_layer = regions[0].src_box.z;
+   vrend_fb_bind_texture(src_res, 0, src_level, src_layer);
 
    glBindFramebuffer(GL_FRAMEBUFFER, ctx->sub->blit_fb_ids[1]);
    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT,
                           GL_TEXTURE_2D, 0, 0);
-   vrend_fb_bind_texture(dst_res, 0, dst_level, dstz);
+   dst_layer = regions[0].dstz;
+   vrend_fb_bind_texture(dst_res, 0, dst_level, dst_layer);
    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, ctx->sub->blit_fb_ids[1]);
 
    glBindFramebuffer(GL_READ_FRAMEBUFFER, ctx->sub->blit_fb_ids[0]);
 
-   glmask = GL_COLOR_BUFFER_BIT;
    glDisable(GL_SCISSOR_TEST);
 
-   if (!src_res->y_0_top) {
-      sy1 = src_box->y;
-      sy2 = src_box->y + src_box->height;
-   } else {
-      sy1 = src_res->base.height0 - src_box->y - src_box->height;
-      sy2 = src_res->base.height0 - src_box->y;
-   }
+   for (i = 0; i < num_regions; i++) {
+      bool rebind = false;
 
-   if (!dst_res->y_0_top) {
-      dy1 = dsty;
-      dy2 = dsty + src_box->height;
-   } else {
-      dy1 = dst_res->base.height0 - dsty - src_box->height;
-      dy2 = dst_res->base.height0 - dsty;
-   }
+      if (regions[i].src_box.z != (int)src_layer) {
+         src_layer = regions[i].src_box.z;
+         glBindFramebuffer(GL_FRAMEBUFFER, ctx->sub->blit_fb_ids[0]);
+         vrend_fb_bind_texture(src_res, 0, src_level, src_layer);
+         rebind = true;
+      }
+      if (regions[i].dstz != dst_layer) {
+         dst_layer = regions[i].dstz;
+         glBindFramebuffer(GL_FRAMEBUFFER, ctx->sub->blit_fb_ids[1]);
+         vrend_fb_bind_texture(dst_res, 0, dst_level, dst_layer);
+         rebind = true;
+      }
+      if (rebind) {
+         glBindFramebuffer(GL_DRAW_FRAMEBUFFER, ctx->sub->blit_fb_ids[1]);
+         glBindFramebuffer(GL_READ_FRAMEBUFFER, ctx->sub->blit_fb_ids[0]);
+      }
 
-   glBlitFramebuffer(src_box->x, sy1,
-                     src_box->x + src_box->width,
-                     sy2,
-                     dstx, dy1,
-                     dstx + src_box->width,
-                     dy2,
-                     glmask, GL_NEAREST);
+      vrend_blit_copy_region(src_res, dst_res, &regions[i]);
+   }
 
    glBindFramebuffer(GL_READ_FRAMEBUFFER, ctx->sub->blit_fb_ids[0]);
    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
@@ -10306,7 +12052,7 @@ void vrend_renderer_resource_copy_region(struct vrend_context *ctx,
    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
                           GL_TEXTURE_2D, 0, 0);
 
-   glBindFramebuffer(GL_FRAMEBUFFER, ctx->sub->fb_id);
+   glBindFramebuffer(GL_FRAMEBUFFER, ctx->sub->cur_fb_id);
 
    if (ctx->sub->rs_state.scissor)
       glEnable(GL_SCISSOR_TEST);
@@ -10558,7 +12304,7 @@ static void vrend_renderer_blit_fbo(struct vrend_context *ctx,
       intermediate_copy = (struct vrend_resource *)CALLOC_STRUCT(vrend_texture);
       vrend_renderer_resource_copy_args(&args, intermediate_copy);
       /* this is PIPE_MASK_ZS and bgra fixup is not needed */
-      ASSERTED int r = vrend_resource_alloc_texture(intermediate_copy, args.format, NULL);
+      ASSERTED int r = vrend_resource_alloc_texture(intermediate_copy, args.format, NULL, false);
       assert(!r);
 
       glGenFramebuffers(1, &intermediate_fbo);
@@ -10642,7 +12388,7 @@ static void vrend_renderer_blit_fbo(struct vrend_context *ctx,
    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT,
                           GL_TEXTURE_2D, 0, 0);
 
-   glBindFramebuffer(GL_FRAMEBUFFER, ctx->sub->fb_id);
+   glBindFramebuffer(GL_FRAMEBUFFER, ctx->sub->cur_fb_id);
 
    if (has_feature(feat_srgb_write_control)) {
       if (ctx->sub->framebuffer_srgb_enabled)
@@ -10694,8 +12440,12 @@ static void vrend_renderer_blit_int(struct vrend_context *ctx,
       blit_info.has_srgb_write_control = has_feature(feat_texture_srgb_decode);
       blit_info.has_texture_srgb_decode = has_feature(feat_srgb_write_control);
 
+      blit_info.has_compute_blit = has_feature(feat_compute_shader) &&
+                                   has_feature(feat_images);
+
       VREND_DEBUG(dbg_blit, ctx, "BLIT_INT: use GL fallback\n");
-      vrend_renderer_blit_gl(ctx, src_res, dst_res, &blit_info);
+      if (!vrend_renderer_blit_compute(ctx, src_res, dst_res, &blit_info))
+         vrend_renderer_blit_gl(ctx, src_res, dst_res, &blit_info);
       vrend_sync_make_current(ctx->sub->gl_context);
    }
 
@@ -10738,6 +12488,8 @@ void vrend_renderer_blit(struct vrend_context *ctx,
       return;
    }
 
+   vrend_resource_mark_written(dst_res);
+
    if (info->render_condition_enable == false)
       vrend_pause_render_condition(ctx, true);
 
@@ -10839,6 +12591,19 @@ int vrend_renderer_create_fence(struct vrend_context *ctx,
    fence->ctx = ctx;
    fence->flags = flags;
    fence->fence_id = fence_id;
+   fence->residency_epoch = ctx->timeline->epoch++;
+   fence->video_frame = 0;
+
+#ifdef ENABLE_VIDEO
+   fence->video_frame = vrend_video_context_last_frame(ctx->video);
+   /* async fence callbacks retire fences on the sync thread, which cannot
+    * complete video frames
+    */
+   if (vrend_state.use_async_fence_cb && fence->video_frame) {
+      vrend_video_wait_frame(fence->video_frame);
+      fence->video_frame = 0;
+   }
+#endif
 
 #ifdef HAVE_EPOXY_EGL_H
    if (vrend_state.use_egl_fence) {
@@ -10868,6 +12633,37 @@ int vrend_renderer_create_fence(struct vrend_context *ctx,
    return ENOMEM;
 }
 
+static inline void vrend_residency_fence_retired(const struct vrend_fence *fence)
+{
+   /* the timeline of a destroyed context has retired everything */
+   if (fence->ctx)
+      fence->ctx->timeline->retired_epoch = fence->residency_epoch;
+}
+
+static inline bool vrend_fence_video_completed(const struct vrend_fence *fence)
+{
+#ifdef ENABLE_VIDEO
+   return vrend_video_frame_completed(fence->video_frame);
+#else
+   (void)fence;
+   return true;
+#endif
+}
+
+#ifdef ENABLE_VIDEO
+/* Called by the video frame thread when a frame can be completed, which may
+ * let fences retire.
+ */
+void vrend_renderer_video_frame_synced(void)
+{
+   if (vrend_state.sync_thread && !vrend_state.use_async_fence_cb &&
+       vrend_state.eventfd != -1) {
+      if (write_eventfd(vrend_state.eventfd, 1))
+         perror("failed to write to eventfd\n");
+   }
+}
+#endif
+
 static bool need_fence_retire_signal_locked(struct vrend_fence *fence,
                                             const struct list_head *signaled_list)
 {
@@ -10893,11 +12689,16 @@ void vrend_renderer_check_fences(void)
 {
    struct list_head retired_fences;
    struct vrend_fence *fence, *stor;
+   bool idle;
 
    assert(!vrend_state.use_async_fence_cb);
 
    list_inithead(&retired_fences);
 
+#ifdef ENABLE_VIDEO
+   vrend_video_retire_frames();
+#endif
+
    if (vrend_state.sync_thread) {
       flush_eventfd(vrend_state.eventfd);
       mtx_lock(&vrend_state.fence_mutex);
@@ -10906,10 +12707,17 @@ void vrend_renderer_check_fences(void)
           * by setting fence->ctx to NULL
           */
          if (!fence->ctx) {
+            vrend_residency_fence_retired(fence);
             free_fence_locked(fence);
             continue;
          }
 
+         /* fences retire in order */
+         if (!vrend_fence_video_completed(fence))
+            break;
+
+         vrend_residency_fence_retired(fence);
+
          if (need_fence_retire_signal_locked(fence, &vrend_state.fence_list)) {
             list_del(&fence->fences);
             list_addtail(&fence->fences, &retired_fences);
@@ -10917,12 +12725,16 @@ void vrend_renderer_check_fences(void)
             free_fence_locked(fence);
          }
       }
+      idle = LIST_IS_EMPTY(&vrend_state.fence_list) &&
+             LIST_IS_EMPTY(&vrend_state.fence_wait_list);
       mtx_unlock(&vrend_state.fence_mutex);
    } else {
       vrend_renderer_force_ctx_0();
 
       LIST_FOR_EACH_ENTRY_SAFE(fence, stor, &vrend_state.fence_list, fences) {
-         if (do_wait(fence, /* can_block */ false)) {
+         if (vrend_fence_video_completed(fence) &&
+             do_wait(fence, /* can_block */ false)) {
+            vrend_residency_fence_retired(fence);
             list_del(&fence->fences);
             list_addtail(&fence->fences, &retired_fences);
          } else {
@@ -10930,6 +12742,7 @@ void vrend_renderer_check_fences(void)
             break;
          }
       }
+      idle = LIST_IS_EMPTY(&vrend_state.fence_list);
 
       LIST_FOR_EACH_ENTRY_SAFE(fence, stor, &retired_fences, fences) {
          if (!need_fence_retire_signal_locked(fence, &retired_fences))
@@ -10937,6 +12750,8 @@ void vrend_renderer_check_fences(void)
       }
    }
 
+   vrend_destroy_queue_reclaim(idle);
+
    if (LIST_IS_EMPTY(&retired_fences))
       return;
 
@@ -10948,6 +12763,9 @@ void vrend_renderer_check_fences(void)
 
       free_fence_locked(fence);
    }
+
+   if (vrend_state.residency.budget)
+      vrend_residency_evict();
 }
 
 static bool vrend_get_one_query_result(GLuint query_id, bool use_64, uint64_t *result)
@@ -11101,6 +12919,23 @@ bool vrend_hw_switch_context(struct vrend_context *ctx, bool now)
    return true;
 }
 
+struct vrend_context *vrend_hw_save_context(void)
+{
+   return vrend_state.current_ctx;
+}
+
+void vrend_hw_restore_context(struct vrend_context *ctx)
+{
+   /* unlike vrend_hw_switch_context, this also goes back to a context that
+    * went into error in the meantime */
+   if (!ctx || ctx == vrend_state.current_ctx)
+      return;
+
+   ctx->ctx_switch_pending = true;
+   vrend_finish_context_switch(ctx);
+   vrend_state.current_ctx = ctx;
+}
+
 static void vrend_finish_context_switch(struct vrend_context *ctx)
 {
    if (ctx->ctx_switch_pending == false)
@@ -11118,6 +12953,12 @@ static void vrend_finish_context_switch(struct vrend_context *ctx)
 void
 vrend_renderer_object_destroy(struct vrend_context *ctx, uint32_t handle)
 {
+   struct vrend_surface *surf;
+
+   surf = vrend_object_lookup(ctx->sub->object_hash, handle, VIRGL_OBJECT_SURFACE);
+   if (surf)
+      vrend_fb_cache_purge_surface(ctx->sub, surf);
+
    vrend_object_remove(ctx->sub->object_hash, handle, 0);
 }
 
@@ -12221,6 +14062,8 @@ static void vrend_renderer_fill_caps_v2(int gl_ver, int gles_ver,  union virgl_c
    if (has_feature(feat_khr_debug))
        caps->v2.capability_bits_v2 |= VIRGL_CAP_V2_STRING_MARKER;
 
+   caps->v2.capability_bits_v2 |= VIRGL_CAP_V2_LINK_SHADER_HINT;
+
    if (has_feature(feat_implicit_msaa))
        caps->v2.capability_bits_v2 |= VIRGL_CAP_V2_IMPLICIT_MSAA;
 
@@ -12381,6 +14224,9 @@ void *vrend_renderer_get_cursor_contents(struct pipe_resource *pres,
    if (!width || !height)
       return NULL;
 
+   if (!vrend_resource_touch(res))
+      return NULL;
+
    *width = res->base.width0;
    *height = res->base.height0;
 
@@ -12522,7 +14368,14 @@ void vrend_renderer_detach_res_ctx(struct vrend_context *ctx,
 
 struct vrend_resource *vrend_renderer_ctx_res_lookup(struct vrend_context *ctx, int res_handle)
 {
-   return vrend_ctx_resource_lookup(ctx->res_hash, res_handle);
+   struct vrend_resource *res = vrend_ctx_resource_lookup(ctx->res_hash, res_handle);
+
+   if (res && !vrend_resource_touch(res)) {
+      vrend_report_context_error(ctx, VIRGL_ERROR_CTX_ILLEGAL_RESOURCE, res_handle);
+      return NULL;
+   }
+
+   return res;
 }
 
 void vrend_context_set_debug_flags(struct vrend_context *ctx, const char *flagstring)
@@ -12540,6 +14393,14 @@ void vrend_renderer_resource_get_info(struct pipe_resource *pres,
    struct vrend_resource *res = (struct vrend_resource *)pres;
    int elsize;
 
+   /* the caller may keep using tex_id, the texture must stay resident.
+    * Touching it can allocate or restore its storage, and the VMM can call
+    * this with any context current, or none.  Without storage the VMM gets
+   * tex_id 0. */
+   vrend_renderer_force_ctx_0();
+   if (vrend_resource_touch(res))
+      res->residency_pinned = true;
+
    elsize = util_format_get_blocksize(res->base.format);
 
    info->tex_id = res->id;
@@ -12592,6 +14453,8 @@ void vrend_renderer_create_sub_ctx(struct vrend_context *ctx, int sub_ctx_id)
 {
    struct vrend_sub_context *sub;
    struct virgl_gl_ctx_param ctx_params;
+   uint64_t start_ns, elapsed_ns;
+   bool reused;
    GLuint i;
 
    LIST_FOR_EACH_ENTRY(sub, &ctx->sub_ctxs, head) {
@@ -12604,11 +14467,20 @@ void vrend_renderer_create_sub_ctx(struct vrend_context *ctx, int sub_ctx_id)
    if (!sub)
       return;
 
+   start_ns = virgl_time_ns();
+
+   /* Default is enabled, so set the initial hardware state accordingly */
+   for (int i = 0; i < PIPE_MAX_COLOR_BUFS; ++i) {
+      sub->hw_blend_state.rt[i].colormask = 0xf;
+   }
+
    ctx_params.shared = (ctx->ctx_id == 0 && sub_ctx_id == 0) ? false : true;
    ctx_params.major_ver = vrend_state.gl_major_ver;
    ctx_params.minor_ver = vrend_state.gl_minor_ver;
    ctx_params.compat_ctx = !vrend_state.use_core_profile && !vrend_state.use_gles;
-   sub->gl_context = vrend_clicbs->create_gl_context(0, &ctx_params);
+   reused = ctx_params.shared && vrend_gl_context_pool_get(sub);
+   if (!reused)
+      sub->gl_context = vrend_clicbs->create_gl_context(0, &ctx_params);
    sub->parent = ctx;
    vrend_clicbs->make_current(sub->gl_context);
 
@@ -12626,24 +14498,26 @@ void vrend_renderer_create_sub_ctx(struct vrend_context *ctx, int sub_ctx_id)
       sub->vps[i].far_val = 1.0;
    }
 
-   /* Default is enabled, so set the initial hardware state accordingly */
-   for (int i = 0; i < PIPE_MAX_COLOR_BUFS; ++i) {
-      sub->hw_blend_state.rt[i].colormask = 0xf;
+   if (!reused) {
+      glGenVertexArrays(1, &sub->vaoid);
+      glGenFramebuffers(1, &sub->fb_id);
+      glGenFramebuffers(2, sub->blit_fb_ids);
    }
 
-   glGenVertexArrays(1, &sub->vaoid);
    if (!has_feature(feat_gles31_vertex_attrib_binding)) {
       glBindVertexArray(sub->vaoid);
    }
-
-   glGenFramebuffers(1, &sub->fb_id);
    glBindFramebuffer(GL_FRAMEBUFFER, sub->fb_id);
-   glGenFramebuffers(2, sub->blit_fb_ids);
+   sub->cur_fb_id = sub->fb_id;
+   list_inithead(&sub->fb_cache);
 
    for (int i = 0; i < VREND_PROGRAM_NQUEUES; ++i)
       list_inithead(&sub->gl_programs[i]);
    list_inithead(&sub->cs_programs);
    list_inithead(&sub->streamout_list);
+   list_inithead(&sub->link_hints);
+   sub->streamout_cache = _mesa_hash_table_create(NULL, vrend_streamout_key_hash,
+                                                  vrend_streamout_key_equal);
 
    sub->object_hash = vrend_object_init_ctx_table();
 
@@ -12654,7 +14528,26 @@ void vrend_renderer_create_sub_ctx(struct vrend_context *ctx, int sub_ctx_id)
    if (sub_ctx_id == 0)
       ctx->sub0 = sub;
 
-   vrend_set_tweak_from_env(&ctx->sub->tweaks);
+   sub->tweaks = vrend_state.env_tweaks;
+
+   elapsed_ns = virgl_time_ns() - start_ns;
+   if (reused) {
+      vrend_state.sub_ctx_stats.reused++;
+      vrend_state.sub_ctx_stats.reused_ns += elapsed_ns;
+   } else {
+      vrend_state.sub_ctx_stats.created++;
+      vrend_state.sub_ctx_stats.created_ns += elapsed_ns;
+   }
+
+   VREND_DEBUG(dbg_stats, ctx, "sub-context %d: %s GL context in %" PRIu64 " us "
+               "(created %" PRIu64 ", avg %" PRIu64 " us; reused %" PRIu64 ", avg %" PRIu64 " us)\n",
+               sub_ctx_id, reused ? "reused" : "created", elapsed_ns / 1000,
+               vrend_state.sub_ctx_stats.created,
+               vrend_state.sub_ctx_stats.created ?
+               vrend_state.sub_ctx_stats.created_ns / vrend_state.sub_ctx_stats.created / 1000 : 0,
+               vrend_state.sub_ctx_stats.reused,
+               vrend_state.sub_ctx_stats.reused ?
+               vrend_state.sub_ctx_stats.reused_ns / vrend_state.sub_ctx_stats.reused / 1000 : 0);
 }
 
 unsigned vrend_context_has_debug_flag(const struct vrend_context *ctx, enum virgl_debug_flags flag)
@@ -12703,6 +14596,68 @@ void vrend_renderer_set_sub_ctx(struct vrend_context *ctx, int sub_ctx_id)
    }
 }
 
+/* Destroys all sub-contexts of ctx, together with their objects and bound
+ * state, and starts over with an empty sub-context 0.  The resources
+ * attached to ctx are left alone. */
+void vrend_renderer_reset_sub_ctxs(struct vrend_context *ctx)
+{
+   struct vrend_sub_context *sub, *tmp;
+
+   vrend_clicbs->make_current(ctx->sub->gl_context);
+   vrend_set_framebuffer_state(ctx, 0, NULL, 0);
+   for (int shader_type = 0; shader_type < PIPE_SHADER_TYPES; shader_type++)
+      vrend_set_num_sampler_views(ctx, shader_type, 0, 0);
+   vrend_set_streamout_targets(ctx, 0, 0, NULL);
+   vrend_set_index_buffer(ctx, 0, 0, 0);
+
+   LIST_FOR_EACH_ENTRY_SAFE_REV(sub, tmp, &ctx->sub_ctxs, head) {
+      ctx->sub = sub;
+      vrend_destroy_sub_context(sub);
+   }
+   ctx->sub = NULL;
+   ctx->sub0 = NULL;
+
+   vrend_renderer_create_sub_ctx(ctx, 0);
+   vrend_renderer_set_sub_ctx(ctx, 0);
+}
+
+bool vrend_renderer_use_snapshots(void)
+{
+   return vrend_state.use_snapshots;
+}
+
+uint64_t vrend_renderer_resource_write_seq(void)
+{
+   return vrend_state.resource_write_seq;
+}
+
+struct vrend_foreach_resource_args {
+   vrend_resource_callback callback;
+   void *data;
+};
+
+static enum pipe_error vrend_foreach_resource_cb(void *key, void *value, void *data)
+{
+   const struct vrend_foreach_resource_args *args = data;
+
+   if (!args->callback((uint32_t)(uintptr_t)key, value, args->data))
+      return PIPE_ERROR;
+   return PIPE_OK;
+}
+
+/* Stops at the first resource for which callback returns false. */
+void vrend_renderer_ctx_foreach_resource(struct vrend_context *ctx,
+                                         vrend_resource_callback callback,
+                                         void *data)
+{
+   struct vrend_foreach_resource_args args = {
+      .callback = callback,
+      .data = data,
+   };
+
+   util_hash_table_foreach(ctx->res_hash, vrend_foreach_resource_cb, &args);
+}
+
 void vrend_renderer_prepare_reset(void)
 {
    /* make sure user contexts are no longer accessed */
@@ -12713,8 +14668,10 @@ void vrend_renderer_prepare_reset(void)
 void vrend_renderer_reset(void)
 {
    vrend_free_fences();
+   vrend_destroy_queue_reclaim(true);
    vrend_blitter_fini();
 
+   vrend_gl_context_pool_fini();
    vrend_destroy_context(vrend_state.ctx0);
 
    vrend_state.ctx0 = vrend_create_context(0, strlen("HOST"), "HOST");
@@ -12876,7 +14833,7 @@ vrend_renderer_pipe_resource_set_type(struct vrend_context *ctx,
 
          gr->storage_bits |= VREND_STORAGE_EGL_IMAGE;
 
-         ret = vrend_resource_alloc_texture(gr, virgl_format, gr->egl_image);
+         ret = vrend_resource_alloc_texture(gr, virgl_format, gr->egl_image, false);
          if (ret) {
             virgl_egl_image_destroy(egl, gr->egl_image);
             FREE(gr);
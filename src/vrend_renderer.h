@@ -108,6 +108,39 @@ struct vrend_resource {
    uint32_t blob_id;
    struct list_head head;
    bool is_imported;
+
+   /* Texture residency under VIRGL_RESIDENCY_BUDGET_MB.  residency_head is
+    * only linked for tracked textures.  While spilled, id is 0 and the
+    * texel data of all levels lives in spill_data.
+    */
+   struct list_head residency_head;
+   void *spill_data;
+   bool residency_pinned;
+
+   /* The context that used the resource last, and the epoch of the fence of
+    * that context that covers the use, see vrend_fence_timeline.
+    */
+   struct vrend_fence_timeline *last_use_timeline;
+   uint64_t last_use;
+
+   /* Once destroyed, the resource waits in the destroy queue until its last
+    * use has retired, see vrend_renderer_resource_destroy.
+    */
+   struct list_head destroy_head;
+
+   /* The GL storage of the texture is only allocated on first use.  While
+    * deferred, id is 0 and target and storage_bits already describe the
+    * texture that will be allocated from base.
+    */
+   bool storage_deferred;
+
+   /* Video frame that writes to the resource and has not completed, or 0.
+    * Looking the resource up waits for the frame.
+    */
+   uint64_t video_frame;
+
+   /* resource write sequence of the last write, for incremental snapshots */
+   uint64_t write_seq;
 };
 
 #define VIRGL_TEXTURE_NEED_SWIZZLE        (1 << 0)
@@ -147,6 +180,7 @@ struct vrend_if_cbs {
 #define VREND_USE_VIDEO          (1 << 3)
 #define VREND_D3D11_SHARE_TEXTURE (1 << 4)
 #define VREND_USE_COMPAT_CONTEXT (1 << 5)
+#define VREND_USE_SNAPSHOTS      (1 << 6)
 
 bool vrend_check_no_error(struct vrend_context *ctx);
 
@@ -171,6 +205,15 @@ int vrend_create_shader(struct vrend_context *ctx,
 
 void vrend_link_program_hook(struct vrend_context *ctx, uint32_t *handles);
 
+/* Queues a shader combination to be linked by
+ * vrend_renderer_process_link_hints(). */
+void vrend_link_program_hint(struct vrend_context *ctx, const uint32_t *handles);
+
+void vrend_renderer_process_link_hints(struct vrend_context *ctx);
+
+void vrend_renderer_get_link_hint_stats(struct vrend_context *ctx,
+                                        struct vrend_link_hint_stats *stats);
+
 void vrend_bind_shader(struct vrend_context *ctx,
                        uint32_t handle,
                        enum pipe_shader_type type);
@@ -359,6 +402,19 @@ void vrend_renderer_resource_copy_region(struct vrend_context *ctx,
                                          uint32_t src_handle, uint32_t src_level,
                                          const struct pipe_box *src_box);
 
+struct vrend_copy_region {
+   uint32_t dstx, dsty, dstz;
+   struct pipe_box src_box;
+};
+
+/* Copy a run of regions between the same pair of resource levels, the
+ * destination and source stay attached for the whole run. */
+void vrend_renderer_resource_copy_regions(struct vrend_context *ctx,
+                                          uint32_t dst_handle, uint32_t dst_level,
+                                          uint32_t src_handle, uint32_t src_level,
+                                          const struct vrend_copy_region *regions,
+                                          uint32_t num_regions);
+
 void vrend_renderer_blit(struct vrend_context *ctx,
                          uint32_t dst_handle, uint32_t src_handle,
                          const struct pipe_blit_info *info);
@@ -403,10 +459,19 @@ int vrend_renderer_create_fence(struct vrend_context *ctx,
 
 void vrend_renderer_check_fences(void);
 
+#ifdef ENABLE_VIDEO
+void vrend_renderer_video_frame_synced(void);
+#endif
+
 int vrend_renderer_create_ctx0_fence(uint32_t fence_id);
 int vrend_renderer_export_ctx0_fence(uint32_t fence_id, int* out_fd);
 
 bool vrend_hw_switch_context(struct vrend_context *ctx, bool now);
+/* For code that switches to other contexts behind the back of the caller:
+ * returns the current context, to be made current again with
+ * vrend_hw_restore_context() afterwards. */
+struct vrend_context *vrend_hw_save_context(void);
+void vrend_hw_restore_context(struct vrend_context *ctx);
 uint32_t vrend_renderer_object_insert(struct vrend_context *ctx, void *data,
                                       uint32_t handle, enum virgl_object_type type);
 void vrend_renderer_object_destroy(struct vrend_context *ctx, uint32_t handle);
@@ -449,6 +514,9 @@ struct vrend_resource *vrend_renderer_ctx_res_lookup(struct vrend_context *ctx,
 
 void vrend_renderer_resource_destroy(struct vrend_resource *res);
 
+int vrend_renderer_resource_import_egl_image(struct vrend_resource *res,
+                                             void *image);
+
 static inline void
 vrend_resource_reference(struct vrend_resource **ptr, struct vrend_resource *tex)
 {
@@ -501,6 +569,7 @@ struct vrend_blit_info {
    bool has_srgb_write_control;
    bool needs_manual_srgb_decode;
    bool needs_manual_srgb_encode;
+   bool has_compute_blit;
 };
 
 void vrend_renderer_resource_get_info(struct pipe_resource *pres,
@@ -512,6 +581,17 @@ void vrend_renderer_get_cap_set(uint32_t cap_set, uint32_t *max_ver,
 void vrend_renderer_create_sub_ctx(struct vrend_context *ctx, int sub_ctx_id);
 void vrend_renderer_destroy_sub_ctx(struct vrend_context *ctx, int sub_ctx_id);
 void vrend_renderer_set_sub_ctx(struct vrend_context *ctx, int sub_ctx_id);
+void vrend_renderer_reset_sub_ctxs(struct vrend_context *ctx);
+
+bool vrend_renderer_use_snapshots(void);
+uint64_t vrend_renderer_resource_write_seq(void);
+
+typedef bool (*vrend_resource_callback)(uint32_t res_id,
+                                        struct vrend_resource *res,
+                                        void *data);
+void vrend_renderer_ctx_foreach_resource(struct vrend_context *ctx,
+                                         vrend_resource_callback callback,
+                                         void *data);
 
 void vrend_report_context_error_internal(const char *fname, struct vrend_context *ctx,
                                    enum virgl_ctx_errors error, uint32_t value);
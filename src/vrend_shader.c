@@ -691,6 +691,14 @@ static int require_glsl_ver(const struct dump_ctx *ctx, int glsl_ver)
    return glsl_ver > ctx->glsl_ver_required ? glsl_ver : ctx->glsl_ver_required;
 }
 
+static bool consts_in_ubo(const struct dump_ctx *ctx)
+{
+   /* Shaders that bind guest UBOs keep the constants as plain uniforms, so
+    * that the guest visible block count doesn't change */
+   return ctx->cfg->use_const_ubo && !ctx->ubo_used_mask &&
+          ctx->num_consts <= VREND_SHADER_CONST_UBO_MAX_CONSTS;
+}
+
 static void emit_indent(struct vrend_glsl_strbufs *glsl_strbufs)
 {
    if (glsl_strbufs->indent_level > 0) {
@@ -6638,7 +6646,13 @@ static int emit_ios_common(const struct dump_ctx *ctx,
    }
    if (ctx->num_consts) {
       const char *cname = tgsi_proc_to_prefix(ctx->prog_type);
-      emit_hdrf(glsl_strbufs, "uniform uvec4 %sconst0[%d];\n", cname, ctx->num_consts);
+      if (consts_in_ubo(ctx)) {
+         if (!ctx->cfg->use_gles)
+            glsl_ver_required = require_glsl_ver(ctx, 140);
+         emit_hdrf(glsl_strbufs, "layout(std140) uniform %sVirglConsts { uvec4 %sconst0[%d]; };\n",
+                   cname, cname, ctx->num_consts);
+      } else
+         emit_hdrf(glsl_strbufs, "uniform uvec4 %sconst0[%d];\n", cname, ctx->num_consts);
    }
 
    if (ctx->ubo_used_mask) {
@@ -7808,6 +7822,7 @@ static void fill_sinfo(const struct dump_ctx *ctx, struct vrend_shader_info *sin
    sinfo->image_last_binding = ctx->key->image_binding_offset + ctx->image_last_binding;
    sinfo->num_consts = ctx->num_consts;
    sinfo->ubo_used_mask = ctx->ubo_used_mask;
+   sinfo->consts_in_ubo = ctx->num_consts && consts_in_ubo(ctx);
    sinfo->fog_input_mask = ctx->fog_input_mask;
    sinfo->fog_output_mask = ctx->fog_output_mask;
 
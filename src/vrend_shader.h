@@ -164,6 +164,7 @@ struct vrend_shader_info {
    uint8_t has_output_arrays : 1;
    uint8_t use_pervertex_in : 1;
    uint8_t reads_drawid : 1;
+   uint8_t consts_in_ubo : 1;
 };
 
 struct vrend_variable_shader_info {
@@ -259,10 +260,15 @@ struct vrend_shader_cfg {
    uint32_t has_texture_shadow_lod : 1;
    uint32_t has_vs_layer : 1;
    uint32_t has_vs_viewport_index : 1;
+   uint32_t use_const_ubo : 1;
 };
 
 struct vrend_context;
 
+/* Largest constant file that is declared as a uniform block when
+ * use_const_ubo is set, this is the minimum GL_MAX_UNIFORM_BLOCK_SIZE */
+#define VREND_SHADER_CONST_UBO_MAX_CONSTS 1024
+
 #define SHADER_MAX_STRINGS 3
 #define SHADER_STRING_VER_EXT 0
 #define SHADER_STRING_HDR 1
@@ -0,0 +1,868 @@
+/*
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "vrend_snapshot.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util/hash_table.h"
+#include "util/list.h"
+#include "util/u_format.h"
+#include "util/u_math.h"
+#include "virgl_protocol.h"
+#include "virgl_util.h"
+#include "vrend_iov.h"
+#include "vrend_renderer.h"
+
+#define VREND_SNAPSHOT_MAGIC 0x53535256 /* "VRSS" */
+#define VREND_SNAPSHOT_VERSION 1
+
+#define VREND_SNAPSHOT_FLAG_INCREMENTAL (1u << 0)
+
+struct vrend_snapshot_header {
+   uint32_t magic;
+   uint32_t version;
+   uint32_t flags;
+   uint32_t num_cmd_dwords;
+   uint32_t num_transfers;
+   uint32_t reserved;
+};
+
+/* followed by size bytes of data, padded to 8 bytes */
+struct vrend_snapshot_transfer {
+   uint32_t res_id;
+   uint32_t level;
+   uint32_t width;
+   uint32_t height;
+   uint32_t depth;
+   uint32_t stride;
+   uint32_t layer_stride;
+   uint32_t reserved;
+   uint64_t size;
+};
+
+/* The commands that created an object.  Shaders can take more than one. */
+struct vrend_snapshot_object {
+   struct list_head head;
+   uint32_t handle;
+   uint32_t type;
+
+   /* destroyed by the guest, but a recorded state command still refers to
+    * it: it is created, bound and destroyed again on restore
+    */
+   bool destroyed;
+
+   uint32_t num_dwords;
+   uint32_t max_dwords;
+   uint32_t *dwords;
+};
+
+/* The last command that set a piece of state. */
+struct vrend_snapshot_state {
+   struct list_head head;
+   uint64_t key;
+   uint32_t num_dwords;
+   uint32_t dwords[];
+};
+
+struct vrend_snapshot_sub_ctx {
+   struct list_head head;
+   uint32_t sub_ctx_id;
+
+   /* in creation order */
+   struct hash_table_u64 *objects;
+   struct list_head object_list;
+
+   /* in the order they were last set */
+   struct hash_table_u64 *states;
+   struct list_head state_list;
+};
+
+struct vrend_snapshot_journal {
+   struct list_head sub_ctxs;
+   struct vrend_snapshot_sub_ctx *sub;
+
+   /* resource write sequence at the time of the last snapshot */
+   uint64_t write_seq;
+
+   /* an allocation failed and the journal is incomplete */
+   bool lost;
+};
+
+/* Returns the key under which a state command is recorded, or 0 for
+ * commands that do not set any state.  Commands that set a range of slots
+ * are keyed by the range, which replays correctly because a command only
+ * ever replaces an earlier one that set the very same slots.
+ */
+static uint64_t
+vrend_snapshot_state_key(const uint32_t *buf, uint32_t length)
+{
+   uint32_t cmd = buf[0] & 0xff;
+   uint32_t sel = 0, slot = 0, range = 0;
+
+   switch (cmd) {
+   case VIRGL_CCMD_BIND_OBJECT:
+      sel = (buf[0] >> 8) & 0xff;
+      break;
+   case VIRGL_CCMD_BIND_SHADER:
+      if (length < VIRGL_BIND_SHADER_SIZE)
+         return 0;
+      sel = buf[VIRGL_BIND_SHADER_TYPE];
+      break;
+   case VIRGL_CCMD_SET_TWEAKS:
+      if (length < VIRGL_SET_TWEAKS_SIZE)
+         return 0;
+      sel = buf[VIRGL_SET_TWEAKS_ID];
+      break;
+   case VIRGL_CCMD_SET_FRAMEBUFFER_STATE_NO_ATTACH:
+      /* replaces the attachments as well */
+      cmd = VIRGL_CCMD_SET_FRAMEBUFFER_STATE;
+      break;
+   case VIRGL_CCMD_SET_FRAMEBUFFER_STATE:
+   case VIRGL_CCMD_SET_VERTEX_BUFFERS:
+   case VIRGL_CCMD_SET_INDEX_BUFFER:
+   case VIRGL_CCMD_SET_STENCIL_REF:
+   case VIRGL_CCMD_SET_BLEND_COLOR:
+   case VIRGL_CCMD_SET_POLYGON_STIPPLE:
+   case VIRGL_CCMD_SET_CLIP_STATE:
+   case VIRGL_CCMD_SET_SAMPLE_MASK:
+   case VIRGL_CCMD_SET_MIN_SAMPLES:
+   case VIRGL_CCMD_SET_STREAMOUT_TARGETS:
+   case VIRGL_CCMD_SET_RENDER_CONDITION:
+   case VIRGL_CCMD_SET_TESS_STATE:
+      break;
+   case VIRGL_CCMD_SET_VIEWPORT_STATE:
+   case VIRGL_CCMD_SET_SCISSOR_STATE:
+   case VIRGL_CCMD_SET_ATOMIC_BUFFERS:
+      if (length < 1)
+         return 0;
+      slot = buf[1];
+      range = length;
+      break;
+   case VIRGL_CCMD_SET_SAMPLER_VIEWS:
+   case VIRGL_CCMD_BIND_SAMPLER_STATES:
+   case VIRGL_CCMD_SET_SHADER_BUFFERS:
+   case VIRGL_CCMD_SET_SHADER_IMAGES:
+      if (length < 2)
+         return 0;
+      sel = buf[1];
+      slot = buf[2];
+      range = length;
+      break;
+   case VIRGL_CCMD_SET_CONSTANT_BUFFER:
+   case VIRGL_CCMD_SET_UNIFORM_BUFFER:
+      if (length < 2)
+         return 0;
+      sel = buf[1];
+      slot = buf[2];
+      break;
+   default:
+      return 0;
+   }
+
+   return cmd | (uint64_t)(sel & 0xff) << 8 | (uint64_t)(slot & 0xffff) << 16 |
+          (uint64_t)range << 32;
+}
+
+/* The object handles a state command refers to are dwords[first..end). */
+static bool
+vrend_snapshot_state_handles(const struct vrend_snapshot_state *state,
+                             uint32_t *first,
+                             uint32_t *end)
+{
+   switch (state->dwords[0] & 0xff) {
+   case VIRGL_CCMD_BIND_OBJECT:
+   case VIRGL_CCMD_BIND_SHADER:
+   case VIRGL_CCMD_SET_RENDER_CONDITION:
+      *first = 1;
+      *end = 2;
+      break;
+   case VIRGL_CCMD_SET_SAMPLER_VIEWS:
+   case VIRGL_CCMD_BIND_SAMPLER_STATES:
+      *first = 3;
+      *end = state->num_dwords;
+      break;
+   case VIRGL_CCMD_SET_FRAMEBUFFER_STATE:
+      *first = VIRGL_SET_FRAMEBUFFER_STATE_NR_ZSURF_HANDLE;
+      *end = state->num_dwords;
+      break;
+   case VIRGL_CCMD_SET_STREAMOUT_TARGETS:
+      *first = VIRGL_SET_STREAMOUT_TARGETS_H0;
+      *end = state->num_dwords;
+      break;
+   default:
+      return false;
+   }
+
+   *end = MIN2(*end, state->num_dwords);
+   return *first < *end;
+}
+
+static bool
+vrend_snapshot_sub_ctx_references(const struct vrend_snapshot_sub_ctx *sub,
+                                  uint32_t handle)
+{
+   list_for_each_entry (struct vrend_snapshot_state, state, &sub->state_list, head) {
+      uint32_t first, end;
+      if (!vrend_snapshot_state_handles(state, &first, &end))
+         continue;
+
+      for (uint32_t i = first; i < end; i++) {
+         if (state->dwords[i] == handle)
+            return true;
+      }
+   }
+
+   return false;
+}
+
+static void
+vrend_snapshot_object_free(struct vrend_snapshot_sub_ctx *sub,
+                           struct vrend_snapshot_object *obj)
+{
+   _mesa_hash_table_u64_remove(sub->objects, obj->handle);
+   list_del(&obj->head);
+   free(obj->dwords);
+   free(obj);
+}
+
+/* Frees the destroyed objects that the state command no longer keeps
+ * alive, before it is replaced or dropped. */
+static void
+vrend_snapshot_state_release(struct vrend_snapshot_sub_ctx *sub,
+                             struct vrend_snapshot_state *state)
+{
+   uint32_t first, end;
+
+   list_del(&state->head);
+
+   if (vrend_snapshot_state_handles(state, &first, &end)) {
+      for (uint32_t i = first; i < end; i++) {
+         struct vrend_snapshot_object *obj =
+            _mesa_hash_table_u64_search(sub->objects, state->dwords[i]);
+         if (obj && obj->destroyed &&
+             !vrend_snapshot_sub_ctx_references(sub, obj->handle))
+            vrend_snapshot_object_free(sub, obj);
+      }
+   }
+
+   free(state);
+}
+
+static struct vrend_snapshot_sub_ctx *
+vrend_snapshot_sub_ctx_create(struct vrend_snapshot_journal *journal,
+                              uint32_t sub_ctx_id)
+{
+   struct vrend_snapshot_sub_ctx *sub = calloc(1, sizeof(*sub));
+   if (!sub)
+      return NULL;
+
+   sub->sub_ctx_id = sub_ctx_id;
+   sub->objects = _mesa_hash_table_u64_create(NULL);
+   sub->states = _mesa_hash_table_u64_create(NULL);
+   if (!sub->objects || !sub->states) {
+      if (sub->objects)
+         _mesa_hash_table_u64_destroy(sub->objects);
+      if (sub->states)
+         _mesa_hash_table_u64_destroy(sub->states);
+      free(sub);
+      return NULL;
+   }
+
+   list_inithead(&sub->object_list);
+   list_inithead(&sub->state_list);
+   list_addtail(&sub->head, &journal->sub_ctxs);
+
+   return sub;
+}
+
+static void
+vrend_snapshot_sub_ctx_destroy(struct vrend_snapshot_sub_ctx *sub)
+{
+   list_for_each_entry_safe (struct vrend_snapshot_state, state, &sub->state_list, head)
+      free(state);
+   list_for_each_entry_safe (struct vrend_snapshot_object, obj, &sub->object_list, head) {
+      free(obj->dwords);
+      free(obj);
+   }
+
+   _mesa_hash_table_u64_destroy(sub->states);
+   _mesa_hash_table_u64_destroy(sub->objects);
+   list_del(&sub->head);
+   free(sub);
+}
+
+static struct vrend_snapshot_sub_ctx *
+vrend_snapshot_sub_ctx_lookup(struct vrend_snapshot_journal *journal,
+                              uint32_t sub_ctx_id)
+{
+   list_for_each_entry (struct vrend_snapshot_sub_ctx, sub, &journal->sub_ctxs, head) {
+      if (sub->sub_ctx_id == sub_ctx_id)
+         return sub;
+   }
+
+   return NULL;
+}
+
+struct vrend_snapshot_journal *
+vrend_snapshot_journal_create(void)
+{
+   struct vrend_snapshot_journal *journal = calloc(1, sizeof(*journal));
+   if (!journal)
+      return NULL;
+
+   list_inithead(&journal->sub_ctxs);
+
+   /* like the context, the journal starts out with sub-context 0 */
+   journal->sub = vrend_snapshot_sub_ctx_create(journal, 0);
+   if (!journal->sub) {
+      free(journal);
+      return NULL;
+   }
+
+   return journal;
+}
+
+void
+vrend_snapshot_journal_destroy(struct vrend_snapshot_journal *journal)
+{
+   list_for_each_entry_safe (struct vrend_snapshot_sub_ctx, sub, &journal->sub_ctxs, head)
+      vrend_snapshot_sub_ctx_destroy(sub);
+   free(journal);
+}
+
+void
+vrend_snapshot_journal_reset(struct vrend_snapshot_journal *journal)
+{
+   list_for_each_entry_safe (struct vrend_snapshot_sub_ctx, sub, &journal->sub_ctxs, head) {
+      if (sub->sub_ctx_id)
+         vrend_snapshot_sub_ctx_destroy(sub);
+   }
+
+   struct vrend_snapshot_sub_ctx *sub0 = vrend_snapshot_sub_ctx_lookup(journal, 0);
+   list_for_each_entry_safe (struct vrend_snapshot_state, state, &sub0->state_list, head)
+      free(state);
+   list_for_each_entry_safe (struct vrend_snapshot_object, obj, &sub0->object_list, head) {
+      free(obj->dwords);
+      free(obj);
+   }
+   list_inithead(&sub0->state_list);
+   list_inithead(&sub0->object_list);
+   _mesa_hash_table_u64_clear(sub0->states);
+   _mesa_hash_table_u64_clear(sub0->objects);
+
+   journal->sub = sub0;
+   journal->lost = false;
+}
+
+static bool
+vrend_snapshot_object_append(struct vrend_snapshot_object *obj,
+                             const uint32_t *buf,
+                             uint32_t num_dwords)
+{
+   if (obj->num_dwords + num_dwords > obj->max_dwords) {
+      const uint32_t max_dwords = MAX2(obj->max_dwords * 2, obj->num_dwords + num_dwords);
+      uint32_t *dwords = realloc(obj->dwords, sizeof(*dwords) * max_dwords);
+      if (!dwords)
+         return false;
+
+      obj->dwords = dwords;
+      obj->max_dwords = max_dwords;
+   }
+
+   memcpy(obj->dwords + obj->num_dwords, buf, sizeof(*buf) * num_dwords);
+   obj->num_dwords += num_dwords;
+
+   return true;
+}
+
+static void
+vrend_snapshot_record_create(struct vrend_snapshot_journal *journal,
+                             const uint32_t *buf,
+                             uint32_t length)
+{
+   struct vrend_snapshot_sub_ctx *sub = journal->sub;
+   const uint32_t type = (buf[0] >> 8) & 0xff;
+   struct vrend_snapshot_object *obj;
+
+   if (length < VIRGL_OBJ_CREATE_HANDLE)
+      return;
+
+   const uint32_t handle = buf[VIRGL_OBJ_CREATE_HANDLE];
+   obj = _mesa_hash_table_u64_search(sub->objects, handle);
+
+   /* the remaining parts of a shader whose text did not fit a command */
+   if (type == VIRGL_OBJECT_SHADER && length >= VIRGL_OBJ_SHADER_OFFSET &&
+       (buf[VIRGL_OBJ_SHADER_OFFSET] & VIRGL_OBJ_SHADER_OFFSET_CONT)) {
+      if (obj && !obj->destroyed && !vrend_snapshot_object_append(obj, buf, length + 1))
+         journal->lost = true;
+      return;
+   }
+
+   if (obj)
+      vrend_snapshot_object_free(sub, obj);
+
+   obj = calloc(1, sizeof(*obj));
+   if (!obj || !vrend_snapshot_object_append(obj, buf, length + 1)) {
+      free(obj);
+      journal->lost = true;
+      return;
+   }
+
+   obj->handle = handle;
+   obj->type = type;
+   _mesa_hash_table_u64_insert(sub->objects, handle, obj);
+   list_addtail(&obj->head, &sub->object_list);
+}
+
+static void
+vrend_snapshot_record_destroy(struct vrend_snapshot_journal *journal,
+                              const uint32_t *buf,
+                              uint32_t length)
+{
+   struct vrend_snapshot_sub_ctx *sub = journal->sub;
+   struct vrend_snapshot_object *obj;
+
+   if (length < VIRGL_OBJ_DESTROY_HANDLE)
+      return;
+
+   obj = _mesa_hash_table_u64_search(sub->objects, buf[VIRGL_OBJ_DESTROY_HANDLE]);
+   if (!obj)
+      return;
+
+   if (vrend_snapshot_sub_ctx_references(sub, obj->handle))
+      obj->destroyed = true;
+   else
+      vrend_snapshot_object_free(sub, obj);
+}
+
+static void
+vrend_snapshot_record_state(struct vrend_snapshot_journal *journal,
+                            uint64_t key,
+                            const uint32_t *buf,
+                            uint32_t length)
+{
+   struct vrend_snapshot_sub_ctx *sub = journal->sub;
+   struct vrend_snapshot_state *state;
+
+   state = malloc(sizeof(*state) + sizeof(*buf) * (length + 1));
+   if (!state) {
+      journal->lost = true;
+      return;
+   }
+
+   state->key = key;
+   state->num_dwords = length + 1;
+   memcpy(state->dwords, buf, sizeof(*buf) * (length + 1));
+
+   /* the new command goes to the end, so that it is replayed after
+    * the commands it overrides
+    */
+   list_addtail(&state->head, &sub->state_list);
+
+   struct vrend_snapshot_state *old = _mesa_hash_table_u64_search(sub->states, key);
+   _mesa_hash_table_u64_insert(sub->states, key, state);
+   if (old)
+      vrend_snapshot_state_release(sub, old);
+}
+
+void
+vrend_snapshot_journal_record(struct vrend_snapshot_journal *journal,
+                              const uint32_t *buf,
+                              uint32_t length)
+{
+   struct vrend_snapshot_sub_ctx *sub;
+   uint64_t key;
+
+   switch (buf[0] & 0xff) {
+   case VIRGL_CCMD_CREATE_OBJECT:
+      vrend_snapshot_record_create(journal, buf, length);
+      break;
+   case VIRGL_CCMD_DESTROY_OBJECT:
+      vrend_snapshot_record_destroy(journal, buf, length);
+      break;
+   case VIRGL_CCMD_CREATE_SUB_CTX:
+      if (length < 1 || vrend_snapshot_sub_ctx_lookup(journal, buf[1]))
+         break;
+      sub = vrend_snapshot_sub_ctx_create(journal, buf[1]);
+      if (sub)
+         journal->sub = sub;
+      else
+         journal->lost = true;
+      break;
+   case VIRGL_CCMD_DESTROY_SUB_CTX:
+      if (length < 1 || !buf[1])
+         break;
+      sub = vrend_snapshot_sub_ctx_lookup(journal, buf[1]);
+      if (sub) {
+         if (journal->sub == sub)
+            journal->sub = vrend_snapshot_sub_ctx_lookup(journal, 0);
+         vrend_snapshot_sub_ctx_destroy(sub);
+      }
+      break;
+   case VIRGL_CCMD_SET_SUB_CTX:
+      if (length < 1)
+         break;
+      sub = vrend_snapshot_sub_ctx_lookup(journal, buf[1]);
+      if (sub)
+         journal->sub = sub;
+      break;
+   default:
+      key = vrend_snapshot_state_key(buf, length);
+      if (key)
+         vrend_snapshot_record_state(journal, key, buf, length);
+      break;
+   }
+}
+
+static uint32_t
+vrend_snapshot_journal_num_dwords(const struct vrend_snapshot_journal *journal)
+{
+   /* the final VIRGL_CCMD_SET_SUB_CTX */
+   uint32_t num_dwords = 2;
+
+   list_for_each_entry (struct vrend_snapshot_sub_ctx, sub, &journal->sub_ctxs, head) {
+      num_dwords += sub->sub_ctx_id ? 4 : 2;
+
+      list_for_each_entry (struct vrend_snapshot_object, obj, &sub->object_list, head)
+         num_dwords += obj->num_dwords + (obj->destroyed ? 2 : 0);
+      list_for_each_entry (struct vrend_snapshot_state, state, &sub->state_list, head)
+         num_dwords += state->num_dwords;
+   }
+
+   return num_dwords;
+}
+
+static uint32_t *
+vrend_snapshot_journal_write(const struct vrend_snapshot_journal *journal,
+                             uint32_t *cmds)
+{
+   list_for_each_entry (struct vrend_snapshot_sub_ctx, sub, &journal->sub_ctxs, head) {
+      if (sub->sub_ctx_id) {
+         *cmds++ = VIRGL_CMD0(VIRGL_CCMD_CREATE_SUB_CTX, 0, 1);
+         *cmds++ = sub->sub_ctx_id;
+      }
+      *cmds++ = VIRGL_CMD0(VIRGL_CCMD_SET_SUB_CTX, 0, 1);
+      *cmds++ = sub->sub_ctx_id;
+
+      list_for_each_entry (struct vrend_snapshot_object, obj, &sub->object_list, head) {
+         memcpy(cmds, obj->dwords, sizeof(*cmds) * obj->num_dwords);
+         cmds += obj->num_dwords;
+      }
+
+      list_for_each_entry (struct vrend_snapshot_state, state, &sub->state_list, head) {
+         memcpy(cmds, state->dwords, sizeof(*cmds) * state->num_dwords);
+         cmds += state->num_dwords;
+      }
+
+      list_for_each_entry (struct vrend_snapshot_object, obj, &sub->object_list, head) {
+         if (obj->destroyed) {
+            *cmds++ = VIRGL_CMD0(VIRGL_CCMD_DESTROY_OBJECT, obj->type, 1);
+            *cmds++ = obj->handle;
+         }
+      }
+   }
+
+   *cmds++ = VIRGL_CMD0(VIRGL_CCMD_SET_SUB_CTX, 0, 1);
+   *cmds++ = journal->sub->sub_ctx_id;
+
+   return cmds;
+}
+
+struct vrend_snapshot_resource {
+   uint32_t res_id;
+   struct vrend_resource *res;
+};
+
+struct vrend_snapshot_resource_list {
+   struct vrend_snapshot_resource *resources;
+   uint32_t count;
+   uint32_t max_count;
+
+   bool incremental;
+   uint64_t write_seq;
+   bool failed;
+};
+
+/* Whether the contents of the resource live in host memory that only the
+ * renderer knows about.  Guest memory is migrated by the VMM, and
+ * multisampled textures cannot be read back.
+ */
+static bool
+vrend_snapshot_resource_has_contents(const struct vrend_resource *res)
+{
+   if (res->storage_deferred || res->is_imported || res->base.nr_samples > 1)
+      return false;
+
+   if (has_bit(res->storage_bits, VREND_STORAGE_HOST_SYSTEM_MEMORY))
+      return !res->iov;
+
+   return has_bit(res->storage_bits, VREND_STORAGE_GL_TEXTURE) ||
+          has_bit(res->storage_bits, VREND_STORAGE_GL_BUFFER);
+}
+
+static bool
+vrend_snapshot_collect_resource(uint32_t res_id,
+                                struct vrend_resource *res,
+                                void *data)
+{
+   struct vrend_snapshot_resource_list *list = data;
+
+   if (!vrend_snapshot_resource_has_contents(res))
+      return true;
+   if (list->incremental && res->write_seq <= list->write_seq)
+      return true;
+
+   if (list->count == list->max_count) {
+      const uint32_t max_count = MAX2(list->max_count * 2, 16);
+      struct vrend_snapshot_resource *resources =
+         realloc(list->resources, sizeof(*resources) * max_count);
+      if (!resources) {
+         list->failed = true;
+         return false;
+      }
+
+      list->resources = resources;
+      list->max_count = max_count;
+   }
+
+   list->resources[list->count++] = (struct vrend_snapshot_resource){
+      .res_id = res_id,
+      .res = res,
+   };
+
+   return true;
+}
+
+static uint32_t
+vrend_snapshot_resource_num_levels(const struct vrend_resource *res)
+{
+   return res->base.target == PIPE_BUFFER ? 1 : res->base.last_level + 1;
+}
+
+static void
+vrend_snapshot_transfer_init(struct vrend_snapshot_transfer *xfer,
+                             uint32_t res_id,
+                             const struct vrend_resource *res,
+                             uint32_t level)
+{
+   const struct pipe_resource *base = &res->base;
+
+   xfer->res_id = res_id;
+   xfer->level = level;
+   xfer->width = u_minify(base->width0, level);
+   xfer->height = u_minify(base->height0, level);
+   xfer->depth = base->target == PIPE_TEXTURE_3D ? u_minify(base->depth0, level)
+                                                 : MAX2(base->array_size, 1);
+   xfer->stride = util_format_get_stride(base->format, xfer->width);
+   xfer->layer_stride = util_format_get_2d_size(base->format, xfer->stride, xfer->height);
+   xfer->reserved = 0;
+   xfer->size = (uint64_t)xfer->layer_stride * xfer->depth;
+}
+
+static int
+vrend_snapshot_transfer(struct vrend_context *ctx,
+                        const struct vrend_snapshot_transfer *xfer,
+                        void *data,
+                        int transfer_mode)
+{
+   struct pipe_box box = {
+      .width = xfer->width,
+      .height = xfer->height,
+      .depth = xfer->depth,
+   };
+   const struct iovec iov = {
+      .iov_base = data,
+      .iov_len = xfer->size,
+   };
+   const struct vrend_transfer_info info = {
+      .level = xfer->level,
+      .stride = xfer->stride,
+      .layer_stride = xfer->layer_stride,
+      .iovec = &iov,
+      .iovec_cnt = 1,
+      .box = &box,
+   };
+
+   int ret = vrend_renderer_transfer_iov(ctx, xfer->res_id, &info, transfer_mode);
+   return vrend_check_no_error(ctx) || ret ? -ret : -EINVAL;
+}
+
+int
+vrend_snapshot_save(struct vrend_snapshot_journal *journal,
+                    struct vrend_context *ctx,
+                    bool incremental,
+                    void **data,
+                    size_t *size)
+{
+   struct vrend_snapshot_resource_list list = {
+      .incremental = incremental,
+      .write_seq = journal->write_seq,
+   };
+   const uint64_t write_seq = vrend_renderer_resource_write_seq();
+   uint32_t num_transfers = 0;
+   size_t total_size;
+   int ret = 0;
+
+   if (journal->lost)
+      return -ENOMEM;
+
+   vrend_renderer_ctx_foreach_resource(ctx, vrend_snapshot_collect_resource, &list);
+   if (list.failed) {
+      free(list.resources);
+      return -ENOMEM;
+   }
+
+   const uint32_t num_cmd_dwords = vrend_snapshot_journal_num_dwords(journal);
+   total_size = sizeof(struct vrend_snapshot_header) +
+                align64(sizeof(uint32_t) * num_cmd_dwords, 8);
+
+   for (uint32_t i = 0; i < list.count; i++) {
+      const struct vrend_snapshot_resource *r = &list.resources[i];
+      const uint32_t num_levels = vrend_snapshot_resource_num_levels(r->res);
+
+      for (uint32_t level = 0; level < num_levels; level++) {
+         struct vrend_snapshot_transfer xfer;
+         vrend_snapshot_transfer_init(&xfer, r->res_id, r->res, level);
+         total_size += sizeof(xfer) + align64(xfer.size, 8);
+         num_transfers++;
+      }
+   }
+
+   uint8_t *buf = calloc(1, total_size);
+   if (!buf) {
+      free(list.resources);
+      return -ENOMEM;
+   }
+
+   struct vrend_snapshot_header *header = (struct vrend_snapshot_header *)buf;
+   *header = (struct vrend_snapshot_header){
+      .magic = VREND_SNAPSHOT_MAGIC,
+      .version = VREND_SNAPSHOT_VERSION,
+      .flags = incremental ? VREND_SNAPSHOT_FLAG_INCREMENTAL : 0,
+      .num_cmd_dwords = num_cmd_dwords,
+      .num_transfers = num_transfers,
+   };
+
+   uint8_t *ptr = buf + sizeof(*header);
+   vrend_snapshot_journal_write(journal, (uint32_t *)ptr);
+   ptr += align64(sizeof(uint32_t) * num_cmd_dwords, 8);
+
+   for (uint32_t i = 0; i < list.count && !ret; i++) {
+      const struct vrend_snapshot_resource *r = &list.resources[i];
+      const uint32_t num_levels = vrend_snapshot_resource_num_levels(r->res);
+
+      for (uint32_t level = 0; level < num_levels && !ret; level++) {
+         struct vrend_snapshot_transfer *xfer = (struct vrend_snapshot_transfer *)ptr;
+         vrend_snapshot_transfer_init(xfer, r->res_id, r->res, level);
+         ptr += sizeof(*xfer);
+
+         ret = vrend_snapshot_transfer(ctx, xfer, ptr, VIRGL_TRANSFER_FROM_HOST);
+         if (ret)
+            virgl_error("failed to read back resource %d level %d: %d\n",
+                        r->res_id, level, ret);
+         ptr += align64(xfer->size, 8);
+      }
+   }
+
+   free(list.resources);
+
+   if (ret) {
+      free(buf);
+      return ret;
+   }
+
+   journal->write_seq = write_seq;
+   *data = buf;
+   *size = total_size;
+
+   return 0;
+}
+
+static bool
+vrend_snapshot_get_header(const void *data,
+                          size_t size,
+                          struct vrend_snapshot_header *header)
+{
+   if (size < sizeof(*header))
+      return false;
+
+   memcpy(header, data, sizeof(*header));
+   if (header->magic != VREND_SNAPSHOT_MAGIC || header->version != VREND_SNAPSHOT_VERSION)
+      return false;
+
+   return (size - sizeof(*header)) / sizeof(uint32_t) >= header->num_cmd_dwords;
+}
+
+int
+vrend_snapshot_get_commands(const void *data,
+                            size_t size,
+                            uint32_t **cmds,
+                            uint32_t *num_dwords)
+{
+   struct vrend_snapshot_header header;
+
+   if (!vrend_snapshot_get_header(data, size, &header))
+      return -EINVAL;
+
+   *cmds = malloc(sizeof(uint32_t) * header.num_cmd_dwords);
+   if (!*cmds)
+      return -ENOMEM;
+
+   memcpy(*cmds, (const uint8_t *)data + sizeof(header),
+          sizeof(uint32_t) * header.num_cmd_dwords);
+   *num_dwords = header.num_cmd_dwords;
+
+   return 0;
+}
+
+int
+vrend_snapshot_restore_resources(struct vrend_snapshot_journal *journal,
+                                 struct vrend_context *ctx,
+                                 const void *data,
+                                 size_t size)
+{
+   struct vrend_snapshot_header header;
+
+   if (!vrend_snapshot_get_header(data, size, &header))
+      return -EINVAL;
+
+   const uint8_t *ptr = data;
+   const uint8_t *end = ptr + size;
+   const uint64_t cmd_size = align64(sizeof(uint32_t) * header.num_cmd_dwords, 8);
+   if ((uint64_t)size - sizeof(header) < cmd_size)
+      return -EINVAL;
+   ptr += sizeof(header) + cmd_size;
+
+   for (uint32_t i = 0; i < header.num_transfers; i++) {
+      struct vrend_snapshot_transfer xfer;
+
+      if ((size_t)(end - ptr) < sizeof(xfer))
+         return -EINVAL;
+      memcpy(&xfer, ptr, sizeof(xfer));
+      ptr += sizeof(xfer);
+
+      if ((uint64_t)(end - ptr) < xfer.size)
+         return -EINVAL;
+
+      /* the VMM recreates and attaches the resources before restoring */
+      if (!vrend_renderer_ctx_res_lookup(ctx, xfer.res_id)) {
+         virgl_error("resource %d of the snapshot is not attached\n", xfer.res_id);
+         return -EINVAL;
+      }
+
+      int ret = vrend_snapshot_transfer(ctx, &xfer, (void *)ptr, VIRGL_TRANSFER_TO_HOST);
+      if (ret)
+         return ret;
+
+      ptr += MIN2(align64(xfer.size, 8), (uint64_t)(end - ptr));
+   }
+
+   /* what has just been restored is not a new write */
+   journal->write_seq = vrend_renderer_resource_write_seq();
+
+   return 0;
+}
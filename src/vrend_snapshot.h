@@ -0,0 +1,73 @@
+/*
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef VREND_SNAPSHOT_H
+#define VREND_SNAPSHOT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct vrend_context;
+
+/*
+ * Context snapshots.
+ *
+ * The GL objects of a context cannot be turned back into the commands that
+ * created them, so a context that may be snapshotted keeps a journal of
+ * the commands its current state is made of: the commands that created
+ * the live objects of each sub-context, including all parts of multi-part
+ * shaders so that the TGSI is kept, and the last command that set each
+ * piece of bound state.  A snapshot is that journal as a command stream,
+ * followed by the contents of the attached resources as read back with the
+ * transfer paths.
+ *
+ * An incremental snapshot only carries the contents of the resources that
+ * have been written since the previous snapshot of the context, and must
+ * be restored on top of the snapshots that precede it.
+ */
+
+struct vrend_snapshot_journal;
+
+struct vrend_snapshot_journal *
+vrend_snapshot_journal_create(void);
+
+void
+vrend_snapshot_journal_destroy(struct vrend_snapshot_journal *journal);
+
+/* forgets everything, for a context whose sub-contexts have been reset */
+void
+vrend_snapshot_journal_reset(struct vrend_snapshot_journal *journal);
+
+/* records a command that has been dispatched successfully, length is the
+ * length of the command without its header */
+void
+vrend_snapshot_journal_record(struct vrend_snapshot_journal *journal,
+                              const uint32_t *buf,
+                              uint32_t length);
+
+/* data is allocated with malloc */
+int
+vrend_snapshot_save(struct vrend_snapshot_journal *journal,
+                    struct vrend_context *ctx,
+                    bool incremental,
+                    void **data,
+                    size_t *size);
+
+/* returns a copy, allocated with malloc, of the command stream of a
+ * snapshot, to be submitted to a context with freshly reset sub-contexts */
+int
+vrend_snapshot_get_commands(const void *data,
+                            size_t size,
+                            uint32_t **cmds,
+                            uint32_t *num_dwords);
+
+/* writes the resource contents of a snapshot back */
+int
+vrend_snapshot_restore_resources(struct vrend_snapshot_journal *journal,
+                                 struct vrend_context *ctx,
+                                 const void *data,
+                                 size_t size);
+
+#endif /* VREND_SNAPSHOT_H */
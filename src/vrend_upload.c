@@ -0,0 +1,189 @@
+/*
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "vrend_upload.h"
+
+#include <stdlib.h>
+
+#include "c11/threads.h"
+#include "util/macros.h"
+#include "util/u_thread.h"
+
+#include "virgl_util.h"
+#include "vrend_convert.h"
+
+#define VREND_UPLOAD_DEFAULT_THREADS 2
+#define VREND_UPLOAD_MAX_THREADS 16
+
+static struct {
+   mtx_t mutex;
+   /* signaled when a job is queued, or the pool stops */
+   cnd_t queue_cond;
+   /* signaled when a job is done */
+   cnd_t done_cond;
+   struct list_head queue;
+   bool stop;
+
+   unsigned int num_threads;
+   thrd_t threads[VREND_UPLOAD_MAX_THREADS];
+} upload_pool;
+
+static void vrend_upload_run(struct vrend_upload_job *job)
+{
+   char *dst = job->staging + (uint64_t)job->first_row * job->row_size;
+   const uint32_t last_row = job->first_row + job->num_rows;
+
+   if (!job->invert && job->stride == job->row_size &&
+       job->layer_stride == job->rows_per_slice * job->stride) {
+      vrend_read_from_iovec(job->iov, job->num_iovs,
+                            job->offset + (uint64_t)job->first_row * job->stride,
+                            dst, (size_t)job->num_rows * job->row_size);
+   } else {
+      for (uint32_t row = job->first_row; row < last_row; row++) {
+         const uint32_t slice = row / job->rows_per_slice;
+         uint32_t y = row % job->rows_per_slice;
+
+         if (job->invert)
+            y = job->rows_per_slice - 1 - y;
+
+         vrend_read_from_iovec(job->iov, job->num_iovs,
+                               job->offset + (uint64_t)slice * job->layer_stride +
+                               (uint64_t)y * job->stride,
+                               dst + (uint64_t)(row - job->first_row) * job->row_size,
+                               job->row_size);
+      }
+   }
+
+   const size_t count = (size_t)job->num_rows * job->row_size / 4;
+
+   if (job->swap_rb)
+      vrend_convert_swap_rb(dst, count);
+   if (job->z24_scale)
+      vrend_convert_z24_scale(dst, count, job->z24_scale);
+}
+
+static int vrend_upload_thread(UNUSED void *arg)
+{
+   u_thread_setname("vrend-upload");
+
+   mtx_lock(&upload_pool.mutex);
+   while (true) {
+      while (!upload_pool.stop && list_is_empty(&upload_pool.queue))
+         cnd_wait(&upload_pool.queue_cond, &upload_pool.mutex);
+      if (list_is_empty(&upload_pool.queue))
+         break;
+
+      struct vrend_upload_job *job =
+         list_first_entry(&upload_pool.queue, struct vrend_upload_job, head);
+      list_del(&job->head);
+      mtx_unlock(&upload_pool.mutex);
+
+      vrend_upload_run(job);
+
+      mtx_lock(&upload_pool.mutex);
+      job->done = true;
+      cnd_broadcast(&upload_pool.done_cond);
+   }
+   mtx_unlock(&upload_pool.mutex);
+
+   return 0;
+}
+
+static unsigned int upload_thread_count(void)
+{
+   const char *threads = getenv("VIRGL_UPLOAD_THREADS");
+
+   if (threads)
+      return MIN2(strtoul(threads, NULL, 0), VREND_UPLOAD_MAX_THREADS);
+
+   return VREND_UPLOAD_DEFAULT_THREADS;
+}
+
+bool vrend_upload_init(void)
+{
+   const unsigned int num_threads = upload_thread_count();
+
+   upload_pool.num_threads = 0;
+   upload_pool.stop = false;
+   list_inithead(&upload_pool.queue);
+
+   if (!num_threads)
+      return true;
+
+   if (mtx_init(&upload_pool.mutex, mtx_plain) != thrd_success)
+      return false;
+
+   if (cnd_init(&upload_pool.queue_cond) != thrd_success) {
+      mtx_destroy(&upload_pool.mutex);
+      return false;
+   }
+
+   if (cnd_init(&upload_pool.done_cond) != thrd_success) {
+      cnd_destroy(&upload_pool.queue_cond);
+      mtx_destroy(&upload_pool.mutex);
+      return false;
+   }
+
+   for (unsigned int i = 0; i < num_threads; i++) {
+      if (thrd_create(&upload_pool.threads[i], vrend_upload_thread, NULL) != thrd_success)
+         break;
+      upload_pool.num_threads++;
+   }
+
+   if (upload_pool.num_threads < num_threads)
+      virgl_warn("started %u of %u upload threads\n", upload_pool.num_threads, num_threads);
+
+   if (!upload_pool.num_threads) {
+      cnd_destroy(&upload_pool.done_cond);
+      cnd_destroy(&upload_pool.queue_cond);
+      mtx_destroy(&upload_pool.mutex);
+   }
+
+   return true;
+}
+
+void vrend_upload_fini(void)
+{
+   if (!upload_pool.num_threads)
+      return;
+
+   mtx_lock(&upload_pool.mutex);
+   upload_pool.stop = true;
+   cnd_broadcast(&upload_pool.queue_cond);
+   mtx_unlock(&upload_pool.mutex);
+
+   for (unsigned int i = 0; i < upload_pool.num_threads; i++)
+      thrd_join(upload_pool.threads[i], NULL);
+   upload_pool.num_threads = 0;
+
+   cnd_destroy(&upload_pool.done_cond);
+   cnd_destroy(&upload_pool.queue_cond);
+   mtx_destroy(&upload_pool.mutex);
+}
+
+bool vrend_upload_enabled(void)
+{
+   return upload_pool.num_threads > 0;
+}
+
+void vrend_upload_submit(struct vrend_upload_job *jobs, unsigned int count)
+{
+   assert(vrend_upload_enabled());
+
+   mtx_lock(&upload_pool.mutex);
+   for (unsigned int i = 0; i < count; i++) {
+      jobs[i].done = false;
+      list_addtail(&jobs[i].head, &upload_pool.queue);
+   }
+   cnd_broadcast(&upload_pool.queue_cond);
+   mtx_unlock(&upload_pool.mutex);
+}
+
+void vrend_upload_wait(struct vrend_upload_job *job)
+{
+   mtx_lock(&upload_pool.mutex);
+   while (!job->done)
+      cnd_wait(&upload_pool.done_cond, &upload_pool.mutex);
+   mtx_unlock(&upload_pool.mutex);
+}
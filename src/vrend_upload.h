@@ -0,0 +1,64 @@
+/*
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef VREND_UPLOAD_H
+#define VREND_UPLOAD_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "util/list.h"
+#include "vrend_iov.h"
+
+/* Texture uploads that need a staging copy have their texels gathered from
+ * the guest iovecs, flipped and converted by a pool of worker threads.  The
+ * staging data is split in bands that the GL thread uploads as soon as they
+ * are ready, so the CPU work runs in parallel and overlaps with the GL
+ * calls.  The size of the pool is set with VIRGL_UPLOAD_THREADS, 0 keeps
+ * everything on the GL thread.
+ */
+
+/* bands are about this large, smaller uploads are not worth splitting */
+#define VREND_UPLOAD_BAND_SIZE (256 * 1024)
+
+/* Prepares rows [first_row, first_row + num_rows) of the staging data, the
+ * rows of all slices being numbered in sequence.  The source rows are laid
+ * out as in read_transfer_data.
+ */
+struct vrend_upload_job {
+   const struct iovec *iov;
+   unsigned int num_iovs;
+   uint64_t offset;
+   uint32_t stride;
+   uint32_t layer_stride;
+   uint32_t row_size;
+   uint32_t rows_per_slice;
+   bool invert;
+
+   /* 32bpp conversions applied to the staging rows, z24_scale of 0 means
+    * none */
+   bool swap_rb;
+   float z24_scale;
+
+   char *staging;
+   uint32_t first_row;
+   uint32_t num_rows;
+
+   /* private */
+   bool done;
+   struct list_head head;
+};
+
+bool vrend_upload_init(void);
+
+void vrend_upload_fini(void);
+
+bool vrend_upload_enabled(void);
+
+/* Queues the jobs, which must stay alive until waited for. */
+void vrend_upload_submit(struct vrend_upload_job *jobs, unsigned int count);
+
+void vrend_upload_wait(struct vrend_upload_job *job);
+
+#endif /* VREND_UPLOAD_H */
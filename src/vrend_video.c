@@ -66,11 +66,15 @@
  */
 
 
+#include <sys/stat.h>
+#include <drm_fourcc.h>
+
 #include "virgl_video.h"
 #include "virgl_video_hw.h"
 
 #include "vrend_debug.h"
 #include "vrend_winsys.h"
+#include "vrend_winsys_egl.h"
 #include "vrend_renderer.h"
 #include "vrend_video.h"
 
@@ -80,6 +84,7 @@ struct vrend_video_context {
     struct vrend_context *ctx;
     struct list_head codecs;
     struct list_head buffers;
+    uint64_t last_frame;    /* last frame ended in this context */
 };
 
 struct vrend_video_codec {
@@ -91,11 +96,35 @@ struct vrend_video_codec {
     struct list_head head;
 };
 
+/*
+ * EGL image imported from an exported VA surface plane.
+ *
+ * libva hands out new fds every time a surface is exported, so images are
+ * keyed by the underlying dma-buf (device + inode) and the plane layout,
+ * which lets surfaces that are exported again reuse the same import.
+ */
+struct vrend_video_image {
+    dev_t dev;
+    ino_t ino;
+    uint32_t offset;
+    uint64_t modifier;
+    uint32_t drm_format;
+    uint32_t width;
+    uint32_t height;
+    uint32_t pitch;
+
+    void *egl_image;
+    unsigned refcount;
+    struct list_head head;
+};
+
 struct vrend_video_plane {
     uint32_t res_handle;
     GLuint texture;         /* texture for temporary use */
     GLuint framebuffer;     /* framebuffer for temporary use */
-    EGLImageKHR egl_image;  /* egl image for temporary use */
+    struct vrend_video_image *image;
+    bool texture_bound;         /* 'texture' is bound to 'image' */
+    GLuint imported_res_id;     /* resource texture is backed by 'image' */
 };
 
 struct vrend_video_buffer {
@@ -109,6 +138,8 @@ struct vrend_video_buffer {
     struct vrend_video_plane planes[3];
 };
 
+static struct list_head video_images;
+
 static struct vrend_video_codec *vrend_video_codec(
         struct virgl_video_codec *codec)
 {
@@ -150,6 +181,135 @@ static struct vrend_video_buffer *get_video_buffer(
 }
 
 
+static struct vrend_video_image *get_video_image(
+                        const struct virgl_video_dma_buf *dmabuf, unsigned idx)
+{
+    struct stat st;
+    int fds[1];
+    uint32_t strides[1], offsets[1];
+    struct vrend_video_image *img;
+    const struct virgl_video_dma_buf_plane *plane = &dmabuf->planes[idx];
+    uint32_t width = dmabuf->width / (idx + 1);
+    uint32_t height = dmabuf->height / (idx + 1);
+
+    if (!egl || fstat(plane->fd, &st))
+        return NULL;
+
+    LIST_FOR_EACH_ENTRY(img, &video_images, head) {
+        if (img->dev == st.st_dev && img->ino == st.st_ino &&
+            img->offset == plane->offset && img->modifier == plane->modifier &&
+            img->drm_format == plane->drm_format && img->pitch == plane->pitch &&
+            img->width == width && img->height == height) {
+            img->refcount++;
+            return img;
+        }
+    }
+
+    img = calloc(1, sizeof(*img));
+    if (!img)
+        return NULL;
+
+    fds[0] = plane->fd;
+    strides[0] = plane->pitch;
+    offsets[0] = plane->offset;
+    img->egl_image = virgl_egl_image_from_dmabuf(egl, width, height,
+                                                 plane->drm_format,
+                                                 plane->modifier, 1,
+                                                 fds, strides, offsets);
+    if (!img->egl_image || img->egl_image == EGL_NO_IMAGE_KHR) {
+        free(img);
+        return NULL;
+    }
+
+    img->dev = st.st_dev;
+    img->ino = st.st_ino;
+    img->offset = plane->offset;
+    img->modifier = plane->modifier;
+    img->drm_format = plane->drm_format;
+    img->width = width;
+    img->height = height;
+    img->pitch = plane->pitch;
+    img->refcount = 1;
+    list_add(&img->head, &video_images);
+
+    return img;
+}
+
+static void put_video_image(struct vrend_video_image *img)
+{
+    if (!img || --img->refcount)
+        return;
+
+    list_del(&img->head);
+    virgl_egl_image_destroy(egl, img->egl_image);
+    free(img);
+}
+
+static struct vrend_video_image *video_plane_image(
+                                        struct vrend_video_plane *plane,
+                                        const struct virgl_video_dma_buf *dmabuf,
+                                        unsigned idx)
+{
+    if (!plane->image)
+        plane->image = get_video_image(dmabuf, idx);
+
+    return plane->image;
+}
+
+/* Bind the temporary texture of the plane to its image, once. */
+static void video_plane_bind_texture(struct vrend_video_plane *plane)
+{
+    glBindTexture(GL_TEXTURE_2D, plane->texture);
+    if (!plane->texture_bound) {
+        glEGLImageTargetTexture2DOES(GL_TEXTURE_2D,
+                                     (GLeglImageOES)(plane->image->egl_image));
+        plane->texture_bound = true;
+    }
+}
+
+/* The format a plane of the given fourcc must have to be aliased. */
+static enum pipe_format video_plane_pipe_format(uint32_t drm_format)
+{
+    switch (drm_format) {
+    case DRM_FORMAT_R8:
+        return PIPE_FORMAT_R8_UNORM;
+    case DRM_FORMAT_GR88:
+        return PIPE_FORMAT_R8G8_UNORM;
+    case DRM_FORMAT_R16:
+        return PIPE_FORMAT_R16_UNORM;
+    case DRM_FORMAT_GR1616:
+        return PIPE_FORMAT_R16G16_UNORM;
+    default:
+        return PIPE_FORMAT_NONE;
+    }
+}
+
+/*
+ * Try to make the resource texture an alias of the decoded surface plane.
+ * Once this succeeded, the decoder writes straight into the storage the
+ * guest samples from and no copy is needed anymore.  The plane must have
+ * the size and the format of the resource, anything else is copied.
+ */
+static bool video_plane_import(struct vrend_video_plane *plane,
+                               struct vrend_resource *res)
+{
+    if (plane->imported_res_id && plane->imported_res_id == res->id)
+        return true;
+
+    if (res->base.width0 != plane->image->width ||
+        res->base.height0 != plane->image->height)
+        return false;
+
+    if (video_plane_pipe_format(plane->image->drm_format) != res->base.format)
+        return false;
+
+    if (vrend_renderer_resource_import_egl_image(res, plane->image->egl_image))
+        return false;
+
+    plane->imported_res_id = res->id;
+    return true;
+}
+
 static int sync_dmabuf_to_video_buffer(struct vrend_video_buffer *buf,
                                        const struct virgl_video_dma_buf *dmabuf)
 {
@@ -169,30 +329,17 @@ static int sync_dmabuf_to_video_buffer(struct vrend_video_buffer *buf,
         }
 
         /* dmabuf -> eglimage */
-        if (EGL_NO_IMAGE_KHR == plane->egl_image) {
-            EGLint img_attrs[16] = {
-                EGL_LINUX_DRM_FOURCC_EXT,       dmabuf->planes[i].drm_format,
-                EGL_WIDTH,                      dmabuf->width / (i + 1),
-                EGL_HEIGHT,                     dmabuf->height / (i + 1),
-                EGL_DMA_BUF_PLANE0_FD_EXT,      dmabuf->planes[i].fd,
-                EGL_DMA_BUF_PLANE0_OFFSET_EXT,  dmabuf->planes[i].offset,
-                EGL_DMA_BUF_PLANE0_PITCH_EXT,   dmabuf->planes[i].pitch,
-                EGL_NONE
-            };
-
-            plane->egl_image = eglCreateImageKHR(eglGetCurrentDisplay(),
-                    EGL_NO_CONTEXT, EGL_LINUX_DMA_BUF_EXT, NULL, img_attrs);
-        }
-
-        if (EGL_NO_IMAGE_KHR == plane->egl_image) {
+        if (!video_plane_image(plane, dmabuf, i)) {
             virgl_error("%s: create egl image failed\n", __func__);
             continue;
         }
 
+        /* eglimage -> vrend_video_buffer.planes[i], without a copy */
+        if (video_plane_import(plane, res))
+            continue;
+
         /* eglimage -> texture */
-        glBindTexture(GL_TEXTURE_2D, plane->texture);
-        glEGLImageTargetTexture2DOES(GL_TEXTURE_2D,
-                                    (GLeglImageOES)(plane->egl_image));
+        video_plane_bind_texture(plane);
 
         /* texture -> framebuffer */
         glBindFramebuffer(GL_READ_FRAMEBUFFER, plane->framebuffer);
@@ -230,30 +377,17 @@ static int sync_video_buffer_to_dmabuf(struct vrend_video_buffer *buf,
         }
 
         /* dmabuf -> eglimage */
-        if (EGL_NO_IMAGE_KHR == plane->egl_image) {
-            EGLint img_attrs[16] = {
-                EGL_LINUX_DRM_FOURCC_EXT,       dmabuf->planes[i].drm_format,
-                EGL_WIDTH,                      dmabuf->width / (i + 1),
-                EGL_HEIGHT,                     dmabuf->height / (i + 1),
-                EGL_DMA_BUF_PLANE0_FD_EXT,      dmabuf->planes[i].fd,
-                EGL_DMA_BUF_PLANE0_OFFSET_EXT,  dmabuf->planes[i].offset,
-                EGL_DMA_BUF_PLANE0_PITCH_EXT,   dmabuf->planes[i].pitch,
-                EGL_NONE
-            };
-
-            plane->egl_image = eglCreateImageKHR(eglGetCurrentDisplay(),
-                    EGL_NO_CONTEXT, EGL_LINUX_DMA_BUF_EXT, NULL, img_attrs);
-        }
-
-        if (EGL_NO_IMAGE_KHR == plane->egl_image) {
+        if (!video_plane_image(plane, dmabuf, i)) {
             virgl_error("%s: create egl image failed\n", __func__);
             continue;
         }
 
+        /* the surface already is the storage of the resource */
+        if (plane->imported_res_id && plane->imported_res_id == res->id)
+            continue;
+
         /* eglimage -> texture */
-        glBindTexture(GL_TEXTURE_2D, plane->texture);
-        glEGLImageTargetTexture2DOES(GL_TEXTURE_2D,
-                                    (GLeglImageOES)(plane->egl_image));
+        video_plane_bind_texture(plane);
 
         /* vrend_video_buffer.planes[i] -> framebuffer */
         glBindFramebuffer(GL_READ_FRAMEBUFFER, plane->framebuffer);
@@ -282,6 +416,9 @@ static void vrend_video_decode_completed(
 
     (void)codec;
 
+    /* completions may run while another context is current */
+    vrend_hw_switch_context(buf->ctx->ctx, true);
+
     sync_dmabuf_to_video_buffer(buf, dmabuf);
 }
 
@@ -316,6 +453,8 @@ static void vrend_video_encode_completed(
     if (!cdc->dest_res || !cdc->feed_res)
         return;
 
+    vrend_hw_switch_context(cdc->ctx->ctx, true);
+
     memset(&feedback, 0, sizeof(feedback));
 
     /* sync coded data to guest */
@@ -354,6 +493,7 @@ static struct virgl_video_callbacks video_callbacks = {
     .decode_completed           = vrend_video_decode_completed,
     .encode_upload_picture      = vrend_video_enocde_upload_picture,
     .encode_completed           = vrend_video_encode_completed,
+    .frame_synced               = vrend_renderer_video_frame_synced,
 };
 
 int vrend_video_init(int drm_fd)
@@ -361,6 +501,8 @@ int vrend_video_init(int drm_fd)
     if (drm_fd < 0)
         return -1;
 
+    list_inithead(&video_images);
+
     return virgl_video_init(drm_fd, &video_callbacks, 0);
 }
 
@@ -369,6 +511,36 @@ void vrend_video_fini(void)
     virgl_video_destroy();
 }
 
+/*
+ * The frame queue is global, so the completions run from whatever context
+ * retires them, and switch to the context that owns the frame.
+ */
+void vrend_video_retire_frames(void)
+{
+    struct vrend_context *ctx = vrend_hw_save_context();
+
+    virgl_video_retire_frames();
+    vrend_hw_restore_context(ctx);
+}
+
+void vrend_video_wait_frame(uint64_t frame)
+{
+    struct vrend_context *ctx = vrend_hw_save_context();
+
+    virgl_video_wait_frame(frame);
+    vrend_hw_restore_context(ctx);
+}
+
+bool vrend_video_frame_completed(uint64_t frame)
+{
+    return virgl_video_frame_completed(frame);
+}
+
+uint64_t vrend_video_context_last_frame(const struct vrend_video_context *ctx)
+{
+    return ctx ? ctx->last_frame : 0;
+}
+
 int vrend_video_fill_caps(union virgl_caps *caps)
 {
     return virgl_video_fill_caps(caps);
@@ -487,9 +659,6 @@ int vrend_video_create_buffer(struct vrend_video_context *ctx,
         return -1;
     }
 
-    for (i = 0; i < ARRAY_SIZE(buf->planes); i++)
-        buf->planes[i].egl_image = EGL_NO_IMAGE_KHR;
-
     for (i = 0, buf->num_planes = 0;
          i < num_res && buf->num_planes < ARRAY_SIZE(buf->planes); i++) {
 
@@ -530,8 +699,7 @@ static void destroy_video_buffer(struct vrend_video_buffer *buf)
 
         glDeleteTextures(1, &plane->texture);
         glDeleteFramebuffers(1, &plane->framebuffer);
-        if (plane->egl_image == EGL_NO_IMAGE_KHR)
-            eglDestroyImageKHR(eglGetCurrentDisplay(), plane->egl_image);
+        put_video_image(plane->image);
     }
 
     virgl_video_destroy_buffer(buf->buffer);
@@ -566,6 +734,8 @@ void vrend_video_destroy_context(struct vrend_video_context *ctx)
    struct vrend_video_codec *vcdc, *vcdc_tmp;
    struct vrend_video_buffer *vbuf, *vbuf_tmp;
 
+   virgl_video_wait_frame(ctx->last_frame);
+
    LIST_FOR_EACH_ENTRY_SAFE(vcdc, vcdc_tmp, &ctx->codecs, head)
       destroy_video_codec(vcdc);
 
@@ -856,10 +1026,27 @@ int vrend_video_end_frame(struct vrend_video_context *ctx,
 {
     struct vrend_video_codec *cdc = get_video_codec(ctx, cdc_handle);
     struct vrend_video_buffer *tgt = get_video_buffer(ctx, tgt_handle);
+    struct vrend_resource *res;
+    int err;
 
     if (!cdc || !tgt)
         return -1;
 
-    return virgl_video_end_frame(cdc->codec, tgt->buffer);
+    err = virgl_video_end_frame(cdc->codec, tgt->buffer);
+    if (err)
+        return err;
+
+    /*
+     * The frame may still be in flight. Fences created from now on, and
+     * lookups of the planes of the target, wait for its completion.
+     */
+    ctx->last_frame = virgl_video_buffer_frame(tgt->buffer);
+    for (unsigned i = 0; i < tgt->num_planes; i++) {
+        res = vrend_renderer_ctx_res_lookup(ctx->ctx, tgt->planes[i].res_handle);
+        if (res && !vrend_video_frame_completed(ctx->last_frame))
+            res->video_frame = ctx->last_frame;
+    }
+
+    return 0;
 }
 
@@ -35,6 +35,9 @@
 #ifndef VREND_VIDEO_H
 #define VREND_VIDEO_H
 
+#include <stdbool.h>
+#include <stdint.h>
+
 #include <virgl_hw.h>
 
 #define VREND_VIDEO_BUFFER_PLANE_NUM  3
@@ -44,6 +47,12 @@ struct vrend_video_context;
 int vrend_video_init(int drm_fd);
 void vrend_video_fini(void);
 
+/* frames end asynchronously, see virgl_video_end_frame() */
+void vrend_video_retire_frames(void);
+void vrend_video_wait_frame(uint64_t frame);
+bool vrend_video_frame_completed(uint64_t frame);
+uint64_t vrend_video_context_last_frame(const struct vrend_video_context *ctx);
+
 int vrend_video_fill_caps(union virgl_caps *caps);
 
 struct vrend_video_context *vrend_video_create_context(struct vrend_context *ctx);
@@ -22,12 +22,15 @@
  *
  **************************************************************************/
 #include <check.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
 #include <errno.h>
 #include <virglrenderer.h>
 #include "virgl_hw.h"
 #include "vrend_iov.h"
+#include "vrend_blitter.h"
+#include "vrend_debug.h"
 #include "pipe/p_format.h"
 #include "testvirgl_encode.h"
 #include "virgl_protocol.h"
@@ -145,6 +148,291 @@ START_TEST(virgl_test_clear)
 }
 END_TEST
 
+#if UTIL_ARCH_LITTLE_ENDIAN
+static const uint32_t test_red = 0xffff0000;
+#else
+static const uint32_t test_red = 0x0000ffff;
+#endif
+static const uint32_t test_blue = 0xff0000ff;
+
+static void clear_surface(struct virgl_context *ctx, struct virgl_surface *surf,
+                          float r, float g, float b)
+{
+    struct pipe_framebuffer_state fb_state;
+    union pipe_color_union color;
+
+    fb_state.nr_cbufs = 1;
+    fb_state.zsbuf = NULL;
+    fb_state.cbufs[0] = &surf->base;
+    virgl_encoder_set_framebuffer_state(ctx, &fb_state);
+
+    color.f[0] = r;
+    color.f[1] = g;
+    color.f[2] = b;
+    color.f[3] = 1.0;
+    virgl_encode_clear(ctx, PIPE_CLEAR_COLOR0, &color, 0.0, 0);
+}
+
+static void check_resource_color(struct virgl_context *ctx, struct virgl_resource *res,
+                                 uint32_t expected)
+{
+    struct virgl_box box = { .w = 5, .h = 1, .d = 1 };
+    uint32_t *ptr = res->iovs[0].iov_base;
+    int ret;
+    int i;
+
+    ret = virgl_renderer_transfer_read_iov(res->handle, ctx->ctx_id, 0, 50, 0, &box, 0, NULL, 0);
+    ck_assert_int_eq(ret, 0);
+
+    for (i = 0; i < 5; i++)
+        ck_assert_int_eq(ptr[i], expected);
+}
+
+/* switch back and forth between render targets, and reuse a surface handle
+ * for a different resource while the framebuffer that used it is bound */
+START_TEST(virgl_test_clear_fb_switch)
+{
+    struct virgl_context ctx;
+    struct virgl_resource res[3];
+    struct virgl_surface surf[3];
+    int ret;
+    int i;
+
+    ret = testvirgl_init_ctx_cmdbuf(&ctx);
+    ck_assert_int_eq(ret, 0);
+
+    for (i = 0; i < 3; i++) {
+        ret = testvirgl_create_backed_simple_2d_res(&res[i], i + 1, 50, 50);
+        ck_assert_int_eq(ret, 0);
+        virgl_renderer_ctx_attach_resource(ctx.ctx_id, res[i].handle);
+
+        memset(&surf[i], 0, sizeof(surf[i]));
+        surf[i].base.format = PIPE_FORMAT_B8G8R8X8_UNORM;
+        surf[i].handle = i < 2 ? i + 1 : 1;
+        surf[i].base.texture = &res[i].base;
+    }
+
+    virgl_encoder_create_surface(&ctx, surf[0].handle, &res[0], &surf[0].base);
+    virgl_encoder_create_surface(&ctx, surf[1].handle, &res[1], &surf[1].base);
+
+    for (i = 0; i < 4; i++) {
+        clear_surface(&ctx, &surf[0], 1.0, 0.0, 0.0);
+        clear_surface(&ctx, &surf[1], 0.0, 1.0, 0.0);
+    }
+    testvirgl_ctx_send_cmdbuf(&ctx);
+
+    check_resource_color(&ctx, &res[0], test_red);
+    check_resource_color(&ctx, &res[1], test_green);
+
+    /* surface handle 1 now names a view of the third resource */
+    clear_surface(&ctx, &surf[0], 0.0, 0.0, 1.0);
+    virgl_encode_delete_object(&ctx, surf[0].handle, VIRGL_OBJECT_SURFACE);
+    virgl_encoder_create_surface(&ctx, surf[2].handle, &res[2], &surf[2].base);
+    clear_surface(&ctx, &surf[2], 0.0, 1.0, 0.0);
+    clear_surface(&ctx, &surf[1], 1.0, 0.0, 0.0);
+    testvirgl_ctx_send_cmdbuf(&ctx);
+
+    check_resource_color(&ctx, &res[0], test_blue);
+    check_resource_color(&ctx, &res[1], test_red);
+    check_resource_color(&ctx, &res[2], test_green);
+
+    for (i = 0; i < 3; i++) {
+        virgl_renderer_ctx_detach_resource(ctx.ctx_id, res[i].handle);
+        testvirgl_destroy_backed_res(&res[i]);
+    }
+
+    testvirgl_fini_ctx_cmdbuf(&ctx);
+}
+END_TEST
+
+/* submit a command stream scattered over small misaligned iovecs, so that
+ * every command straddles a boundary */
+START_TEST(virgl_test_clear_iov)
+{
+    struct virgl_context ctx;
+    struct virgl_resource res[2];
+    struct virgl_surface surf[2];
+    static uint8_t stream[4096 + 1];
+    static struct iovec iovs[4096];
+    unsigned num_iovs = 0;
+    size_t size, offset;
+    int ret;
+    int i;
+
+    ret = testvirgl_init_ctx_cmdbuf(&ctx);
+    ck_assert_int_eq(ret, 0);
+
+    for (i = 0; i < 2; i++) {
+        ret = testvirgl_create_backed_simple_2d_res(&res[i], i + 1, 50, 50);
+        ck_assert_int_eq(ret, 0);
+        virgl_renderer_ctx_attach_resource(ctx.ctx_id, res[i].handle);
+
+        memset(&surf[i], 0, sizeof(surf[i]));
+        surf[i].base.format = PIPE_FORMAT_B8G8R8X8_UNORM;
+        surf[i].handle = i + 1;
+        surf[i].base.texture = &res[i].base;
+        virgl_encoder_create_surface(&ctx, surf[i].handle, &res[i], &surf[i].base);
+    }
+
+    clear_surface(&ctx, &surf[0], 1.0, 0.0, 0.0);
+    clear_surface(&ctx, &surf[1], 0.0, 1.0, 0.0);
+
+    size = ctx.cbuf->cdw * sizeof(uint32_t);
+    ck_assert_int_lt(size, sizeof(stream));
+    memcpy(stream + 1, ctx.cbuf->buf, size);
+    ctx.cbuf->cdw = 0;
+
+    for (offset = 0; offset < size; offset += 7) {
+        iovs[num_iovs].iov_base = stream + 1 + offset;
+        iovs[num_iovs].iov_len = MIN2(size - offset, 7);
+        num_iovs++;
+        /* empty iovecs are skipped */
+        iovs[num_iovs].iov_base = NULL;
+        iovs[num_iovs].iov_len = 0;
+        num_iovs++;
+    }
+
+    ret = virgl_renderer_submit_cmd_iov(iovs, num_iovs, ctx.ctx_id);
+    ck_assert_int_eq(ret, 0);
+
+    check_resource_color(&ctx, &res[0], test_red);
+    check_resource_color(&ctx, &res[1], test_green);
+
+    for (i = 0; i < 2; i++) {
+        virgl_renderer_ctx_detach_resource(ctx.ctx_id, res[i].handle);
+        testvirgl_destroy_backed_res(&res[i]);
+    }
+
+    testvirgl_fini_ctx_cmdbuf(&ctx);
+}
+END_TEST
+
+#define COPY_TEST_SIZE 64
+
+static void set_box_2d(int x, int y, int w, int h, struct pipe_box *box)
+{
+    box->x = x;
+    box->y = y;
+    box->z = 0;
+    box->width = w;
+    box->height = h;
+    box->depth = 1;
+}
+
+/* tiled copies from a pattern texture, with runs of adjacent tiles the
+ * decoder can merge, runs that it can't and a clear in between */
+static void run_copy_region_sequence(uint32_t *result)
+{
+    struct virgl_context ctx;
+    struct virgl_resource src, dst;
+    struct virgl_surface surf;
+    union pipe_color_union color;
+    struct virgl_box box = { 0, 0, 0, COPY_TEST_SIZE, COPY_TEST_SIZE, 1 };
+    struct pipe_box src_box;
+    uint32_t *ptr;
+    int ret;
+    int x, y;
+
+    ret = testvirgl_init_ctx_cmdbuf(&ctx);
+    ck_assert_int_eq(ret, 0);
+
+    ret = testvirgl_create_backed_simple_2d_res(&src, 1, COPY_TEST_SIZE, COPY_TEST_SIZE);
+    ck_assert_int_eq(ret, 0);
+    ret = testvirgl_create_backed_simple_2d_res(&dst, 2, COPY_TEST_SIZE, COPY_TEST_SIZE);
+    ck_assert_int_eq(ret, 0);
+    virgl_renderer_ctx_attach_resource(ctx.ctx_id, src.handle);
+    virgl_renderer_ctx_attach_resource(ctx.ctx_id, dst.handle);
+
+    ptr = src.iovs[0].iov_base;
+    for (x = 0; x < COPY_TEST_SIZE * COPY_TEST_SIZE; x++)
+        ptr[x] = 0xff000000 | (x * 2654435761u >> 8);
+    ret = virgl_renderer_transfer_write_iov(src.handle, ctx.ctx_id, 0, COPY_TEST_SIZE * 4, 0,
+                                            &box, 0, NULL, 0);
+    ck_assert_int_eq(ret, 0);
+
+    memset(&surf, 0, sizeof(surf));
+    surf.base.format = PIPE_FORMAT_B8G8R8X8_UNORM;
+    surf.handle = 1;
+    surf.base.texture = &dst.base;
+    virgl_encoder_create_surface(&ctx, surf.handle, &dst, &surf.base);
+    clear_surface(&ctx, &surf, 0.0, 0.0, 1.0);
+
+    /* 8x8 tiles of the top half in row order, these merge into rows */
+    for (y = 0; y < COPY_TEST_SIZE / 2; y += 8) {
+        for (x = 0; x < COPY_TEST_SIZE; x += 8) {
+            set_box_2d(x, y, 8, 8, &src_box);
+            virgl_encode_resource_copy_region(&ctx, &dst, 0, x, y, 0, &src, 0, &src_box);
+        }
+    }
+
+    /* the clear has to overwrite all of the copies queued before it */
+    color.f[0] = 1.0;
+    color.f[1] = 0.0;
+    color.f[2] = 0.0;
+    color.f[3] = 1.0;
+    virgl_encode_clear(&ctx, PIPE_CLEAR_COLOR0, &color, 0.0, 0);
+
+    for (x = 0; x < COPY_TEST_SIZE; x += 8) {
+        set_box_2d(x, COPY_TEST_SIZE / 2 - 8, 8, 8, &src_box);
+        virgl_encode_resource_copy_region(&ctx, &dst, 0, x, COPY_TEST_SIZE / 2 - 8, 0,
+                                          &src, 0, &src_box);
+    }
+
+    /* bottom half transposed tile by tile, nothing merges */
+    for (y = COPY_TEST_SIZE / 2; y < COPY_TEST_SIZE; y += 4) {
+        for (x = 0; x < COPY_TEST_SIZE / 2; x += 4) {
+            set_box_2d(y - COPY_TEST_SIZE / 2, x, 4, 4, &src_box);
+            virgl_encode_resource_copy_region(&ctx, &dst, 0, x, y, 0, &src, 0, &src_box);
+        }
+    }
+
+    /* copies within the destination read back earlier copies */
+    for (x = 0; x < COPY_TEST_SIZE / 2; x += 2) {
+        set_box_2d(x, COPY_TEST_SIZE / 2 - 8, 2, 8, &src_box);
+        virgl_encode_resource_copy_region(&ctx, &dst, 0, COPY_TEST_SIZE / 2 + x, COPY_TEST_SIZE / 2,
+                                          0, &dst, 0, &src_box);
+    }
+
+    ret = testvirgl_ctx_send_cmdbuf(&ctx);
+    ck_assert_int_eq(ret, 0);
+
+    ret = virgl_renderer_transfer_read_iov(dst.handle, ctx.ctx_id, 0, COPY_TEST_SIZE * 4, 0,
+                                           &box, 0, NULL, 0);
+    ck_assert_int_eq(ret, 0);
+    memcpy(result, dst.iovs[0].iov_base, COPY_TEST_SIZE * COPY_TEST_SIZE * 4);
+
+    virgl_renderer_ctx_detach_resource(ctx.ctx_id, src.handle);
+    virgl_renderer_ctx_detach_resource(ctx.ctx_id, dst.handle);
+    testvirgl_destroy_backed_res(&src);
+    testvirgl_destroy_backed_res(&dst);
+    testvirgl_fini_ctx_cmdbuf(&ctx);
+}
+
+START_TEST(virgl_test_copy_region_batching)
+{
+    static uint32_t batched[COPY_TEST_SIZE * COPY_TEST_SIZE];
+    static uint32_t unbatched[COPY_TEST_SIZE * COPY_TEST_SIZE];
+    int x;
+
+    run_copy_region_sequence(batched);
+
+    setenv("VIRGL_NO_COPY_BATCHING", "1", 1);
+    run_copy_region_sequence(unbatched);
+    unsetenv("VIRGL_NO_COPY_BATCHING");
+
+    for (x = 0; x < COPY_TEST_SIZE * COPY_TEST_SIZE; x++)
+        ck_assert_int_eq(batched[x], unbatched[x]);
+
+    ck_assert_int_eq(batched[0], test_red);
+
+    /* the last row of the top half is a plain copy of the source */
+    for (x = 0; x < COPY_TEST_SIZE; x++) {
+        uint32_t i = (COPY_TEST_SIZE / 2 - 1) * COPY_TEST_SIZE + x;
+        ck_assert_int_eq(batched[i] & 0xffffff, (i * 2654435761u >> 8) & 0xffffff);
+    }
+}
+END_TEST
+
 START_TEST(virgl_test_blit_simple)
 {
     struct virgl_context ctx;
@@ -236,6 +524,118 @@ START_TEST(virgl_test_blit_simple)
 }
 END_TEST
 
+#define MIP_TEST_SIZE 64
+
+/* filtered downsample into the second level of a texture, the swizzle
+ * between B8G8R8X8 and R8G8B8A8 keeps it off the FBO blit path, returns
+ * the number of blits done with a compute shader */
+static unsigned run_mip_blit(uint32_t *result)
+{
+    struct virgl_context ctx;
+    struct virgl_resource src, dst;
+    struct virgl_renderer_resource_create_args args;
+    struct virgl_box box = { 0, 0, 0, MIP_TEST_SIZE, MIP_TEST_SIZE, 1 };
+    struct virgl_box level_box = { 0, 0, 0, MIP_TEST_SIZE / 2, MIP_TEST_SIZE / 2, 1 };
+    struct pipe_blit_info blit;
+    struct iovec iov;
+    uint32_t *ptr;
+    unsigned compute_blits;
+    int ret;
+    int x;
+
+    ret = testvirgl_init_ctx_cmdbuf(&ctx);
+    ck_assert_int_eq(ret, 0);
+
+    ret = testvirgl_create_backed_simple_2d_res(&src, 1, MIP_TEST_SIZE, MIP_TEST_SIZE);
+    ck_assert_int_eq(ret, 0);
+    virgl_renderer_ctx_attach_resource(ctx.ctx_id, src.handle);
+
+    testvirgl_init_simple_2d_resource(&args, 2);
+    args.format = PIPE_FORMAT_R8G8B8A8_UNORM;
+    args.width = MIP_TEST_SIZE;
+    args.height = MIP_TEST_SIZE;
+    args.last_level = 1;
+    args.bind = PIPE_BIND_SAMPLER_VIEW | PIPE_BIND_RENDER_TARGET;
+    ret = virgl_renderer_resource_create(&args, NULL, 0);
+    ck_assert_int_eq(ret, 0);
+    dst.handle = 2;
+    dst.base.target = args.target;
+    dst.base.format = args.format;
+    virgl_renderer_ctx_attach_resource(ctx.ctx_id, dst.handle);
+
+    ptr = src.iovs[0].iov_base;
+    for (x = 0; x < MIP_TEST_SIZE * MIP_TEST_SIZE; x++)
+        ptr[x] = 0xff000000 | (x * 2654435761u >> 8);
+    ret = virgl_renderer_transfer_write_iov(src.handle, ctx.ctx_id, 0, MIP_TEST_SIZE * 4, 0,
+                                            &box, 0, NULL, 0);
+    ck_assert_int_eq(ret, 0);
+
+    memset(&blit, 0, sizeof(blit));
+    blit.mask = PIPE_MASK_RGBA;
+    blit.filter = PIPE_TEX_FILTER_LINEAR;
+    blit.src.format = src.base.format;
+    blit.src.box.width = MIP_TEST_SIZE;
+    blit.src.box.height = MIP_TEST_SIZE;
+    blit.src.box.depth = 1;
+    blit.dst.format = dst.base.format;
+    blit.dst.level = 1;
+    blit.dst.box.width = MIP_TEST_SIZE / 2;
+    blit.dst.box.height = MIP_TEST_SIZE / 2;
+    blit.dst.box.depth = 1;
+    virgl_encode_blit(&ctx, &dst, &src, &blit);
+
+    ret = testvirgl_ctx_send_cmdbuf(&ctx);
+    ck_assert_int_eq(ret, 0);
+
+    iov.iov_base = result;
+    iov.iov_len = MIP_TEST_SIZE / 2 * MIP_TEST_SIZE / 2 * 4;
+    ret = virgl_renderer_transfer_read_iov(dst.handle, ctx.ctx_id, 1, MIP_TEST_SIZE / 2 * 4, 0,
+                                           &level_box, 0, &iov, 1);
+    ck_assert_int_eq(ret, 0);
+
+    compute_blits = vrend_blitter_compute_blit_count();
+
+    virgl_renderer_ctx_detach_resource(ctx.ctx_id, src.handle);
+    virgl_renderer_ctx_detach_resource(ctx.ctx_id, dst.handle);
+    testvirgl_destroy_backed_res(&src);
+    virgl_renderer_resource_unref(dst.handle);
+    testvirgl_fini_ctx_cmdbuf(&ctx);
+    return compute_blits;
+}
+
+/* the compute blitter used on GLES hosts has to match the GL blitter */
+START_TEST(virgl_test_blit_mip_compute)
+{
+    static uint32_t compute[MIP_TEST_SIZE / 2 * MIP_TEST_SIZE / 2];
+    static uint32_t gl[MIP_TEST_SIZE / 2 * MIP_TEST_SIZE / 2];
+    int saved_flags = context_flags;
+    unsigned compute_blits, gl_compute_blits;
+    int x;
+
+    /* the compute blitter is only used on GLES */
+    context_flags |= VIRGL_RENDERER_USE_GLES;
+    compute_blits = run_mip_blit(compute);
+
+    setenv("VIRGL_NO_COMPUTE_BLIT", "1", 1);
+    gl_compute_blits = run_mip_blit(gl);
+    unsetenv("VIRGL_NO_COMPUTE_BLIT");
+    context_flags = saved_flags;
+
+    ck_assert_int_eq(gl_compute_blits, 0);
+    if (!compute_blits) {
+        fprintf(stderr, "virgl_test_blit_mip_compute: no compute blit support, skipped\n");
+        return;
+    }
+
+    for (x = 0; x < MIP_TEST_SIZE / 2 * MIP_TEST_SIZE / 2; x++)
+        ck_assert_int_eq(compute[x], gl[x]);
+
+    /* every texel of the level was written */
+    for (x = 0; x < MIP_TEST_SIZE / 2 * MIP_TEST_SIZE / 2; x++)
+        ck_assert_int_eq(compute[x] >> 24, 0xff);
+}
+END_TEST
+
 struct vertex {
    float position[4];
    float color[4];
@@ -492,6 +892,84 @@ START_TEST(virgl_test_render_simple)
 }
 END_TEST
 
+/* a hinted program is linked at the end of the submit, before any draw,
+ * and found again when the same shaders are used */
+START_TEST(virgl_test_link_shader_hint)
+{
+    struct virgl_context ctx;
+    struct vrend_link_hint_stats stats;
+    uint32_t handles[2][PIPE_SHADER_TYPES];
+    int vs_handle, fs_handle;
+    int ctx_handle = 1;
+    int ret;
+
+    ret = testvirgl_init_ctx_cmdbuf(&ctx);
+    ck_assert_int_eq(ret, 0);
+
+    /* create vertex shader */
+    {
+        struct pipe_shader_state vs;
+        const char *text =
+            "VERT\n"
+            "DCL IN[0]\n"
+            "DCL IN[1]\n"
+            "DCL OUT[0], POSITION\n"
+            "DCL OUT[1], COLOR\n"
+            "  0: MOV OUT[1], IN[1]\n"
+            "  1: MOV OUT[0], IN[0]\n"
+            "  2: END\n";
+        memset(&vs, 0, sizeof(vs));
+        vs_handle = ctx_handle++;
+        virgl_encode_shader_state(&ctx, vs_handle, PIPE_SHADER_VERTEX,
+                                  &vs, text);
+    }
+
+    /* create fragment shader */
+    {
+        struct pipe_shader_state fs;
+        const char *text =
+            "FRAG\n"
+            "DCL IN[0], COLOR, LINEAR\n"
+            "DCL OUT[0], COLOR\n"
+            "  0: MOV OUT[0], IN[0]\n"
+            "  1: END\n";
+        memset(&fs, 0, sizeof(fs));
+        fs_handle = ctx_handle++;
+        virgl_encode_shader_state(&ctx, fs_handle, PIPE_SHADER_FRAGMENT,
+                                  &fs, text);
+    }
+
+    /* the second entry names a shader that doesn't exist and is dropped */
+    memset(handles, 0, sizeof(handles));
+    handles[0][PIPE_SHADER_VERTEX] = vs_handle;
+    handles[0][PIPE_SHADER_FRAGMENT] = fs_handle;
+    handles[1][PIPE_SHADER_VERTEX] = ctx_handle + 100;
+    handles[1][PIPE_SHADER_FRAGMENT] = fs_handle;
+    virgl_encode_link_shader_hint(&ctx, &handles[0][0], 2);
+    ret = testvirgl_ctx_send_cmdbuf(&ctx);
+    ck_assert_int_eq(ret, 0);
+
+    ck_assert(vrend_debug_get_link_hint_stats(ctx.ctx_id, &stats));
+    ck_assert_int_eq(stats.queued, 2);
+    ck_assert_int_eq(stats.dropped, 1);
+    ck_assert_int_eq(stats.linked, 1);
+    ck_assert_int_eq(stats.used, 0);
+
+    /* selecting the same shaders finds the hinted program */
+    virgl_encode_bind_shader(&ctx, vs_handle, PIPE_SHADER_VERTEX);
+    virgl_encode_bind_shader(&ctx, fs_handle, PIPE_SHADER_FRAGMENT);
+    virgl_encode_link_shader(&ctx, handles[0]);
+    ret = testvirgl_ctx_send_cmdbuf(&ctx);
+    ck_assert_int_eq(ret, 0);
+
+    ck_assert(vrend_debug_get_link_hint_stats(ctx.ctx_id, &stats));
+    ck_assert_int_eq(stats.linked, 1);
+    ck_assert_int_eq(stats.used, 1);
+
+    testvirgl_fini_ctx_cmdbuf(&ctx);
+}
+END_TEST
+
 /* create a resource - clear it to a color, render something */
 START_TEST(virgl_test_render_geom_simple)
 {
@@ -1203,10 +1681,15 @@ static Suite *virgl_init_suite(void)
   s = suite_create("virgl_clear");
   tc_core = tcase_create("clear");
   tcase_add_test(tc_core, virgl_test_clear);
+  tcase_add_test(tc_core, virgl_test_clear_fb_switch);
+  tcase_add_test(tc_core, virgl_test_clear_iov);
   tcase_add_test(tc_core, virgl_test_blit_simple);
+  tcase_add_test(tc_core, virgl_test_blit_mip_compute);
+  tcase_add_test(tc_core, virgl_test_copy_region_batching);
   tcase_add_test(tc_core, virgl_test_overlap_obj_id);
   tcase_add_test(tc_core, virgl_test_large_shader);
   tcase_add_test(tc_core, virgl_test_render_simple);
+  tcase_add_test(tc_core, virgl_test_link_shader_hint);
   tcase_add_test(tc_core, virgl_test_render_geom_simple);
   tcase_add_test(tc_core, virgl_test_render_xfb);
   tcase_add_test(tc_core, virgl_test_set_viewport_state);
@@ -0,0 +1,171 @@
+/*
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <check.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util/u_format.h"
+#include "../src/vrend_convert.h"
+
+/* Test every conversion kernel the host can run against a reference that
+ * packs and unpacks pixels from the u_format descriptions. */
+
+/* odd enough to exercise the scalar tails of all vector widths */
+#define NUM_PIXELS 263
+
+static uint32_t rand_state = 0x12345678;
+
+static uint32_t next_rand(void)
+{
+   rand_state ^= rand_state << 13;
+   rand_state ^= rand_state >> 17;
+   rand_state ^= rand_state << 5;
+   return rand_state;
+}
+
+static void fill_random(void *data, size_t size)
+{
+   uint8_t *p = data;
+   for (size_t i = 0; i < size; i++)
+      p[i] = next_rand();
+}
+
+static uint32_t read_pixel(const struct util_format_description *desc, const uint8_t *p)
+{
+   uint32_t v = 0;
+   for (unsigned b = 0; b < desc->block.bits / 8; b++)
+      v |= (uint32_t)p[b] << (8 * b);
+   return v;
+}
+
+static void write_pixel(const struct util_format_description *desc, uint8_t *p, uint32_t v)
+{
+   for (unsigned b = 0; b < desc->block.bits / 8; b++)
+      p[b] = v >> (8 * b);
+}
+
+static uint32_t channel_mask(const struct util_format_channel_description *ch)
+{
+   return ch->size >= 32 ? ~0u : (1u << ch->size) - 1;
+}
+
+static void unpack_unorm8(enum pipe_format format, const uint8_t *p, uint8_t rgba[4])
+{
+   const struct util_format_description *desc = util_format_description(format);
+   uint32_t v = read_pixel(desc, p);
+
+   for (int c = 0; c < 4; c++) {
+      unsigned swz = desc->swizzle[c];
+      if (swz <= UTIL_FORMAT_SWIZZLE_W) {
+         const struct util_format_channel_description *ch = &desc->channel[swz];
+         rgba[c] = (v >> ch->shift) & channel_mask(ch);
+      } else {
+         rgba[c] = swz == UTIL_FORMAT_SWIZZLE_1 ? 0xff : 0;
+      }
+   }
+}
+
+static void pack_unorm8(enum pipe_format format, const uint8_t rgba[4], uint8_t *p)
+{
+   const struct util_format_description *desc = util_format_description(format);
+   uint32_t v = 0;
+
+   for (int c = 0; c < 4; c++) {
+      unsigned swz = desc->swizzle[c];
+      if (swz <= UTIL_FORMAT_SWIZZLE_W) {
+         const struct util_format_channel_description *ch = &desc->channel[swz];
+         v |= ((uint32_t)rgba[c] & channel_mask(ch)) << ch->shift;
+      }
+   }
+   write_pixel(desc, p, v);
+}
+
+static void reference_convert(enum pipe_format src_format, const void *src,
+                              enum pipe_format dst_format, void *dst, size_t count)
+{
+   unsigned src_bpp = util_format_get_blocksize(src_format);
+   unsigned dst_bpp = util_format_get_blocksize(dst_format);
+
+   for (size_t i = 0; i < count; i++) {
+      uint8_t rgba[4];
+      unpack_unorm8(src_format, (const uint8_t *)src + i * src_bpp, rgba);
+      pack_unorm8(dst_format, rgba, (uint8_t *)dst + i * dst_bpp);
+   }
+}
+
+START_TEST(convert_swap_rb)
+{
+   for (int isa = 0; isa < VREND_CONVERT_ISA_COUNT; isa++) {
+      const struct vrend_convert_funcs *funcs = vrend_convert_get_funcs(isa);
+      uint8_t data[NUM_PIXELS * 4 + 1], ref[NUM_PIXELS * 4 + 1];
+
+      if (!funcs)
+         continue;
+
+      fill_random(data, sizeof(data));
+      memcpy(ref, data, sizeof(data));
+
+      funcs->swap_rb(data + 1, NUM_PIXELS);
+      reference_convert(PIPE_FORMAT_B8G8R8A8_UNORM, ref + 1,
+                        PIPE_FORMAT_R8G8B8A8_UNORM, ref + 1, NUM_PIXELS);
+      ck_assert_msg(!memcmp(data, ref, sizeof(data)), "%s: swap_rb mismatch", funcs->name);
+   }
+}
+END_TEST
+
+START_TEST(convert_z24_scale)
+{
+   const struct vrend_convert_funcs *ref_funcs = vrend_convert_get_funcs(VREND_CONVERT_ISA_C);
+   const float scales[] = { 256.0f, 1.0f / 256.0f };
+
+   for (int isa = 0; isa < VREND_CONVERT_ISA_COUNT; isa++) {
+      const struct vrend_convert_funcs *funcs = vrend_convert_get_funcs(isa);
+
+      if (!funcs)
+         continue;
+
+      for (unsigned s = 0; s < sizeof(scales) / sizeof(scales[0]); s++) {
+         uint32_t data[NUM_PIXELS], ref[NUM_PIXELS];
+
+         fill_random(data, sizeof(data));
+         memcpy(ref, data, sizeof(data));
+
+         funcs->z24_scale(data, NUM_PIXELS, scales[s]);
+         ref_funcs->z24_scale(ref, NUM_PIXELS, scales[s]);
+         ck_assert_msg(!memcmp(data, ref, sizeof(data)), "%s: z24_scale mismatch", funcs->name);
+      }
+   }
+}
+END_TEST
+
+static Suite *init_suite(void)
+{
+  Suite *s;
+  TCase *tc_core;
+
+  s = suite_create("vrend_convert");
+  tc_core = tcase_create("convert");
+
+  suite_add_tcase(s, tc_core);
+
+  tcase_add_test(tc_core, convert_swap_rb);
+  tcase_add_test(tc_core, convert_z24_scale);
+  return s;
+}
+
+int main(void)
+{
+   Suite *s;
+   SRunner *sr;
+   int number_failed;
+
+   s = init_suite();
+   sr = srunner_create(s);
+
+   srunner_run_all(sr, CK_NORMAL);
+   number_failed = srunner_ntests_failed(sr);
+   srunner_free(sr);
+   return number_failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
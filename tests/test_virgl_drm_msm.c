@@ -0,0 +1,252 @@
+/*
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <check.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "util/macros.h"
+#include "virglrenderer.h"
+#include "virglrenderer_hw.h"
+
+#include "msm_drm.h"
+#include "msm_proto.h"
+#include "msm_renderer.h"
+
+/* Test the bo cache of the msm native context, on top of the stub device
+ * (see src/drm/msm/msm_stub.h).
+ */
+
+#define CTX_ID        1
+#define SHMEM_RES_ID  1
+#define SHMEM_SIZE    (64 * 1024)
+#define BO_SIZE       (64 * 1024)
+
+/* the first user-allocated iova, see the stub device */
+#define VA_START 0x100000000ull
+
+static int test_cookie;
+
+static struct {
+   struct msm_shmem *shmem;
+   uint32_t seqno;
+   uint32_t next_blob_id;
+   uint32_t next_res_id;
+} drm;
+
+static void stub_write_fence(UNUSED void *cookie, UNUSED uint32_t fence)
+{
+}
+
+static struct virgl_renderer_callbacks test_cbs = {
+   .version = 1,
+   .write_fence = stub_write_fence,
+};
+
+static void drm_setup(void)
+{
+   setenv("VIRGL_DRM_STUB", "0", 1);
+   unsetenv("VIRGL_DRM_NO_BO_CACHE");
+
+   int ret = virgl_renderer_init(&test_cookie,
+                                 VIRGL_RENDERER_NO_VIRGL | VIRGL_RENDERER_DRM,
+                                 &test_cbs);
+   ck_assert_int_eq(ret, 0);
+
+   ret = virgl_renderer_context_create_with_flags(CTX_ID, VIRGL_RENDERER_CAPSET_DRM,
+                                                  strlen("test"), "test");
+   ck_assert_int_eq(ret, 0);
+
+   const struct virgl_renderer_resource_create_blob_args args = {
+      .res_handle = SHMEM_RES_ID,
+      .ctx_id = CTX_ID,
+      .blob_mem = VIRGL_RENDERER_BLOB_MEM_HOST3D,
+      .blob_flags = VIRGL_RENDERER_BLOB_FLAG_USE_MAPPABLE,
+      .blob_id = 0,
+      .size = SHMEM_SIZE,
+   };
+   void *map;
+   uint64_t size;
+
+   ret = virgl_renderer_resource_create_blob(&args);
+   ck_assert_int_eq(ret, 0);
+   ret = virgl_renderer_resource_map(SHMEM_RES_ID, &map, &size);
+   ck_assert_int_eq(ret, 0);
+   virgl_renderer_ctx_attach_resource(CTX_ID, SHMEM_RES_ID);
+
+   drm.shmem = map;
+   drm.seqno = 0;
+   drm.next_blob_id = 0;
+   drm.next_res_id = SHMEM_RES_ID;
+}
+
+static void drm_teardown(void)
+{
+   virgl_renderer_resource_unmap(SHMEM_RES_ID);
+   virgl_renderer_ctx_detach_resource(CTX_ID, SHMEM_RES_ID);
+   virgl_renderer_resource_unref(SHMEM_RES_ID);
+
+   virgl_renderer_context_destroy(CTX_ID);
+   virgl_renderer_cleanup(&test_cookie);
+}
+
+static void gem_new(uint32_t blob_id, uint32_t size)
+{
+   struct msm_ccmd_gem_new_req req = {
+      .hdr = {
+         .cmd = MSM_CCMD_GEM_NEW,
+         .len = sizeof(req),
+         .seqno = ++drm.seqno,
+      },
+      .iova = VA_START + (uint64_t)blob_id * 2 * BO_SIZE,
+      .size = size,
+      .flags = MSM_BO_WC,
+      .blob_id = blob_id,
+   };
+
+   int ret = virgl_renderer_submit_cmd(&req, CTX_ID, sizeof(req) / 4);
+   ck_assert_int_eq(ret, 0);
+}
+
+static uint32_t bo_create(uint32_t size, uint32_t blob_flags)
+{
+   const uint32_t blob_id = ++drm.next_blob_id;
+   const uint32_t res_id = ++drm.next_res_id;
+
+   gem_new(blob_id, size);
+
+   const struct virgl_renderer_resource_create_blob_args args = {
+      .res_handle = res_id,
+      .ctx_id = CTX_ID,
+      .blob_mem = VIRGL_RENDERER_BLOB_MEM_HOST3D,
+      .blob_flags = blob_flags,
+      .blob_id = blob_id,
+      .size = ALIGN_POT(size, getpagesize()),
+   };
+   int ret = virgl_renderer_resource_create_blob(&args);
+   ck_assert_int_eq(ret, 0);
+   virgl_renderer_ctx_attach_resource(CTX_ID, res_id);
+
+   return res_id;
+}
+
+static void bo_destroy(uint32_t res_id)
+{
+   virgl_renderer_ctx_detach_resource(CTX_ID, res_id);
+   virgl_renderer_resource_unref(res_id);
+}
+
+static void get_stats(struct msm_bo_cache_stats *stats)
+{
+   ck_assert(msm_renderer_get_bo_cache_stats(CTX_ID, stats));
+   /* failed allocations are only reported there */
+   ck_assert_int_eq(drm.shmem->async_error, 0);
+}
+
+START_TEST(bo_cache_same_size_reused)
+{
+   struct msm_bo_cache_stats before, after;
+
+   bo_destroy(bo_create(BO_SIZE, VIRGL_RENDERER_BLOB_FLAG_USE_MAPPABLE));
+
+   get_stats(&before);
+   ck_assert_int_eq(before.size, BO_SIZE);
+
+   uint32_t res_id = bo_create(BO_SIZE, VIRGL_RENDERER_BLOB_FLAG_USE_MAPPABLE);
+
+   get_stats(&after);
+   ck_assert_int_eq(after.hits, before.hits + 1);
+   ck_assert_int_eq(after.misses, before.misses);
+   ck_assert_int_eq(after.size, 0);
+
+   bo_destroy(res_id);
+}
+END_TEST
+
+START_TEST(bo_cache_other_size_not_reused)
+{
+   struct msm_bo_cache_stats before, after;
+
+   bo_destroy(bo_create(BO_SIZE, VIRGL_RENDERER_BLOB_FLAG_USE_MAPPABLE));
+
+   get_stats(&before);
+   ck_assert_int_eq(before.size, BO_SIZE);
+
+   /* same bucket, but buffers are only reused for their exact size */
+   uint32_t res_id = bo_create(BO_SIZE - 4096, VIRGL_RENDERER_BLOB_FLAG_USE_MAPPABLE);
+
+   get_stats(&after);
+   ck_assert_int_eq(after.hits, before.hits);
+   ck_assert_int_eq(after.misses, before.misses + 1);
+   ck_assert_int_eq(after.size, BO_SIZE);
+
+   bo_destroy(res_id);
+}
+END_TEST
+
+START_TEST(bo_cache_exported_not_cached)
+{
+   struct msm_bo_cache_stats before, after;
+   uint32_t fd_type;
+   int fd;
+
+   get_stats(&before);
+
+   /* the blob is a dma-buf, which the VMM may keep past the resource */
+   uint32_t res_id = bo_create(BO_SIZE, VIRGL_RENDERER_BLOB_FLAG_USE_MAPPABLE |
+                                        VIRGL_RENDERER_BLOB_FLAG_USE_SHAREABLE);
+   int ret = virgl_renderer_resource_export_blob(res_id, &fd_type, &fd);
+   ck_assert_int_eq(ret, 0);
+   ck_assert_int_eq(fd_type, VIRGL_RENDERER_BLOB_FD_TYPE_DMABUF);
+   bo_destroy(res_id);
+
+   get_stats(&after);
+   ck_assert_int_eq(after.size, 0);
+
+   /* so there is nothing to hand out again */
+   res_id = bo_create(BO_SIZE, VIRGL_RENDERER_BLOB_FLAG_USE_MAPPABLE);
+
+   get_stats(&after);
+   ck_assert_int_eq(after.hits, before.hits);
+   ck_assert_int_eq(after.misses, before.misses + 2);
+
+   close(fd);
+
+   bo_destroy(res_id);
+}
+END_TEST
+
+static Suite *virgl_init_suite(void)
+{
+   Suite *s;
+   TCase *tc_core;
+
+   s = suite_create("virgl_drm_msm");
+   tc_core = tcase_create("bo_cache");
+   tcase_add_checked_fixture(tc_core, drm_setup, drm_teardown);
+
+   tcase_add_test(tc_core, bo_cache_same_size_reused);
+   tcase_add_test(tc_core, bo_cache_other_size_not_reused);
+   tcase_add_test(tc_core, bo_cache_exported_not_cached);
+
+   suite_add_tcase(s, tc_core);
+   return s;
+}
+
+int main(void)
+{
+   Suite *s;
+   SRunner *sr;
+   int number_failed;
+
+   s = virgl_init_suite();
+   sr = srunner_create(s);
+
+   srunner_run_all(sr, CK_NORMAL);
+   number_failed = srunner_ntests_failed(sr);
+   srunner_free(sr);
+
+   return number_failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -31,6 +31,7 @@
 #include <check.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <unistd.h>
 #include <virglrenderer.h>
 #include "virgl_hw.h"
 #include "testvirgl.h"
@@ -304,6 +305,88 @@ START_TEST(private_ptr)
 }
 END_TEST
 
+/* Writes to a texture so that it gets GL storage, and returns its name. */
+static uint32_t write_texture(struct virgl_resource *res)
+{
+  struct virgl_renderer_resource_info info;
+  struct virgl_box box = { 0, 0, 0, 64, 64, 1 };
+  int ret;
+
+  virgl_renderer_ctx_attach_resource(1, res->handle);
+  ret = virgl_renderer_transfer_write_iov(res->handle, 1, 0, 0, 0, &box, 0, NULL, 0);
+  ck_assert_int_eq(ret, 0);
+
+  ret = virgl_renderer_resource_get_info(res->handle, &info);
+  ck_assert_int_eq(ret, 0);
+  ck_assert_int_ne(info.tex_id, 0);
+  return info.tex_id;
+}
+
+/* the GL name of a destroyed texture is not released, and so not handed out
+ * again, until the fence that follows its destruction has retired */
+START_TEST(deferred_destroy)
+{
+  struct virgl_resource res[8];
+  struct virgl_resource old;
+  uint32_t old_id;
+  int ret;
+
+  ret = testvirgl_init_single_ctx();
+  ck_assert_int_eq(ret, 0);
+
+  ret = testvirgl_create_backed_simple_2d_res(&old, 1, 64, 64);
+  ck_assert_int_eq(ret, 0);
+  old_id = write_texture(&old);
+
+  virgl_renderer_ctx_detach_resource(1, old.handle);
+  testvirgl_destroy_backed_res(&old);
+
+  for (unsigned i = 0; i < ARRAY_SIZE(res); i++) {
+    ret = testvirgl_create_backed_simple_2d_res(&res[i], i + 2, 64, 64);
+    ck_assert_int_eq(ret, 0);
+    ck_assert_int_ne(write_texture(&res[i]), old_id);
+  }
+
+  testvirgl_reset_fence();
+  ret = virgl_renderer_create_fence(1, 0);
+  ck_assert_int_eq(ret, 0);
+  while (testvirgl_get_last_fence() != 1) {
+    virgl_renderer_poll();
+    usleep(1000);
+  }
+
+  for (unsigned i = 0; i < ARRAY_SIZE(res); i++) {
+    virgl_renderer_ctx_detach_resource(1, res[i].handle);
+    testvirgl_destroy_backed_res(&res[i]);
+  }
+
+  testvirgl_fini_single_ctx();
+}
+END_TEST
+
+/* with no room in the destroy queue, GL objects are deleted right away */
+START_TEST(deferred_destroy_disabled)
+{
+  struct virgl_resource res;
+  int ret;
+
+  setenv("VIRGL_DESTROY_QUEUE_MB", "0", 1);
+  ret = testvirgl_init_single_ctx();
+  unsetenv("VIRGL_DESTROY_QUEUE_MB");
+  ck_assert_int_eq(ret, 0);
+
+  for (unsigned i = 0; i < 4; i++) {
+    ret = testvirgl_create_backed_simple_2d_res(&res, 1, 64, 64);
+    ck_assert_int_eq(ret, 0);
+    write_texture(&res);
+    virgl_renderer_ctx_detach_resource(1, res.handle);
+    testvirgl_destroy_backed_res(&res);
+  }
+
+  testvirgl_fini_single_ctx();
+}
+END_TEST
+
 static Suite *virgl_init_suite(void)
 {
   Suite *s;
@@ -315,6 +398,8 @@ static Suite *virgl_init_suite(void)
   tcase_add_loop_test(tc_core, virgl_res_tests, 0, ARRAY_SIZE(testlist));
   tcase_add_loop_test(tc_core, cubemaparray_res_tests, 0, ARRAY_SIZE(cubemaparray_testlist));
   tcase_add_test(tc_core, private_ptr);
+  tcase_add_test(tc_core, deferred_destroy);
+  tcase_add_test(tc_core, deferred_destroy_disabled);
   suite_add_tcase(s, tc_core);
   return s;
 
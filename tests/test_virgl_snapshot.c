@@ -0,0 +1,400 @@
+/*
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <check.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <virglrenderer.h>
+
+#include "vrend_iov.h"
+#include "pipe/p_format.h"
+#include "testvirgl_encode.h"
+#include "util/u_memory.h"
+#include "virgl_protocol.h"
+
+/* Round trips of virgl contexts through virgl_renderer_context_snapshot
+ * and virgl_renderer_context_restore.  The context is destroyed and
+ * created again in between, as it would be on the destination of a
+ * migration, and what it renders after the restore is compared with what
+ * the original context rendered.
+ */
+
+#define TW 64
+#define TH 64
+
+struct vertex {
+   float position[4];
+   float color[4];
+};
+
+static struct vertex vertices[3] = {
+   { { 0.0f, -0.9f, 0.0f, 1.0f }, { 1.0f, 0.0f, 0.0f, 1.0f } },
+   { { -0.9f, 0.9f, 0.0f, 1.0f }, { 0.0f, 1.0f, 0.0f, 1.0f } },
+   { { 0.9f, 0.9f, 0.0f, 1.0f }, { 0.0f, 0.0f, 1.0f, 1.0f } },
+};
+
+static struct vertex other_vertices[3] = {
+   { { -0.5f, -0.5f, 0.0f, 1.0f }, { 1.0f, 1.0f, 0.0f, 1.0f } },
+   { { 0.5f, -0.5f, 0.0f, 1.0f }, { 0.0f, 1.0f, 1.0f, 1.0f } },
+   { { 0.0f, 0.5f, 0.0f, 1.0f }, { 1.0f, 0.0f, 1.0f, 1.0f } },
+};
+
+struct snapshot_test {
+   struct virgl_context ctx;
+   struct virgl_resource res;
+   struct virgl_resource vbo;
+};
+
+static void upload_vertices(struct snapshot_test *t, struct vertex *verts)
+{
+   struct virgl_box box = { 0, 0, 0, sizeof(vertices), 1, 1 };
+
+   virgl_encoder_inline_write(&t->ctx, &t->vbo, 0, 0, (struct pipe_box *)&box,
+                              verts, box.w, 0);
+   ck_assert_int_eq(testvirgl_ctx_send_cmdbuf(&t->ctx), 0);
+}
+
+static void attach_resources(struct snapshot_test *t)
+{
+   virgl_renderer_ctx_attach_resource(t->ctx.ctx_id, t->res.handle);
+   virgl_renderer_ctx_attach_resource(t->ctx.ctx_id, t->vbo.handle);
+}
+
+static void setup(struct snapshot_test *t)
+{
+   ck_assert_int_eq(testvirgl_init_ctx_cmdbuf(&t->ctx), 0);
+   ck_assert_int_eq(testvirgl_create_backed_simple_2d_res(&t->res, 1, TW, TH), 0);
+   ck_assert_int_eq(testvirgl_create_backed_simple_buffer(&t->vbo, 2, sizeof(vertices),
+                                                          PIPE_BIND_VERTEX_BUFFER), 0);
+   attach_resources(t);
+   upload_vertices(t, vertices);
+}
+
+static void teardown(struct snapshot_test *t)
+{
+   virgl_renderer_ctx_detach_resource(t->ctx.ctx_id, t->res.handle);
+   virgl_renderer_ctx_detach_resource(t->ctx.ctx_id, t->vbo.handle);
+   testvirgl_destroy_backed_res(&t->vbo);
+   testvirgl_destroy_backed_res(&t->res);
+   testvirgl_fini_ctx_cmdbuf(&t->ctx);
+}
+
+/* the state of virgl_test_render_simple, with a blend state that is
+ * destroyed while it is still bound */
+static void encode_render_state(struct snapshot_test *t, uint32_t handle)
+{
+   struct virgl_context *ctx = &t->ctx;
+   struct virgl_surface surf;
+   struct pipe_framebuffer_state fb_state;
+   struct pipe_vertex_element ve[2];
+   struct pipe_vertex_buffer vbuf;
+   uint32_t shaders[PIPE_SHADER_TYPES];
+
+   memset(shaders, 0, sizeof(shaders));
+   memset(&surf, 0, sizeof(surf));
+   surf.base.format = PIPE_FORMAT_B8G8R8X8_UNORM;
+   surf.handle = handle++;
+   surf.base.texture = &t->res.base;
+   virgl_encoder_create_surface(ctx, surf.handle, &t->res, &surf.base);
+
+   memset(&fb_state, 0, sizeof(fb_state));
+   fb_state.nr_cbufs = 1;
+   fb_state.cbufs[0] = &surf.base;
+   virgl_encoder_set_framebuffer_state(ctx, &fb_state);
+
+   const uint32_t ve_handle = handle++;
+   memset(ve, 0, sizeof(ve));
+   ve[0].src_offset = Offset(struct vertex, position);
+   ve[0].src_format = PIPE_FORMAT_R32G32B32A32_FLOAT;
+   ve[1].src_offset = Offset(struct vertex, color);
+   ve[1].src_format = PIPE_FORMAT_R32G32B32A32_FLOAT;
+   virgl_encoder_create_vertex_elements(ctx, ve_handle, 2, ve);
+   virgl_encode_bind_object(ctx, ve_handle, VIRGL_OBJECT_VERTEX_ELEMENTS);
+
+   vbuf.stride = sizeof(struct vertex);
+   vbuf.buffer_offset = 0;
+   vbuf.buffer = &t->vbo.base;
+   virgl_encoder_set_vertex_buffers(ctx, 1, &vbuf);
+
+   {
+      struct pipe_shader_state vs;
+      const char *text = "VERT\n"
+                         "DCL IN[0]\n"
+                         "DCL IN[1]\n"
+                         "DCL OUT[0], POSITION\n"
+                         "DCL OUT[1], COLOR\n"
+                         "  0: MOV OUT[1], IN[1]\n"
+                         "  1: MOV OUT[0], IN[0]\n"
+                         "  2: END\n";
+      shaders[PIPE_SHADER_VERTEX] = handle++;
+      memset(&vs, 0, sizeof(vs));
+      virgl_encode_shader_state(ctx, shaders[PIPE_SHADER_VERTEX], PIPE_SHADER_VERTEX,
+                                &vs, text);
+      virgl_encode_bind_shader(ctx, shaders[PIPE_SHADER_VERTEX], PIPE_SHADER_VERTEX);
+   }
+
+   {
+      struct pipe_shader_state fs;
+      const char *text = "FRAG\n"
+                         "DCL IN[0], COLOR, LINEAR\n"
+                         "DCL OUT[0], COLOR\n"
+                         "  0: MOV OUT[0], IN[0]\n"
+                         "  1: END\n";
+      shaders[PIPE_SHADER_FRAGMENT] = handle++;
+      memset(&fs, 0, sizeof(fs));
+      virgl_encode_shader_state(ctx, shaders[PIPE_SHADER_FRAGMENT], PIPE_SHADER_FRAGMENT,
+                                &fs, text);
+      virgl_encode_bind_shader(ctx, shaders[PIPE_SHADER_FRAGMENT], PIPE_SHADER_FRAGMENT);
+   }
+
+   virgl_encode_link_shader(ctx, shaders);
+
+   {
+      struct pipe_blend_state blend;
+      const uint32_t blend_handle = handle++;
+      memset(&blend, 0, sizeof(blend));
+      blend.rt[0].colormask = PIPE_MASK_RGBA;
+      virgl_encode_blend_state(ctx, blend_handle, &blend);
+      virgl_encode_bind_object(ctx, blend_handle, VIRGL_OBJECT_BLEND);
+      virgl_encode_delete_object(ctx, blend_handle, VIRGL_OBJECT_BLEND);
+   }
+
+   {
+      struct pipe_depth_stencil_alpha_state dsa;
+      const uint32_t dsa_handle = handle++;
+      memset(&dsa, 0, sizeof(dsa));
+      virgl_encode_dsa_state(ctx, dsa_handle, &dsa);
+      virgl_encode_bind_object(ctx, dsa_handle, VIRGL_OBJECT_DSA);
+   }
+
+   {
+      struct pipe_rasterizer_state rasterizer;
+      const uint32_t rs_handle = handle++;
+      memset(&rasterizer, 0, sizeof(rasterizer));
+      rasterizer.cull_face = PIPE_FACE_NONE;
+      rasterizer.half_pixel_center = 1;
+      rasterizer.bottom_edge_rule = 1;
+      rasterizer.depth_clip = 1;
+      virgl_encode_rasterizer_state(ctx, rs_handle, &rasterizer);
+      virgl_encode_bind_object(ctx, rs_handle, VIRGL_OBJECT_RASTERIZER);
+   }
+
+   {
+      struct pipe_viewport_state vp;
+      vp.scale[0] = TW / 2.0f;
+      vp.scale[1] = TH / 2.0f;
+      vp.scale[2] = 0.5f;
+      vp.translate[0] = TW / 2.0f;
+      vp.translate[1] = TH / 2.0f;
+      vp.translate[2] = 0.5f;
+      virgl_encoder_set_viewport_states(ctx, 0, 1, &vp);
+   }
+
+   ck_assert_int_eq(testvirgl_ctx_send_cmdbuf(ctx), 0);
+}
+
+static void clear(struct snapshot_test *t, float r, float g, float b)
+{
+   union pipe_color_union color = { .f = { r, g, b, 1.0f } };
+
+   virgl_encode_clear(&t->ctx, PIPE_CLEAR_COLOR0, &color, 0.0, 0);
+   ck_assert_int_eq(testvirgl_ctx_send_cmdbuf(&t->ctx), 0);
+}
+
+static void draw(struct snapshot_test *t)
+{
+   struct pipe_draw_info info;
+
+   memset(&info, 0, sizeof(info));
+   info.count = 3;
+   info.mode = PIPE_PRIM_TRIANGLES;
+   virgl_encoder_draw_vbo(&t->ctx, &info);
+   ck_assert_int_eq(testvirgl_ctx_send_cmdbuf(&t->ctx), 0);
+}
+
+/* returns the rendered pixels, to be freed */
+static uint32_t *read_pixels(struct snapshot_test *t)
+{
+   struct virgl_box box = { 0, 0, 0, TW, TH, 1 };
+   uint32_t *pixels = malloc(TW * TH * sizeof(*pixels));
+   ck_assert(pixels != NULL);
+
+   testvirgl_reset_fence();
+   ck_assert_int_eq(virgl_renderer_create_fence(1, t->ctx.ctx_id), 0);
+   while (testvirgl_get_last_fence() < 1) {
+      virgl_renderer_poll();
+      nanosleep((struct timespec[]){ { 0, 50000 } }, NULL);
+   }
+
+   ck_assert_int_eq(virgl_renderer_transfer_read_iov(t->res.handle, t->ctx.ctx_id, 0, 0, 0,
+                                                     &box, 0, NULL, 0), 0);
+   memcpy(pixels, t->res.iovs[0].iov_base, TW * TH * sizeof(*pixels));
+
+   return pixels;
+}
+
+static void snapshot(struct snapshot_test *t, uint32_t flags, void **data, size_t *size)
+{
+   ck_assert_int_eq(virgl_renderer_context_snapshot(t->ctx.ctx_id, flags, data, size), 0);
+   ck_assert(*data != NULL);
+   ck_assert(*size > 0);
+}
+
+/* what the destination of a migration does before restoring */
+static void recreate_context(struct snapshot_test *t)
+{
+   virgl_renderer_context_destroy(t->ctx.ctx_id);
+   ck_assert_int_eq(virgl_renderer_context_create(t->ctx.ctx_id, strlen("test1"), "test1"), 0);
+   attach_resources(t);
+}
+
+static void zero_render_target(struct snapshot_test *t)
+{
+   struct virgl_box box = { 0, 0, 0, TW, TH, 1 };
+
+   memset(t->res.iovs[0].iov_base, 0, TW * TH * sizeof(uint32_t));
+   ck_assert_int_eq(virgl_renderer_transfer_write_iov(t->res.handle, t->ctx.ctx_id, 0, 0, 0,
+                                                      &box, 0, NULL, 0), 0);
+}
+
+static void restore(struct snapshot_test *t, const void *data, size_t size)
+{
+   ck_assert_int_eq(virgl_renderer_context_restore(t->ctx.ctx_id, data, size), 0);
+}
+
+START_TEST(virgl_test_snapshot_round_trip)
+{
+   struct snapshot_test t;
+   void *data;
+   size_t size;
+
+   setup(&t);
+   encode_render_state(&t, 1);
+   clear(&t, 0.0f, 1.0f, 0.0f);
+
+   snapshot(&t, 0, &data, &size);
+
+   draw(&t);
+   uint32_t *expected = read_pixels(&t);
+
+   recreate_context(&t);
+   zero_render_target(&t);
+   restore(&t, data, size);
+
+   /* the contents of the render target come from the snapshot as well */
+   draw(&t);
+   uint32_t *pixels = read_pixels(&t);
+   ck_assert(!memcmp(pixels, expected, TW * TH * sizeof(*pixels)));
+
+   free(pixels);
+   free(expected);
+   free(data);
+   teardown(&t);
+}
+END_TEST
+
+START_TEST(virgl_test_snapshot_incremental)
+{
+   struct snapshot_test t;
+   void *full, *incremental, *empty;
+   size_t full_size, incremental_size, empty_size;
+
+   setup(&t);
+
+   /* the state lives in a sub-context */
+   virgl_encoder_create_sub_ctx(&t.ctx, 2);
+   virgl_encoder_set_sub_ctx(&t.ctx, 2);
+   encode_render_state(&t, 1);
+   clear(&t, 0.0f, 0.0f, 1.0f);
+
+   snapshot(&t, 0, &full, &full_size);
+
+   /* only the vertex buffer is written after the full snapshot */
+   upload_vertices(&t, other_vertices);
+   snapshot(&t, VIRGL_RENDERER_SNAPSHOT_INCREMENTAL, &incremental, &incremental_size);
+   snapshot(&t, VIRGL_RENDERER_SNAPSHOT_INCREMENTAL, &empty, &empty_size);
+   ck_assert(incremental_size < full_size);
+   ck_assert(empty_size < incremental_size);
+
+   draw(&t);
+   uint32_t *expected = read_pixels(&t);
+
+   recreate_context(&t);
+   restore(&t, full, full_size);
+   restore(&t, incremental, incremental_size);
+
+   draw(&t);
+   uint32_t *pixels = read_pixels(&t);
+   ck_assert(!memcmp(pixels, expected, TW * TH * sizeof(*pixels)));
+
+   free(pixels);
+   free(expected);
+   free(empty);
+   free(incremental);
+   free(full);
+   teardown(&t);
+}
+END_TEST
+
+START_TEST(virgl_test_snapshot_restore_invalid)
+{
+   struct snapshot_test t;
+   uint32_t garbage[16];
+   void *data;
+   size_t size;
+
+   setup(&t);
+   encode_render_state(&t, 1);
+   snapshot(&t, 0, &data, &size);
+
+   memset(garbage, 0xaa, sizeof(garbage));
+   ck_assert_int_eq(virgl_renderer_context_restore(t.ctx.ctx_id, garbage, sizeof(garbage)),
+                    -EINVAL);
+   ck_assert_int_eq(virgl_renderer_context_restore(t.ctx.ctx_id, data, size / 2), -EINVAL);
+   ck_assert_int_eq(virgl_renderer_context_restore(t.ctx.ctx_id + 1, data, size), -EINVAL);
+
+   free(data);
+   teardown(&t);
+}
+END_TEST
+
+static Suite *virgl_init_suite(void)
+{
+   Suite *s;
+   TCase *tc_core;
+
+   s = suite_create("virgl_snapshot");
+   tc_core = tcase_create("snapshot");
+
+   tcase_add_test(tc_core, virgl_test_snapshot_round_trip);
+   tcase_add_test(tc_core, virgl_test_snapshot_incremental);
+   tcase_add_test(tc_core, virgl_test_snapshot_restore_invalid);
+
+   suite_add_tcase(s, tc_core);
+   return s;
+}
+
+int main(void)
+{
+   Suite *s;
+   SRunner *sr;
+   int number_failed;
+
+   context_flags |= VIRGL_RENDERER_CONTEXT_SNAPSHOTS;
+   if (getenv("VRENDTEST_USE_EGL_SURFACELESS"))
+      context_flags |= VIRGL_RENDERER_USE_SURFACELESS;
+   if (getenv("VRENDTEST_USE_EGL_GLES"))
+      context_flags |= VIRGL_RENDERER_USE_GLES;
+
+   s = virgl_init_suite();
+   sr = srunner_create(s);
+
+   srunner_run_all(sr, CK_NORMAL);
+   number_failed = srunner_ntests_failed(sr);
+   srunner_free(sr);
+
+   return number_failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
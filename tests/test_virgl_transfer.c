@@ -26,11 +26,13 @@
 #include <check.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <unistd.h>
 #include <virglrenderer.h>
 #include "pipe/p_defines.h"
 #include "virgl_hw.h"
 #include "vrend_iov.h"
 #include "virgl_protocol.h"
+#include "vrend_debug.h"
 #include "testvirgl_encode.h"
 
 /* pass an illegal context to transfer fn */
@@ -1001,6 +1003,373 @@ START_TEST(test_vrend_host_backed_memory_no_data_leak)
 }
 END_TEST
 
+/* with a budget smaller than the textures, the first texture is spilled once
+ * the fence covering its upload retires, and restored when it is read back */
+START_TEST(virgl_test_transfer_residency_spill_restore)
+{
+   const uint32_t size = 512;
+   struct virgl_resource res[2];
+   struct virgl_box box = { 0, 0, 0, size, size, 1 };
+   int ret;
+
+   setenv("VIRGL_RESIDENCY_BUDGET_MB", "1", 1);
+   ret = testvirgl_init_single_ctx();
+   unsetenv("VIRGL_RESIDENCY_BUDGET_MB");
+   ck_assert_int_eq(ret, 0);
+
+   for (unsigned i = 0; i < ARRAY_SIZE(res); i++) {
+      ret = testvirgl_create_backed_simple_2d_res(&res[i], i + 1, size, size);
+      ck_assert_int_eq(ret, 0);
+      virgl_renderer_ctx_attach_resource(1, res[i].handle);
+
+      uint8_t *data = res[i].iovs[0].iov_base;
+      for (uint32_t j = 0; j < res[i].iovs[0].iov_len; j++)
+         data[j] = j * (i + 3);
+
+      ret = virgl_renderer_transfer_write_iov(res[i].handle, 1, 0, 0, 0, &box, 0, NULL, 0);
+      ck_assert_int_eq(ret, 0);
+   }
+
+   testvirgl_reset_fence();
+   ret = virgl_renderer_create_fence(1, 0);
+   ck_assert_int_eq(ret, 0);
+   while (testvirgl_get_last_fence() != 1) {
+      virgl_renderer_poll();
+      usleep(1000);
+   }
+
+   for (unsigned i = 0; i < ARRAY_SIZE(res); i++) {
+      uint8_t *data = res[i].iovs[0].iov_base;
+      memset(data, 0, res[i].iovs[0].iov_len);
+
+      ret = virgl_renderer_transfer_read_iov(res[i].handle, 1, 0, 0, 0, &box, 0, NULL, 0);
+      ck_assert_int_eq(ret, 0);
+
+      /* skip the X channel of B8G8R8X8 */
+      for (uint32_t j = 0; j < res[i].iovs[0].iov_len; j++) {
+         if (j % 4 != 3)
+            ck_assert_int_eq(data[j], (uint8_t)(j * (i + 3)));
+      }
+
+      virgl_renderer_ctx_detach_resource(1, res[i].handle);
+      testvirgl_destroy_backed_res(&res[i]);
+   }
+
+   testvirgl_fini_single_ctx();
+}
+END_TEST
+
+
+/* large uploads from many iovecs are gathered in bands by the upload threads,
+ * the bands have to land at the right place in the texture */
+START_TEST(virgl_test_transfer_upload_threads_bands)
+{
+   const uint32_t size = 512;
+   const uint32_t chunk = 4096;
+   struct virgl_resource res;
+   struct virgl_box box = { 0, 0, 0, size, size, 1 };
+   struct iovec *iovs;
+   unsigned num_iovs;
+   uint8_t *data;
+   int ret;
+
+   setenv("VIRGL_UPLOAD_THREADS", "3", 1);
+   ret = testvirgl_init_single_ctx();
+   unsetenv("VIRGL_UPLOAD_THREADS");
+   ck_assert_int_eq(ret, 0);
+
+   ret = testvirgl_create_backed_simple_2d_res(&res, 1, size, size);
+   ck_assert_int_eq(ret, 0);
+   virgl_renderer_ctx_attach_resource(1, res.handle);
+
+   data = res.iovs[0].iov_base;
+   for (uint32_t i = 0; i < res.iovs[0].iov_len; i++)
+      data[i] = i * 7 + i / 4096;
+
+   num_iovs = res.iovs[0].iov_len / chunk;
+   iovs = calloc(num_iovs, sizeof(*iovs));
+   ck_assert(iovs != NULL);
+   for (unsigned i = 0; i < num_iovs; i++) {
+      iovs[i].iov_base = data + i * chunk;
+      iovs[i].iov_len = chunk;
+   }
+
+   ret = virgl_renderer_transfer_write_iov(res.handle, 1, 0, 0, 0, &box, 0, iovs, num_iovs);
+   ck_assert_int_eq(ret, 0);
+   free(iovs);
+
+   memset(data, 0, res.iovs[0].iov_len);
+   ret = virgl_renderer_transfer_read_iov(res.handle, 1, 0, 0, 0, &box, 0, NULL, 0);
+   ck_assert_int_eq(ret, 0);
+
+   /* skip the X channel of B8G8R8X8 */
+   for (uint32_t i = 0; i < res.iovs[0].iov_len; i++) {
+      if (i % 4 != 3)
+         ck_assert_int_eq(data[i], (uint8_t)(i * 7 + i / 4096));
+   }
+
+   virgl_renderer_ctx_detach_resource(1, res.handle);
+   testvirgl_destroy_backed_res(&res);
+   testvirgl_fini_single_ctx();
+}
+END_TEST
+
+
+#define LAZY_TEST_SIZE 64
+
+/* texture storage is deferred until first use, every entry point that uses a
+ * texture has to allocate it */
+static void lazy_storage_fill(struct virgl_resource *res, uint32_t seed)
+{
+   uint32_t *ptr = res->iovs[0].iov_base;
+
+   for (uint32_t i = 0; i < LAZY_TEST_SIZE * LAZY_TEST_SIZE; i++)
+      ptr[i] = 0xff000000 | ((i + seed) * 2654435761u >> 8);
+}
+
+static void lazy_storage_check(struct virgl_context *ctx, struct virgl_resource *res,
+                               uint32_t seed)
+{
+   struct virgl_box box = { 0, 0, 0, LAZY_TEST_SIZE, LAZY_TEST_SIZE, 1 };
+   uint32_t *ptr = res->iovs[0].iov_base;
+   int ret;
+
+   memset(ptr, 0, res->iovs[0].iov_len);
+   ret = virgl_renderer_transfer_read_iov(res->handle, ctx->ctx_id, 0, LAZY_TEST_SIZE * 4, 0,
+                                          &box, 0, NULL, 0);
+   ck_assert_int_eq(ret, 0);
+
+   /* skip the X channel of B8G8R8X8 */
+   for (uint32_t i = 0; i < LAZY_TEST_SIZE * LAZY_TEST_SIZE; i++)
+      ck_assert_int_eq(ptr[i] & 0xffffff, ((i + seed) * 2654435761u >> 8) & 0xffffff);
+}
+
+START_TEST(virgl_test_lazy_storage_never_used)
+{
+   struct virgl_context ctx;
+   struct virgl_resource res[8];
+   struct vrend_lazy_storage_stats before, after;
+   uint64_t expected;
+   int ret;
+
+   ret = testvirgl_init_ctx_cmdbuf(&ctx);
+   ck_assert_int_eq(ret, 0);
+
+   vrend_debug_get_lazy_storage_stats(&before);
+   expected = before.enabled ? ARRAY_SIZE(res) : 0;
+
+   for (unsigned i = 0; i < ARRAY_SIZE(res); i++) {
+      ret = testvirgl_create_backed_simple_2d_res(&res[i], i + 1, LAZY_TEST_SIZE, LAZY_TEST_SIZE);
+      ck_assert_int_eq(ret, 0);
+      virgl_renderer_ctx_attach_resource(ctx.ctx_id, res[i].handle);
+   }
+
+   for (unsigned i = 0; i < ARRAY_SIZE(res); i++) {
+      virgl_renderer_ctx_detach_resource(ctx.ctx_id, res[i].handle);
+      testvirgl_destroy_backed_res(&res[i]);
+   }
+
+   /* none of the textures got GL storage */
+   vrend_debug_get_lazy_storage_stats(&after);
+   ck_assert_int_eq(after.deferred - before.deferred, expected);
+   ck_assert_int_eq(after.never_materialized - before.never_materialized, expected);
+   ck_assert_int_eq(after.materialized, before.materialized);
+
+   testvirgl_fini_ctx_cmdbuf(&ctx);
+}
+END_TEST
+
+START_TEST(virgl_test_lazy_storage_transfer)
+{
+   struct virgl_context ctx;
+   struct virgl_resource res;
+   struct virgl_box box = { 0, 0, 0, LAZY_TEST_SIZE, LAZY_TEST_SIZE, 1 };
+   int ret;
+
+   ret = testvirgl_init_ctx_cmdbuf(&ctx);
+   ck_assert_int_eq(ret, 0);
+
+   ret = testvirgl_create_backed_simple_2d_res(&res, 1, LAZY_TEST_SIZE, LAZY_TEST_SIZE);
+   ck_assert_int_eq(ret, 0);
+   virgl_renderer_ctx_attach_resource(ctx.ctx_id, res.handle);
+
+   /* a read from a texture that was never written is valid */
+   ret = virgl_renderer_transfer_read_iov(res.handle, ctx.ctx_id, 0, LAZY_TEST_SIZE * 4, 0,
+                                          &box, 0, NULL, 0);
+   ck_assert_int_eq(ret, 0);
+
+   lazy_storage_fill(&res, 1);
+   ret = virgl_renderer_transfer_write_iov(res.handle, ctx.ctx_id, 0, LAZY_TEST_SIZE * 4, 0,
+                                           &box, 0, NULL, 0);
+   ck_assert_int_eq(ret, 0);
+   lazy_storage_check(&ctx, &res, 1);
+
+   virgl_renderer_ctx_detach_resource(ctx.ctx_id, res.handle);
+   testvirgl_destroy_backed_res(&res);
+   testvirgl_fini_ctx_cmdbuf(&ctx);
+}
+END_TEST
+
+START_TEST(virgl_test_lazy_storage_inline_write)
+{
+   struct virgl_context ctx;
+   struct virgl_resource res;
+   struct pipe_box box = { 0, 0, 0, LAZY_TEST_SIZE, LAZY_TEST_SIZE, 1 };
+   uint32_t *data;
+   int ret;
+
+   ret = testvirgl_init_ctx_cmdbuf(&ctx);
+   ck_assert_int_eq(ret, 0);
+
+   ret = testvirgl_create_backed_simple_2d_res(&res, 1, LAZY_TEST_SIZE, LAZY_TEST_SIZE);
+   ck_assert_int_eq(ret, 0);
+   virgl_renderer_ctx_attach_resource(ctx.ctx_id, res.handle);
+
+   data = malloc(res.iovs[0].iov_len);
+   ck_assert(data != NULL);
+   lazy_storage_fill(&res, 2);
+   memcpy(data, res.iovs[0].iov_base, res.iovs[0].iov_len);
+
+   virgl_encoder_inline_write(&ctx, &res, 0, 0, &box, data, LAZY_TEST_SIZE * 4, 0);
+   ret = testvirgl_ctx_send_cmdbuf(&ctx);
+   ck_assert_int_eq(ret, 0);
+   lazy_storage_check(&ctx, &res, 2);
+
+   free(data);
+   virgl_renderer_ctx_detach_resource(ctx.ctx_id, res.handle);
+   testvirgl_destroy_backed_res(&res);
+   testvirgl_fini_ctx_cmdbuf(&ctx);
+}
+END_TEST
+
+START_TEST(virgl_test_lazy_storage_surface)
+{
+   struct virgl_context ctx;
+   struct virgl_resource res;
+   struct virgl_surface surf;
+   struct pipe_framebuffer_state fb_state;
+   union pipe_color_union color;
+   struct virgl_box box = { 0, 0, 0, LAZY_TEST_SIZE, LAZY_TEST_SIZE, 1 };
+   uint32_t *ptr;
+   int ret;
+
+   ret = testvirgl_init_ctx_cmdbuf(&ctx);
+   ck_assert_int_eq(ret, 0);
+
+   ret = testvirgl_create_backed_simple_2d_res(&res, 1, LAZY_TEST_SIZE, LAZY_TEST_SIZE);
+   ck_assert_int_eq(ret, 0);
+   virgl_renderer_ctx_attach_resource(ctx.ctx_id, res.handle);
+
+   /* the surface is the first use of the texture */
+   memset(&surf, 0, sizeof(surf));
+   surf.base.format = PIPE_FORMAT_B8G8R8X8_UNORM;
+   surf.handle = 1;
+   surf.base.texture = &res.base;
+   virgl_encoder_create_surface(&ctx, surf.handle, &res, &surf.base);
+
+   memset(&fb_state, 0, sizeof(fb_state));
+   fb_state.nr_cbufs = 1;
+   fb_state.cbufs[0] = &surf.base;
+   virgl_encoder_set_framebuffer_state(&ctx, &fb_state);
+
+   color.f[0] = 0.0;
+   color.f[1] = 1.0;
+   color.f[2] = 0.0;
+   color.f[3] = 1.0;
+   virgl_encode_clear(&ctx, PIPE_CLEAR_COLOR0, &color, 0.0, 0);
+   ret = testvirgl_ctx_send_cmdbuf(&ctx);
+   ck_assert_int_eq(ret, 0);
+
+   ret = virgl_renderer_transfer_read_iov(res.handle, ctx.ctx_id, 0, LAZY_TEST_SIZE * 4, 0,
+                                          &box, 0, NULL, 0);
+   ck_assert_int_eq(ret, 0);
+
+   ptr = res.iovs[0].iov_base;
+   for (uint32_t i = 0; i < LAZY_TEST_SIZE * LAZY_TEST_SIZE; i++)
+      ck_assert_int_eq(ptr[i] & 0xffffff, 0x00ff00);
+
+   virgl_renderer_ctx_detach_resource(ctx.ctx_id, res.handle);
+   testvirgl_destroy_backed_res(&res);
+   testvirgl_fini_ctx_cmdbuf(&ctx);
+}
+END_TEST
+
+START_TEST(virgl_test_lazy_storage_copy_region)
+{
+   struct virgl_context ctx;
+   struct virgl_resource src, dst;
+   struct virgl_box box = { 0, 0, 0, LAZY_TEST_SIZE, LAZY_TEST_SIZE, 1 };
+   struct pipe_box src_box = { 0, 0, 0, LAZY_TEST_SIZE, LAZY_TEST_SIZE, 1 };
+   int ret;
+
+   ret = testvirgl_init_ctx_cmdbuf(&ctx);
+   ck_assert_int_eq(ret, 0);
+
+   ret = testvirgl_create_backed_simple_2d_res(&src, 1, LAZY_TEST_SIZE, LAZY_TEST_SIZE);
+   ck_assert_int_eq(ret, 0);
+   ret = testvirgl_create_backed_simple_2d_res(&dst, 2, LAZY_TEST_SIZE, LAZY_TEST_SIZE);
+   ck_assert_int_eq(ret, 0);
+   virgl_renderer_ctx_attach_resource(ctx.ctx_id, src.handle);
+   virgl_renderer_ctx_attach_resource(ctx.ctx_id, dst.handle);
+
+   lazy_storage_fill(&src, 3);
+   ret = virgl_renderer_transfer_write_iov(src.handle, ctx.ctx_id, 0, LAZY_TEST_SIZE * 4, 0,
+                                           &box, 0, NULL, 0);
+   ck_assert_int_eq(ret, 0);
+
+   /* the copy is the first use of the destination */
+   virgl_encode_resource_copy_region(&ctx, &dst, 0, 0, 0, 0, &src, 0, &src_box);
+   ret = testvirgl_ctx_send_cmdbuf(&ctx);
+   ck_assert_int_eq(ret, 0);
+   lazy_storage_check(&ctx, &dst, 3);
+
+   virgl_renderer_ctx_detach_resource(ctx.ctx_id, src.handle);
+   virgl_renderer_ctx_detach_resource(ctx.ctx_id, dst.handle);
+   testvirgl_destroy_backed_res(&src);
+   testvirgl_destroy_backed_res(&dst);
+   testvirgl_fini_ctx_cmdbuf(&ctx);
+}
+END_TEST
+
+START_TEST(virgl_test_lazy_storage_get_info)
+{
+   struct virgl_context ctx;
+   struct virgl_resource res;
+   struct virgl_renderer_resource_info info;
+   struct virgl_box box = { 0, 0, 0, LAZY_TEST_SIZE, LAZY_TEST_SIZE, 1 };
+   uint32_t tex_id;
+   int ret;
+
+   ret = testvirgl_init_ctx_cmdbuf(&ctx);
+   ck_assert_int_eq(ret, 0);
+
+   ret = testvirgl_create_backed_simple_2d_res(&res, 1, LAZY_TEST_SIZE, LAZY_TEST_SIZE);
+   ck_assert_int_eq(ret, 0);
+   virgl_renderer_ctx_attach_resource(ctx.ctx_id, res.handle);
+
+   /* exporting the texture hands out its GL name */
+   ret = virgl_renderer_resource_get_info(res.handle, &info);
+   ck_assert_int_eq(ret, 0);
+   ck_assert_int_ne(info.tex_id, 0);
+   tex_id = info.tex_id;
+
+   lazy_storage_fill(&res, 4);
+   ret = virgl_renderer_transfer_write_iov(res.handle, ctx.ctx_id, 0, LAZY_TEST_SIZE * 4, 0,
+                                           &box, 0, NULL, 0);
+   ck_assert_int_eq(ret, 0);
+   lazy_storage_check(&ctx, &res, 4);
+
+   /* the storage is not allocated again */
+   ret = virgl_renderer_resource_get_info(res.handle, &info);
+   ck_assert_int_eq(ret, 0);
+   ck_assert_int_eq(info.tex_id, tex_id);
+
+   virgl_renderer_ctx_detach_resource(ctx.ctx_id, res.handle);
+   testvirgl_destroy_backed_res(&res);
+   testvirgl_fini_ctx_cmdbuf(&ctx);
+}
+END_TEST
+
 
 static Suite *virgl_init_suite(void)
 {
@@ -1064,6 +1433,26 @@ static Suite *virgl_init_suite(void)
 
   suite_add_tcase(s, tc_core);
 
+  tc_core = tcase_create("residency");
+  tcase_add_test(tc_core, virgl_test_transfer_residency_spill_restore);
+
+  suite_add_tcase(s, tc_core);
+
+  tc_core = tcase_create("upload_threads");
+  tcase_add_test(tc_core, virgl_test_transfer_upload_threads_bands);
+
+  suite_add_tcase(s, tc_core);
+
+  tc_core = tcase_create("lazy_storage");
+  tcase_add_test(tc_core, virgl_test_lazy_storage_never_used);
+  tcase_add_test(tc_core, virgl_test_lazy_storage_transfer);
+  tcase_add_test(tc_core, virgl_test_lazy_storage_inline_write);
+  tcase_add_test(tc_core, virgl_test_lazy_storage_surface);
+  tcase_add_test(tc_core, virgl_test_lazy_storage_copy_region);
+  tcase_add_test(tc_core, virgl_test_lazy_storage_get_info);
+
+  suite_add_tcase(s, tc_core);
+
   return s;
 
 }
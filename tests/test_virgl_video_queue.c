@@ -0,0 +1,248 @@
+/*
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <check.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../src/virgl_video_queue.h"
+
+/* Test the video frame queue against a stub backend whose sync simulates
+ * the decode latency of the hardware.
+ */
+
+#define MAX_FRAMES 16
+
+struct stub_frame {
+   struct virgl_video_queue_entry base;
+   int fail;
+};
+
+static struct {
+   unsigned latency_ms;
+   atomic_bool hold;
+   atomic_uint synced;
+   atomic_uint notified;
+   thrd_t owner;
+   unsigned completed;
+   uint64_t completed_seqs[MAX_FRAMES];
+   int completed_status[MAX_FRAMES];
+   bool completed_on_owner;
+} stub;
+
+static uint64_t now_ms(void)
+{
+   struct timespec ts;
+   timespec_get(&ts, TIME_UTC);
+   return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void sleep_ms(unsigned ms)
+{
+   struct timespec ts = { ms / 1000, (ms % 1000) * 1000000 };
+   thrd_sleep(&ts, NULL);
+}
+
+static int stub_sync(void *data, struct virgl_video_queue_entry *entry)
+{
+   struct stub_frame *frame = (struct stub_frame *)entry;
+
+   (void)data;
+
+   while (atomic_load(&stub.hold))
+      sleep_ms(1);
+   sleep_ms(stub.latency_ms);
+
+   atomic_fetch_add(&stub.synced, 1);
+   return frame->fail;
+}
+
+static void stub_complete(void *data, struct virgl_video_queue_entry *entry)
+{
+   (void)data;
+
+   if (stub.completed < MAX_FRAMES) {
+      stub.completed_seqs[stub.completed] = entry->seq;
+      stub.completed_status[stub.completed] = entry->status;
+   }
+   stub.completed++;
+   stub.completed_on_owner &= thrd_equal(thrd_current(), stub.owner);
+
+   free(entry);
+}
+
+static void stub_notify(void *data)
+{
+   (void)data;
+   atomic_fetch_add(&stub.notified, 1);
+}
+
+static void stub_init(struct virgl_video_queue *queue, unsigned latency_ms)
+{
+   memset(&stub, 0, sizeof(stub));
+   stub.latency_ms = latency_ms;
+   stub.owner = thrd_current();
+   stub.completed_on_owner = true;
+
+   ck_assert_int_eq(virgl_video_queue_init(queue, stub_sync, stub_complete,
+                                           stub_notify, NULL), 0);
+}
+
+static uint64_t stub_submit(struct virgl_video_queue *queue, int fail)
+{
+   struct stub_frame *frame = calloc(1, sizeof(*frame));
+   ck_assert(frame != NULL);
+   frame->fail = fail;
+   return virgl_video_queue_submit(queue, &frame->base);
+}
+
+START_TEST(video_queue_submit_does_not_block)
+{
+   struct virgl_video_queue queue;
+   uint64_t seqs[4];
+
+   stub_init(&queue, 20);
+
+   const uint64_t begin = now_ms();
+   for (unsigned i = 0; i < 4; i++)
+      seqs[i] = stub_submit(&queue, 0);
+   ck_assert(now_ms() - begin < 20);
+
+   for (unsigned i = 0; i < 4; i++)
+      ck_assert_int_eq(seqs[i], i + 1);
+   ck_assert_int_eq(stub.completed, 0);
+
+   virgl_video_queue_wait(&queue, seqs[3]);
+   ck_assert(now_ms() - begin >= 4 * 20);
+   ck_assert_int_eq(stub.completed, 4);
+   for (unsigned i = 0; i < 4; i++) {
+      ck_assert_int_eq(stub.completed_seqs[i], i + 1);
+      ck_assert_int_eq(stub.completed_status[i], 0);
+   }
+   ck_assert(stub.completed_on_owner);
+   ck_assert(virgl_video_queue_is_completed(&queue, seqs[3]));
+
+   virgl_video_queue_fini(&queue);
+}
+END_TEST
+
+START_TEST(video_queue_retire_does_not_block)
+{
+   struct virgl_video_queue queue;
+
+   stub_init(&queue, 0);
+   atomic_store(&stub.hold, true);
+
+   const uint64_t seq = stub_submit(&queue, 0);
+   virgl_video_queue_retire(&queue);
+   ck_assert_int_eq(stub.completed, 0);
+   ck_assert(!virgl_video_queue_is_completed(&queue, seq));
+
+   atomic_store(&stub.hold, false);
+   while (!atomic_load(&stub.notified))
+      sleep_ms(1);
+
+   /* synced, but only completed once retired */
+   ck_assert_int_eq(stub.completed, 0);
+   virgl_video_queue_retire(&queue);
+   ck_assert_int_eq(stub.completed, 1);
+   ck_assert(virgl_video_queue_is_completed(&queue, seq));
+
+   virgl_video_queue_fini(&queue);
+}
+END_TEST
+
+START_TEST(video_queue_wait_for_earlier_frame)
+{
+   struct virgl_video_queue queue;
+
+   stub_init(&queue, 5);
+
+   const uint64_t first = stub_submit(&queue, 0);
+   stub_submit(&queue, 0);
+   stub_submit(&queue, 0);
+
+   virgl_video_queue_wait(&queue, first);
+   ck_assert(virgl_video_queue_is_completed(&queue, first));
+   ck_assert(stub.completed >= 1);
+   ck_assert_int_eq(stub.completed_seqs[0], first);
+
+   virgl_video_queue_fini(&queue);
+   ck_assert_int_eq(stub.completed, 3);
+}
+END_TEST
+
+START_TEST(video_queue_failed_sync)
+{
+   struct virgl_video_queue queue;
+
+   stub_init(&queue, 0);
+
+   stub_submit(&queue, 0);
+   const uint64_t seq = stub_submit(&queue, -1);
+   stub_submit(&queue, 0);
+
+   virgl_video_queue_fini(&queue);
+   ck_assert_int_eq(stub.completed, 3);
+   ck_assert_int_eq(stub.completed_seqs[1], seq);
+   ck_assert_int_eq(stub.completed_status[0], 0);
+   ck_assert_int_eq(stub.completed_status[1], -1);
+   ck_assert_int_eq(stub.completed_status[2], 0);
+}
+END_TEST
+
+START_TEST(video_queue_fini_completes_pending)
+{
+   struct virgl_video_queue queue;
+
+   stub_init(&queue, 2);
+
+   for (unsigned i = 0; i < 8; i++)
+      stub_submit(&queue, 0);
+
+   virgl_video_queue_fini(&queue);
+   ck_assert_int_eq(atomic_load(&stub.synced), 8);
+   ck_assert_int_eq(stub.completed, 8);
+   for (unsigned i = 0; i < 8; i++)
+      ck_assert_int_eq(stub.completed_seqs[i], i + 1);
+   ck_assert(stub.completed_on_owner);
+}
+END_TEST
+
+static Suite *virgl_init_suite(void)
+{
+   Suite *s;
+   TCase *tc_core;
+
+   s = suite_create("virgl_video_queue");
+   tc_core = tcase_create("video_queue");
+
+   tcase_add_test(tc_core, video_queue_submit_does_not_block);
+   tcase_add_test(tc_core, video_queue_retire_does_not_block);
+   tcase_add_test(tc_core, video_queue_wait_for_earlier_frame);
+   tcase_add_test(tc_core, video_queue_failed_sync);
+   tcase_add_test(tc_core, video_queue_fini_completes_pending);
+
+   suite_add_tcase(s, tc_core);
+   return s;
+}
+
+int main(void)
+{
+   Suite *s;
+   SRunner *sr;
+   int number_failed;
+
+   s = virgl_init_suite();
+   sr = srunner_create(s);
+
+   srunner_run_all(sr, CK_NORMAL);
+   number_failed = srunner_ntests_failed(sr);
+   srunner_free(sr);
+
+   return number_failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -954,6 +954,24 @@ int virgl_encode_link_shader(struct virgl_context *ctx, uint32_t *handles)
    return 0;
 }
 
+int virgl_encode_link_shader_hint(struct virgl_context *ctx,
+                                  const uint32_t *handles,
+                                  uint32_t num_entries)
+{
+   uint32_t i;
+   virgl_encoder_write_cmd_dword(ctx, VIRGL_CMD0(VIRGL_CCMD_LINK_SHADER_HINT, 0,
+                                                 num_entries * VIRGL_LINK_SHADER_HINT_ENTRY_SIZE));
+   for (i = 0; i < num_entries; i++) {
+      const uint32_t *entry = &handles[i * PIPE_SHADER_TYPES];
+      virgl_encoder_write_dword(ctx->cbuf, entry[PIPE_SHADER_VERTEX]);
+      virgl_encoder_write_dword(ctx->cbuf, entry[PIPE_SHADER_FRAGMENT]);
+      virgl_encoder_write_dword(ctx->cbuf, entry[PIPE_SHADER_GEOMETRY]);
+      virgl_encoder_write_dword(ctx->cbuf, entry[PIPE_SHADER_TESS_CTRL]);
+      virgl_encoder_write_dword(ctx->cbuf, entry[PIPE_SHADER_TESS_EVAL]);
+   }
+   return 0;
+}
+
 int virgl_encode_bind_shader(struct virgl_context *ctx,
                              uint32_t handle, uint32_t type)
 {
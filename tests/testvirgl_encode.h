@@ -259,6 +259,10 @@ int virgl_encoder_set_sub_ctx(struct virgl_context *ctx, uint32_t sub_ctx_id);
 int virgl_encoder_create_sub_ctx(struct virgl_context *ctx, uint32_t sub_ctx_id);
 int virgl_encoder_destroy_sub_ctx(struct virgl_context *ctx, uint32_t sub_ctx_id);
 int virgl_encode_link_shader(struct virgl_context *ctx, uint32_t *handles);
+/* handles holds PIPE_SHADER_TYPES handles per entry */
+int virgl_encode_link_shader_hint(struct virgl_context *ctx,
+                                  const uint32_t *handles,
+                                  uint32_t num_entries);
 int virgl_encode_bind_shader(struct virgl_context *ctx,
                              uint32_t handle, uint32_t type);
 #endif